@@ -0,0 +1,976 @@
+// Virtqueue benchmark without KVM.
+//
+// The devices run on a fake guest: guest memory is an anonymous mapping,
+// the interrupts go to eventfds nobody reads, and a small driver below
+// builds the rings and rings the doorbell through virtio_mmio_write().
+// Build and run with 'make bench'. With -u, the block requests go to a
+// vhost-user backend instead, and guest memory is a memfd shared with it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <linux/ioprio.h>
+
+#include "../virtio.h"
+#include "../iothread.h"
+#include "../mvvm.h"
+#include "../blkdev.h"
+#include "../blkcache.h"
+
+#define GUEST_MEM_SIZE (256ULL * 1024 * 1024)
+#define DISK_SIZE      (64ULL * 1024 * 1024)
+#define MAX_SEGS       4
+#define NET_HDR_SIZE   12
+#define NET_MTU        1514
+
+// virtio-mmio registers
+#define REG_DEVICE_FEATURES     0x010
+#define REG_DEVICE_FEATURES_SEL 0x014
+#define REG_DRIVER_FEATURES     0x020
+#define REG_DRIVER_FEATURES_SEL 0x024
+#define REG_QUEUE_SEL           0x030
+#define REG_QUEUE_NUM_MAX       0x034
+#define REG_QUEUE_NUM           0x038
+#define REG_QUEUE_READY         0x044
+#define REG_QUEUE_NOTIFY        0x050
+#define REG_STATUS              0x070
+#define REG_QUEUE_DESC_LOW      0x080
+#define REG_QUEUE_DESC_HIGH     0x084
+#define REG_QUEUE_AVAIL_LOW     0x090
+#define REG_QUEUE_AVAIL_HIGH    0x094
+#define REG_QUEUE_USED_LOW      0x0a0
+#define REG_QUEUE_USED_HIGH     0x0a4
+
+#define F_BLK_FLUSH     9
+#define F_INDIRECT_DESC 28
+#define F_EVENT_IDX     29
+#define F_VERSION_1     32
+#define F_RING_PACKED   34
+
+#define DESC_F_NEXT     1
+#define DESC_F_WRITE    2
+#define DESC_F_INDIRECT 4
+#define DESC_F_AVAIL    (1 << 7)
+#define DESC_F_USED     (1 << 15)
+#define USED_F_NO_NOTIFY 1
+#define EVENT_F_DISABLE 1
+#define EVENT_F_DESC    2
+
+// Allocations made by the linked objects, see --wrap in the Makefile
+static atomic_long alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    atomic_fetch_add(&alloc_count, 1);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    atomic_fetch_add(&alloc_count, 1);
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+    atomic_fetch_add(&alloc_count, 1);
+    return __real_realloc(p, size);
+}
+
+struct seg {
+    uint64_t addr;
+    uint32_t len;
+    bool write;
+};
+
+struct vq {
+    int idx;
+    int num;
+    bool packed;
+    uint64_t desc;      // guest addresses
+    uint64_t avail;     // driver area
+    uint64_t used;      // device area
+    uint64_t indirect;  // a table of MAX_SEGS descriptors per buffer id
+    // split
+    uint16_t avail_idx;
+    uint16_t last_used;
+    uint16_t free_head;
+    int num_free;
+    uint16_t *chain_len;
+    // packed
+    uint16_t next_avail;
+    uint16_t next_used;
+    bool avail_wrap;
+    bool used_wrap;
+    uint16_t *free_ids;
+    int nfree_ids;
+    // descriptors added since the last kick
+    uint16_t added;
+    uint64_t kicks;
+};
+
+struct driver {
+    struct virtio_device *dev;
+    struct guest_mem_map *mem;
+    uint64_t brk;
+    uint64_t features;
+    bool indirect;
+    struct vq vq[3];
+};
+
+struct opts {
+    long requests;
+    int depth;
+    bool blk;
+    bool net;
+    bool split;
+    bool packed;
+    bool indirect;
+    const char *vhost_user;     // socket of a vhost-user-blk backend
+    bool direct;                // disk image opened with O_DIRECT
+    bool overlay;               // a copy-on-write delta over the image
+    int flush_every;            // every Nth block request flushes, 0 if none
+    enum virtio_block_cache cache;
+    uint64_t cache_size;        // of the in memory disk cache, 0 if none
+    bool sequential;            // only 4K reads, one after the other
+    bool prio;                  // reads before writes, with ioprio
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+gpa(struct driver *d, uint64_t addr)
+{
+    return (uint8_t *)d->mem->host_mem + addr;
+}
+
+static uint64_t
+guest_alloc(struct driver *d, uint64_t size, uint64_t align)
+{
+    uint64_t addr = (d->brk + align - 1) & ~(align - 1);
+
+    if (addr + size > d->mem->size) {
+        fprintf(stderr, "vqbench: out of guest memory\n");
+        exit(EXIT_FAILURE);
+    }
+    d->brk = addr + size;
+    memset(gpa(d, addr), 0, size);
+    return addr;
+}
+
+static void
+reg_write(struct driver *d, uint32_t reg, uint32_t val)
+{
+    virtio_mmio_write(d->dev, reg, val, 4);
+}
+
+static uint32_t
+reg_read(struct driver *d, uint32_t reg)
+{
+    return virtio_mmio_read(d->dev, reg, 4);
+}
+
+// Split descriptors end with flags and next, packed ones with id and flags
+#define SPLIT_FLAGS  12
+#define SPLIT_NEXT   14
+#define PACKED_ID    12
+#define PACKED_FLAGS 14
+
+static void
+put_desc(struct driver *d, uint64_t table, int i, uint64_t addr,
+         uint32_t len, uint16_t id_or_next, uint16_t flags, bool packed)
+{
+    uint8_t *p = gpa(d, table + i * 16);
+    memcpy(p, &addr, 8);
+    memcpy(p + 8, &len, 4);
+    memcpy(p + (packed ? PACKED_ID : SPLIT_NEXT), &id_or_next, 2);
+    memcpy(p + (packed ? PACKED_FLAGS : SPLIT_FLAGS), &flags, 2);
+}
+
+// Negotiate 'features' and set up 'nq' queues of 'num' entries
+static int
+driver_init(struct driver *d, uint64_t features, int nq, int num)
+{
+    uint64_t offered = 0;
+
+    reg_write(d, REG_STATUS, 0);
+    reg_write(d, REG_STATUS, 1 | 2);
+    reg_write(d, REG_DEVICE_FEATURES_SEL, 0);
+    offered = reg_read(d, REG_DEVICE_FEATURES);
+    reg_write(d, REG_DEVICE_FEATURES_SEL, 1);
+    offered |= (uint64_t)reg_read(d, REG_DEVICE_FEATURES) << 32;
+    d->features = offered & features;
+    reg_write(d, REG_DRIVER_FEATURES_SEL, 0);
+    reg_write(d, REG_DRIVER_FEATURES, d->features);
+    reg_write(d, REG_DRIVER_FEATURES_SEL, 1);
+    reg_write(d, REG_DRIVER_FEATURES, d->features >> 32);
+    reg_write(d, REG_STATUS, 1 | 2 | 8);
+    d->indirect = (d->features >> F_INDIRECT_DESC) & 1;
+
+    for (int i = 0; i < nq; i++) {
+        struct vq *q = &d->vq[i];
+        *q = (struct vq){0};
+        q->idx = i;
+        q->packed = (d->features >> F_RING_PACKED) & 1;
+        reg_write(d, REG_QUEUE_SEL, i);
+        q->num = num;
+        if ((int)reg_read(d, REG_QUEUE_NUM_MAX) < num) {
+            q->num = reg_read(d, REG_QUEUE_NUM_MAX);
+        }
+        reg_write(d, REG_QUEUE_NUM, q->num);
+        q->desc = guest_alloc(d, 16 * q->num, 16);
+        if (q->packed) {
+            q->avail = guest_alloc(d, 4, 4);
+            q->used = guest_alloc(d, 4, 4);
+            q->avail_wrap = q->used_wrap = true;
+        } else {
+            q->avail = guest_alloc(d, 6 + 2 * q->num, 2);
+            q->used = guest_alloc(d, 6 + 8 * q->num, 4);
+            for (int j = 0; j < q->num - 1; j++) {
+                put_desc(d, q->desc, j, 0, 0, j + 1, 0, false);
+            }
+        }
+        q->indirect = guest_alloc(d, (uint64_t)16 * MAX_SEGS * q->num, 16);
+        q->num_free = q->num;
+        q->chain_len = calloc(q->num, sizeof(uint16_t));
+        q->free_ids = calloc(q->num, sizeof(uint16_t));
+        for (int j = 0; j < q->num; j++) {
+            q->free_ids[q->nfree_ids++] = q->num - 1 - j;
+        }
+        reg_write(d, REG_QUEUE_DESC_LOW, q->desc);
+        reg_write(d, REG_QUEUE_DESC_HIGH, q->desc >> 32);
+        reg_write(d, REG_QUEUE_AVAIL_LOW, q->avail);
+        reg_write(d, REG_QUEUE_AVAIL_HIGH, q->avail >> 32);
+        reg_write(d, REG_QUEUE_USED_LOW, q->used);
+        reg_write(d, REG_QUEUE_USED_HIGH, q->used >> 32);
+        reg_write(d, REG_QUEUE_READY, 1);
+    }
+    reg_write(d, REG_STATUS, 1 | 2 | 4 | 8);
+    return 0;
+}
+
+static void
+driver_destroy(struct driver *d, int nq)
+{
+    for (int i = 0; i < nq; i++) {
+        free(d->vq[i].chain_len);
+        free(d->vq[i].free_ids);
+    }
+}
+
+// Post a buffer, return its id or -1 if the ring is full
+static int
+vq_add(struct driver *d, struct vq *q, const struct seg *sg, int n)
+{
+    bool indirect = d->indirect && n > 1;
+    int ndescs = indirect ? 1 : n;
+    uint16_t id = 0, flags = 0, head_flags = 0;
+    int i = 0;
+
+    if (q->packed) {
+        if (q->nfree_ids == 0 || q->num_free < ndescs) {
+            return -1;
+        }
+        id = q->free_ids[--q->nfree_ids];
+    } else {
+        if (q->num_free < ndescs) {
+            return -1;
+        }
+        id = q->free_head;
+    }
+    if (indirect) {
+        uint64_t table = q->indirect + (uint64_t)id * 16 * MAX_SEGS;
+        for (i = 0; i < n; i++) {
+            flags = (sg[i].write ? DESC_F_WRITE : 0) |
+                    (i < n - 1 ? DESC_F_NEXT : 0);
+            put_desc(d, table, i, sg[i].addr, sg[i].len, i + 1, flags,
+                     q->packed);
+        }
+    }
+
+    if (q->packed) {
+        uint16_t slot = q->next_avail;
+        uint16_t avail = q->avail_wrap ? DESC_F_AVAIL : DESC_F_USED;
+        for (i = 0; i < ndescs; i++) {
+            if (indirect) {
+                flags = DESC_F_INDIRECT;
+                put_desc(d, q->desc, slot, q->indirect +
+                         (uint64_t)id * 16 * MAX_SEGS, 16 * n, id, 0, true);
+            } else {
+                flags = (sg[i].write ? DESC_F_WRITE : 0) |
+                        (i < n - 1 ? DESC_F_NEXT : 0);
+                put_desc(d, q->desc, slot, sg[i].addr, sg[i].len, id, 0,
+                         true);
+            }
+            flags |= avail;
+            if (i == 0) {
+                // made available last
+                head_flags = flags;
+            } else {
+                memcpy((uint8_t *)gpa(d, q->desc + slot * 16) + PACKED_FLAGS,
+                       &flags, 2);
+            }
+            if (++slot == q->num) {
+                slot = 0;
+                q->avail_wrap = !q->avail_wrap;
+                avail = q->avail_wrap ? DESC_F_AVAIL : DESC_F_USED;
+            }
+        }
+        atomic_store_explicit((_Atomic uint16_t *)
+                              ((uint8_t *)gpa(d, q->desc + q->next_avail * 16) +
+                               PACKED_FLAGS),
+                              head_flags, memory_order_release);
+        q->chain_len[id] = ndescs;
+        q->next_avail = slot;
+        q->num_free -= ndescs;
+    } else {
+        uint16_t cur = id;
+        uint16_t *ring = gpa(d, q->avail + 4);
+        for (i = 0; i < ndescs; i++) {
+            uint8_t *p = gpa(d, q->desc + cur * 16);
+            uint16_t next = 0;
+            memcpy(&next, p + SPLIT_NEXT, 2);
+            if (indirect) {
+                put_desc(d, q->desc, cur, q->indirect +
+                         (uint64_t)id * 16 * MAX_SEGS, 16 * n, next,
+                         DESC_F_INDIRECT, false);
+            } else {
+                flags = (sg[i].write ? DESC_F_WRITE : 0) |
+                        (i < n - 1 ? DESC_F_NEXT : 0);
+                put_desc(d, q->desc, cur, sg[i].addr, sg[i].len, next, flags,
+                         false);
+            }
+            cur = next;
+        }
+        q->free_head = cur;
+        q->num_free -= ndescs;
+        q->chain_len[id] = ndescs;
+        ring[q->avail_idx & (q->num - 1)] = id;
+        q->avail_idx++;
+        atomic_store_explicit((_Atomic uint16_t *)gpa(d, q->avail + 2),
+                              q->avail_idx, memory_order_release);
+    }
+    q->added += ndescs;
+    return id;
+}
+
+static bool
+need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+// Notify the device unless it asked not to be
+static void
+vq_kick(struct driver *d, struct vq *q)
+{
+    bool event_idx = (d->features >> F_EVENT_IDX) & 1;
+    bool kick = true;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (q->packed) {
+        uint16_t off_wrap = *(uint16_t *)gpa(d, q->used);
+        uint16_t flags = *(uint16_t *)gpa(d, q->used + 2);
+        uint16_t new = q->next_avail, old = new - q->added;
+        if (flags == EVENT_F_DISABLE) {
+            kick = false;
+        } else if (flags == EVENT_F_DESC && event_idx) {
+            uint16_t event = off_wrap & 0x7fff;
+            if ((off_wrap >> 15) != q->avail_wrap) {
+                event -= q->num;
+            }
+            kick = need_event(event, new, old);
+        }
+    } else if (event_idx) {
+        uint16_t event = *(uint16_t *)gpa(d, q->used + 4 + 8 * q->num);
+        kick = need_event(event, q->avail_idx, q->avail_idx - q->added);
+    } else {
+        kick = !(*(uint16_t *)gpa(d, q->used) & USED_F_NO_NOTIFY);
+    }
+    q->added = 0;
+    if (kick) {
+        q->kicks++;
+        virtio_mmio_write(d->dev, REG_QUEUE_NOTIFY, q->idx, 4);
+    }
+}
+
+// Take a used buffer, return its id or -1
+static int
+vq_get_used(struct driver *d, struct vq *q, uint32_t *len)
+{
+    uint16_t id = 0;
+
+    if (q->packed) {
+        uint8_t *p = gpa(d, q->desc + q->next_used * 16);
+        uint16_t flags = atomic_load_explicit((_Atomic uint16_t *)(p + PACKED_FLAGS),
+                                              memory_order_acquire);
+        bool avail = flags & DESC_F_AVAIL, used = flags & DESC_F_USED;
+        if (avail != used || used != q->used_wrap) {
+            return -1;
+        }
+        memcpy(&id, p + PACKED_ID, 2);
+        memcpy(len, p + 8, 4);
+        q->next_used += q->chain_len[id];
+        if (q->next_used >= q->num) {
+            q->next_used -= q->num;
+            q->used_wrap = !q->used_wrap;
+        }
+        q->num_free += q->chain_len[id];
+        q->free_ids[q->nfree_ids++] = id;
+        if ((d->features >> F_EVENT_IDX) & 1) {
+            uint16_t event[2] = {q->next_used | (q->used_wrap << 15),
+                                 EVENT_F_DESC};
+            memcpy(gpa(d, q->avail), event, 4);
+        }
+    } else {
+        uint16_t used_idx = atomic_load_explicit(
+            (_Atomic uint16_t *)gpa(d, q->used + 2), memory_order_acquire);
+        uint32_t elem[2];
+        uint16_t tail = 0;
+        if (used_idx == q->last_used) {
+            return -1;
+        }
+        memcpy(elem, gpa(d, q->used + 4 + 8 * (q->last_used & (q->num - 1))), 8);
+        id = elem[0];
+        *len = elem[1];
+        q->last_used++;
+        // ask for an interrupt at the next buffer, like a driver would
+        *(uint16_t *)gpa(d, q->avail + 4 + 2 * q->num) = q->last_used;
+        // give the chain back to the free list
+        tail = id;
+        for (int i = 1; i < q->chain_len[id]; i++) {
+            memcpy(&tail, (uint8_t *)gpa(d, q->desc + tail * 16) + SPLIT_NEXT, 2);
+        }
+        memcpy((uint8_t *)gpa(d, q->desc + tail * 16) + SPLIT_NEXT,
+               &q->free_head, 2);
+        q->free_head = id;
+        q->num_free += q->chain_len[id];
+    }
+    return id;
+}
+
+struct result {
+    long requests;
+    uint64_t ns;
+    long allocs;
+    uint64_t kicks;
+    uint64_t irqs;
+};
+
+static void
+print_result(const char *name, const char *ring, struct result *r)
+{
+    printf("%-8s %-7s %8ld req %10.0f req/s %8.0f ns/req %6.2f allocs/req "
+           "%6.3f kicks/req %6.3f irqs/req\n",
+           name, ring, r->requests, r->requests * 1e9 / r->ns,
+           (double)r->ns / r->requests, (double)r->allocs / r->requests,
+           (double)r->kicks / r->requests, (double)r->irqs / r->requests);
+}
+
+static uint64_t
+queue_irqs(struct virtio_device *dev, int nq)
+{
+    struct virtio_queue_stats st = {0};
+    uint64_t irqs = 0;
+
+    for (int i = 0; i < nq; i++) {
+        virtio_get_queue_stats(dev, i, &st);
+        irqs += st.irqs;
+    }
+    return irqs;
+}
+
+static uint64_t
+ring_features(bool packed, bool indirect)
+{
+    uint64_t f = (1ULL << F_VERSION_1) | (1ULL << F_EVENT_IDX);
+
+    if (packed) {
+        f |= 1ULL << F_RING_PACKED;
+    }
+    if (indirect) {
+        f |= 1ULL << F_INDIRECT_DESC;
+    }
+    return f;
+}
+
+// 4K reads and writes at random sectors, or reads in a row with -S, and
+// the flushes asked for,
+// 'depth' requests in flight. Prints the mean latency of the reads and
+// writes.
+static int
+bench_blk(struct opts *o, struct guest_mem_map *mem, struct io_threads *io,
+          bool packed, struct result *r)
+{
+    char path[] = "/tmp/vqbench-XXXXXX";
+    char vu_path[256];
+    char spec[128];
+    char delta[64];
+    struct mvvm vm = {0};
+    struct driver d = {0};
+    struct vq *q = NULL;
+    uint64_t bufs = 0, start = 0;
+    long issued = 0, done = 0, errors = 0;
+    uint64_t *issue_ns = NULL, lat_ns[2] = {0};
+    long lat_n[2] = {0};
+    int *slot_of = NULL, *free_slots = NULL, nfree = 0, fd = -1;
+    uint32_t len = 0;
+    int id = 0;
+
+    vm.vm_fd = -1;
+    vm.mem_map = mem;
+    vm.io = io;
+    if (o->vhost_user) {
+        snprintf(vu_path, sizeof(vu_path), "vhost-user:%s", o->vhost_user);
+        if (mvvm_init_virtio_blk(&vm, vu_path) < 0) {
+            return -1;
+        }
+    } else {
+        fd = mkstemp(path);
+        if (fd < 0 || ftruncate(fd, DISK_SIZE) < 0) {
+            perror("vqbench: disk image");
+            return -1;
+        }
+        close(fd);
+        snprintf(delta, sizeof(delta), "%s.delta", path);
+        if (o->overlay) {
+            snprintf(spec, sizeof(spec), "overlay:%s:%s", path, delta);
+        } else {
+            snprintf(spec, sizeof(spec), "%s%s", o->direct ? "direct:" : "",
+                     path);
+        }
+        if (mvvm_init_virtio_blk(&vm, spec) < 0) {
+            unlink(path);
+            unlink(delta);
+            return -1;
+        }
+        unlink(path);
+        unlink(delta);
+        virtio_block_set_cache(vm.blk, o->cache);
+        if (o->cache_size && mvvm_cache_virtio_blk(&vm, o->cache_size) < 0) {
+            mvvm_destroy_virtio_blk(&vm);
+            return -1;
+        }
+    }
+    d.dev = vm.blk;
+    d.mem = mem;
+    d.brk = 4096;
+    // without FLUSH, the device writes through
+    driver_init(&d, ring_features(packed, o->indirect) | (1ULL << F_BLK_FLUSH),
+                1, o->depth);
+    q = &d.vq[0];
+    // one header, 4K of data and a status byte per slot
+    bufs = guest_alloc(&d, (uint64_t)q->num * 8192, 4096);
+    slot_of = calloc(q->num, sizeof(int));
+    free_slots = calloc(q->num, sizeof(int));
+    issue_ns = calloc(q->num, sizeof(uint64_t));
+    for (int i = 0; i < q->num; i++) {
+        free_slots[nfree++] = i;
+    }
+
+    start = now_ns();
+    r->allocs = atomic_load(&alloc_count);
+    while (done < o->requests) {
+        while (issued < o->requests && nfree > 0) {
+            int slot = free_slots[nfree - 1];
+            uint64_t hdr = bufs + (uint64_t)slot * 8192;
+            uint64_t data = hdr + 4096;
+            uint32_t type = o->sequential ? 0 : issued & 1;
+            uint32_t ioprio = 0;
+            uint64_t sector = (uint64_t)(rand() % (DISK_SIZE / 4096)) * 8;
+            struct seg sg[3] = {
+                {hdr, 16, false},
+                {data, 4096, type == 0},
+                {hdr + 16, 1, true},
+            };
+            int n = 3;
+            if (o->sequential) {
+                sector = (uint64_t)issued * 8 % (DISK_SIZE / 512);
+            }
+            if (o->flush_every && issued % o->flush_every == o->flush_every - 1) {
+                // no data, the status follows the header
+                type = 4;
+                sector = 0;
+                sg[1] = sg[2];
+                n = 2;
+            }
+            if (o->prio) {
+                ioprio = type == 0 ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, 0) :
+                                     IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+            }
+            memcpy(gpa(&d, hdr), &type, 4);
+            memcpy((uint8_t *)gpa(&d, hdr) + 4, &ioprio, 4);
+            memcpy((uint8_t *)gpa(&d, hdr) + 8, &sector, 8);
+            *(uint8_t *)gpa(&d, hdr + 16) = 0xff;
+            id = vq_add(&d, q, sg, n);
+            if (id < 0) {
+                break;
+            }
+            slot_of[id] = slot;
+            issue_ns[slot] = now_ns();
+            nfree--;
+            issued++;
+        }
+        vq_kick(&d, q);
+        while ((id = vq_get_used(&d, q, &len)) >= 0) {
+            int slot = slot_of[id];
+            uint32_t type = 0;
+            if (*(uint8_t *)gpa(&d, bufs + (uint64_t)slot * 8192 + 16) != 0) {
+                errors++;
+            }
+            memcpy(&type, gpa(&d, bufs + (uint64_t)slot * 8192), 4);
+            if (type < 2) {
+                lat_ns[type] += now_ns() - issue_ns[slot];
+                lat_n[type]++;
+            }
+            free_slots[nfree++] = slot;
+            done++;
+        }
+    }
+    r->ns = now_ns() - start;
+    r->allocs = atomic_load(&alloc_count) - r->allocs;
+    r->requests = done;
+    r->kicks = q->kicks;
+    r->irqs = queue_irqs(vm.blk, 1);
+    if (vm.blk_cache) {
+        block_cache_print_stats(vm.blk_cache, "vqbench", stdout);
+    }
+    printf("vqbench: latency %.0f us read, %.0f us write\n",
+           lat_n[0] ? lat_ns[0] / 1e3 / lat_n[0] : 0.0,
+           lat_n[1] ? lat_ns[1] / 1e3 / lat_n[1] : 0.0);
+
+    free(issue_ns);
+    free(slot_of);
+    free(free_slots);
+    driver_destroy(&d, 1);
+    mvvm_destroy_virtio_blk(&vm);
+    if (errors) {
+        fprintf(stderr, "vqbench: %ld block requests failed\n", errors);
+        return -1;
+    }
+    return 0;
+}
+
+struct fake_ether {
+    long packets;
+    long bytes;
+};
+
+static void
+fake_write_packet(struct ether_device *net, const struct iovec *iov,
+                  int iovcnt)
+{
+    struct fake_ether *e = net->opaque;
+
+    e->packets++;
+    for (int i = 0; i < iovcnt; i++) {
+        e->bytes += iov[i].iov_len;
+    }
+}
+
+// Send 'requests' packets, then receive as many
+static int
+bench_net(struct opts *o, struct guest_mem_map *mem, struct io_threads *io,
+          bool packed, struct result *tx, struct result *rx)
+{
+    struct virtio_bus_def bus = {0};
+    struct ether_device *es = NULL;
+    struct fake_ether fake = {0};
+    struct virtio_device *dev = NULL;
+    struct driver d = {0};
+    struct vq *rxq = NULL, *txq = NULL;
+    uint8_t pkt[NET_MTU];
+    uint64_t bufs = 0, start = 0, irqs = 0;
+    long issued = 0, done = 0, errors = 0;
+    uint32_t len = 0;
+    int id = 0;
+
+    // freed by virtio_net_destroy()
+    es = calloc(1, sizeof(*es));
+    es->write_packet_to_ether = fake_write_packet;
+    es->opaque = &fake;
+    bus.mem_map = mem;
+    bus.irq.vmfd = -1;
+    bus.iothread = io_threads_pick(io);
+    dev = virtio_net_init(bus, 0, es);
+    if (!dev) {
+        free(es);
+        return -1;
+    }
+    d.dev = dev;
+    d.mem = mem;
+    d.brk = 4096;
+    driver_init(&d, ring_features(packed, o->indirect), 2, o->depth);
+    rxq = &d.vq[0];
+    txq = &d.vq[1];
+    // header and packet, one 2K buffer per id and queue
+    bufs = guest_alloc(&d, (uint64_t)2 * 2048 * txq->num, 4096);
+    memset(pkt, 0x5a, sizeof(pkt));
+
+    start = now_ns();
+    tx->allocs = atomic_load(&alloc_count);
+    while (done < o->requests) {
+        while (issued < o->requests) {
+            uint64_t buf = bufs + (uint64_t)(issued % txq->num) * 2048;
+            struct seg sg[2] = {
+                {buf, NET_HDR_SIZE, false},
+                {buf + NET_HDR_SIZE, NET_MTU, false},
+            };
+            if (vq_add(&d, txq, sg, 2) < 0) {
+                break;
+            }
+            issued++;
+        }
+        vq_kick(&d, txq);
+        while (vq_get_used(&d, txq, &len) >= 0) {
+            done++;
+        }
+    }
+    tx->ns = now_ns() - start;
+    tx->allocs = atomic_load(&alloc_count) - tx->allocs;
+    tx->requests = done;
+    tx->kicks = txq->kicks;
+    tx->irqs = irqs = queue_irqs(dev, 2);
+    if (fake.packets != done || fake.bytes != done * NET_MTU) {
+        fprintf(stderr, "vqbench: sent %ld packets, %ld arrived\n",
+                done, fake.packets);
+        errors++;
+    }
+
+    issued = done = 0;
+    bufs += (uint64_t)2048 * txq->num;
+    start = now_ns();
+    rx->allocs = atomic_load(&alloc_count);
+    while (done < o->requests) {
+        // keep the receive queue full, as a driver does
+        while (rxq->num_free > 0) {
+            struct seg sg = {bufs + (uint64_t)rxq->free_head * 2048, 2048,
+                             true};
+            if (rxq->packed) {
+                sg.addr = bufs + (uint64_t)rxq->next_avail * 2048;
+            }
+            if (vq_add(&d, rxq, &sg, 1) < 0) {
+                break;
+            }
+        }
+        vq_kick(&d, rxq);
+        while (issued < o->requests && es->can_write_packet_to_virtio(es)) {
+            es->write_packet_to_virtio(es, pkt, sizeof(pkt));
+            issued++;
+        }
+        es->flush_packets_to_virtio(es);
+        while ((id = vq_get_used(&d, rxq, &len)) >= 0) {
+            if (len != NET_HDR_SIZE + sizeof(pkt)) {
+                errors++;
+            }
+            done++;
+        }
+    }
+    rx->ns = now_ns() - start;
+    rx->allocs = atomic_load(&alloc_count) - rx->allocs;
+    rx->requests = done;
+    rx->kicks = rxq->kicks;
+    rx->irqs = queue_irqs(dev, 2) - irqs;
+
+    driver_destroy(&d, 2);
+    virtio_net_destroy(dev);
+    free(dev);
+    if (errors) {
+        fprintf(stderr, "vqbench: network check failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+print_usage(FILE *stream, const char *program_name)
+{
+    fprintf(stream, "Usage: %s [-n REQUESTS] [-q DEPTH] [-d blk|net] "
+            "[-r split|packed] [-i] [-D] [-O] [-F N] [-w CACHE] [-b MB] "
+            "[-S] [-P] [-u SOCKET]\n",
+            program_name);
+    fprintf(stream, "\n");
+    fprintf(stream, "Options:\n");
+    fprintf(stream,
+            "  -n REQUESTS       Requests per run (default: 20000)\n");
+    fprintf(stream,
+            "  -q DEPTH          Queue size (default: 64)\n");
+    fprintf(stream,
+            "  -d DEVICE         Only run the blk or net device\n");
+    fprintf(stream,
+            "  -r RING           Only use split or packed rings\n");
+    fprintf(stream,
+            "  -i                Use indirect descriptors\n");
+    fprintf(stream,
+            "  -D                Open the disk image with O_DIRECT\n");
+    fprintf(stream,
+            "  -O                Write to a copy-on-write overlay of the "
+            "disk image\n");
+    fprintf(stream,
+            "  -F N              Make every Nth block request a flush\n");
+    fprintf(stream,
+            "  -w CACHE          writeback (default), writethrough or unsafe\n");
+    fprintf(stream,
+            "  -b MB             Cache MB of the disk in memory\n");
+    fprintf(stream,
+            "  -S                Read the disk sequentially, no writes\n");
+    fprintf(stream,
+            "  -P                Give the reads a real time priority, and\n"
+            "                    the writes an idle one\n");
+    fprintf(stream,
+            "  -u SOCKET         Send the block requests to the vhost-user\n"
+            "                    backend on SOCKET, whose disk has at least\n"
+            "                    64 MiB (implies -d blk -r split)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct opts o = {
+        .requests = 20000,
+        .depth = 64,
+        .blk = true,
+        .net = true,
+        .split = true,
+        .packed = true,
+    };
+    struct guest_mem_map mem = {0};
+    struct io_threads *io = NULL;
+    struct result r = {0}, r2 = {0};
+    int opt = 0, ret = 0;
+
+    while ((opt = getopt(argc, argv, "n:q:d:r:iDOF:w:b:SPu:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            o.requests = atol(optarg);
+            break;
+        case 'q':
+            o.depth = atoi(optarg);
+            break;
+        case 'd':
+            o.blk = strcmp(optarg, "blk") == 0;
+            o.net = strcmp(optarg, "net") == 0;
+            break;
+        case 'r':
+            o.split = strcmp(optarg, "split") == 0;
+            o.packed = strcmp(optarg, "packed") == 0;
+            break;
+        case 'i':
+            o.indirect = true;
+            break;
+        case 'D':
+            o.direct = true;
+            break;
+        case 'O':
+            o.overlay = true;
+            break;
+        case 'F':
+            o.flush_every = atoi(optarg);
+            break;
+        case 'w':
+            if (virtio_block_parse_cache(optarg, &o.cache) < 0) {
+                print_usage(stderr, argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            o.cache_size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'S':
+            o.sequential = true;
+            break;
+        case 'P':
+            o.prio = true;
+            break;
+        case 'u':
+            o.vhost_user = optarg;
+            break;
+        case 'h':
+            print_usage(stdout, argv[0]);
+            return 0;
+        default:
+            print_usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    // split rings need a power of 2
+    if (o.requests <= 0 || o.depth <= 0 || (o.depth & (o.depth - 1)) ||
+        (!o.blk && !o.net) || (!o.split && !o.packed)) {
+        print_usage(stderr, argv[0]);
+        return 1;
+    }
+
+    mem.size = GUEST_MEM_SIZE;
+    mem.fd = -1;
+    if (o.vhost_user) {
+        // the backend maps guest memory, and has no packed rings
+        o.net = o.packed = false;
+        o.split = true;
+        mem.fd = memfd_create("vqbench", MFD_CLOEXEC);
+        if (mem.fd < 0 || ftruncate(mem.fd, mem.size) < 0) {
+            perror("vqbench: memfd");
+            return 1;
+        }
+    }
+    mem.host_mem = mmap(NULL, mem.size, PROT_READ | PROT_WRITE,
+                        (mem.fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED) |
+                        MAP_NORESERVE, mem.fd, 0);
+    if (mem.host_mem == MAP_FAILED) {
+        perror("vqbench: mmap");
+        return 1;
+    }
+    io = new_io_threads(1, NULL, 0);
+    if (!io) {
+        fprintf(stderr, "vqbench: failed to start the io thread\n");
+        return 1;
+    }
+    for (int packed = 0; packed < 2; packed++) {
+        const char *ring = packed ? "packed" : "split";
+        if ((packed && !o.packed) || (!packed && !o.split)) {
+            continue;
+        }
+        if (o.blk) {
+            if (bench_blk(&o, &mem, io, packed, &r) < 0) {
+                ret = 1;
+            } else {
+                print_result("blk", ring, &r);
+            }
+        }
+        if (o.net) {
+            if (bench_net(&o, &mem, io, packed, &r, &r2) < 0) {
+                ret = 1;
+            } else {
+                print_result("net-tx", ring, &r);
+                print_result("net-rx", ring, &r2);
+            }
+        }
+    }
+    delete_io_threads(io);
+    munmap(mem.host_mem, mem.size);
+    if (mem.fd >= 0) {
+        close(mem.fd);
+    }
+    return ret;
+}
@@ -0,0 +1,969 @@
+#define _GNU_SOURCE
+#include "blkcache.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "iov.h"
+#include "config.h"
+
+#define PAGE_SECTORS (BLOCK_CACHE_PAGE / SECTOR_SIZE)
+// larger reads go around the cache
+#define MAX_FILL_PAGES (BLOCK_CACHE_READAHEAD_MAX / BLOCK_CACHE_PAGE)
+// sequential streams followed at once
+#define MAX_STREAMS 8
+// pages of the fills in flight, kept beyond those of the cache
+#define POOL_PAGES (2 * MAX_FILL_PAGES)
+
+enum {
+    QUEUE_NONE,     // being filled
+    QUEUE_A1IN,     // read once, FIFO
+    QUEUE_AM,       // read again, LRU
+    QUEUE_A1OUT,    // evicted from A1in, without data, FIFO
+};
+
+struct cache_page {
+    uint64_t index;             // of the page on the device
+    struct cache_page *hnext;
+    struct cache_page *prev;    // in its queue, towards the head
+    struct cache_page *next;
+    void *data;                 // NULL unless in A1in or Am
+    uint8_t queue;
+    bool ghost;                 // was in A1out before the fill
+    bool stale;                 // written while being filled
+    bool readahead;             // not read by the guest yet
+};
+
+struct cache_list {
+    struct cache_page *head;    // most recent
+    struct cache_page *tail;
+    size_t len;
+};
+
+struct cache_stream {
+    uint64_t next;              // sector expected next
+    uint64_t ra_end;            // read ahead up to this sector
+    uint32_t window;            // pages, 0 if the slot is free
+};
+
+// a read of whole pages from the device
+struct cache_fill {
+    struct block_cache *c;
+    block_device_completion_fn *cb;     // NULL for readahead
+    struct blk_io_callback_arg *cbarg;
+    const struct iovec *iov;            // of the guest read
+    int iovcnt;
+    size_t offset;                      // of the guest read in the pages
+    size_t len;
+    uint64_t first;
+    int npages;
+    struct cache_page **pages;          // those we fill, else NULL
+    struct iovec bufs[];
+};
+
+// writes, discards and write zeroes on their way to the device
+struct cache_write {
+    struct block_cache *c;
+    block_device_completion_fn *cb;
+    struct blk_io_callback_arg *cbarg;
+    struct cache_write *prev;
+    struct cache_write *next;
+    int n;
+    struct block_range ranges[];
+};
+
+struct block_cache {
+    struct block_device *bs;
+    struct block_device lower;
+    uint64_t pages;             // whole pages of the device
+    size_t capacity;            // pages with data
+    size_t kin;                 // target length of A1in
+    size_t kout;                // max length of A1out
+    pthread_mutex_t lock;
+    struct cache_page **hash;
+    size_t hash_mask;
+    struct cache_list a1in;
+    struct cache_list am;
+    struct cache_list a1out;
+    struct cache_write *writes;
+    struct cache_stream streams[MAX_STREAMS];
+    int stream_victim;
+    struct block_cache_stats stats;
+    struct obj_pool page_pool;
+    struct obj_pool page_bufs;
+    struct obj_pool fill_pool;
+    struct obj_pool write_pool;     // of a single range
+    struct obj_pool range_pool;     // of a discard or write zeroes
+};
+
+// Copy 'len' bytes at 'offset' of the pages to the iovec
+static void
+pages_to_iov(const struct iovec *pages, size_t offset,
+             const struct iovec *iov, size_t len)
+{
+    size_t done = 0, iov_off = 0, n = 0, pos = 0;
+
+    while (done < len) {
+        pos = offset + done;
+        n = BLOCK_CACHE_PAGE - pos % BLOCK_CACHE_PAGE;
+        if (n > iov->iov_len - iov_off) {
+            n = iov->iov_len - iov_off;
+        }
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy((uint8_t *)iov->iov_base + iov_off,
+               (uint8_t *)pages[pos / BLOCK_CACHE_PAGE].iov_base +
+               pos % BLOCK_CACHE_PAGE, n);
+        done += n;
+        iov_off += n;
+        if (iov_off == iov->iov_len) {
+            iov++;
+            iov_off = 0;
+        }
+    }
+}
+
+static void
+list_push(struct cache_list *l, struct cache_page *p)
+{
+    p->prev = NULL;
+    p->next = l->head;
+    if (l->head) {
+        l->head->prev = p;
+    } else {
+        l->tail = p;
+    }
+    l->head = p;
+    l->len++;
+}
+
+static void
+list_del(struct cache_list *l, struct cache_page *p)
+{
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        l->head = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    } else {
+        l->tail = p->prev;
+    }
+    l->len--;
+}
+
+static struct cache_list *
+page_list(struct block_cache *c, struct cache_page *p)
+{
+    switch (p->queue) {
+    case QUEUE_A1IN:
+        return &c->a1in;
+    case QUEUE_AM:
+        return &c->am;
+    case QUEUE_A1OUT:
+        return &c->a1out;
+    default:
+        return NULL;
+    }
+}
+
+static void
+page_unqueue(struct block_cache *c, struct cache_page *p)
+{
+    struct cache_list *l = page_list(c, p);
+
+    if (l) {
+        list_del(l, p);
+    }
+    p->queue = QUEUE_NONE;
+}
+
+static struct cache_page **
+page_bucket(struct block_cache *c, uint64_t index)
+{
+    return &c->hash[(index * 0x9e3779b97f4a7c15ULL >> 32) & c->hash_mask];
+}
+
+static struct cache_page *
+page_find(struct block_cache *c, uint64_t index)
+{
+    struct cache_page *p = *page_bucket(c, index);
+
+    while (p && p->index != index) {
+        p = p->hnext;
+    }
+    return p;
+}
+
+static struct cache_page *
+page_new(struct block_cache *c, uint64_t index)
+{
+    struct cache_page **bucket = page_bucket(c, index);
+    struct cache_page *p = obj_pool_alloc(&c->page_pool, sizeof(*p));
+
+    if (!p) {
+        return NULL;
+    }
+    *p = (struct cache_page){
+        .index = index,
+        .hnext = *bucket,
+    };
+    *bucket = p;
+    return p;
+}
+
+static void
+page_free(struct block_cache *c, struct cache_page *p)
+{
+    struct cache_page **pp = page_bucket(c, p->index);
+
+    page_unqueue(c, p);
+    while (*pp != p) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = p->hnext;
+    obj_pool_free(&c->page_bufs, p->data, BLOCK_CACHE_PAGE);
+    obj_pool_free(&c->page_pool, p, sizeof(*p));
+}
+
+// 2Q: the pages read once go first, to A1out which remembers them for a
+// while. A page read again after that is in the working set, it goes to
+// Am the next time.
+static void
+cache_evict(struct block_cache *c)
+{
+    struct cache_page *p = NULL;
+
+    if (c->a1in.len > c->kin || c->am.len == 0) {
+        p = c->a1in.tail;
+        list_del(&c->a1in, p);
+        obj_pool_free(&c->page_bufs, p->data, BLOCK_CACHE_PAGE);
+        p->data = NULL;
+        p->readahead = false;
+        p->queue = QUEUE_A1OUT;
+        list_push(&c->a1out, p);
+        while (c->a1out.len > c->kout) {
+            page_free(c, c->a1out.tail);
+        }
+    } else {
+        page_free(c, c->am.tail);
+    }
+    c->stats.evictions++;
+}
+
+static void
+page_install(struct block_cache *c, struct cache_page *p, void *data,
+             bool readahead)
+{
+    while (c->a1in.len + c->am.len >= c->capacity) {
+        cache_evict(c);
+    }
+    p->data = data;
+    p->readahead = readahead;
+    p->queue = p->ghost ? QUEUE_AM : QUEUE_A1IN;
+    list_push(page_list(c, p), p);
+}
+
+static void
+page_hit(struct block_cache *c, struct cache_page *p)
+{
+    if (p->readahead) {
+        p->readahead = false;
+        c->stats.readahead_hits++;
+    }
+    // A1in stays in the order of the reads from the device
+    if (p->queue == QUEUE_AM) {
+        list_del(&c->am, p);
+        list_push(&c->am, p);
+    }
+}
+
+// Drop the pages of a range being written. Those being filled may get
+// the old data, they are not installed.
+static void
+cache_invalidate(struct block_cache *c, const struct block_range *r)
+{
+    struct cache_page *p = NULL, *next = NULL;
+    uint64_t first = r->sector_num / PAGE_SECTORS;
+    uint64_t last = 0;
+
+    if (r->num_sectors == 0) {
+        return;
+    }
+    last = (r->sector_num + r->num_sectors - 1) / PAGE_SECTORS;
+    if (last - first <= c->hash_mask) {
+        for (uint64_t i = first; i <= last; i++) {
+            p = page_find(c, i);
+            if (p && p->queue == QUEUE_NONE) {
+                p->stale = true;
+            } else if (p) {
+                page_free(c, p);
+            }
+        }
+        return;
+    }
+    // more pages than the cache has, e.g. a discard of the whole disk
+    for (size_t b = 0; b <= c->hash_mask; b++) {
+        for (p = c->hash[b]; p; p = next) {
+            next = p->hnext;
+            if (p->index < first || p->index > last) {
+                continue;
+            }
+            if (p->queue == QUEUE_NONE) {
+                p->stale = true;
+            } else {
+                page_free(c, p);
+            }
+        }
+    }
+}
+
+static bool
+cache_writing(struct block_cache *c, uint64_t index)
+{
+    uint64_t start = index * PAGE_SECTORS;
+
+    for (struct cache_write *w = c->writes; w; w = w->next) {
+        for (int i = 0; i < w->n; i++) {
+            if (w->ranges[i].sector_num < start + PAGE_SECTORS &&
+                start < w->ranges[i].sector_num + w->ranges[i].num_sectors) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Follow the streams of sequential reads. Return true and the pages to
+// read ahead if 'sector_num' continues one which needs more.
+static bool
+cache_stream_update(struct block_cache *c, uint64_t sector_num,
+                    uint64_t sectors, uint64_t *first, int *npages)
+{
+    struct cache_stream *s = NULL;
+    uint64_t end = sector_num + sectors;
+    uint32_t max = BLOCK_CACHE_READAHEAD_MAX / BLOCK_CACHE_PAGE;
+
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (c->streams[i].window && c->streams[i].next == sector_num) {
+            s = &c->streams[i];
+            break;
+        }
+    }
+    if (!s) {
+        s = &c->streams[c->stream_victim];
+        c->stream_victim = (c->stream_victim + 1) % MAX_STREAMS;
+        *s = (struct cache_stream){
+            .next = end,
+            .ra_end = end,
+            .window = BLOCK_CACHE_READAHEAD_MIN / BLOCK_CACHE_PAGE,
+        };
+        return false;
+    }
+    s->next = end;
+    // half of the window is still ahead
+    if (s->ra_end >= end + (uint64_t)s->window * PAGE_SECTORS / 2) {
+        return false;
+    }
+    *first = ((s->ra_end > end ? s->ra_end : end) + PAGE_SECTORS - 1) /
+             PAGE_SECTORS;
+    // it goes to A1in, where it must not push out what it reads ahead
+    *npages = s->window < c->kin ? s->window : c->kin;
+    if (*first >= c->pages) {
+        return false;
+    }
+    if (*npages > c->pages - *first) {
+        *npages = c->pages - *first;
+    }
+    s->ra_end = (*first + *npages) * PAGE_SECTORS;
+    s->window = s->window * 2 < max ? s->window * 2 : max;
+    return true;
+}
+
+static size_t
+fill_size(int npages)
+{
+    return sizeof(struct cache_fill) +
+           npages * (sizeof(struct iovec) + sizeof(struct cache_page *));
+}
+
+static void
+fill_free(struct cache_fill *f)
+{
+    struct block_cache *c = f->c;
+
+    for (int i = 0; i < f->npages; i++) {
+        obj_pool_free(&c->page_bufs, f->bufs[i].iov_base, BLOCK_CACHE_PAGE);
+    }
+    obj_pool_free(&c->fill_pool, f, fill_size(f->npages));
+}
+
+static struct cache_fill *
+fill_new(struct block_cache *c, uint64_t first, int npages)
+{
+    struct cache_fill *f = obj_pool_alloc(&c->fill_pool, fill_size(npages));
+
+    if (!f) {
+        return NULL;
+    }
+    *f = (struct cache_fill){
+        .c = c,
+        .first = first,
+        .npages = npages,
+        .pages = (struct cache_page **)(f->bufs + npages),
+    };
+    for (int i = 0; i < npages; i++) {
+        f->bufs[i] = (struct iovec){NULL, BLOCK_CACHE_PAGE};
+        f->pages[i] = NULL;
+    }
+    for (int i = 0; i < npages; i++) {
+        // aligned for O_DIRECT
+        f->bufs[i].iov_base = obj_pool_alloc(&c->page_bufs, BLOCK_CACHE_PAGE);
+        if (!f->bufs[i].iov_base) {
+            fill_free(f);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+// Take the pages of the fill which are not in the cache, nor being read
+// or written. Return how many.
+static int
+fill_claim(struct block_cache *c, struct cache_fill *f)
+{
+    struct cache_page *p = NULL;
+    int n = 0;
+
+    for (int i = 0; i < f->npages; i++) {
+        p = page_find(c, f->first + i);
+        if ((p && p->queue != QUEUE_A1OUT) ||
+            cache_writing(c, f->first + i)) {
+            continue;
+        }
+        if (p) {
+            page_unqueue(c, p);
+            p->ghost = true;
+        } else {
+            p = page_new(c, f->first + i);
+            if (!p) {
+                continue;
+            }
+        }
+        p->stale = false;
+        f->pages[i] = p;
+        n++;
+    }
+    return n;
+}
+
+// Install the pages read, the buffers go to the cache
+static void
+fill_end(struct block_cache *c, struct cache_fill *f, int ret)
+{
+    struct cache_page *p = NULL;
+
+    for (int i = 0; i < f->npages; i++) {
+        p = f->pages[i];
+        if (!p) {
+            continue;
+        }
+        if (ret < 0 || p->stale) {
+            page_free(c, p);
+            continue;
+        }
+        page_install(c, p, f->bufs[i].iov_base, !f->cb);
+        f->bufs[i].iov_base = NULL;
+    }
+}
+
+static void
+cache_fill_cb(struct blk_io_callback_arg *arg, int ret)
+{
+    // the device only hands our fill back
+    struct cache_fill *f = (struct cache_fill *)arg;
+    struct block_cache *c = f->c;
+    block_device_completion_fn *cb = f->cb;
+    struct blk_io_callback_arg *cbarg = f->cbarg;
+
+    // the pages may be evicted once installed
+    if (cb && ret >= 0) {
+        pages_to_iov(f->bufs, f->offset, f->iov, f->len);
+    }
+    pthread_mutex_lock(&c->lock);
+    fill_end(c, f, ret);
+    pthread_mutex_unlock(&c->lock);
+    fill_free(f);
+    if (cb) {
+        cb(cbarg, ret);
+    }
+}
+
+static void
+cache_readahead(struct block_cache *c, uint64_t first, int npages,
+                uint16_t ioprio)
+{
+    struct cache_fill *f = fill_new(c, first, npages);
+    int i0 = 0, i1 = npages - 1, n = 0;
+
+    if (!f) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    n = fill_claim(c, f);
+    c->stats.readahead += n;
+    pthread_mutex_unlock(&c->lock);
+    if (n == 0) {
+        fill_free(f);
+        return;
+    }
+    // only read the pages claimed, and those in between
+    while (!f->pages[i0]) {
+        i0++;
+    }
+    while (!f->pages[i1]) {
+        i1--;
+    }
+    if (c->lower.read_async(&c->lower, (first + i0) * PAGE_SECTORS,
+                            f->bufs + i0, i1 - i0 + 1, ioprio,
+                            cache_fill_cb,
+                            (struct blk_io_callback_arg *)f) < 0) {
+        pthread_mutex_lock(&c->lock);
+        c->stats.readahead -= n;
+        fill_end(c, f, -1);
+        pthread_mutex_unlock(&c->lock);
+        fill_free(f);
+    }
+}
+
+static int64_t
+block_cache_get_sector_count(struct block_device *bs)
+{
+    struct block_cache *c = bs->opaque;
+
+    return c->lower.get_sector_count(&c->lower);
+}
+
+static int
+block_cache_read_async(struct block_device *bs, uint64_t sector_num,
+                       const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                       block_device_completion_fn *cb,
+                       struct blk_io_callback_arg *cbarg)
+{
+    struct block_cache *c = bs->opaque;
+    struct iovec pages[MAX_FILL_PAGES];
+    struct cache_page *p = NULL;
+    struct cache_fill *f = NULL;
+    size_t len = iov_size(iov, iovcnt);
+    size_t offset = sector_num % PAGE_SECTORS * SECTOR_SIZE;
+    uint64_t first = sector_num / PAGE_SECTORS, ra_first = 0;
+    int npages = (offset + len + BLOCK_CACHE_PAGE - 1) / BLOCK_CACHE_PAGE;
+    int ra_npages = 0, ret = 0;
+    bool hit = true, ra = false;
+
+    if (len == 0 || npages > MAX_FILL_PAGES || first + npages > c->pages) {
+        return c->lower.read_async(&c->lower, sector_num, iov, iovcnt, ioprio,
+                                   cb, cbarg);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < npages && hit; i++) {
+        p = page_find(c, first + i);
+        hit = p && p->data;
+        if (hit) {
+            pages[i] = (struct iovec){p->data, BLOCK_CACHE_PAGE};
+        }
+    }
+    if (hit) {
+        for (int i = 0; i < npages; i++) {
+            page_hit(c, page_find(c, first + i));
+        }
+        pages_to_iov(pages, offset, iov, len);
+        c->stats.hits++;
+        ra = cache_stream_update(c, sector_num, len / SECTOR_SIZE,
+                                 &ra_first, &ra_npages);
+        pthread_mutex_unlock(&c->lock);
+        if (ra) {
+            cache_readahead(c, ra_first, ra_npages, ioprio);
+        }
+        return 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    f = fill_new(c, first, npages);
+    if (!f) {
+        return c->lower.read_async(&c->lower, sector_num, iov, iovcnt, ioprio,
+                                   cb, cbarg);
+    }
+    f->cb = cb;
+    f->cbarg = cbarg;
+    f->iov = iov;
+    f->iovcnt = iovcnt;
+    f->offset = offset;
+    f->len = len;
+    pthread_mutex_lock(&c->lock);
+    fill_claim(c, f);
+    pthread_mutex_unlock(&c->lock);
+    ret = c->lower.read_async(&c->lower, first * PAGE_SECTORS, f->bufs,
+                              npages, ioprio, cache_fill_cb,
+                              (struct blk_io_callback_arg *)f);
+    if (ret < 0) {
+        pthread_mutex_lock(&c->lock);
+        fill_end(c, f, ret);
+        pthread_mutex_unlock(&c->lock);
+        fill_free(f);
+        return ret;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->stats.misses++;
+    ra = cache_stream_update(c, sector_num, len / SECTOR_SIZE,
+                             &ra_first, &ra_npages);
+    pthread_mutex_unlock(&c->lock);
+    if (ra) {
+        cache_readahead(c, ra_first, ra_npages, ioprio);
+    }
+    return 0;
+}
+
+static struct obj_pool *
+cache_write_pool(struct block_cache *c, int n)
+{
+    return n == 1 ? &c->write_pool : &c->range_pool;
+}
+
+static struct cache_write *
+cache_write_begin(struct block_cache *c, const struct block_range *ranges,
+                  int n, block_device_completion_fn *cb,
+                  struct blk_io_callback_arg *cbarg)
+{
+    struct cache_write *w = obj_pool_alloc(cache_write_pool(c, n),
+                                           sizeof(*w) + n * sizeof(*ranges));
+
+    if (!w) {
+        return NULL;
+    }
+    w->c = c;
+    w->cb = cb;
+    w->cbarg = cbarg;
+    w->n = n;
+    memcpy(w->ranges, ranges, n * sizeof(*ranges));
+    pthread_mutex_lock(&c->lock);
+    w->prev = NULL;
+    w->next = c->writes;
+    if (c->writes) {
+        c->writes->prev = w;
+    }
+    c->writes = w;
+    for (int i = 0; i < n; i++) {
+        cache_invalidate(c, &ranges[i]);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return w;
+}
+
+static void
+cache_write_end(struct cache_write *w)
+{
+    struct block_cache *c = w->c;
+
+    pthread_mutex_lock(&c->lock);
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        c->writes = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    }
+    pthread_mutex_unlock(&c->lock);
+    obj_pool_free(cache_write_pool(c, w->n), w,
+                  sizeof(*w) + w->n * sizeof(*w->ranges));
+}
+
+static void
+cache_write_cb(struct blk_io_callback_arg *arg, int ret)
+{
+    struct cache_write *w = (struct cache_write *)arg;
+    block_device_completion_fn *cb = w->cb;
+    struct blk_io_callback_arg *cbarg = w->cbarg;
+
+    cache_write_end(w);
+    cb(cbarg, ret);
+}
+
+static int
+block_cache_write_async(struct block_device *bs, uint64_t sector_num,
+                        const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                        int flags, block_device_completion_fn *cb,
+                        struct blk_io_callback_arg *cbarg)
+{
+    struct block_cache *c = bs->opaque;
+    struct block_range r = {
+        .sector_num = sector_num,
+        .num_sectors = iov_size(iov, iovcnt) / SECTOR_SIZE,
+    };
+    struct cache_write *w = cache_write_begin(c, &r, 1, cb, cbarg);
+    int ret = 0;
+
+    if (!w) {
+        return -1;
+    }
+    ret = c->lower.write_async(&c->lower, sector_num, iov, iovcnt, ioprio,
+                               flags,
+                               cache_write_cb, (struct blk_io_callback_arg *)w);
+    if (ret < 0) {
+        cache_write_end(w);
+    }
+    return ret;
+}
+
+static int
+block_cache_discard_async(struct block_device *bs,
+                          const struct block_range *ranges, int n,
+                          block_device_completion_fn *cb,
+                          struct blk_io_callback_arg *cbarg)
+{
+    struct block_cache *c = bs->opaque;
+    struct cache_write *w = cache_write_begin(c, ranges, n, cb, cbarg);
+    int ret = 0;
+
+    if (!w) {
+        return -1;
+    }
+    ret = c->lower.discard_async(&c->lower, ranges, n, cache_write_cb,
+                                 (struct blk_io_callback_arg *)w);
+    if (ret < 0) {
+        cache_write_end(w);
+    }
+    return ret;
+}
+
+static int
+block_cache_write_zeroes_async(struct block_device *bs,
+                               const struct block_range *ranges, int n,
+                               int flags, block_device_completion_fn *cb,
+                               struct blk_io_callback_arg *cbarg)
+{
+    struct block_cache *c = bs->opaque;
+    struct cache_write *w = cache_write_begin(c, ranges, n, cb, cbarg);
+    int ret = 0;
+
+    if (!w) {
+        return -1;
+    }
+    ret = c->lower.write_zeroes_async(&c->lower, ranges, n, flags,
+                                      cache_write_cb,
+                                      (struct blk_io_callback_arg *)w);
+    if (ret < 0) {
+        cache_write_end(w);
+    }
+    return ret;
+}
+
+static int
+block_cache_flush_async(struct block_device *bs,
+                        block_device_completion_fn *cb,
+                        struct blk_io_callback_arg *cbarg)
+{
+    struct block_cache *c = bs->opaque;
+
+    // nothing dirty here
+    return c->lower.flush_async(&c->lower, cb, cbarg);
+}
+
+static void
+block_cache_submit(struct block_device *bs)
+{
+    struct block_cache *c = bs->opaque;
+
+    c->lower.submit(&c->lower);
+}
+
+// those of the cache are printed by block_cache_print_stats()
+static void
+block_cache_print_lower_stats(struct block_device *bs, const char *name,
+                              FILE *f)
+{
+    struct block_cache *c = bs->opaque;
+
+    c->lower.print_stats(&c->lower, name, f);
+}
+
+static void
+cache_pools_destroy(struct block_cache *c)
+{
+    obj_pool_destroy(&c->page_pool);
+    obj_pool_destroy(&c->page_bufs);
+    obj_pool_destroy(&c->fill_pool);
+    obj_pool_destroy(&c->write_pool);
+    obj_pool_destroy(&c->range_pool);
+}
+
+// Sized to the cache: its pages, those remembered in A1out, those being
+// filled and their buffers are all allocated up front
+static int
+cache_pools_init(struct block_cache *c)
+{
+    size_t pages = c->capacity + c->kout + POOL_PAGES;
+    size_t bufs = c->capacity + POOL_PAGES;
+
+    if (pages > INT_MAX) {
+        return -1;
+    }
+    if (obj_pool_init(&c->page_pool, sizeof(struct cache_page), 0,
+                      pages) < 0) {
+        return -1;
+    }
+    if (obj_pool_init(&c->page_bufs, BLOCK_CACHE_PAGE, BLOCK_CACHE_PAGE,
+                      bufs) < 0) {
+        obj_pool_destroy(&c->page_pool);
+        return -1;
+    }
+    if (obj_pool_init(&c->fill_pool, fill_size(MAX_FILL_PAGES), 0,
+                      4 * MAX_STREAMS) < 0) {
+        obj_pool_destroy(&c->page_pool);
+        obj_pool_destroy(&c->page_bufs);
+        return -1;
+    }
+    if (obj_pool_init(&c->write_pool, sizeof(struct cache_write) +
+                      sizeof(struct block_range), 0,
+                      VIRTIO_BLK_MAX_QUEUE_NUM) < 0) {
+        obj_pool_destroy(&c->page_pool);
+        obj_pool_destroy(&c->page_bufs);
+        obj_pool_destroy(&c->fill_pool);
+        return -1;
+    }
+    if (obj_pool_init(&c->range_pool, sizeof(struct cache_write) +
+                      VIRTIO_BLK_DISCARD_SEG_MAX * sizeof(struct block_range),
+                      0, VIRTIO_BLK_MAX_QUEUE_NUM) < 0) {
+        obj_pool_destroy(&c->page_pool);
+        obj_pool_destroy(&c->page_bufs);
+        obj_pool_destroy(&c->fill_pool);
+        obj_pool_destroy(&c->write_pool);
+        return -1;
+    }
+    if (obj_pool_prealloc(&c->page_pool, pages) < 0 ||
+        obj_pool_prealloc(&c->page_bufs, bufs) < 0 ||
+        obj_pool_prealloc(&c->fill_pool, 4 * MAX_STREAMS) < 0 ||
+        obj_pool_prealloc(&c->write_pool, VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+        obj_pool_prealloc(&c->range_pool, VIRTIO_BLK_MAX_QUEUE_NUM) < 0) {
+        cache_pools_destroy(c);
+        return -1;
+    }
+    return 0;
+}
+
+struct block_cache *
+block_cache_new(struct block_device *bs, uint64_t size)
+{
+    struct block_cache *c = NULL;
+    size_t buckets = 1;
+
+    if (size < BLOCK_CACHE_PAGE) {
+        fprintf(stderr, "block cache: %" PRIu64 " bytes is too small\n",
+                size);
+        return NULL;
+    }
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->capacity = size / BLOCK_CACHE_PAGE;
+    c->kin = c->capacity / 4 ? c->capacity / 4 : 1;
+    c->kout = c->capacity / 2 ? c->capacity / 2 : 1;
+    while (buckets < c->capacity + c->kout) {
+        buckets <<= 1;
+    }
+    c->hash = calloc(buckets, sizeof(*c->hash));
+    if (!c->hash || cache_pools_init(c) < 0) {
+        free(c->hash);
+        free(c);
+        return NULL;
+    }
+    c->hash_mask = buckets - 1;
+    pthread_mutex_init(&c->lock, NULL);
+    c->pages = bs->get_sector_count(bs) / PAGE_SECTORS;
+    c->bs = bs;
+    c->lower = *bs;
+
+    bs->get_sector_count = block_cache_get_sector_count;
+    bs->read_async = block_cache_read_async;
+    bs->write_async = block_cache_write_async;
+    bs->submit = bs->submit ? block_cache_submit : NULL;
+    bs->flush_async = bs->flush_async ? block_cache_flush_async : NULL;
+    bs->discard_async = bs->discard_async ? block_cache_discard_async : NULL;
+    bs->write_zeroes_async = bs->write_zeroes_async ?
+                             block_cache_write_zeroes_async : NULL;
+    bs->print_stats = bs->print_stats ? block_cache_print_lower_stats : NULL;
+    bs->opaque = c;
+    return c;
+}
+
+void
+block_cache_delete(struct block_cache *c)
+{
+    struct cache_page *p = NULL, *next = NULL;
+
+    *c->bs = c->lower;
+    for (size_t b = 0; b <= c->hash_mask; b++) {
+        for (p = c->hash[b]; p; p = next) {
+            next = p->hnext;
+            obj_pool_free(&c->page_bufs, p->data, BLOCK_CACHE_PAGE);
+            obj_pool_free(&c->page_pool, p, sizeof(*p));
+        }
+    }
+    free(c->hash);
+    cache_pools_destroy(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+struct block_device *
+block_cache_lower(struct block_cache *c)
+{
+    return &c->lower;
+}
+
+void
+block_cache_get_stats(struct block_cache *c, struct block_cache_stats *st)
+{
+    pthread_mutex_lock(&c->lock);
+    *st = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+block_cache_print_stats(struct block_cache *c, const char *name, FILE *f)
+{
+    struct block_cache_stats st = {0};
+    struct pool_stats pst = {0};
+    uint64_t reads = 0;
+
+    block_cache_get_stats(c, &st);
+    reads = st.hits + st.misses;
+    fprintf(f, "%s cache: %" PRIu64 " hits, %" PRIu64 " misses (%.2f%% hits), "
+            "%" PRIu64 " evictions\n",
+            name, st.hits, st.misses, reads ? 100.0 * st.hits / reads : 0.0,
+            st.evictions);
+    fprintf(f, "%s cache: %" PRIu64 " pages read ahead, %" PRIu64 " used\n",
+            name, st.readahead, st.readahead_hits);
+    obj_pool_get_stats(&c->page_pool, &pst);
+    pool_print_stats(&pst, name, "cache pages", f);
+    obj_pool_get_stats(&c->page_bufs, &pst);
+    pool_print_stats(&pst, name, "cache page buffers", f);
+    obj_pool_get_stats(&c->fill_pool, &pst);
+    pool_print_stats(&pst, name, "cache fills", f);
+    obj_pool_get_stats(&c->write_pool, &pst);
+    pool_print_stats(&pst, name, "cache writes", f);
+    obj_pool_get_stats(&c->range_pool, &pst);
+    pool_print_stats(&pst, name, "cache discards", f);
+}
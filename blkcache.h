@@ -0,0 +1,46 @@
+#ifndef MVVMM_BLKCACHE_H_
+#define MVVMM_BLKCACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "virtio.h"
+
+// A read cache in front of any struct block_device, for images whose
+// reads are expensive and not cached by the host, e.g. O_DIRECT ones or
+// those on a network file system. Pages of BLOCK_CACHE_PAGE bytes are
+// kept up to a memory budget and evicted with 2Q, so that a scan does
+// not flush the pages read again and again. Sequential streams of reads
+// are detected and read ahead asynchronously.
+//
+// Writes go straight to the device, the pages they overlap are dropped.
+// A read served from the cache completes inside read_async, which then
+// returns 1.
+
+#define BLOCK_CACHE_PAGE 4096
+// readahead window of a stream, doubled up to the max as it goes on
+#define BLOCK_CACHE_READAHEAD_MIN (128 * 1024)
+#define BLOCK_CACHE_READAHEAD_MAX (1024 * 1024)
+
+struct block_cache;
+
+struct block_cache_stats {
+    uint64_t hits;              // reads served from the cache
+    uint64_t misses;            // reads which went to the device
+    uint64_t readahead;         // pages read ahead
+    uint64_t readahead_hits;    // of them, pages read by the guest later
+    uint64_t evictions;
+};
+
+// Put a cache of 'size' bytes in front of 'bs', whose hooks are replaced
+// by those of the cache. The device must be idle. NULL on failure.
+struct block_cache *block_cache_new(struct block_device *bs, uint64_t size);
+// Give 'bs' its hooks back and free the cache, once the I/O is done
+void block_cache_delete(struct block_cache *c);
+// The device underneath, a copy of 'bs' before the cache
+struct block_device *block_cache_lower(struct block_cache *c);
+
+void block_cache_get_stats(struct block_cache *c, struct block_cache_stats *st);
+void block_cache_print_stats(struct block_cache *c, const char *name, FILE *f);
+
+#endif
@@ -1,50 +1,227 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/ioprio.h>
 
 #include "virtio.h"
+#include "iov.h"
 #include "threadpool.h"
+#include "uring.h"
+#include "overlay.h"
+#include "pool.h"
+#include "blkcache.h"
+#include "iothread.h"
 #include "mvvm.h"
 #include "config.h"
 
 #define SECTOR_SIZE 512
+#define VHOST_USER_PREFIX "vhost-user:"
+#define DIRECT_PREFIX "direct:"
+#define OVERLAY_PREFIX "overlay:"
 
-// Context for block device operations using thread pool
+struct block_uring;
+
+// A flush waiting for the sync which covers it
+struct block_flush {
+    block_device_completion_fn *cb;
+    struct blk_io_callback_arg *opaque;
+    struct block_flush *next;
+};
+
+// Context for block device operations, using io_uring or a thread pool
 struct block_device_ctx {
     int fd;
+    // With O_DIRECT, 'fd' bypasses the host page cache and 'buffered_fd'
+    // serves the requests which are not aligned. Otherwise both are the
+    // same.
+    int buffered_fd;
+    uint32_t mem_align;         // of the buffers for 'fd', 0 if buffered
+    uint32_t offset_align;      // of the offsets and lengths
     uint64_t size;
+    // a copy-on-write disk, whose delta is 'fd', NULL for a raw image
+    struct overlay *overlay;
+    // with 'uring', only runs the discards and write zeroes
     struct thread_pool *pool;
+    struct block_uring *uring;
+    // Group commit: the flushes arriving while a sync runs wait for the
+    // next one, a single sync for all of them
+    pthread_mutex_t flush_lock;
+    struct block_flush *flushes;
+    bool syncing;
+    // the requests for the I/O threads, the flushes, the discards and
+    // the bounce buffers, kept for the next ones
+    struct obj_pool req_pool;
+    struct obj_pool flush_pool;
+    struct obj_pool zero_pool;
+    struct buf_pool bounce_pool;
 };
 
 // Request structure passed to worker threads for async I/O
 struct async_io_req {
+    struct block_device_ctx *ctx;
     int fd;
     uint64_t offset;
-    uint8_t *buf;
+    const struct iovec *iov;
+    int iovcnt;
     size_t count;
     block_device_completion_fn *cb;
     void *opaque;
     int is_write;
+    int rw_flags;               // RWF_DSYNC for a write through
+    bool bounce;                // the buffers are not aligned for O_DIRECT
+    struct overlay *overlay;    // NULL for a raw image
+    uint16_t ioprio;            // that of the guest request
 };
 
+// A discard or write zeroes request, for the I/O threads
+struct block_zero_req {
+    struct block_device_ctx *ctx;
+    block_device_completion_fn *cb;
+    struct blk_io_callback_arg *opaque;
+    bool zeroes;                // the ranges must read as zeroes
+    bool sync;                  // write through
+    int n;
+    struct block_range ranges[];
+};
+
+static size_t
+block_zero_req_size(int n)
+{
+    return sizeof(struct block_zero_req) + n * sizeof(struct block_range);
+}
+
+// The fd serving a request. With O_DIRECT, '*bounce' tells if the guest
+// buffers must be copied to an aligned buffer.
+static int
+block_pick_fd(struct block_device_ctx *ctx, uint64_t offset,
+              const struct iovec *iov, int iovcnt, size_t count, bool *bounce)
+{
+    *bounce = false;
+    if (ctx->mem_align == 0) {
+        return ctx->fd;
+    }
+    if (offset % ctx->offset_align != 0 || count % ctx->offset_align != 0) {
+        return ctx->buffered_fd;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if ((uintptr_t)iov[i].iov_base % ctx->mem_align != 0 ||
+            iov[i].iov_len % ctx->mem_align != 0) {
+            *bounce = true;
+            break;
+        }
+    }
+    return ctx->fd;
+}
+
+// Page aligned, which is enough for any device
+static void *
+block_bounce_alloc(struct block_device_ctx *ctx, size_t count)
+{
+    return buf_pool_alloc(&ctx->bounce_pool, count);
+}
+
+static void
+block_bounce_free(struct block_device_ctx *ctx, void *buf, size_t count)
+{
+    buf_pool_free(&ctx->bounce_pool, buf, count);
+}
+
+// Blocking I/O through an aligned copy of the guest buffers
+static ssize_t
+block_bounce_rw(struct async_io_req *req)
+{
+    void *buf = block_bounce_alloc(req->ctx, req->count);
+    ssize_t n = 0;
+
+    if (!buf) {
+        return -1;
+    }
+    if (req->is_write) {
+        struct iovec iov = {.iov_base = buf, .iov_len = req->count};
+
+        iov_to_buf(req->iov, req->iovcnt, 0, buf, req->count);
+        n = pwritev2(req->fd, &iov, 1, req->offset, req->rw_flags);
+    } else {
+        n = pread(req->fd, buf, req->count, req->offset);
+        if (n == (ssize_t)req->count) {
+            iov_from_buf(req->iov, req->iovcnt, 0, buf, req->count);
+        }
+    }
+    block_bounce_free(req->ctx, buf, req->count);
+    return n;
+}
+
+// The queue of the thread pool for a priority: the best effort levels
+// above the normal one first, the idle class last
+static int
+block_prio_level(uint16_t ioprio)
+{
+    if (IOPRIO_PRIO_CLASS(ioprio) == IOPRIO_CLASS_IDLE) {
+        return 2;
+    }
+    if (IOPRIO_PRIO_CLASS(ioprio) == IOPRIO_CLASS_BE &&
+        IOPRIO_PRIO_DATA(ioprio) < IOPRIO_NORM) {
+        return 0;
+    }
+    return THREAD_POOL_PRIO_DEFAULT;
+}
+
+// The syscalls of a worker go at the priority of its request, for the
+// host I/O scheduler. Only changed when it differs from the last one.
+static void
+block_set_ioprio(uint16_t ioprio)
+{
+    static __thread uint16_t current = 0;
+
+    if (ioprio == current) {
+        return;
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == 0) {
+        current = ioprio;
+    }
+}
+
 // Worker function executed by thread pool for disk I/O operations
 static void*
 block_io_worker_fn(void *arg)
 {
     struct async_io_req *req = arg;
+    struct block_device_ctx *ctx = req->ctx;
     ssize_t n = 0;
     int ret = 0;
 
-    // Perform actual I/O using pread/pwrite for thread safety
-    if (req->is_write) {
-        n = pwrite(req->fd, req->buf, req->count, req->offset);
-        free(req->buf);
+    block_set_ioprio(req->ioprio);
+
+    // Perform actual I/O using preadv/pwritev for thread safety, the
+    // iovecs point directly into guest memory
+    if (req->overlay && req->is_write) {
+        n = overlay_pwritev(req->overlay, req->iov, req->iovcnt, req->offset);
+        if (n >= 0 && req->rw_flags && overlay_flush(req->overlay) < 0) {
+            n = -1;
+        }
+    } else if (req->overlay) {
+        n = overlay_preadv(req->overlay, req->iov, req->iovcnt, req->offset);
+    } else if (req->bounce) {
+        n = block_bounce_rw(req);
+    } else if (req->is_write) {
+        n = pwritev2(req->fd, req->iov, req->iovcnt, req->offset,
+                     req->rw_flags);
     } else {
-        n = pread(req->fd, req->buf, req->count, req->offset);
+        n = preadv(req->fd, req->iov, req->iovcnt, req->offset);
     }
 
     // Determine return code based on operation result
@@ -56,15 +233,82 @@ block_io_worker_fn(void *arg)
         ret = 0;
     }
 
-    // Invoke completion callback if provided
-    if (req->cb) {
-        req->cb(req->opaque, ret);
-    }
+    // Give the request back before the callback, which may issue the
+    // next ones
+    block_device_completion_fn *cb = req->cb;
+    void *opaque = req->opaque;
+    obj_pool_free(&ctx->req_pool, req, sizeof(*req));
 
-    free(req);
+    if (cb) {
+        cb(opaque, ret);
+    }
     return NULL;
 }
 
+static void
+block_pools_destroy(struct block_device_ctx *ctx)
+{
+    obj_pool_destroy(&ctx->req_pool);
+    obj_pool_destroy(&ctx->flush_pool);
+    obj_pool_destroy(&ctx->zero_pool);
+    buf_pool_destroy(&ctx->bounce_pool);
+}
+
+static int
+block_pools_init(struct block_device_ctx *ctx)
+{
+    // at most a queue of requests waits, and one runs per I/O thread
+    if (obj_pool_init(&ctx->req_pool, sizeof(struct async_io_req), 0,
+                      VIRTIO_BLK_IO_QUEUE + VIRTIO_BLK_IO_THREADS) < 0) {
+        return -1;
+    }
+    if (obj_pool_init(&ctx->flush_pool, sizeof(struct block_flush), 0,
+                      VIRTIO_BLK_MAX_QUEUE_NUM) < 0) {
+        obj_pool_destroy(&ctx->req_pool);
+        return -1;
+    }
+    if (obj_pool_init(&ctx->zero_pool,
+                      block_zero_req_size(VIRTIO_BLK_DISCARD_SEG_MAX), 0,
+                      VIRTIO_BLK_MAX_QUEUE_NUM) < 0) {
+        obj_pool_destroy(&ctx->req_pool);
+        obj_pool_destroy(&ctx->flush_pool);
+        return -1;
+    }
+    if (buf_pool_init(&ctx->bounce_pool, VIRTIO_BLK_BOUNCE_BUFS) < 0) {
+        obj_pool_destroy(&ctx->req_pool);
+        obj_pool_destroy(&ctx->flush_pool);
+        obj_pool_destroy(&ctx->zero_pool);
+        return -1;
+    }
+    // filled up front, the bounce buffers for the smallest requests
+    if (obj_pool_prealloc(&ctx->req_pool,
+                          VIRTIO_BLK_IO_QUEUE + VIRTIO_BLK_IO_THREADS) < 0 ||
+        obj_pool_prealloc(&ctx->flush_pool, VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+        obj_pool_prealloc(&ctx->zero_pool, VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+        buf_pool_prealloc(&ctx->bounce_pool, POOL_BUF_MIN,
+                          VIRTIO_BLK_BOUNCE_BUFS) < 0) {
+        block_pools_destroy(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+block_print_stats(struct block_device *bs, const char *name, FILE *f)
+{
+    struct block_device_ctx *ctx = bs->opaque;
+    struct pool_stats st = {0};
+
+    obj_pool_get_stats(&ctx->req_pool, &st);
+    pool_print_stats(&st, name, "I/O thread requests", f);
+    obj_pool_get_stats(&ctx->flush_pool, &st);
+    pool_print_stats(&st, name, "flushes", f);
+    obj_pool_get_stats(&ctx->zero_pool, &st);
+    pool_print_stats(&st, name, "discards", f);
+    buf_pool_get_stats(&ctx->bounce_pool, &st);
+    pool_print_stats(&st, name, "bounce buffers", f);
+}
+
 // Get total sector count (synchronous operation)
 static int64_t
 block_get_sector_count(struct block_device *bs)
@@ -75,28 +319,38 @@ block_get_sector_count(struct block_device *bs)
 
 // Asynchronous read operation using thread pool
 static int
-block_read_async(struct block_device *bs, uint64_t sector_num, uint8_t *buf, int n,
+block_read_async(struct block_device *bs, uint64_t sector_num,
+                 const struct iovec *iov, int iovcnt, uint16_t ioprio,
                  block_device_completion_fn *cb, struct blk_io_callback_arg *opaque)
 {
     struct block_device_ctx *ctx = bs->opaque;
     struct async_io_req *req = NULL;
+    int ret = 0;
 
-    req = malloc(sizeof(*req));
+    req = obj_pool_alloc(&ctx->req_pool, sizeof(*req));
     if (!req) {
         return -1;
     }
 
-    req->fd = ctx->fd;
+    req->ctx = ctx;
     req->offset = sector_num * SECTOR_SIZE;
-    req->buf = buf;
-    req->count = n * SECTOR_SIZE;
+    req->iov = iov;
+    req->iovcnt = iovcnt;
+    req->count = iov_size(iov, iovcnt);
+    req->fd = block_pick_fd(ctx, req->offset, iov, iovcnt, req->count,
+                            &req->bounce);
     req->cb = cb;
     req->opaque = opaque;
     req->is_write = 0;
+    req->rw_flags = 0;
+    req->overlay = ctx->overlay;
+    req->ioprio = ioprio;
 
-    if (thread_pool_run(ctx->pool, block_io_worker_fn, req) < 0) {
-        free(req);
-        return -1;
+    ret = thread_pool_run_prio(ctx->pool, block_io_worker_fn, req,
+                               block_prio_level(req->ioprio));
+    if (ret < 0) {
+        obj_pool_free(&ctx->req_pool, req, sizeof(*req));
+        return ret;
     }
 
     return 0;
@@ -104,35 +358,673 @@ block_read_async(struct block_device *bs, uint64_t sector_num, uint8_t *buf, int
 
 // Asynchronous write operation using thread pool
 static int
-block_write_async(struct block_device *bs, uint64_t sector_num, const uint8_t *buf,
-                  int n, block_device_completion_fn *cb, struct blk_io_callback_arg *opaque)
+block_write_async(struct block_device *bs, uint64_t sector_num,
+                  const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                  int flags,
+                  block_device_completion_fn *cb, struct blk_io_callback_arg *opaque)
 {
     struct block_device_ctx *ctx = bs->opaque;
     struct async_io_req *req = NULL;;
+    int ret = 0;
 
-    req = malloc(sizeof(*req));
+    req = obj_pool_alloc(&ctx->req_pool, sizeof(*req));
     if (!req) {
         return -ENOMEM;
     }
 
-    req->fd = ctx->fd;
+    req->ctx = ctx;
     req->offset = sector_num * SECTOR_SIZE;
-    // Cast away const for pread/pwrite API compatibility
-    req->buf = (uint8_t *)buf;
-    req->count = n * SECTOR_SIZE;
+    req->iov = iov;
+    req->iovcnt = iovcnt;
+    req->count = iov_size(iov, iovcnt);
+    req->fd = block_pick_fd(ctx, req->offset, iov, iovcnt, req->count,
+                            &req->bounce);
     req->cb = cb;
     req->opaque = opaque;
     req->is_write = 1;
+    req->rw_flags = flags & BLOCK_REQ_DSYNC ? RWF_DSYNC : 0;
+    req->overlay = ctx->overlay;
+    req->ioprio = ioprio;
+
+    ret = thread_pool_run_prio(ctx->pool, block_io_worker_fn, req,
+                               block_prio_level(req->ioprio));
+    if (ret < 0) {
+        obj_pool_free(&ctx->req_pool, req, sizeof(*req));
+        return ret;
+    }
+
+    return 0;
+}
+
+// Complete the flushes covered by a sync
+static void
+block_flush_done(struct block_device_ctx *ctx, struct block_flush *f, int ret)
+{
+    struct block_flush *next = NULL;
+
+    for (; f; f = next) {
+        next = f->next;
+        f->cb(f->opaque, ret);
+        obj_pool_free(&ctx->flush_pool, f, sizeof(*f));
+    }
+}
+
+// The flushes the next sync covers. If there are none, no sync runs
+// anymore.
+static struct block_flush *
+block_flush_take(struct block_device_ctx *ctx)
+{
+    struct block_flush *f = NULL;
+
+    pthread_mutex_lock(&ctx->flush_lock);
+    f = ctx->flushes;
+    ctx->flushes = NULL;
+    if (!f) {
+        ctx->syncing = false;
+    }
+    pthread_mutex_unlock(&ctx->flush_lock);
+    return f;
+}
+
+// Sync until no flush waits. A sync covers both fds, they share the
+// inode. That of an overlay also writes the entries of its new clusters.
+static void*
+block_flush_worker_fn(void *arg)
+{
+    struct block_device_ctx *ctx = arg;
+    struct block_flush *f = NULL;
+    int ret = 0;
+
+    while ((f = block_flush_take(ctx)) != NULL) {
+        if (ctx->overlay) {
+            ret = overlay_flush(ctx->overlay);
+        } else {
+            ret = fdatasync(ctx->fd);
+        }
+        block_flush_done(ctx, f, ret < 0 ? -1 : 0);
+    }
+    return NULL;
+}
+
+static int block_uring_sync(struct block_device_ctx *ctx);
+
+static int
+block_flush_async(struct block_device *bs, block_device_completion_fn *cb,
+                  struct blk_io_callback_arg *opaque)
+{
+    struct block_device_ctx *ctx = bs->opaque;
+    struct block_flush *f = NULL;
+    int ret = 0;
+
+    f = obj_pool_alloc(&ctx->flush_pool, sizeof(*f));
+    if (!f) {
+        return -ENOMEM;
+    }
+    f->cb = cb;
+    f->opaque = opaque;
+    pthread_mutex_lock(&ctx->flush_lock);
+    f->next = ctx->flushes;
+    ctx->flushes = f;
+    if (!ctx->syncing) {
+        if (ctx->uring) {
+            ret = block_uring_sync(ctx);
+        } else {
+            ret = thread_pool_run(ctx->pool, block_flush_worker_fn, ctx);
+        }
+        if (ret < 0) {
+            ctx->flushes = f->next;
+            pthread_mutex_unlock(&ctx->flush_lock);
+            obj_pool_free(&ctx->flush_pool, f, sizeof(*f));
+            return ret;
+        }
+        ctx->syncing = true;
+    }
+    pthread_mutex_unlock(&ctx->flush_lock);
+    return 0;
+}
+
+// Zero a range the slow way, if the file system cannot
+static int
+block_write_zero_buf(struct block_device_ctx *ctx, uint64_t offset,
+                     uint64_t len)
+{
+    static const uint8_t zeroes[65536];
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = pwrite(ctx->buffered_fd, zeroes,
+                   len < sizeof(zeroes) ? len : sizeof(zeroes), offset);
+        if (n <= 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Deallocate the ranges, or zero them without writing data if the file
+// system or device can
+static void*
+block_zero_worker_fn(void *arg)
+{
+    struct block_zero_req *req = arg;
+    struct block_device_ctx *ctx = req->ctx;
+    uint64_t offset = 0, len = 0;
+    int mode = 0, ret = 0;
+
+    for (int i = 0; i < req->n && ret == 0; i++) {
+        offset = req->ranges[i].sector_num * SECTOR_SIZE;
+        len = (uint64_t)req->ranges[i].num_sectors * SECTOR_SIZE;
+        mode = FALLOC_FL_KEEP_SIZE;
+        if (!req->zeroes || req->ranges[i].unmap) {
+            mode |= FALLOC_FL_PUNCH_HOLE;
+        } else {
+            mode |= FALLOC_FL_ZERO_RANGE;
+        }
+        if (fallocate(ctx->fd, mode, offset, len) == 0) {
+            continue;
+        }
+        // a discard is only a hint
+        if (errno != EOPNOTSUPP) {
+            ret = -1;
+        } else if (req->zeroes) {
+            ret = block_write_zero_buf(ctx, offset, len);
+        }
+    }
+    if (ret == 0 && req->sync && fdatasync(ctx->fd) < 0) {
+        ret = -1;
+    }
+    // given back before the callback too
+    block_device_completion_fn *cb = req->cb;
+    struct blk_io_callback_arg *opaque = req->opaque;
+    obj_pool_free(&ctx->zero_pool, req, block_zero_req_size(req->n));
+    cb(opaque, ret);
+    return NULL;
+}
+
+static int
+block_zero_queue(struct block_device *bs, const struct block_range *ranges,
+                 int n, bool zeroes, int flags, block_device_completion_fn *cb,
+                 struct blk_io_callback_arg *opaque)
+{
+    struct block_device_ctx *ctx = bs->opaque;
+    struct block_zero_req *req = NULL;
+    int ret = 0;
+
+    req = obj_pool_alloc(&ctx->zero_pool, block_zero_req_size(n));
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->ctx = ctx;
+    req->cb = cb;
+    req->opaque = opaque;
+    req->zeroes = zeroes;
+    req->sync = zeroes && (flags & BLOCK_REQ_DSYNC);
+    req->n = n;
+    memcpy(req->ranges, ranges, n * sizeof(*ranges));
+    ret = thread_pool_run(ctx->pool, block_zero_worker_fn, req);
+    if (ret < 0) {
+        obj_pool_free(&ctx->zero_pool, req, block_zero_req_size(n));
+    }
+    return ret;
+}
+
+static int
+block_discard_async(struct block_device *bs, const struct block_range *ranges,
+                    int n, block_device_completion_fn *cb,
+                    struct blk_io_callback_arg *opaque)
+{
+    return block_zero_queue(bs, ranges, n, false, 0, cb, opaque);
+}
+
+static int
+block_write_zeroes_async(struct block_device *bs,
+                         const struct block_range *ranges, int n, int flags,
+                         block_device_completion_fn *cb,
+                         struct blk_io_callback_arg *opaque)
+{
+    return block_zero_queue(bs, ranges, n, true, flags, cb, opaque);
+}
+
+// io_uring backend. The requests are queued with the device lock held and
+// submitted once per kick. The io thread of the device completes them when
+// the eventfd of the ring fires, without a thread handoff per request.
+struct uring_req {
+    block_device_completion_fn *cb;
+    struct blk_io_callback_arg *opaque;
+    size_t count;
+    // aligned copy of the guest buffers for O_DIRECT, NULL if none
+    void *bounce;
+    const struct iovec *iov;
+    int iovcnt;
+    bool is_write;
+    // the flushes a sync covers, NULL for a read or write
+    struct block_flush *flushes;
+};
+
+// registered buffers are at most 1 GiB
+#define URING_BUF_SHIFT 30
 
-    if (thread_pool_run(ctx->pool, block_io_worker_fn, req) < 0) {
-        free(req);
+struct block_uring {
+    struct block_device_ctx *ctx;
+    struct uring ring;
+    pthread_mutex_t lock;       // submission ring and free list
+    int efd;
+    struct io_handler handler;
+    int inflight;
+    // a sync is due but the ring was full, for the thread reaping it
+    bool sync_deferred;
+    // guest memory registered in chunks of 1 GiB, NULL if not
+    uint8_t *mem;
+    uint64_t mem_size;
+    struct uring_req reqs[VIRTIO_BLK_URING_ENTRIES];
+    int free_reqs[VIRTIO_BLK_URING_ENTRIES];
+    int nfree;
+};
+
+// The registered buffer holding a single buffer request, -1 if none
+static int
+block_uring_fixed_buf(struct block_uring *u, const struct iovec *iov,
+                      int iovcnt)
+{
+    uint64_t start = 0, end = 0;
+
+    if (!u->mem || iovcnt != 1 || iov[0].iov_len == 0 ||
+        (uint8_t *)iov[0].iov_base < u->mem) {
         return -1;
     }
+    start = (uint8_t *)iov[0].iov_base - u->mem;
+    end = start + iov[0].iov_len - 1;
+    if (end >= u->mem_size ||
+        start >> URING_BUF_SHIFT != end >> URING_BUF_SHIFT) {
+        return -1;
+    }
+    return start >> URING_BUF_SHIFT;
+}
+
+static int
+block_uring_queue(struct block_device *bs, uint64_t sector_num,
+                  const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                  int flags, block_device_completion_fn *cb,
+                  struct blk_io_callback_arg *opaque, int is_write)
+{
+    struct block_device_ctx *ctx = bs->opaque;
+    struct block_uring *u = ctx->uring;
+    struct io_uring_sqe *sqe = NULL;
+    uint64_t offset = sector_num * SECTOR_SIZE;
+    size_t count = iov_size(iov, iovcnt);
+    void *bounce = NULL;
+    bool need_bounce = false;
+    int i = 0, buf = 0, fd = 0;
+
+    fd = block_pick_fd(ctx, offset, iov, iovcnt, count, &need_bounce);
+    if (need_bounce) {
+        bounce = block_bounce_alloc(ctx, count);
+        if (!bounce) {
+            return -ENOMEM;
+        }
+        if (is_write) {
+            iov_to_buf(iov, iovcnt, 0, bounce, count);
+        }
+    }
+    pthread_mutex_lock(&u->lock);
+    if (u->nfree == 0 || (sqe = uring_get_sqe(&u->ring)) == NULL) {
+        pthread_mutex_unlock(&u->lock);
+        block_bounce_free(ctx, bounce, count);
+        return -EAGAIN;
+    }
+    i = u->free_reqs[--u->nfree];
+    u->reqs[i] = (struct uring_req){
+        .cb = cb,
+        .opaque = opaque,
+        .count = count,
+        .bounce = bounce,
+        .iov = iov,
+        .iovcnt = iovcnt,
+        .is_write = is_write,
+    };
+    buf = block_uring_fixed_buf(u, iov, iovcnt);
+    if (bounce) {
+        sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->addr = (uintptr_t)bounce;
+        sqe->len = count;
+    } else if (buf >= 0) {
+        sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)iov[0].iov_base;
+        sqe->len = iov[0].iov_len;
+        sqe->buf_index = buf;
+    } else {
+        // the iovecs stay valid until the completion
+        sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)iov;
+        sqe->len = iovcnt;
+    }
+    // registered as 0, and 1 for the buffered fd
+    sqe->fd = fd == ctx->fd ? 0 : 1;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->off = offset;
+    sqe->ioprio = ioprio;
+    if (is_write && (flags & BLOCK_REQ_DSYNC)) {
+        sqe->rw_flags = RWF_DSYNC;
+    }
+    sqe->user_data = i;
+    u->inflight++;
+    pthread_mutex_unlock(&u->lock);
+    return 0;
+}
+
+// Queue a sync for the flushes waiting, with the flush lock held
+static int
+block_uring_sync(struct block_device_ctx *ctx)
+{
+    struct block_uring *u = ctx->uring;
+    struct io_uring_sqe *sqe = NULL;
+    int i = 0;
+
+    pthread_mutex_lock(&u->lock);
+    if (u->nfree == 0 || (sqe = uring_get_sqe(&u->ring)) == NULL) {
+        pthread_mutex_unlock(&u->lock);
+        return -EAGAIN;
+    }
+    i = u->free_reqs[--u->nfree];
+    u->reqs[i] = (struct uring_req){.flushes = ctx->flushes};
+    ctx->flushes = NULL;
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = i;
+    u->inflight++;
+    pthread_mutex_unlock(&u->lock);
+    return 0;
+}
+
+// Start the sync for the flushes which came during the last one. If the
+// ring is full of requests not submitted yet, the next reap retries,
+// rather than syncing on the io thread shared with other devices.
+static void
+block_uring_sync_next(struct block_uring *u)
+{
+    struct block_device_ctx *ctx = u->ctx;
+    int ret = 0;
+
+    pthread_mutex_lock(&ctx->flush_lock);
+    if (!ctx->flushes) {
+        ctx->syncing = false;
+        u->sync_deferred = false;
+        pthread_mutex_unlock(&ctx->flush_lock);
+        return;
+    }
+    ret = block_uring_sync(ctx);
+    u->sync_deferred = ret < 0;
+    pthread_mutex_unlock(&ctx->flush_lock);
+    if (ret < 0) {
+        return;
+    }
+    pthread_mutex_lock(&u->lock);
+    if (uring_submit(&u->ring) < 0) {
+        perror("io_uring_enter");
+    }
+    pthread_mutex_unlock(&u->lock);
+}
+
+static int
+block_uring_read_async(struct block_device *bs, uint64_t sector_num,
+                       const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                       block_device_completion_fn *cb,
+                       struct blk_io_callback_arg *opaque)
+{
+    return block_uring_queue(bs, sector_num, iov, iovcnt, ioprio, 0, cb,
+                             opaque, 0);
+}
+
+static int
+block_uring_write_async(struct block_device *bs, uint64_t sector_num,
+                        const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                        int flags, block_device_completion_fn *cb,
+                        struct blk_io_callback_arg *opaque)
+{
+    return block_uring_queue(bs, sector_num, iov, iovcnt, ioprio, flags, cb,
+                             opaque, 1);
+}
+
+static void
+block_uring_submit(struct block_device *bs)
+{
+    struct block_device_ctx *ctx = bs->opaque;
+
+    pthread_mutex_lock(&ctx->uring->lock);
+    if (uring_submit(&ctx->uring->ring) < 0) {
+        perror("io_uring_enter");
+    }
+    pthread_mutex_unlock(&ctx->uring->lock);
+}
+
+// Complete the requests done so far. The callbacks may queue new ones.
+static void
+block_uring_reap(struct block_uring *u)
+{
+    struct io_uring_cqe *cqe = NULL;
+    struct uring_req req = {0};
+    int i = 0, res = 0;
+
+    while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+        i = cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(&u->ring);
+        req = u->reqs[i];
+        pthread_mutex_lock(&u->lock);
+        u->free_reqs[u->nfree++] = i;
+        u->inflight--;
+        pthread_mutex_unlock(&u->lock);
+        if (req.flushes) {
+            block_flush_done(u->ctx, req.flushes, res < 0 ? -1 : 0);
+            block_uring_sync_next(u);
+            continue;
+        }
+        if (req.bounce) {
+            if (!req.is_write && res >= 0 && (size_t)res == req.count) {
+                iov_from_buf(req.iov, req.iovcnt, 0, req.bounce, req.count);
+            }
+            block_bounce_free(u->ctx, req.bounce, req.count);
+        }
+        req.cb(req.opaque, res >= 0 && (size_t)res == req.count ? 0 : -1);
+    }
+    if (u->sync_deferred) {
+        block_uring_sync_next(u);
+    }
+}
+
+static void
+block_uring_handler(struct io_handler *h, uint32_t revents)
+{
+    struct block_uring *u = h->opaque;
+    uint64_t val = 0;
+
+    if (read(u->efd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+        perror("block_uring_handler, read eventfd");
+    }
+    block_uring_reap(u);
+}
+
+static void
+block_uring_delete(struct block_uring *u)
+{
+    int inflight = 0;
+
+    if (u->handler.thread) {
+        io_handler_remove(&u->handler);
+    }
+    // the requests in flight write to guest memory
+    while (1) {
+        pthread_mutex_lock(&u->lock);
+        inflight = u->inflight;
+        pthread_mutex_unlock(&u->lock);
+        if (inflight == 0 || uring_wait(&u->ring) < 0) {
+            break;
+        }
+        block_uring_reap(u);
+    }
+    uring_destroy(&u->ring);
+    if (u->efd >= 0) {
+        close(u->efd);
+    }
+    pthread_mutex_destroy(&u->lock);
+    free(u);
+}
+
+// Register guest memory so that the kernel does not pin the pages of each
+// request. Without it, the requests use plain iovecs.
+static void
+block_uring_register_mem(struct block_uring *u, struct guest_mem_map *mem)
+{
+    int n = (mem->size + (1ULL << URING_BUF_SHIFT) - 1) >> URING_BUF_SHIFT;
+    struct iovec *iov = calloc(n, sizeof(*iov));
+
+    // without them, the requests go through the iovecs
+    if (!iov) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = (uint8_t *)mem->host_mem +
+                          ((uint64_t)i << URING_BUF_SHIFT);
+        iov[i].iov_len = mem->size - ((uint64_t)i << URING_BUF_SHIFT);
+        if (iov[i].iov_len > 1ULL << URING_BUF_SHIFT) {
+            iov[i].iov_len = 1ULL << URING_BUF_SHIFT;
+        }
+    }
+    if (uring_register_buffers(&u->ring, iov, n) == 0) {
+        u->mem = mem->host_mem;
+        u->mem_size = mem->size;
+    }
+    free(iov);
+}
+
+// NULL if io_uring cannot be used, the caller falls back to threads
+static struct block_uring *
+block_uring_new(struct block_device_ctx *ctx, struct io_thread *t,
+                struct guest_mem_map *mem)
+{
+    struct block_uring *u = calloc(1, sizeof(*u));
+    int fds[2] = {ctx->fd, ctx->buffered_fd};
 
+    u->ctx = ctx;
+    u->efd = -1;
+    pthread_mutex_init(&u->lock, NULL);
+    if (uring_init(&u->ring, VIRTIO_BLK_URING_ENTRIES,
+                   VIRTIO_BLK_URING_SQPOLL) < 0) {
+        pthread_mutex_destroy(&u->lock);
+        free(u);
+        return NULL;
+    }
+    u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (u->efd < 0 || uring_register_files(&u->ring, fds, 2) < 0 ||
+        uring_register_eventfd(&u->ring, u->efd) < 0) {
+        goto fail;
+    }
+    if (VIRTIO_BLK_URING_FIXED_BUFS) {
+        block_uring_register_mem(u, mem);
+    }
+    for (int i = 0; i < VIRTIO_BLK_URING_ENTRIES; i++) {
+        u->free_reqs[u->nfree++] = i;
+    }
+    u->handler = (struct io_handler){
+        .fd = u->efd,
+        .events = EPOLLIN,
+        .fn = block_uring_handler,
+        .opaque = u,
+    };
+    if (io_handler_add(t, &u->handler) < 0) {
+        u->handler.thread = NULL;
+        goto fail;
+    }
+    return u;
+
+fail:
+    block_uring_delete(u);
+    return NULL;
+}
+
+// What the guest should know of the storage underneath, so that it sends
+// requests aligned to its blocks. With O_DIRECT, also the alignment of the
+// requests which can bypass the page cache.
+static void
+block_get_topology(struct block_device_ctx *ctx, struct stat *st,
+                   bool direct, struct block_topology *t)
+{
+    struct statx stx = {0};
+    int logical = 0, physical = 0;
+    unsigned int io_min = 0, io_opt = 0;
+
+    *t = (struct block_topology){0};
+    if (S_ISBLK(st->st_mode)) {
+        if (ioctl(ctx->fd, BLKSSZGET, &logical) < 0) {
+            logical = SECTOR_SIZE;
+        }
+        if (ioctl(ctx->fd, BLKPBSZGET, &physical) < 0) {
+            physical = logical;
+        }
+        ioctl(ctx->fd, BLKIOMIN, &io_min);
+        ioctl(ctx->fd, BLKIOOPT, &io_opt);
+        ctx->mem_align = logical;
+        ctx->offset_align = logical;
+    } else {
+        // a file, whose blocks are those of the file system
+        logical = SECTOR_SIZE;
+        physical = st->st_blksize;
+        io_min = st->st_blksize;
+        ctx->mem_align = SECTOR_SIZE;
+        ctx->offset_align = SECTOR_SIZE;
+    }
+    // since Linux 6.1, e.g. 4 byte aligned buffers may be enough
+    if (direct &&
+        statx(ctx->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+        ctx->mem_align = stx.stx_dio_mem_align;
+        ctx->offset_align = stx.stx_dio_offset_align;
+    }
+    if (direct) {
+        // the guest must not send smaller blocks than O_DIRECT takes
+        if (ctx->offset_align > (uint32_t)logical) {
+            logical = ctx->offset_align;
+        }
+    } else {
+        ctx->mem_align = 0;
+        ctx->offset_align = 0;
+    }
+    if (physical < logical) {
+        physical = logical;
+    }
+    t->logical_block_size = logical;
+    t->physical_block_size = physical;
+    t->min_io_size = io_min;
+    t->opt_io_size = io_opt;
+}
+
+// "BASE:DELTA", the delta is created if it does not exist
+static int
+block_open_overlay(struct block_device_ctx *ctx, const char *spec)
+{
+    const char *sep = strchr(spec, ':');
+    char *base = NULL;
+
+    if (!sep) {
+        fprintf(stderr, "overlay: expected BASE:DELTA, got %s\n", spec);
+        return -1;
+    }
+    base = strndup(spec, sep - spec);
+    ctx->overlay = overlay_open(base, sep + 1);
+    free(base);
+    if (!ctx->overlay) {
+        return -1;
+    }
+    ctx->fd = ctx->overlay->fd;
+    ctx->buffered_fd = ctx->fd;
     return 0;
 }
 
-// Initialize virtio block device with thread pool backend
+// Initialize virtio block device with an io_uring or thread pool backend
 int
 mvvm_init_virtio_blk(struct mvvm *self, const char *disk_path)
 {
@@ -141,31 +1033,106 @@ mvvm_init_virtio_blk(struct mvvm *self, const char *disk_path)
     struct irq_signal irq = {0};
     struct stat st = {0};
     struct virtio_bus_def bus = {0};
+    struct block_topology topology = {0};
+    bool direct = false;
     int ret = -1;
+
+    irq.vmfd = self->vm_fd;
+    irq.irqline = VIRTIO_BLK_IRQ;
+    // Setup virtio bus definition
+    bus.mem_map = self->mem_map;
+    bus.irq = irq;
+    bus.iothread = io_threads_pick(self->io);
+    bus.pci = self->pci;
+    // The requests go to another process, which owns the disk
+    if (strncmp(disk_path, VHOST_USER_PREFIX, strlen(VHOST_USER_PREFIX)) == 0) {
+        self->blk = virtio_block_init_vhost_user(bus, VIRTIO_BLK_MMIO_ADDR,
+                disk_path + strlen(VHOST_USER_PREFIX));
+        if (!self->blk) {
+            fprintf(stderr, "failed to connect to the vhost-user backend\n");
+            return -1;
+        }
+        return 0;
+    }
     // Allocate block device context
     ctx = malloc(sizeof(*ctx));
     if (!ctx) {
         fprintf(stderr, "failed to allocate block device context\n");
         return -1;
     }
-    // Open disk image file
-    ctx->fd = open(disk_path, O_RDWR);
-    if (ctx->fd < 0) {
-        perror("mvvm_init_virtio_blk, open disk image");
-        goto fail;
+    ctx->pool = NULL;
+    ctx->uring = NULL;
+    ctx->overlay = NULL;
+    ctx->fd = -1;
+    ctx->buffered_fd = -1;
+    pthread_mutex_init(&ctx->flush_lock, NULL);
+    ctx->flushes = NULL;
+    ctx->syncing = false;
+    if (block_pools_init(ctx) < 0) {
+        fprintf(stderr, "failed to allocate the request pools\n");
+        pthread_mutex_destroy(&ctx->flush_lock);
+        free(ctx);
+        return -1;
+    }
+    // The guest caches the data already, skip the host page cache
+    if (strncmp(disk_path, DIRECT_PREFIX, strlen(DIRECT_PREFIX)) == 0) {
+        direct = true;
+        disk_path += strlen(DIRECT_PREFIX);
+    }
+    if (strncmp(disk_path, OVERLAY_PREFIX, strlen(OVERLAY_PREFIX)) == 0) {
+        if (direct) {
+            fprintf(stderr, "mvvm_init_virtio_blk, an overlay cannot be "
+                    "opened with O_DIRECT\n");
+            goto fail;
+        }
+        if (block_open_overlay(ctx, disk_path + strlen(OVERLAY_PREFIX)) < 0) {
+            goto fail;
+        }
+    } else {
+        // Open disk image file
+        ctx->fd = open(disk_path, O_RDWR | O_CLOEXEC | (direct ? O_DIRECT : 0));
+        if (ctx->fd < 0) {
+            perror("mvvm_init_virtio_blk, open disk image");
+            goto fail;
+        }
+        ctx->buffered_fd = direct ? open(disk_path, O_RDWR | O_CLOEXEC) : ctx->fd;
+        if (ctx->buffered_fd < 0) {
+            perror("mvvm_init_virtio_blk, open disk image");
+            goto fail;
+        }
     }
     // Get file size
     if (fstat(ctx->fd, &st) < 0) {
         perror("mvvm_init_virtio_blk, fstat disk image");
         goto fail;
     }
-    ctx->size = st.st_size;
-    // Create thread pool for async I/O operations
-    ctx->pool = new_thread_pool(VIRTIO_BLK_MAX_QUEUE_NUM);
-    if (!ctx->pool) {
-        fprintf(stderr, "failed to create thread pool\n");
+    ctx->size = ctx->overlay ? ctx->overlay->size : (uint64_t)st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(ctx->fd, BLKGETSIZE64, &ctx->size) < 0) {
+        perror("mvvm_init_virtio_blk, BLKGETSIZE64");
         goto fail;
     }
+    block_get_topology(ctx, &st, direct, &topology);
+    // the overlay lookups block, they run on the I/O threads
+    if (VIRTIO_BLK_URING && !ctx->overlay) {
+        ctx->uring = block_uring_new(ctx, bus.iothread, self->mem_map);
+        if (!ctx->uring) {
+            fprintf(stderr, "io_uring unavailable, using I/O threads\n");
+        }
+    }
+    // Create thread pool for async I/O operations, a single thread for the
+    // fallocate() calls if the reads and writes go through io_uring
+    {
+        int cpu = bus.iothread->cpu;
+        bool pin = VIRTIO_BLK_PIN_WORKERS && cpu >= 0;
+
+        ctx->pool = new_thread_pool(ctx->uring ? 1 : VIRTIO_BLK_IO_THREADS,
+                                    VIRTIO_BLK_IO_QUEUE,
+                                    pin ? &cpu : NULL, 1);
+        if (!ctx->pool) {
+            fprintf(stderr, "failed to create thread pool\n");
+            goto fail;
+        }
+    }
     // Allocate and initialize struct block_device structure
     bs = malloc(sizeof(*bs));
     if (!bs) {
@@ -174,21 +1141,31 @@ mvvm_init_virtio_blk(struct mvvm *self, const char *disk_path)
     }
 
     bs->get_sector_count = block_get_sector_count;
-    bs->read_async = block_read_async;
-    bs->write_async = block_write_async;
+    if (ctx->uring) {
+        bs->read_async = block_uring_read_async;
+        bs->write_async = block_uring_write_async;
+        bs->submit = block_uring_submit;
+    } else {
+        bs->read_async = block_read_async;
+        bs->write_async = block_write_async;
+        bs->submit = NULL;
+    }
+    bs->flush_async = block_flush_async;
+    // a hole in the delta would not read as the base, nor as zeroes
+    bs->discard_async = ctx->overlay ? NULL : block_discard_async;
+    bs->write_zeroes_async = ctx->overlay ? NULL : block_write_zeroes_async;
+    bs->print_stats = block_print_stats;
+    bs->topology = topology;
     bs->opaque = ctx;
 
-    irq.vmfd = self->vm_fd;
-    irq.irqline = VIRTIO_BLK_IRQ;
-    // Setup virtio bus definition
-    bus.mem_map = self->mem_map;
-    bus.irq = irq;
     // Initialize virtio block device
     self->blk = virtio_block_init(bus, VIRTIO_BLK_MMIO_ADDR, bs);
     if (!self->blk) {
         fprintf(stderr, "failed to initialize virtio block device\n");
         goto fail;
     }
+    virtio_set_coalescing(self->blk, -1, VIRTIO_BLK_COAL_MAX_FRAMES,
+                          VIRTIO_BLK_COAL_USECS);
     // Note: mem_map and irq are now owned by virtio device layer
     // ctx and bs are referenced by virtio device for callbacks
     return 0;
@@ -198,18 +1175,62 @@ fail:
         free(bs);
     }
     if (ctx) {
-        if (ctx->fd >= 0) {
-            close(ctx->fd);
+        if (ctx->uring) {
+            block_uring_delete(ctx->uring);
         }
+        if (ctx->pool) {
+            delete_thread_pool(ctx->pool);
+        }
+        if (ctx->overlay) {
+            overlay_close(ctx->overlay);
+        } else {
+            if (ctx->buffered_fd >= 0 && ctx->buffered_fd != ctx->fd) {
+                close(ctx->buffered_fd);
+            }
+            if (ctx->fd >= 0) {
+                close(ctx->fd);
+            }
+        }
+        pthread_mutex_destroy(&ctx->flush_lock);
+        block_pools_destroy(ctx);
         free(ctx);
     }
     return ret;
 }
 
+int mvvm_cache_virtio_blk(struct mvvm *self, uint64_t size) {
+    struct block_device *bs = virtio_block_get_device(self->blk);
+
+    if (!bs) {
+        fprintf(stderr, "the vhost-user backend has its own cache\n");
+        return -1;
+    }
+    self->blk_cache = block_cache_new(bs, size);
+    return self->blk_cache ? 0 : -1;
+}
+
 void mvvm_destroy_virtio_blk(struct mvvm *self) {
     struct block_device_ctx *ctx = virtio_block_get_opaque(self->blk);
-    delete_thread_pool(ctx->pool);
-    free(ctx);
+    if (self->blk_cache) {
+        ctx = block_cache_lower(self->blk_cache)->opaque;
+    }
+    // NULL with a vhost-user backend
+    if (ctx) {
+        if (ctx->uring) {
+            block_uring_delete(ctx->uring);
+        }
+        delete_thread_pool(ctx->pool);
+        if (ctx->overlay) {
+            overlay_close(ctx->overlay);
+        }
+        pthread_mutex_destroy(&ctx->flush_lock);
+        block_pools_destroy(ctx);
+        free(ctx);
+    }
+    if (self->blk_cache) {
+        block_cache_delete(self->blk_cache);
+        self->blk_cache = NULL;
+    }
     virtio_block_destroy(self->blk);
     free(self->blk);
 }
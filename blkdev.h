@@ -1,9 +1,17 @@
 #ifndef MVVMM_BLKDEV_H_
 #define MVVMM_BLKDEV_H_
 
+// A 'disk_path' of "vhost-user:PATH" connects to the vhost-user backend
+// listening on PATH, e.g. tools/vhost-user-blk. "direct:PATH" opens the
+// image or block device with O_DIRECT, bypassing the host page cache.
+// "overlay:BASE:DELTA" is a copy-on-write disk over the read-only BASE,
+// whose writes go to DELTA, created if it does not exist.
 int
 mvvm_init_virtio_blk(struct mvvm *self, const char *disk_path);
 
+// Cache up to 'size' bytes of the disk in memory, before the guest runs
+int mvvm_cache_virtio_blk(struct mvvm *self, uint64_t size);
+
 void mvvm_destroy_virtio_blk(struct mvvm *self);
 
 #endif
\ No newline at end of file
@@ -3,18 +3,74 @@
 #define VIRTIO_BLK_MMIO_ADDR (1024LL * 1024 * 1024 * 1024)
 #define VIRTIO_BLK_IRQ 10
 #define VIRTIO_BLK_CMDLINE " virtio_mmio.device=4K@0x10000000000:10"
-#define VIRTIO_BLK_MAX_QUEUE_NUM 8
+#define VIRTIO_BLK_MAX_QUEUE_NUM 128
+#define VIRTIO_BLK_IO_THREADS 8
+/* requests waiting for an I/O thread, the queue stalls beyond that */
+#define VIRTIO_BLK_IO_QUEUE 256
+/* the I/O threads run on the cpu of the device's io thread, if pinned */
+#define VIRTIO_BLK_PIN_WORKERS 0
+/* the contiguous reads, or writes, of a kick are merged into one backend
+   request up to this size, 0 disables merging */
+#define VIRTIO_BLK_MERGE_MAX (1024 * 1024)
+/* bounce buffers of each size kept for reuse, for the requests which are
+   not aligned for O_DIRECT */
+#define VIRTIO_BLK_BOUNCE_BUFS 16
+/* ranges of a discard or write zeroes request */
+#define VIRTIO_BLK_DISCARD_SEG_MAX 32
+/* the requests go through io_uring when the host kernel has it, else
+   through VIRTIO_BLK_IO_THREADS blocking workers */
+#define VIRTIO_BLK_URING 1
+#define VIRTIO_BLK_URING_ENTRIES 256
+/* a kernel thread polls for submissions, which costs a host cpu */
+#define VIRTIO_BLK_URING_SQPOLL 0
+/* guest memory is registered, and pinned, for single buffer requests */
+#define VIRTIO_BLK_URING_FIXED_BUFS 0
+/* interrupt coalescing, a zero delay (in microseconds) disables it */
+#define VIRTIO_BLK_COAL_MAX_FRAMES 0
+#define VIRTIO_BLK_COAL_USECS 0
 
 #define VIRTIO_NET_MMIO_ADDR (1025LL * 1024 * 1024 * 1024)
 #define VIRTIO_NET_IRQ 11
 #define VIRTIO_NET_CMDLINE " virtio_mmio.device=4K@0x10040000000:11"
-#define VIRTIO_NET_MAX_QUEUE_NUM 32
+#define VIRTIO_NET_MAX_QUEUE_NUM 256
+#define VIRTIO_NET_COAL_MAX_FRAMES 0
+#define VIRTIO_NET_COAL_USECS 0
+
+#define VIRTIO_VSOCK_MMIO_ADDR (1028LL * 1024 * 1024 * 1024)
+#define VIRTIO_VSOCK_IRQ 12
+#define VIRTIO_VSOCK_CMDLINE " virtio_mmio.device=4K@0x10100000000:12"
+#define VIRTIO_VSOCK_MAX_QUEUE_NUM 128
+
+#define VIRTIO_FS_MMIO_ADDR (1029LL * 1024 * 1024 * 1024)
+#define VIRTIO_FS_IRQ 13
+#define VIRTIO_FS_CMDLINE " virtio_mmio.device=4K@0x10140000000:13"
+#define VIRTIO_FS_MAX_QUEUE_NUM 1024
+/* the DAX window of the file system device, a memory slot of its own */
+#define VIRTIO_FS_DAX_ADDR (1032LL * 1024 * 1024 * 1024)
+#define VIRTIO_FS_DAX_SLOT 2
+
+#define VIRTIO_PMEM_MMIO_ADDR (1030LL * 1024 * 1024 * 1024)
+#define VIRTIO_PMEM_IRQ 14
+#define VIRTIO_PMEM_CMDLINE " virtio_mmio.device=4K@0x10180000000:14"
+#define VIRTIO_PMEM_MAX_QUEUE_NUM 128
+/* where the image goes in guest memory, 2 MiB aligned for DAX */
+#define VIRTIO_PMEM_ADDR (1040LL * 1024 * 1024 * 1024)
+#define VIRTIO_PMEM_SLOT 3
+#define VIRTIO_PMEM_ALIGN (2 * 1024 * 1024)
+
+/* where the BARs of the virtio-pci devices go, see -P */
+#define PCI_MMIO_ADDR (1026LL * 1024 * 1024 * 1024)
+#define PCI_MMIO_SIZE (1024LL * 1024 * 1024)
 
 #define DEFAULT_KERNEL_CMDLINE "console=ttyS0 debug"
 
 #define VIRTIO_PAGE_SIZE 4096
 #define SECTOR_SIZE 512
 #define TAP_BUF_SIZE 4096
+#define TAP_RX_BURST 64
+
+#define IO_THREADS 1
+#define MAX_IO_CPUS 64
 
 #ifdef MVVMM_DEBUG
 #define DEBUG(...) do { \
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include "iothread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define IO_THREAD_MAX_EVENTS 32
+
+static void
+io_thread_run_pollers(struct io_thread *t, uint64_t gen)
+{
+    struct io_handler **p = &t->poll_list;
+    struct io_handler *h = NULL;
+
+    while (*p) {
+        h = *p;
+        if (h->poll_fn(h)) {
+            p = &h->poll_next;
+        } else {
+            *p = h->poll_next;
+            h->polling = false;
+            h->poll_next = NULL;
+        }
+        if (t->gen != gen) {
+            // the list changed under us
+            return;
+        }
+    }
+}
+
+static void *
+io_thread_fn(void *arg)
+{
+    struct io_thread *t = arg;
+    struct epoll_event events[IO_THREAD_MAX_EVENTS];
+    struct io_handler *h = NULL;
+    uint64_t gen = 0, val = 0;
+    bool busy = false;
+    int n = 0;
+
+    while (1) {
+        pthread_mutex_lock(&t->lock);
+        if (t->quit) {
+            pthread_mutex_unlock(&t->lock);
+            break;
+        }
+        gen = t->gen;
+        busy = t->poll_list != NULL;
+        pthread_mutex_unlock(&t->lock);
+
+        // do not sleep while some handler is busy polling
+        n = epoll_wait(t->epfd, events, IO_THREAD_MAX_EVENTS, busy ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_thread: epoll_wait");
+            break;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        if (t->gen != gen) {
+            // a handler was removed, its events may be stale. The fds are
+            // level triggered, so nothing is lost by waiting again.
+            pthread_mutex_unlock(&t->lock);
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            h = events[i].data.ptr;
+            if (h == NULL) {
+                read(t->wakeup_fd, &val, sizeof(val));
+                continue;
+            }
+            h->fn(h, events[i].events);
+            if (t->gen != gen) {
+                break;
+            }
+        }
+        if (t->gen == gen) {
+            io_thread_run_pollers(t, gen);
+        }
+        pthread_mutex_unlock(&t->lock);
+    }
+    return NULL;
+}
+
+static int
+io_thread_init(struct io_thread *t, int id, int cpu)
+{
+    struct epoll_event ev = {0};
+    cpu_set_t set;
+    char name[32] = {0};
+
+    t->id = id;
+    t->cpu = cpu;
+    t->epfd = -1;
+    t->wakeup_fd = -1;
+    pthread_mutex_init(&t->lock, NULL);
+
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epfd < 0) {
+        perror("io_thread: epoll_create1");
+        return -1;
+    }
+    t->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->wakeup_fd < 0) {
+        perror("io_thread: eventfd");
+        goto fail;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakeup_fd, &ev) < 0) {
+        perror("io_thread: epoll_ctl");
+        goto fail;
+    }
+    if (pthread_create(&t->th, NULL, io_thread_fn, t) != 0) {
+        fprintf(stderr, "io_thread: failed to create thread\n");
+        goto fail;
+    }
+    snprintf(name, sizeof(name), "mvvmm-io%d", id);
+    name[15] = '\0'; // the kernel limit
+    pthread_setname_np(t->th, name);
+    if (cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "io_thread: invalid cpu %d\n", cpu);
+    } else if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(t->th, sizeof(set), &set) != 0) {
+            fprintf(stderr, "io_thread: failed to pin thread %d to cpu %d\n",
+                    id, cpu);
+        }
+    }
+    return 0;
+
+fail:
+    if (t->wakeup_fd >= 0) {
+        close(t->wakeup_fd);
+    }
+    close(t->epfd);
+    return -1;
+}
+
+static void
+io_thread_stop(struct io_thread *t)
+{
+    uint64_t val = 1;
+
+    pthread_mutex_lock(&t->lock);
+    t->quit = true;
+    pthread_mutex_unlock(&t->lock);
+    write(t->wakeup_fd, &val, sizeof(val));
+    pthread_join(t->th, NULL);
+    close(t->wakeup_fd);
+    close(t->epfd);
+}
+
+struct io_threads *
+new_io_threads(int thread_num, const int *cpus, int cpu_num)
+{
+    struct io_threads *self = NULL;
+    int i = 0;
+
+    if (thread_num <= 0) {
+        return NULL;
+    }
+    self = malloc(sizeof(*self));
+    if (!self) {
+        return NULL;
+    }
+    *self = (struct io_threads){0};
+    self->threads = calloc(thread_num, sizeof(struct io_thread));
+    if (!self->threads) {
+        free(self);
+        return NULL;
+    }
+    for (i = 0; i < thread_num; i++) {
+        int cpu = (cpus && cpu_num > 0) ? cpus[i % cpu_num] : -1;
+        if (io_thread_init(&self->threads[i], i, cpu) < 0) {
+            goto fail;
+        }
+        self->thread_num++;
+    }
+    return self;
+
+fail:
+    delete_io_threads(self);
+    return NULL;
+}
+
+void
+delete_io_threads(struct io_threads *self)
+{
+    if (!self) {
+        return;
+    }
+    for (int i = 0; i < self->thread_num; i++) {
+        io_thread_stop(&self->threads[i]);
+    }
+    free(self->threads);
+    free(self);
+}
+
+struct io_thread *
+io_threads_pick(struct io_threads *self)
+{
+    struct io_thread *t = &self->threads[self->next];
+    self->next = (self->next + 1) % self->thread_num;
+    return t;
+}
+
+int
+io_handler_add(struct io_thread *t, struct io_handler *h)
+{
+    struct epoll_event ev = {0};
+
+    h->thread = t;
+    h->polling = false;
+    h->poll_next = NULL;
+    if (h->fd < 0) {
+        return 0;
+    }
+    ev.events = h->events;
+    ev.data.ptr = h;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+        perror("io_handler_add: epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int
+io_handler_set_events(struct io_handler *h, uint32_t events)
+{
+    struct epoll_event ev = {0};
+
+    if (h->events == events) {
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(h->thread->epfd, EPOLL_CTL_MOD, h->fd, &ev) < 0) {
+        perror("io_handler_set_events: epoll_ctl");
+        return -1;
+    }
+    h->events = events;
+    return 0;
+}
+
+void
+io_handler_remove(struct io_handler *h)
+{
+    struct io_thread *t = h->thread;
+    struct io_handler **p = NULL;
+    bool self = false;
+
+    if (!t) {
+        return;
+    }
+    // the io thread already holds the lock while it runs handlers
+    self = pthread_equal(pthread_self(), t->th);
+    if (!self) {
+        pthread_mutex_lock(&t->lock);
+    }
+    if (h->fd >= 0) {
+        epoll_ctl(t->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+    }
+    for (p = &t->poll_list; *p; p = &(*p)->poll_next) {
+        if (*p == h) {
+            *p = h->poll_next;
+            break;
+        }
+    }
+    h->polling = false;
+    h->poll_next = NULL;
+    h->thread = NULL;
+    t->gen++;
+    if (!self) {
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+void
+io_handler_start_polling(struct io_thread *t, struct io_handler *h)
+{
+    if (h->polling) {
+        return;
+    }
+    h->thread = t;
+    h->polling = true;
+    h->poll_next = t->poll_list;
+    t->poll_list = h;
+}
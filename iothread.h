@@ -0,0 +1,69 @@
+#ifndef MVVMM_IOTHREAD_H_
+#define MVVMM_IOTHREAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct io_thread;
+
+// A file descriptor watched by an io thread. The structure is owned by the
+// caller and must stay valid until io_handler_remove() returns.
+struct io_handler {
+    int fd;              // -1 for a handler which only busy polls
+    uint32_t events;     // EPOLLIN, EPOLLOUT...
+    void (*fn)(struct io_handler *h, uint32_t revents);
+    // Called in a loop after io_handler_start_polling(), until it returns
+    // false. The thread does not sleep meanwhile.
+    bool (*poll_fn)(struct io_handler *h);
+    void *opaque;
+
+    // the following is managed by the io thread
+    struct io_thread *thread;
+    bool polling;
+    struct io_handler *poll_next;
+};
+
+struct io_thread {
+    pthread_t th;
+    int epfd;
+    int wakeup_fd;       // eventfd, written to stop the thread
+    int cpu;             // -1 if not pinned
+    int id;
+    bool quit;
+    // Held while handlers run. Bumped by io_handler_remove() so that the
+    // thread drops events which may refer to a removed handler.
+    pthread_mutex_t lock;
+    uint64_t gen;
+    struct io_handler *poll_list;
+};
+
+struct io_threads {
+    struct io_thread *threads;
+    int thread_num;
+    int next;
+};
+
+// Start 'thread_num' io threads. If 'cpus' is not NULL, thread i is pinned
+// to cpus[i % cpu_num].
+struct io_threads *new_io_threads(int thread_num, const int *cpus, int cpu_num);
+
+// Stop the threads. Handlers still registered are not called anymore.
+void delete_io_threads(struct io_threads *self);
+
+// Pick a thread for a new device, round robin.
+struct io_thread *io_threads_pick(struct io_threads *self);
+
+int io_handler_add(struct io_thread *t, struct io_handler *h);
+
+// Change the events watched, 0 to stop watching for now.
+int io_handler_set_events(struct io_handler *h, uint32_t events);
+
+// Once this returns, the handler is not running and will not be called
+// again. May be called from the handler itself.
+void io_handler_remove(struct io_handler *h);
+
+// Start calling h->poll_fn in a loop. Must be called from the io thread.
+void io_handler_start_polling(struct io_thread *t, struct io_handler *h);
+
+#endif
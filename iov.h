@@ -0,0 +1,95 @@
+#ifndef MVVMM_IOV_H_
+#define MVVMM_IOV_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/uio.h>
+
+// Helpers for the iovec arrays the requests are made of, shared by the
+// devices, the block backends and the tools
+
+static inline size_t
+iov_size(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Copy at most 'len' bytes between 'buf' and 'offset' of the iovecs,
+// return the number of bytes copied
+static inline size_t
+iov_copy(const struct iovec *iov, int iovcnt, size_t offset, void *buf,
+         size_t len, bool to_iov)
+{
+    size_t done = 0, n = 0;
+    uint8_t *p = NULL;
+
+    for (int i = 0; i < iovcnt && done < len; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        p = (uint8_t *)iov[i].iov_base + offset;
+        n = iov[i].iov_len - offset;
+        if (n > len - done) {
+            n = len - done;
+        }
+        if (to_iov) {
+            memcpy(p, (uint8_t *)buf + done, n);
+        } else {
+            memcpy((uint8_t *)buf + done, p, n);
+        }
+        done += n;
+        offset = 0;
+    }
+    return done;
+}
+
+static inline size_t
+iov_to_buf(const struct iovec *iov, int iovcnt, size_t offset, void *buf,
+           size_t len)
+{
+    return iov_copy(iov, iovcnt, offset, buf, len, false);
+}
+
+static inline size_t
+iov_from_buf(const struct iovec *iov, int iovcnt, size_t offset,
+             const void *buf, size_t len)
+{
+    return iov_copy(iov, iovcnt, offset, (void *)buf, len, true);
+}
+
+// Make 'dst' describe the 'len' bytes at 'offset' of 'src'. Return the
+// number of iovecs in 'dst', -1 if 'src' is too short.
+static inline int
+iov_slice(struct iovec *dst, const struct iovec *src, int srccnt,
+          size_t offset, size_t len)
+{
+    int n = 0;
+    size_t l = 0;
+
+    for (int i = 0; i < srccnt && len > 0; i++) {
+        if (offset >= src[i].iov_len) {
+            offset -= src[i].iov_len;
+            continue;
+        }
+        l = src[i].iov_len - offset;
+        if (l > len) {
+            l = len;
+        }
+        dst[n].iov_base = (uint8_t *)src[i].iov_base + offset;
+        dst[n].iov_len = l;
+        n++;
+        len -= l;
+        offset = 0;
+    }
+    return len == 0 ? n : -1;
+}
+
+#endif
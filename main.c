@@ -3,16 +3,20 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
-#include <poll.h>
+#include <sys/epoll.h>
 
 #include <termios.h>
 
 #include "config.h"
 #include "mvvm.h"
 #include "serial.h"
+#include "iothread.h"
+#include "blkdev.h"
+#include "blkcache.h"
 
 struct mvvm *g_vm = NULL;
 
@@ -40,63 +44,114 @@ void set_terminal_raw_mode() {
     g_term_changed = 1;
 }
 
-static int timed_getchar(int fd, int timeout_ms, int *ch) {
-    struct pollfd pfd;
-    int ret;
-    unsigned char c;
-
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-
-    ret = poll(&pfd, 1, timeout_ms);
+// Terminal input is fed to the serial port by an io thread. A character
+// is only passed once the guest has read the previous one, meanwhile stdin
+// is not watched.
+struct console {
+    struct mvvm *vm;
+    struct io_handler stdin_handler;
+    struct io_handler serial_handler;
+    char pending[64];
+    int head;
+    int tail;
+    int escaped;
+};
 
-    if (ret > 0) {
-        if (pfd.revents & POLLIN) {
-            ssize_t n = read(fd, &c, 1);
-            if (n > 0) {
-                *ch = (int)c;
-                return 1;
-            }
+static void console_feed(struct console *con) {
+    while (con->head < con->tail) {
+        if (write_to_serial(con->vm, con->pending[con->head]) < 0) {
+            break;
         }
-        return 0;
-    } else if (ret == 0) {
-        return 0;
+        con->head++;
+    }
+    if (con->head == con->tail) {
+        con->head = con->tail = 0;
+        io_handler_set_events(&con->stdin_handler, EPOLLIN);
     } else {
-        return 0; 
+        io_handler_set_events(&con->stdin_handler, 0);
     }
 }
 
-void* keyboard_thread_func(void* arg) {
-    fprintf(stderr, "Press Ctrl+A & Ctrl+C to exit...\n");
-    struct mvvm *vm = arg;
-    set_terminal_raw_mode();
-    int ch = 0;
-    int escaped = 0;
-    int ret = 0;
-    while (1) {
-        ret = timed_getchar(STDIN_FILENO, 300, &ch);
-        if (vm->quit) break;
-        if (ch == EOF) break;
-        if (ret == 0) continue;
-        if (escaped) {
-            escaped = 0;
+static void console_put(struct console *con, char c) {
+    if (con->tail < (int)sizeof(con->pending)) {
+        con->pending[con->tail++] = c;
+    }
+}
+
+static void console_stdin_handler(struct io_handler *h, uint32_t revents) {
+    struct console *con = h->opaque;
+    // at most half the buffer, an escape may produce two characters
+    char buf[sizeof(con->pending) / 2];
+    ssize_t n = read(h->fd, buf, sizeof(buf));
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        // EOF
+        io_handler_remove(h);
+        return;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        char ch = buf[i];
+        if (con->escaped) {
+            con->escaped = 0;
             if (ch == 0x03) {
                 kill(getpid(), SIGINT);
             } else if (ch == 0x01) {
-                write_to_serial(vm, (char)0x01);
+                console_put(con, 0x01);
             } else {
-                write_to_serial(vm, (char)0x01);
-                write_to_serial(vm, (char)ch);
+                console_put(con, 0x01);
+                console_put(con, ch);
             }
         } else {
             if (ch == 0x01) {
-                escaped = 1;
+                con->escaped = 1;
             } else {
-                write_to_serial(vm, (char)ch);
+                console_put(con, ch);
             }
         }
     }
-    return NULL;
+    console_feed(con);
+}
+
+static void console_serial_handler(struct io_handler *h, uint32_t revents) {
+    struct console *con = h->opaque;
+    uint64_t val = 0;
+    read(h->fd, &val, sizeof(val));
+    console_feed(con);
+}
+
+static int console_init(struct console *con, struct mvvm *vm) {
+    *con = (struct console){0};
+    con->vm = vm;
+    fprintf(stderr, "Press Ctrl+A & Ctrl+C to exit...\n");
+    set_terminal_raw_mode();
+    con->stdin_handler = (struct io_handler){
+        .fd = STDIN_FILENO,
+        .events = EPOLLIN,
+        .fn = console_stdin_handler,
+        .opaque = con,
+    };
+    con->serial_handler = (struct io_handler){
+        .fd = vm->serial.rx_event_fd,
+        .events = EPOLLIN,
+        .fn = console_serial_handler,
+        .opaque = con,
+    };
+    struct io_thread *t = io_threads_pick(vm->io);
+    if (io_handler_add(t, &con->serial_handler) < 0) {
+        return -1;
+    }
+    if (io_handler_add(t, &con->stdin_handler) < 0) {
+        // e.g. stdin is a regular file, run without input
+        fprintf(stderr, "Not watching stdin.\n");
+    }
+    return 0;
+}
+
+static void console_destroy(struct console *con) {
+    io_handler_remove(&con->stdin_handler);
+    io_handler_remove(&con->serial_handler);
 }
 
 void sigint_handler(int sig) {
@@ -116,13 +171,55 @@ struct cmd_opts {
     const char *kernel_path;
     const char *initrd_path; // can be null
     const char *disk_path; // can be null
+    enum virtio_block_cache disk_cache;
+    uint64_t disk_cache_size; // of the in memory disk cache, 0 if none
     uint64_t memory_size; // default 1GB
     const char *kernel_cmdline;
     const char *tap_ifname;
+    int print_stats; // print device statistics on exit
+    uint32_t poll_usecs; // virtqueue busy polling budget, 0 if off
+    int io_threads;
+    int io_cpus[MAX_IO_CPUS]; // cpus to pin the io threads to
+    int io_cpu_num;
+    int pci; // virtio-pci instead of virtio-mmio
+    int vhost_net; // network device served by the host kernel
+    uint64_t vsock_cid; // guest address of the vsock device, 0 if none
+    char *fs_tag; // the shared directory, NULL if none
+    const char *fs_socket; // where its virtiofsd listens
+    uint64_t fs_dax_size; // DAX window of the shared directory, 0 if none
+    const char *pmem_path; // image of the pmem device, NULL if none
 };
 
 static void print_usage(FILE *stream, const char *program_name);
 
+// Parse a comma separated cpu list, e.g. "2,3"
+// Returns the number of cpus, -1 on error
+static int
+parse_cpu_list(const char *str, int *cpus, int max)
+{
+    int n = 0;
+    char *endptr = NULL;
+    long cpu = 0;
+
+    while (*str) {
+        if (n == max) {
+            return -1;
+        }
+        cpu = strtol(str, &endptr, 10);
+        if (endptr == str || cpu < 0 || cpu > INT16_MAX) {
+            return -1;
+        }
+        cpus[n++] = cpu;
+        if (*endptr == ',') {
+            endptr++;
+        } else if (*endptr != '\0') {
+            return -1;
+        }
+        str = endptr;
+    }
+    return n;
+}
+
 // Parse memory size string supporting optional K/M/G suffix
 // Returns 0 on success, -1 on error
 static int
@@ -188,7 +285,8 @@ parse_opts(int argc, char **argv)
         .disk_path = NULL,
         .tap_ifname = NULL,
         .memory_size = 1024LL * 1024 * 1024,
-        .kernel_cmdline = DEFAULT_KERNEL_CMDLINE
+        .kernel_cmdline = DEFAULT_KERNEL_CMDLINE,
+        .io_threads = IO_THREADS,
     };
 
     int opt = 0;
@@ -197,7 +295,7 @@ parse_opts(int argc, char **argv)
     // Suppress getopt's default error messages for manual handling
     opterr = 0;
 
-    while ((opt = getopt(argc, argv, "k:i:m:a:h:d:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "k:i:m:a:h:d:w:b:t:sp:I:c:PVC:f:D:M:")) != -1) {
         switch (opt) {
         case 'k':
             opts.kernel_path = optarg;
@@ -208,9 +306,30 @@ parse_opts(int argc, char **argv)
         case 'd':
             opts.disk_path = optarg;
             break;
+        case 'w':
+            if (virtio_block_parse_cache(optarg, &opts.disk_cache) < 0) {
+                fprintf(stderr, "Error: Invalid cache mode '%s'\n", optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b': {
+            uint64_t size;
+            if (parse_memory_size(optarg, &size) != 0 || size < 4096) {
+                fprintf(stderr, "Error: Invalid disk cache size '%s'\n",
+                        optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            opts.disk_cache_size = size;
+            break;
+        }
         case 't':
             opts.tap_ifname = optarg;
             break;
+        case 'M':
+            opts.pmem_path = optarg;
+            break;
         case 'm': {
             uint64_t mem_size;
             if (parse_memory_size(optarg, &mem_size) != 0) {
@@ -225,13 +344,97 @@ parse_opts(int argc, char **argv)
         case 'a':
             opts.kernel_cmdline = optarg;
             break;
+        case 's':
+            opts.print_stats = 1;
+            break;
+        case 'P':
+            opts.pci = 1;
+            break;
+        case 'V':
+            opts.vhost_net = 1;
+            break;
+        case 'C': {
+            char *end = NULL;
+            unsigned long long cid = strtoull(optarg, &end, 10);
+            // 0-2 are reserved, the host is 2
+            if (*optarg == '\0' || *end != '\0' || cid < 3 ||
+                cid > UINT32_MAX - 1) {
+                fprintf(stderr, "Error: Invalid vsock CID '%s'\n", optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            opts.vsock_cid = cid;
+            break;
+        }
+        case 'f': {
+            char *sep = strchr(optarg, ':');
+            if (sep == NULL || sep == optarg || sep[1] == '\0') {
+                fprintf(stderr, "Error: Invalid shared directory '%s'\n",
+                        optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            *sep = '\0';
+            opts.fs_tag = optarg;
+            opts.fs_socket = sep + 1;
+            break;
+        }
+        case 'D': {
+            uint64_t size;
+            if (parse_memory_size(optarg, &size) != 0 || size == 0 ||
+                size % 4096 != 0) {
+                fprintf(stderr, "Error: Invalid DAX window size '%s'\n",
+                        optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            opts.fs_dax_size = size;
+            break;
+        }
+        case 'p': {
+            char *end = NULL;
+            unsigned long usecs = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || usecs > 1000000) {
+                fprintf(stderr, "Error: Invalid polling time '%s'\n",
+                        optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            opts.poll_usecs = usecs;
+            break;
+        }
+        case 'I': {
+            char *end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1 || n > 64) {
+                fprintf(stderr, "Error: Invalid number of I/O threads '%s'\n",
+                        optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            opts.io_threads = n;
+            break;
+        }
+        case 'c':
+            opts.io_cpu_num = parse_cpu_list(optarg, opts.io_cpus, MAX_IO_CPUS);
+            if (opts.io_cpu_num <= 0) {
+                fprintf(stderr, "Error: Invalid cpu list '%s'\n", optarg);
+                print_usage(stderr, program_name);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'h':
             print_usage(stdout, program_name);
             exit(EXIT_SUCCESS);
         case '?':
             if (optopt == 'k' || optopt == 'i'
                     || optopt == 'm' || optopt == 'a'
-                    || optopt == 'd' || optopt == 't') {
+                    || optopt == 'd' || optopt == 'b'
+                    || optopt == 't'
+                    || optopt == 'p' || optopt == 'I'
+                    || optopt == 'c' || optopt == 'C'
+                    || optopt == 'f' || optopt == 'D'
+                    || optopt == 'M') {
                 fprintf(stderr,
                         "Error: Option -%c requires an argument.\n",
                         optopt);
@@ -256,6 +459,18 @@ parse_opts(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (opts.disk_cache_size && opts.disk_path == NULL) {
+        fprintf(stderr, "Error: -b needs a disk (-d).\n");
+        print_usage(stderr, program_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.fs_dax_size && opts.fs_tag == NULL) {
+        fprintf(stderr, "Error: -D needs a shared directory (-f).\n");
+        print_usage(stderr, program_name);
+        exit(EXIT_FAILURE);
+    }
+
     // Validate required arguments
     if (opts.kernel_path == NULL) {
         fprintf(stderr, "Error: Kernel path (-k) is required.\n");
@@ -283,12 +498,52 @@ print_usage(FILE *stream, const char *program_name)
             "  -m MEMORY_SIZE    Memory size with optional K/M/G suffix "
             "(default: 1G)\n");
     fprintf(stream,
-            "  -d DISK_IMG       Path to disk image (optional)\n");
+            "  -d DISK_IMG       Path to disk image, direct:IMG to bypass the "
+            "host page cache,\n"
+            "                    overlay:BASE:DELTA to write to DELTA over a "
+            "read-only BASE,\n"
+            "                    or vhost-user:SOCKET (optional)\n");
+    fprintf(stream,
+            "  -w CACHE          Disk cache mode: writeback (default), "
+            "writethrough,\n"
+            "                    or unsafe to ignore the flushes\n");
     fprintf(stream,
-            "  -t TAP_IFNAME     Tap interface name (optional)\n");
+            "  -b SIZE           Cache up to SIZE of the disk in memory, with "
+            "readahead\n");
+    fprintf(stream,
+            "  -t TAP_IFNAME     Tap interface name, or vhost-user:SOCKET "
+            "(optional)\n");
     fprintf(stream,
             "  -a KERNEL_CMDLINE Kernel command line "
             "(default: \"console=ttyS0 debug\")\n");
+    fprintf(stream,
+            "  -p USECS          Busy poll the virtqueues for up to USECS "
+            "after a request\n");
+    fprintf(stream,
+            "  -I NUM            Number of I/O threads (default: %d)\n",
+            IO_THREADS);
+    fprintf(stream,
+            "  -c CPU[,CPU...]   Pin the I/O threads to these cpus\n");
+    fprintf(stream,
+            "  -P                Attach the devices to a PCI bus, with "
+            "MSI-X interrupts\n");
+    fprintf(stream,
+            "  -V                Let vhost-net move the packets of the "
+            "tap interface\n");
+    fprintf(stream,
+            "  -C CID            Add a vsock device, the guest has address CID "
+            "(needs /dev/vhost-vsock)\n");
+    fprintf(stream,
+            "  -f TAG:SOCKET     Share a directory served by the virtiofsd "
+            "on SOCKET as TAG\n");
+    fprintf(stream,
+            "  -D SIZE           DAX window of the shared directory, with "
+            "optional K/M/G suffix\n");
+    fprintf(stream,
+            "  -M [snapshot:]IMG Map a disk image into the guest as "
+            "persistent memory\n");
+    fprintf(stream,
+            "  -s                Print device statistics on exit\n");
     fprintf(stream,
             "  -h                Show this help message\n");
 }
@@ -298,22 +553,50 @@ int main(int argc, char *argv[]) {
     struct cmd_opts opts = parse_opts(argc, argv);
     signal(SIGINT, sigint_handler);
     vm = (struct mvvm){0};
-    if (mvvm_init(&vm, opts.memory_size, opts.disk_path, opts.tap_ifname) < 0) {
+    if (mvvm_init(&vm, opts.memory_size, opts.disk_path, opts.tap_ifname,
+                  opts.io_threads, opts.io_cpu_num ? opts.io_cpus : NULL,
+                  opts.io_cpu_num, opts.pci, opts.vhost_net,
+                  opts.vsock_cid, opts.fs_tag, opts.fs_socket,
+                  opts.fs_dax_size, opts.pmem_path) < 0) {
         return -1;
     }
     if (mvvm_load_kernel(&vm, opts.kernel_path, opts.initrd_path, opts.kernel_cmdline) < 0) {
         return -1;
     }
-    pthread_t keyboard_thread = {0};
-    if (pthread_create(&keyboard_thread, NULL, keyboard_thread_func, &vm) != 0) {
-        perror("Failed to create thread");
+    if (vm.blk && opts.disk_cache != VIRTIO_BLK_CACHE_WRITEBACK &&
+        virtio_block_set_cache(vm.blk, opts.disk_cache) < 0) {
+        fprintf(stderr, "The disk backend has no cache mode\n");
+        return -1;
+    }
+    if (opts.disk_cache_size &&
+        mvvm_cache_virtio_blk(&vm, opts.disk_cache_size) < 0) {
+        fprintf(stderr, "Failed to cache the disk\n");
+        return -1;
+    }
+    if (opts.poll_usecs > 0) {
+        if (vm.blk)
+            virtio_set_poll(vm.blk, opts.poll_usecs);
+        if (vm.net)
+            virtio_set_poll(vm.net, opts.poll_usecs);
+    }
+    struct console con = {0};
+    if (console_init(&con, &vm) < 0) {
+        fprintf(stderr, "Failed to watch the terminal\n");
         return 1;
     }
     g_vm = &vm;
     signal(SIGTERM, sigterm_handler);
     mvvm_run(&vm);
     vm.quit = true;
-    pthread_join(keyboard_thread, NULL);
+    console_destroy(&con);
+    if (opts.print_stats) {
+        if (vm.blk)
+            virtio_print_stats(vm.blk, "virtio-blk", stderr);
+        if (vm.blk_cache)
+            block_cache_print_stats(vm.blk_cache, "virtio-blk", stderr);
+        if (vm.net)
+            virtio_print_stats(vm.net, "virtio-net", stderr);
+    }
     mvvm_destroy(&vm);
     return 0;
 }
\ No newline at end of file
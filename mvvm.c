@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "mvvm.h"
 
 #include <errno.h>
@@ -20,6 +21,8 @@
 #include "config.h"
 #include "serial.h"
 #include "virtio.h"
+#include "iothread.h"
+#include "pci.h"
 
 static void set_flat_mode(struct kvm_segment *seg) {
     seg->base = 0;
@@ -87,7 +90,136 @@ int init_cpu(int kvm_fd, int cpu_fd) {
 #define RESERVED_ADDR 0xFFFBD000ULL
 #define RESERVED_SIZE (RESERVED_PAGES * PAGE_SIZE)
 
-int mvvm_init(struct mvvm *self, uint64_t mem_size, const char *disk, const char *network) {
+// The host reaches the guest at AF_VSOCK address 'cid'
+static int
+mvvm_init_virtio_vsock(struct mvvm *self, uint64_t cid)
+{
+    struct virtio_bus_def bus = {0};
+
+    bus.mem_map = self->mem_map;
+    bus.irq.vmfd = self->vm_fd;
+    bus.irq.irqline = VIRTIO_VSOCK_IRQ;
+    bus.iothread = io_threads_pick(self->io);
+    bus.pci = self->pci;
+    self->vsock = virtio_vsock_init(bus, VIRTIO_VSOCK_MMIO_ADDR, cid);
+    if (!self->vsock) {
+        fprintf(stderr, "failed to initialize virtio vsock device\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The DAX window starts inaccessible, virtiofsd maps files into it. It is
+// a memory slot of its own, so that the guest accesses do not exit.
+static int
+mvvm_init_virtio_fs(struct mvvm *self, const char *tag, const char *path,
+                    uint64_t dax_size)
+{
+    struct kvm_userspace_memory_region mem = {0};
+    struct virtio_bus_def bus = {0};
+
+    if (dax_size && self->pci) {
+        // would need a shared memory capability
+        fprintf(stderr, "no DAX window on virtio-pci, sharing without it\n");
+        dax_size = 0;
+    }
+    if (dax_size) {
+        self->fs_dax = mmap(NULL, dax_size, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+        if (self->fs_dax == MAP_FAILED) {
+            self->fs_dax = NULL;
+            fprintf(stderr, "failed to reserve the DAX window\n");
+            return -1;
+        }
+        self->fs_dax_size = dax_size;
+        mem.slot = VIRTIO_FS_DAX_SLOT;
+        mem.guest_phys_addr = VIRTIO_FS_DAX_ADDR;
+        mem.memory_size = dax_size;
+        mem.userspace_addr = (uint64_t)self->fs_dax;
+        if (ioctl(self->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem) < 0) {
+            fprintf(stderr, "failed to set the DAX memory region\n");
+            return -1;
+        }
+    }
+    bus.mem_map = self->mem_map;
+    bus.irq.vmfd = self->vm_fd;
+    bus.irq.irqline = VIRTIO_FS_IRQ;
+    bus.iothread = io_threads_pick(self->io);
+    bus.pci = self->pci;
+    self->fs = virtio_fs_init(bus, VIRTIO_FS_MMIO_ADDR, path, tag,
+                              self->fs_dax, VIRTIO_FS_DAX_ADDR, dax_size);
+    if (!self->fs) {
+        fprintf(stderr, "failed to initialize virtio fs device\n");
+        return -1;
+    }
+    return 0;
+}
+
+#define PMEM_SNAPSHOT_PREFIX "snapshot:"
+
+// The image is a memory slot backed by the host page cache, so that the
+// guest reads it without exits or copies, and VMs mapping the same image
+// share the pages. A snapshot maps it copy-on-write.
+static int
+mvvm_init_virtio_pmem(struct mvvm *self, const char *path)
+{
+    struct kvm_userspace_memory_region mem = {0};
+    struct virtio_bus_def bus = {0};
+    struct stat st = {0};
+    bool snapshot = false;
+
+    self->pmem_fd = -1;
+    if (strncmp(path, PMEM_SNAPSHOT_PREFIX,
+                strlen(PMEM_SNAPSHOT_PREFIX)) == 0) {
+        snapshot = true;
+        path += strlen(PMEM_SNAPSHOT_PREFIX);
+    }
+    self->pmem_fd = open(path, (snapshot ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (self->pmem_fd < 0 || fstat(self->pmem_fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (st.st_size == 0 || st.st_size % VIRTIO_PMEM_ALIGN != 0) {
+        fprintf(stderr, "%s: the size must be a multiple of 2 MiB\n", path);
+        return -1;
+    }
+    self->pmem_mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                          (snapshot ? MAP_PRIVATE : MAP_SHARED) |
+                          MAP_NORESERVE, self->pmem_fd, 0);
+    if (self->pmem_mem == MAP_FAILED) {
+        self->pmem_mem = NULL;
+        perror("failed to map the pmem image");
+        return -1;
+    }
+    self->pmem_size = st.st_size;
+    mem.slot = VIRTIO_PMEM_SLOT;
+    mem.guest_phys_addr = VIRTIO_PMEM_ADDR;
+    mem.memory_size = st.st_size;
+    mem.userspace_addr = (uint64_t)self->pmem_mem;
+    if (ioctl(self->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem) < 0) {
+        fprintf(stderr, "failed to set the pmem memory region\n");
+        return -1;
+    }
+    bus.mem_map = self->mem_map;
+    bus.irq.vmfd = self->vm_fd;
+    bus.irq.irqline = VIRTIO_PMEM_IRQ;
+    bus.iothread = io_threads_pick(self->io);
+    bus.pci = self->pci;
+    self->pmem = virtio_pmem_init(bus, VIRTIO_PMEM_MMIO_ADDR,
+                                  snapshot ? -1 : self->pmem_fd,
+                                  VIRTIO_PMEM_ADDR, st.st_size);
+    if (!self->pmem) {
+        fprintf(stderr, "failed to initialize virtio pmem device\n");
+        return -1;
+    }
+    return 0;
+}
+
+int mvvm_init(struct mvvm *self, uint64_t mem_size, const char *disk, const char *network,
+              int io_threads, const int *io_cpus, int io_cpu_num, bool pci,
+              bool vhost_net, uint64_t vsock_cid, const char *fs_tag,
+              const char *fs_socket, uint64_t fs_dax_size, const char *pmem) {
     struct kvm_pit_config pit = {0};
     struct kvm_userspace_memory_region mem = {0};
     uint64_t tss_addr = RESERVED_ADDR;
@@ -135,9 +267,15 @@ int mvvm_init(struct mvvm *self, uint64_t mem_size, const char *disk, const char
         fprintf(stderr, "failed to allocate PhysMemoryMap\n");
         return -1;
     }
+    // backed by a memfd, so that vhost-user backends can map it too
+    mem_map->fd = memfd_create("mvvmm-ram", MFD_CLOEXEC);
+    if (mem_map->fd < 0 || ftruncate(mem_map->fd, mem_size) < 0) {
+        perror("failed to create guest memory");
+        return -1;
+    }
     mem_map->host_mem =
         mmap(NULL, mem_size,PROT_READ | PROT_WRITE,
-            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            MAP_SHARED | MAP_NORESERVE, mem_map->fd, 0);
     if (mem_map->host_mem == MAP_FAILED) {
         fprintf(stderr, "failed to mmap memory\n");
         return -1;
@@ -191,6 +329,19 @@ int mvvm_init(struct mvvm *self, uint64_t mem_size, const char *disk, const char
     }
     // Initialize serial port
     serial_init(&self->serial, self->vm_fd);
+    // Start the threads running device I/O handlers
+    self->io = new_io_threads(io_threads, io_cpus, io_cpu_num);
+    if (!self->io) {
+        fprintf(stderr, "failed to start I/O threads.\n");
+        return -1;
+    }
+    if (pci) {
+        self->pci = new_pci_bus(self->vm_fd, PCI_MMIO_ADDR, PCI_MMIO_SIZE);
+        if (!self->pci) {
+            fprintf(stderr, "failed to create PCI bus.\n");
+            return -1;
+        }
+    }
     // init virtio block device
     if (disk != NULL) {
         if (mvvm_init_virtio_blk(self, disk) < 0) {
@@ -199,21 +350,67 @@ int mvvm_init(struct mvvm *self, uint64_t mem_size, const char *disk, const char
         }
     }
     if (network != NULL) {
-        if (mvvm_init_virtio_net(self, "vm0") < 0) {
+        if (mvvm_init_virtio_net(self, network, vhost_net) < 0) {
             fprintf(stderr, "mvvm init error, failed to open tap interface.\n");
             return -1;
         }
     }
+    if (vsock_cid != 0) {
+        if (mvvm_init_virtio_vsock(self, vsock_cid) < 0) {
+            fprintf(stderr, "mvvm init error, failed to add vsock device.\n");
+            return -1;
+        }
+    }
+    if (fs_tag != NULL) {
+        if (mvvm_init_virtio_fs(self, fs_tag, fs_socket, fs_dax_size) < 0) {
+            fprintf(stderr, "mvvm init error, failed to share directory.\n");
+            return -1;
+        }
+    }
+    if (pmem != NULL) {
+        if (mvvm_init_virtio_pmem(self, pmem) < 0) {
+            fprintf(stderr, "mvvm init error, failed to map pmem image.\n");
+            return -1;
+        }
+    }
     return 0;
 }
 
 void mvvm_destroy(struct mvvm *self) {
+    // stop the devices before the memory they use goes away
+    if (self->blk) {
+        mvvm_destroy_virtio_blk(self);
+    }
+    if (self->net) {
+        mvvm_destroy_virtio_net(self);
+    }
+    if (self->vsock) {
+        virtio_vsock_destroy(self->vsock);
+        free(self->vsock);
+    }
+    if (self->fs) {
+        virtio_fs_destroy(self->fs);
+        free(self->fs);
+    }
+    if (self->fs_dax) {
+        munmap(self->fs_dax, self->fs_dax_size);
+    }
+    if (self->pmem) {
+        virtio_pmem_destroy(self->pmem);
+        free(self->pmem);
+    }
+    if (self->pmem_mem) {
+        munmap(self->pmem_mem, self->pmem_size);
+        close(self->pmem_fd);
+    }
+    delete_io_threads(self->io);
+    delete_pci_bus(self->pci);
+    serial_destroy(&self->serial);
     munmap(self->mem_map->host_mem, self->mem_map->size);
+    close(self->mem_map->fd);
     close(self->cpu_fd);
     close(self->vm_fd);
     close(self->kvm_fd);
-    mvvm_destroy_virtio_blk(self);
-    mvvm_destroy_virtio_net(self);
     free(self->mem_map);
 }
 
@@ -374,20 +571,42 @@ mvvm_load_kernel(struct mvvm *vm, const char *kernel_path,
     // Copy command line
     cmd_line = (char *)(vm->mem_map->host_mem + 0x20000);
     char *cmdline_buf = strdup(kernel_args);
-    if (vm->blk) {
+    // PCI devices are found by scanning the bus
+    if (vm->blk && !vm->pci) {
         cmdline_buf = cmdline_concat(cmdline_buf, VIRTIO_BLK_CMDLINE);
         if (cmdline_buf == NULL) {
             fprintf(stderr, "invalid kernel args.\n");
             ret = -1; goto end;
         }
     }
-    if (vm->net) {
+    if (vm->net && !vm->pci) {
         cmdline_buf = cmdline_concat(cmdline_buf, VIRTIO_NET_CMDLINE);
         if (cmdline_buf == NULL) {
             fprintf(stderr, "invalid kernel args.\n");
             ret = -1; goto end;
         }
     }
+    if (vm->vsock && !vm->pci) {
+        cmdline_buf = cmdline_concat(cmdline_buf, VIRTIO_VSOCK_CMDLINE);
+        if (cmdline_buf == NULL) {
+            fprintf(stderr, "invalid kernel args.\n");
+            ret = -1; goto end;
+        }
+    }
+    if (vm->fs && !vm->pci) {
+        cmdline_buf = cmdline_concat(cmdline_buf, VIRTIO_FS_CMDLINE);
+        if (cmdline_buf == NULL) {
+            fprintf(stderr, "invalid kernel args.\n");
+            ret = -1; goto end;
+        }
+    }
+    if (vm->pmem && !vm->pci) {
+        cmdline_buf = cmdline_concat(cmdline_buf, VIRTIO_PMEM_CMDLINE);
+        if (cmdline_buf == NULL) {
+            fprintf(stderr, "invalid kernel args.\n");
+            ret = -1; goto end;
+        }
+    }
     if (strnlen(cmdline_buf, 2000) >= 2000) {
         fprintf(stderr, "invalid kernel args.\n");
         free(cmdline_buf);
@@ -476,6 +695,12 @@ int mvvm_run(struct mvvm *vm) {
             if (run->io.port >= 0x3f8 && run->io.port <= 0x3ff) {
                 handle_serial(vm, run);
             }
+            if (vm->pci && run->io.port >= PCI_CONFIG_ADDRESS &&
+                run->io.port < PCI_CONFIG_DATA + 4) {
+                pci_ioport_access(vm->pci, run->io.port,
+                    (uint8_t *)run + run->io.data_offset, run->io.size,
+                    run->io.direction == KVM_EXIT_IO_OUT);
+            }
             if (run->io.port == 0x300) {
                 ret = handle_power(vm, run);
                 if (ret != 0) {
@@ -488,12 +713,25 @@ int mvvm_run(struct mvvm *vm) {
             ret = 1;
             goto exit_loop;
         case KVM_EXIT_MMIO:
+            if (vm->pci && pci_mmio_access(vm->pci, run->mmio.phys_addr,
+                    run->mmio.data, run->mmio.len, run->mmio.is_write) == 0) {
+                break;
+            }
             if (run->mmio.phys_addr >> 30 == 1024) {
                 virtiodev = vm->blk;
                 mmio_base_addr = VIRTIO_BLK_MMIO_ADDR;
             } else if (run->mmio.phys_addr >> 30 == 1025) {
                 virtiodev = vm->net;
                 mmio_base_addr = VIRTIO_NET_MMIO_ADDR;
+            } else if (run->mmio.phys_addr >> 30 == 1028 && vm->vsock) {
+                virtiodev = vm->vsock;
+                mmio_base_addr = VIRTIO_VSOCK_MMIO_ADDR;
+            } else if (run->mmio.phys_addr >> 30 == 1029 && vm->fs) {
+                virtiodev = vm->fs;
+                mmio_base_addr = VIRTIO_FS_MMIO_ADDR;
+            } else if (run->mmio.phys_addr >> 30 == 1030 && vm->pmem) {
+                virtiodev = vm->pmem;
+                mmio_base_addr = VIRTIO_PMEM_MMIO_ADDR;
             } else {
                 break;
             }
@@ -9,6 +9,7 @@
 struct guest_mem_map {
     void *host_mem;
     uint64_t size;
+    int fd;             // the memfd behind host_mem, -1 if there is none
 };
 
 struct mvvm {
@@ -18,12 +19,35 @@ struct mvvm {
     struct guest_mem_map *mem_map;
     struct serial serial;
     struct virtio_device *blk;
+    struct block_cache *blk_cache;  // in front of the disk of 'blk', if any
     struct virtio_device *net;
+    struct virtio_device *vsock;
+    struct virtio_device *fs;
+    void *fs_dax;         // the DAX window of 'fs', NULL if none
+    uint64_t fs_dax_size;
+    struct virtio_device *pmem;
+    void *pmem_mem;       // the image mapped for 'pmem'
+    uint64_t pmem_size;
+    int pmem_fd;
+    struct io_threads *io;
+    struct pci_bus *pci;  // NULL if the devices use virtio-mmio
     int quit;
     uint8_t power_cmd;
 };
 
-int mvvm_init(struct mvvm *vm, uint64_t mem_size, const char *disk, const char *network);
+// The io threads run the device handlers, thread i is pinned to
+// io_cpus[i % io_cpu_num] if io_cpus is not NULL. If 'pci' is true, the
+// devices are virtio-pci with MSI-X instead of virtio-mmio. If 'vhost_net'
+// is true, the host kernel serves the network device. A non-zero
+// 'vsock_cid' adds a vhost-vsock device, the guest has that address. If
+// 'fs_tag' is not NULL, the directory served by the virtiofsd on
+// 'fs_socket' is shared, with a DAX window of 'fs_dax_size' if not 0.
+// 'pmem' is an image mapped into the guest by a virtio-pmem device, with
+// a "snapshot:" prefix the guest writes are private and dropped on exit.
+int mvvm_init(struct mvvm *vm, uint64_t mem_size, const char *disk, const char *network,
+              int io_threads, const int *io_cpus, int io_cpu_num, bool pci,
+              bool vhost_net, uint64_t vsock_cid, const char *fs_tag,
+              const char *fs_socket, uint64_t fs_dax_size, const char *pmem);
 int init_cpu(int kvm_fd, int cpu_fd);
 int mvvm_load_kernel(struct mvvm *vm, const char *kernel_path,
                      const char *initrd_path, const char *kernel_args);
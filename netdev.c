@@ -7,90 +7,57 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
 #include "mvvm.h"
 #include "netdev.h"
 #include "virtio.h"
+#include "iothread.h"
 #include "config.h"
 
+#define VHOST_USER_PREFIX "vhost-user:"
+
 struct tap_net_ctx {
     int fd;
     char ifname[IFNAMSIZ];
-    pthread_t rx_thread;
-    int quit;
-    pthread_mutex_t lock;
+    struct io_handler rx_handler;
 };
 
 static void
-write_packet_to_ether(struct ether_device *net, const uint8_t *buf, int len)
+write_packet_to_ether(struct ether_device *net, const struct iovec *iov, int iovcnt)
 {
     struct tap_net_ctx *ctx = net->opaque;
-    if (!ctx || ctx->fd < 0 || !buf || len <= 0) {
+    if (!ctx || ctx->fd < 0 || !iov || iovcnt <= 0) {
         return;
     }
-    write(ctx->fd, buf, len);
-}
-
-static ssize_t
-timed_read(int fd, void *buf, size_t len, int timeout_ms)
-{
-    struct pollfd pfd = {0};
-    int ret = 0;
-
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-
-    ret = poll(&pfd, 1, timeout_ms);
-    if (ret < 0) {
-        return -1;
-    }
-    if (ret == 0) {
-        // Timeout
-        errno = ETIMEDOUT;
-        return -1;
-    }
-
-    if (pfd.revents & POLLIN) {
-        return read(fd, buf, len);
-    }
-
-    // Error or hangup
-    errno = EIO;
-    return -1;
+    writev(ctx->fd, iov, iovcnt);
 }
 
-static void *
-tap_net_rx_thread(void *arg)
+// Called by the io thread when the TAP device has packets for the guest
+static void
+tap_net_rx_handler(struct io_handler *h, uint32_t revents)
 {
-    struct ether_device *net = arg;
+    struct ether_device *net = h->opaque;
     struct tap_net_ctx *ctx = net->opaque;
     uint8_t buf[TAP_BUF_SIZE] = {0};
+    ssize_t len = 0;
 
-    if (!ctx || ctx->fd < 0) {
-        return NULL;
-    }
-
-    while (1) {
-
-        ssize_t len = timed_read(ctx->fd, buf, sizeof(buf), 300);
+    // bounded, so that other handlers of the thread get their turn
+    for (int i = 0; i < TAP_RX_BURST; i++) {
+        len = read(ctx->fd, buf, sizeof(buf));
         if (len < 0) {
-            if (errno == EINTR || errno == ETIMEDOUT) {
-                pthread_mutex_lock(&ctx->lock);
-                if (ctx->quit) {
-                    pthread_mutex_unlock(&ctx->lock);
-                    return NULL;
-                }
-                pthread_mutex_unlock(&ctx->lock);
-                continue;
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("tap_net_rx_handler: read failed");
+                io_handler_remove(h);
             }
-            perror("tap_net_rx_thread: timed_read failed");
             break;
         }
-
         if (len == 0) {
             // TAP device closed
+            io_handler_remove(h);
             break;
         }
 
@@ -101,13 +68,15 @@ tap_net_rx_thread(void *arg)
         }
         // If virtio queue is full, packet is dropped
     }
-
-    return NULL;
+    // one interrupt for the burst
+    if (net->flush_packets_to_virtio) {
+        net->flush_packets_to_virtio(net);
+    }
 }
 
 // Initialize virtio network device with TAP backend
 int
-mvvm_init_virtio_net(struct mvvm *self, const char *tap_ifname)
+mvvm_init_virtio_net(struct mvvm *self, const char *tap_ifname, bool vhost)
 {
     struct tap_net_ctx *ctx = NULL;
     struct ether_device *net = NULL;
@@ -115,15 +84,20 @@ mvvm_init_virtio_net(struct mvvm *self, const char *tap_ifname)
     struct virtio_bus_def bus = {0};
     struct ifreq ifr = {0};
     int ret = -1;
+    // The packets go to another process, there is no TAP device
+    bool vhost_user = tap_ifname && strncmp(tap_ifname, VHOST_USER_PREFIX,
+                                    strlen(VHOST_USER_PREFIX)) == 0;
 
+    if (vhost_user) {
+        goto alloc_net;
+    }
     // Allocate TAP device context
     ctx = malloc(sizeof(*ctx));
     if (!ctx) {
         fprintf(stderr, "failed to allocate TAP network context\n");
         return -1;
     }
-    ctx->quit = 0;
-    pthread_mutex_init(&ctx->lock, NULL);
+    *ctx = (struct tap_net_ctx){0};
     // Open TUN/TAP clone device
     ctx->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
     if (ctx->fd < 0) {
@@ -147,6 +121,7 @@ mvvm_init_virtio_net(struct mvvm *self, const char *tap_ifname)
     strncpy(ctx->ifname, ifr.ifr_name, IFNAMSIZ - 1);
     ctx->ifname[IFNAMSIZ - 1] = '\0';
 
+alloc_net:
     // Allocate and initialize struct ether_device structure
     net = malloc(sizeof(*net));
     if (!net) {
@@ -172,6 +147,8 @@ mvvm_init_virtio_net(struct mvvm *self, const char *tap_ifname)
     // Setup virtio bus definition
     bus.mem_map = self->mem_map;
     bus.irq = irq;
+    bus.iothread = io_threads_pick(self->io);
+    bus.pci = self->pci;
 
     // Initialize virtio network device
     self->net = virtio_net_init(bus, VIRTIO_NET_MMIO_ADDR, net);
@@ -179,13 +156,38 @@ mvvm_init_virtio_net(struct mvvm *self, const char *tap_ifname)
         fprintf(stderr, "failed to initialize virtio net device\n");
         goto fail;
     }
-    // Start RX thread to handle incoming packets from TAP
-    pthread_t rx_thread;
-    if (pthread_create(&rx_thread, NULL, tap_net_rx_thread, net) != 0) {
-        fprintf(stderr, "failed to create TAP RX thread\n");
+    // the guest may change these with VIRTIO_NET_F_NOTF_COAL
+    virtio_set_coalescing(self->net, -1, VIRTIO_NET_COAL_MAX_FRAMES,
+                          VIRTIO_NET_COAL_USECS);
+    // Then the packets do not go through here at all
+    if (vhost_user) {
+        if (virtio_net_set_vhost_user(self->net,
+                tap_ifname + strlen(VHOST_USER_PREFIX)) < 0) {
+            fprintf(stderr, "failed to connect to the vhost-user backend\n");
+            virtio_net_destroy(self->net);
+            free(self->net);
+            self->net = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    if (vhost) {
+        if (virtio_net_set_vhost(self->net, ctx->fd) == 0) {
+            return 0;
+        }
+        fprintf(stderr, "vhost-net unavailable, using the tap device directly\n");
+    }
+    // Let the io thread of the device handle incoming packets from TAP
+    ctx->rx_handler = (struct io_handler){
+        .fd = ctx->fd,
+        .events = EPOLLIN,
+        .fn = tap_net_rx_handler,
+        .opaque = net,
+    };
+    if (io_handler_add(bus.iothread, &ctx->rx_handler) < 0) {
+        fprintf(stderr, "failed to watch TAP device\n");
         goto fail;
     }
-    ctx->rx_thread = rx_thread;
     return 0;
 
 fail:
@@ -203,12 +205,12 @@ fail:
 
 void mvvm_destroy_virtio_net(struct mvvm *self) {
     struct tap_net_ctx *ctx = virtio_net_get_opaque(self->net);
-    pthread_mutex_lock(&ctx->lock);
-    ctx->quit = 1;
-    pthread_mutex_unlock(&ctx->lock);
-    void *ret = NULL;
-    pthread_join(ctx->rx_thread, &ret);
-    free(ctx);
+    // NULL with a vhost-user backend
+    if (ctx) {
+        io_handler_remove(&ctx->rx_handler);
+        close(ctx->fd);
+        free(ctx);
+    }
     virtio_net_destroy(self->net);
     free(self->net);
 }
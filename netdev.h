@@ -1,10 +1,15 @@
 #ifndef MVVMM_NETDEV_H_
 #define MVVMM_NETDEV_H_
 
+#include <stdbool.h>
+
 struct mvvm;
 
+// With 'vhost', the packets are moved by /dev/vhost-net if available. A
+// 'tap_name' of "vhost-user:PATH" hands them to the vhost-user backend
+// listening on PATH instead.
 int
-mvvm_init_virtio_net(struct mvvm *self, const char *tap_name);
+mvvm_init_virtio_net(struct mvvm *self, const char *tap_name, bool vhost);
 
 void mvvm_destroy_virtio_net(struct mvvm *self);
 
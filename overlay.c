@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include "overlay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "iov.h"
+#include "config.h"
+
+// entries not flushed yet, a write allocating past them flushes first
+#define OVERLAY_DIRTY_MAX 4096
+
+static int
+pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (uint8_t *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int
+pwrite_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static uint64_t
+cluster_size(struct overlay *ov)
+{
+    return 1ULL << ov->cluster_bits;
+}
+
+// Where the cluster of disk 'offset' is in the delta, 0 if in the base
+static uint64_t
+overlay_lookup(struct overlay *ov, uint64_t offset)
+{
+    uint64_t cluster = offset >> ov->cluster_bits;
+    uint64_t *l2 = __atomic_load_n(&ov->l2[cluster >> ov->l2_bits],
+                                   __ATOMIC_ACQUIRE);
+
+    if (!l2) {
+        return 0;
+    }
+    return __atomic_load_n(&l2[cluster & ((1ULL << ov->l2_bits) - 1)],
+                           __ATOMIC_ACQUIRE);
+}
+
+// The bytes from disk 'offset', up to 'max', which are contiguous in the
+// same file. '*where' is their offset in the delta, 0 if in the base.
+static size_t
+overlay_extent(struct overlay *ov, uint64_t offset, size_t max,
+               uint64_t *where)
+{
+    uint64_t cs = cluster_size(ov);
+    uint64_t first = overlay_lookup(ov, offset);
+    uint64_t next = 0;
+    size_t len = cs - (offset & (cs - 1));
+
+    *where = first ? first + (offset & (cs - 1)) : 0;
+    while (len < max) {
+        next = overlay_lookup(ov, offset + len);
+        if (first ? next != *where + len : next != 0) {
+            break;
+        }
+        len += cs;
+    }
+    return len < max ? len : max;
+}
+
+// The L2 table of 'cluster', allocated if there is none yet. With the
+// allocation lock held, and room in 'dirty' for its L1 entry.
+static uint64_t *
+overlay_get_l2(struct overlay *ov, uint64_t cluster)
+{
+    uint64_t i = cluster >> ov->l2_bits;
+    uint64_t *l2 = ov->l2[i];
+    uint64_t offset = ov->end;
+
+    if (l2) {
+        return l2;
+    }
+    l2 = calloc(1, cluster_size(ov));
+    if (!l2) {
+        return NULL;
+    }
+    // zeroes in the file until a flush writes its entries
+    if (ftruncate(ov->fd, offset + cluster_size(ov)) < 0) {
+        perror("overlay: allocate an L2 table");
+        free(l2);
+        return NULL;
+    }
+    ov->end += cluster_size(ov);
+    ov->l1[i] = offset;
+    ov->dirty[ov->ndirty++] = (struct overlay_entry){
+        .offset = ov->l1_offset + i * sizeof(offset),
+        .value = offset,
+    };
+    __atomic_store_n(&ov->l2[i], l2, __ATOMIC_RELEASE);
+    return l2;
+}
+
+// Copy the cluster of 'offset' to the delta, with the 'len' bytes of
+// 'iov' written at 'offset', which do not cross the cluster. If another
+// write copied it meanwhile, '*where' is where it is, else 0.
+static int
+overlay_cow(struct overlay *ov, const struct iovec *iov, int iovcnt,
+            uint64_t offset, size_t len, uint64_t *where)
+{
+    uint64_t cs = cluster_size(ov);
+    uint64_t cluster = offset >> ov->cluster_bits;
+    uint64_t start = cluster << ov->cluster_bits;
+    uint64_t index = cluster & ((1ULL << ov->l2_bits) - 1);
+    uint64_t *l2 = NULL, at = 0;
+    size_t n = cs;
+    uint8_t *buf = NULL;
+    int ret = -1;
+
+    // the last cluster of the disk may be partial
+    if (start + n > ov->size) {
+        n = ov->size - start;
+    }
+    buf = obj_pool_alloc(&ov->cow_bufs, cs);
+    if (!buf) {
+        return -1;
+    }
+    // without the lock, nothing to copy if the whole cluster is written
+    if (len < n && pread_full(ov->base_fd, buf, n, start) < 0) {
+        perror("overlay: read the base");
+        goto out;
+    }
+    iov_to_buf(iov, iovcnt, 0, buf + (offset - start), len);
+
+    pthread_mutex_lock(&ov->alloc_lock);
+    // room for the entries of the cluster and of its table
+    while (ov->ndirty + 2 > OVERLAY_DIRTY_MAX) {
+        pthread_mutex_unlock(&ov->alloc_lock);
+        if (overlay_flush(ov) < 0) {
+            goto out;
+        }
+        pthread_mutex_lock(&ov->alloc_lock);
+    }
+    *where = overlay_lookup(ov, offset);
+    if (*where) {
+        ret = 0;
+        goto unlock;
+    }
+    l2 = overlay_get_l2(ov, cluster);
+    if (!l2) {
+        goto unlock;
+    }
+    // in the page cache only, the entry waits for the next flush
+    at = ov->end;
+    if (pwrite_full(ov->fd, buf, n, at) < 0) {
+        perror("overlay: write the delta");
+        goto unlock;
+    }
+    ov->end += cs;
+    ov->dirty[ov->ndirty++] = (struct overlay_entry){
+        .offset = ov->l1[cluster >> ov->l2_bits] + index * sizeof(uint64_t),
+        .value = at,
+    };
+    __atomic_store_n(&l2[index], at, __ATOMIC_RELEASE);
+    ret = 0;
+
+unlock:
+    pthread_mutex_unlock(&ov->alloc_lock);
+out:
+    obj_pool_free(&ov->cow_bufs, buf, cs);
+    return ret;
+}
+
+// Like qcow2: the clusters allocated are durable before the entries
+// pointing to them are written, and those before the flush completes.
+int
+overlay_flush(struct overlay *ov)
+{
+    int n = 0, ret = 0;
+
+    pthread_mutex_lock(&ov->flush_lock);
+    // those of the writes completed so far, the next ones are appended
+    pthread_mutex_lock(&ov->alloc_lock);
+    n = ov->ndirty;
+    pthread_mutex_unlock(&ov->alloc_lock);
+    if (fdatasync(ov->fd) < 0) {
+        ret = -1;
+    }
+    for (int i = 0; i < n && ret == 0; i++) {
+        ret = pwrite_full(ov->fd, &ov->dirty[i].value,
+                          sizeof(ov->dirty[i].value), ov->dirty[i].offset);
+    }
+    if (ret == 0 && n > 0 && fdatasync(ov->fd) < 0) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        // the entries stay for the next flush
+        perror("overlay: flush");
+    } else if (n > 0) {
+        pthread_mutex_lock(&ov->alloc_lock);
+        ov->ndirty -= n;
+        memmove(ov->dirty, ov->dirty + n, ov->ndirty * sizeof(*ov->dirty));
+        pthread_mutex_unlock(&ov->alloc_lock);
+    }
+    pthread_mutex_unlock(&ov->flush_lock);
+    return ret;
+}
+
+ssize_t
+overlay_preadv(struct overlay *ov, const struct iovec *iov, int iovcnt,
+               uint64_t offset)
+{
+    size_t total = iov_size(iov, iovcnt), done = 0, len = 0;
+    struct iovec sub[IOV_MAX];
+    uint64_t where = 0;
+    ssize_t n = 0;
+    int cnt = 0;
+
+    if (iovcnt > IOV_MAX) {
+        return -1;
+    }
+    while (done < total) {
+        len = overlay_extent(ov, offset + done, total - done, &where);
+        cnt = iov_slice(sub, iov, iovcnt, done, len);
+        if (where) {
+            n = preadv(ov->fd, sub, cnt, where);
+        } else {
+            n = preadv(ov->base_fd, sub, cnt, offset + done);
+        }
+        if (n != (ssize_t)len) {
+            return -1;
+        }
+        done += len;
+    }
+    return done;
+}
+
+ssize_t
+overlay_pwritev(struct overlay *ov, const struct iovec *iov, int iovcnt,
+                uint64_t offset)
+{
+    size_t total = iov_size(iov, iovcnt), done = 0, len = 0;
+    struct iovec sub[IOV_MAX];
+    uint64_t where = 0, cs = cluster_size(ov);
+    ssize_t n = 0;
+    int cnt = 0;
+
+    if (iovcnt > IOV_MAX) {
+        return -1;
+    }
+    while (done < total) {
+        len = overlay_extent(ov, offset + done, total - done, &where);
+        if (!where) {
+            // allocate the clusters one at a time
+            len = cs - ((offset + done) & (cs - 1));
+            len = len < total - done ? len : total - done;
+        }
+        cnt = iov_slice(sub, iov, iovcnt, done, len);
+        if (!where) {
+            if (overlay_cow(ov, sub, cnt, offset + done, len, &where) < 0) {
+                return -1;
+            }
+            if (!where) {
+                done += len;
+                continue;
+            }
+            where += (offset + done) & (cs - 1);
+        }
+        n = pwritev(ov->fd, sub, cnt, where);
+        if (n != (ssize_t)len) {
+            return -1;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static int
+overlay_format(struct overlay *ov, const char *delta)
+{
+    struct overlay_header h = {0};
+    uint64_t cs = cluster_size(ov);
+    uint64_t l2_span = cs << ov->l2_bits;
+
+    ov->l1_offset = cs;
+    ov->l1_size = (ov->size + l2_span - 1) / l2_span;
+    memcpy(h.magic, OVERLAY_MAGIC, sizeof(h.magic));
+    h.version = OVERLAY_VERSION;
+    h.cluster_bits = ov->cluster_bits;
+    h.size = ov->size;
+    h.l1_offset = ov->l1_offset;
+    h.l1_size = ov->l1_size;
+    ov->end = ov->l1_offset +
+              (ov->l1_size * sizeof(uint64_t) + cs - 1) / cs * cs;
+    // the L1 table reads as zeroes
+    if (ftruncate(ov->fd, ov->end) < 0 ||
+        pwrite_full(ov->fd, &h, sizeof(h), 0) < 0) {
+        perror(delta);
+        return -1;
+    }
+    ov->l1 = calloc(ov->l1_size, sizeof(*ov->l1));
+    ov->l2 = calloc(ov->l1_size, sizeof(*ov->l2));
+    return ov->l1 && ov->l2 ? 0 : -1;
+}
+
+// Whether the cluster at 'offset' of the delta is after the L1 table,
+// with at least 'len' of it in the file
+static bool
+overlay_valid_cluster(struct overlay *ov, uint64_t offset, uint64_t first,
+                      uint64_t file_size, uint64_t len)
+{
+    uint64_t cs = cluster_size(ov);
+
+    if ((offset & (cs - 1)) != 0 || offset < first ||
+        offset > file_size || file_size - offset < len) {
+        return false;
+    }
+    return true;
+}
+
+static int
+overlay_load(struct overlay *ov, const char *delta, uint64_t file_size)
+{
+    struct overlay_header h = {0};
+    uint64_t cs = 0, l2_span = 0, first = 0;
+
+    if (pread_full(ov->fd, &h, sizeof(h), 0) < 0 ||
+        memcmp(h.magic, OVERLAY_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != OVERLAY_VERSION ||
+        h.cluster_bits < 9 || h.cluster_bits > 21) {
+        fprintf(stderr, "overlay: %s is not a delta\n", delta);
+        return -1;
+    }
+    if (h.size != ov->size) {
+        fprintf(stderr, "overlay: %s was made for a base of %llu bytes\n",
+                delta, (unsigned long long)h.size);
+        return -1;
+    }
+    ov->cluster_bits = h.cluster_bits;
+    ov->l2_bits = h.cluster_bits - 3;
+    ov->l1_offset = h.l1_offset;
+    ov->l1_size = h.l1_size;
+    cs = cluster_size(ov);
+    l2_span = cs << ov->l2_bits;
+    // the L1 table covers the disk, after the header, inside the file
+    first = ov->l1_offset +
+            ((uint64_t)ov->l1_size * sizeof(uint64_t) + cs - 1) / cs * cs;
+    if (ov->l1_size < (ov->size + l2_span - 1) / l2_span ||
+        ov->l1_offset < cs || (ov->l1_offset & (cs - 1)) != 0 ||
+        ov->l1_offset > file_size ||
+        (uint64_t)ov->l1_size * sizeof(uint64_t) > file_size - ov->l1_offset) {
+        fprintf(stderr, "overlay: %s has an invalid L1 table\n", delta);
+        return -1;
+    }
+    // clusters are allocated past the file and all the clusters mapped
+    ov->end = (file_size + cs - 1) / cs * cs;
+    ov->l1 = calloc(ov->l1_size, sizeof(*ov->l1));
+    ov->l2 = calloc(ov->l1_size, sizeof(*ov->l2));
+    if (!ov->l1 || !ov->l2 ||
+        pread_full(ov->fd, ov->l1, ov->l1_size * sizeof(*ov->l1),
+                   ov->l1_offset) < 0) {
+        fprintf(stderr, "overlay: failed to read the L1 table of %s\n",
+                delta);
+        return -1;
+    }
+    for (uint32_t i = 0; i < ov->l1_size; i++) {
+        if (ov->l1[i] == 0) {
+            continue;
+        }
+        if (!overlay_valid_cluster(ov, ov->l1[i], first, file_size, cs)) {
+            goto bad;
+        }
+        ov->l2[i] = malloc(cs);
+        if (!ov->l2[i] || pread_full(ov->fd, ov->l2[i], cs, ov->l1[i]) < 0) {
+            fprintf(stderr, "overlay: failed to read an L2 table of %s\n",
+                    delta);
+            return -1;
+        }
+        for (uint64_t j = 0; j < (1ULL << ov->l2_bits); j++) {
+            // the last data cluster may be partial
+            if (ov->l2[i][j] != 0 &&
+                !overlay_valid_cluster(ov, ov->l2[i][j], first, file_size, 1)) {
+                goto bad;
+            }
+            if (ov->l2[i][j] + cs > ov->end) {
+                ov->end = ov->l2[i][j] + cs;
+            }
+        }
+        if (ov->l1[i] + cs > ov->end) {
+            ov->end = ov->l1[i] + cs;
+        }
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "overlay: %s has a table entry out of the file\n", delta);
+    return -1;
+}
+
+struct overlay *
+overlay_open(const char *base, const char *delta)
+{
+    struct overlay *ov = calloc(1, sizeof(*ov));
+    struct stat st = {0};
+
+    ov->base_fd = -1;
+    ov->fd = -1;
+    ov->cluster_bits = OVERLAY_CLUSTER_BITS;
+    ov->l2_bits = OVERLAY_CLUSTER_BITS - 3;
+    pthread_mutex_init(&ov->alloc_lock, NULL);
+    pthread_mutex_init(&ov->flush_lock, NULL);
+    // shared by the VMs, and so is its host page cache
+    ov->base_fd = open(base, O_RDONLY | O_CLOEXEC);
+    if (ov->base_fd < 0 || fstat(ov->base_fd, &st) < 0) {
+        perror(base);
+        goto fail;
+    }
+    ov->size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(ov->base_fd, BLKGETSIZE64, &ov->size) < 0) {
+        perror(base);
+        goto fail;
+    }
+    ov->fd = open(delta, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ov->fd < 0 || fstat(ov->fd, &st) < 0) {
+        perror(delta);
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        if (overlay_format(ov, delta) < 0) {
+            goto fail;
+        }
+    } else if (overlay_load(ov, delta, st.st_size) < 0) {
+        goto fail;
+    }
+    ov->dirty = malloc(OVERLAY_DIRTY_MAX * sizeof(*ov->dirty));
+    // a cluster per I/O thread, for the writes which copy one
+    if (!ov->dirty ||
+        obj_pool_init(&ov->cow_bufs, cluster_size(ov), 0,
+                      VIRTIO_BLK_IO_THREADS) < 0 ||
+        obj_pool_prealloc(&ov->cow_bufs, VIRTIO_BLK_IO_THREADS) < 0) {
+        fprintf(stderr, "overlay: out of memory\n");
+        goto fail;
+    }
+    return ov;
+
+fail:
+    overlay_close(ov);
+    return NULL;
+}
+
+void
+overlay_close(struct overlay *ov)
+{
+    if (ov->ndirty > 0) {
+        overlay_flush(ov);
+    }
+    if (ov->l2) {
+        for (uint32_t i = 0; i < ov->l1_size; i++) {
+            free(ov->l2[i]);
+        }
+    }
+    free(ov->l2);
+    free(ov->l1);
+    free(ov->dirty);
+    if (ov->fd >= 0) {
+        close(ov->fd);
+    }
+    if (ov->base_fd >= 0) {
+        close(ov->base_fd);
+    }
+    obj_pool_destroy(&ov->cow_bufs);
+    pthread_mutex_destroy(&ov->alloc_lock);
+    pthread_mutex_destroy(&ov->flush_lock);
+    free(ov);
+}
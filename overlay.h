@@ -0,0 +1,81 @@
+#ifndef MVVMM_OVERLAY_H_
+#define MVVMM_OVERLAY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+
+// A copy-on-write disk: a read-only base image, which many VMs can share,
+// and a sparse delta file with the clusters written by this VM. A two
+// level table maps the clusters of the disk to those of the delta, the
+// clusters not mapped are read from the base.
+//
+// The delta starts with a header cluster, then the L1 table. L2 tables
+// and data clusters are appended as they are allocated. A zero entry is
+// not allocated. The entries of the clusters allocated are only written
+// by a flush, once the clusters are durable, so that after a crash no
+// entry points to a cluster which was not written.
+
+#define OVERLAY_MAGIC "MVVMCOW\0"
+#define OVERLAY_VERSION 1
+#define OVERLAY_CLUSTER_BITS 16
+
+struct overlay_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t size;          // of the disk, that of the base
+    uint64_t l1_offset;
+    uint32_t l1_size;       // entries
+    uint32_t reserved;
+};
+
+// A table entry to write, at 'offset' of the delta
+struct overlay_entry {
+    uint64_t offset;
+    uint64_t value;
+};
+
+struct overlay {
+    int base_fd;
+    int fd;                 // the delta
+    uint64_t size;
+    uint32_t cluster_bits;
+    uint32_t l2_bits;       // entries of an L2 table, a cluster of them
+    uint64_t l1_offset;
+    uint32_t l1_size;
+    // in memory copies of the tables, whose entries are read without the
+    // lock. l2[i] is NULL if L1 entry i is zero.
+    uint64_t *l1;
+    uint64_t **l2;
+    pthread_mutex_t alloc_lock;
+    uint64_t end;           // of the delta, where clusters are allocated
+    // the entries of the clusters allocated and not flushed yet, in the
+    // order of the allocations, appended with the allocation lock held
+    struct overlay_entry *dirty;
+    int ndirty;
+    // one flush at a time, which writes the first entries of 'dirty'
+    pthread_mutex_t flush_lock;
+    struct obj_pool cow_bufs;   // the clusters being copied
+};
+
+// Open the delta of the 'base' image, created if it does not exist yet.
+// NULL on failure, e.g. if the delta was made for a base of another size.
+struct overlay *overlay_open(const char *base, const char *delta);
+void overlay_close(struct overlay *ov);
+
+// Like preadv() and pwritev(), thread safe. Writing a cluster for the
+// first time copies the rest of it from the base. Return the bytes done,
+// -1 on failure.
+ssize_t overlay_preadv(struct overlay *ov, const struct iovec *iov,
+                       int iovcnt, uint64_t offset);
+ssize_t overlay_pwritev(struct overlay *ov, const struct iovec *iov,
+                        int iovcnt, uint64_t offset);
+// Make the writes completed so far durable: their clusters, then the
+// entries mapping them. 0 on success, -1 on failure.
+int overlay_flush(struct overlay *ov);
+
+#endif
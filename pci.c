@@ -0,0 +1,384 @@
+#include "pci.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+
+// GSIs below are the pins of the irqchip
+#define PCI_FIRST_MSI_GSI 24
+#define PCI_MAX_GSI 1024
+
+static uint32_t
+config_get(const uint8_t *p, int size)
+{
+    uint32_t val = 0;
+    for (int i = 0; i < size; i++) {
+        val |= (uint32_t)p[i] << (i * 8);
+    }
+    return val;
+}
+
+static int
+routing_add(struct pci_bus *bus, struct kvm_irq_routing_entry *e)
+{
+    struct kvm_irq_routing *r = bus->routing;
+
+    if (r->nr == bus->routing_max) {
+        int max = bus->routing_max * 2;
+        r = realloc(r, sizeof(*r) + max * sizeof(r->entries[0]));
+        if (!r) {
+            return -1;
+        }
+        bus->routing = r;
+        bus->routing_max = max;
+    }
+    r->entries[r->nr++] = *e;
+    return 0;
+}
+
+static int
+routing_commit(struct pci_bus *bus)
+{
+    if (ioctl(bus->vmfd, KVM_SET_GSI_ROUTING, bus->routing) < 0) {
+        perror("KVM_SET_GSI_ROUTING");
+        return -1;
+    }
+    return 0;
+}
+
+// KVM_SET_GSI_ROUTING replaces the whole table, so it starts with what
+// KVM_CREATE_IRQCHIP set up: GSIs 0-15 on both the PICs and the IOAPIC,
+// 16-23 on the IOAPIC only.
+static int
+routing_init(struct pci_bus *bus)
+{
+    struct kvm_irq_routing_entry e = {0};
+
+    bus->routing_max = 64;
+    bus->routing = calloc(1, sizeof(struct kvm_irq_routing) +
+                          bus->routing_max * sizeof(e));
+    if (!bus->routing) {
+        return -1;
+    }
+    for (int gsi = 0; gsi < PCI_FIRST_MSI_GSI; gsi++) {
+        if (gsi < 16) {
+            e = (struct kvm_irq_routing_entry){0};
+            e.gsi = gsi;
+            e.type = KVM_IRQ_ROUTING_IRQCHIP;
+            e.u.irqchip.irqchip = gsi < 8 ? KVM_IRQCHIP_PIC_MASTER
+                                          : KVM_IRQCHIP_PIC_SLAVE;
+            e.u.irqchip.pin = gsi % 8;
+            routing_add(bus, &e);
+        }
+        e = (struct kvm_irq_routing_entry){0};
+        e.gsi = gsi;
+        e.type = KVM_IRQ_ROUTING_IRQCHIP;
+        e.u.irqchip.irqchip = KVM_IRQCHIP_IOAPIC;
+        e.u.irqchip.pin = gsi;
+        routing_add(bus, &e);
+    }
+    bus->next_gsi = PCI_FIRST_MSI_GSI;
+    return 0;
+}
+
+struct pci_bus *
+new_pci_bus(int vmfd, uint64_t mmio_addr, uint64_t mmio_size)
+{
+    struct pci_bus *bus = NULL;
+    uint8_t *c = NULL;
+
+    bus = calloc(1, sizeof(*bus));
+    if (!bus) {
+        return NULL;
+    }
+    bus->vmfd = vmfd;
+    bus->mmio_next = mmio_addr;
+    bus->mmio_end = mmio_addr + mmio_size;
+    pthread_mutex_init(&bus->lock, NULL);
+    if (routing_init(bus) < 0) {
+        free(bus);
+        return NULL;
+    }
+    // 00:00.0, a host bridge is what guests look for to detect the bus
+    c = bus->host_bridge.config;
+    c[PCI_VENDOR_ID] = 0x36;
+    c[PCI_VENDOR_ID + 1] = 0x1b;
+    c[PCI_DEVICE_ID] = 0x08;
+    c[PCI_CLASS_DEVICE] = 0x00;
+    c[PCI_CLASS_DEVICE + 1] = 0x06;
+    if (pci_register_device(bus, &bus->host_bridge) < 0) {
+        delete_pci_bus(bus);
+        return NULL;
+    }
+    return bus;
+}
+
+void
+delete_pci_bus(struct pci_bus *bus)
+{
+    if (!bus) {
+        return;
+    }
+    free(bus->routing);
+    free(bus);
+}
+
+// Decode the BARs according to the command register and the addresses
+// written by the driver.
+static void
+update_mappings(struct pci_device *d, bool enable)
+{
+    uint16_t cmd = config_get(d->config + PCI_COMMAND, 2);
+    uint64_t addr = 0;
+    bool mapped = false;
+
+    for (int i = 0; i < PCI_NUM_BARS; i++) {
+        int reg = PCI_BASE_ADDRESS_0 + i * 4;
+        if (d->bar_size[i] == 0) {
+            continue;
+        }
+        addr = config_get(d->config + reg, 4) & PCI_BASE_ADDRESS_MEM_MASK;
+        if (d->config[reg] & PCI_BASE_ADDRESS_MEM_TYPE_64) {
+            addr |= (uint64_t)config_get(d->config + reg + 4, 4) << 32;
+        }
+        mapped = enable && (cmd & PCI_COMMAND_MEMORY) && addr != 0 &&
+                 addr + d->bar_size[i] > addr;
+        if (mapped == d->bar_mapped[i] && addr == d->bar_addr[i]) {
+            continue;
+        }
+        if (d->bar_mapped[i]) {
+            d->bar_mapped[i] = false;
+            if (d->bar_map) {
+                d->bar_map(d, i, false);
+            }
+        }
+        d->bar_addr[i] = addr;
+        if (mapped) {
+            d->bar_mapped[i] = true;
+            if (d->bar_map) {
+                d->bar_map(d, i, true);
+            }
+        }
+    }
+}
+
+int
+pci_register_device(struct pci_bus *bus, struct pci_device *d)
+{
+    int slot = 0;
+    uint64_t addr = 0;
+
+    for (slot = 0; slot < PCI_MAX_DEVICES; slot++) {
+        if (!bus->devices[slot]) {
+            break;
+        }
+    }
+    if (slot == PCI_MAX_DEVICES) {
+        fprintf(stderr, "pci: no free slot\n");
+        return -1;
+    }
+    d->wmask[PCI_COMMAND] |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    for (int i = 0; i < PCI_NUM_BARS; i++) {
+        int reg = PCI_BASE_ADDRESS_0 + i * 4;
+        uint64_t mask = ~(d->bar_size[i] - 1);
+        if (d->bar_size[i] == 0) {
+            continue;
+        }
+        addr = (bus->mmio_next + d->bar_size[i] - 1) & mask;
+        if (addr + d->bar_size[i] > bus->mmio_end) {
+            fprintf(stderr, "pci: out of MMIO space\n");
+            return -1;
+        }
+        bus->mmio_next = addr + d->bar_size[i];
+        // as if a firmware had placed it
+        d->config[reg] = (d->config[reg] & 0x0f) | (addr & 0xf0);
+        for (int j = 1; j < 4; j++) {
+            d->config[reg + j] = addr >> (j * 8);
+        }
+        d->wmask[reg] = mask & 0xf0;
+        for (int j = 1; j < 4; j++) {
+            d->wmask[reg + j] = mask >> (j * 8);
+        }
+        if (d->config[reg] & PCI_BASE_ADDRESS_MEM_TYPE_64) {
+            for (int j = 0; j < 4; j++) {
+                d->config[reg + 4 + j] = addr >> (32 + j * 8);
+                d->wmask[reg + 4 + j] = mask >> (32 + j * 8);
+            }
+            i++;
+        }
+    }
+    d->slot = slot;
+    bus->devices[slot] = d;
+    return 0;
+}
+
+void
+pci_unregister_device(struct pci_bus *bus, struct pci_device *d)
+{
+    update_mappings(d, false);
+    bus->devices[d->slot] = NULL;
+}
+
+static void
+config_write(struct pci_device *d, uint32_t offset, uint32_t val, int size)
+{
+    bool bars = false;
+
+    for (int i = 0; i < size && offset + i < PCI_CONFIG_SIZE; i++) {
+        uint32_t off = offset + i;
+        uint8_t wmask = d->wmask[off];
+        d->config[off] = (d->config[off] & ~wmask) | ((val >> (i * 8)) & wmask);
+        if (off == PCI_COMMAND ||
+            (off >= PCI_BASE_ADDRESS_0 && off <= PCI_BASE_ADDRESS_5 + 3)) {
+            bars = true;
+        }
+    }
+    if (bars) {
+        update_mappings(d, true);
+    }
+    if (d->config_write) {
+        d->config_write(d, offset, size);
+    }
+}
+
+void
+pci_ioport_access(struct pci_bus *bus, uint16_t port, void *data,
+                  int size, bool is_write)
+{
+    uint8_t *p = data;
+    struct pci_device *d = NULL;
+    uint32_t addr = bus->config_address;
+    uint32_t offset = 0, val = 0;
+    int slot = (addr >> 11) & 0x1f;
+
+    if (port == PCI_CONFIG_ADDRESS && size == 4) {
+        if (is_write) {
+            bus->config_address = config_get(p, 4);
+        } else {
+            for (int i = 0; i < 4; i++) {
+                p[i] = addr >> (i * 8);
+            }
+        }
+        return;
+    }
+    if (port < PCI_CONFIG_DATA) {
+        // only dword accesses select a register
+        if (!is_write) {
+            memset(p, 0xff, size);
+        }
+        return;
+    }
+    offset = (addr & 0xfc) + (port - PCI_CONFIG_DATA);
+    // bus 0, function 0 only
+    if ((addr & 0x80000000) && (addr & 0xff0700) == 0) {
+        d = bus->devices[slot];
+    }
+    if (!d || offset + size > PCI_CONFIG_SIZE) {
+        if (!is_write) {
+            memset(p, 0xff, size);
+        }
+        return;
+    }
+    if (is_write) {
+        config_write(d, offset, config_get(p, size), size);
+    } else {
+        val = config_get(d->config + offset, size);
+        for (int i = 0; i < size; i++) {
+            p[i] = val >> (i * 8);
+        }
+    }
+}
+
+int
+pci_mmio_access(struct pci_bus *bus, uint64_t addr, void *data,
+                int size, bool is_write)
+{
+    uint8_t *p = data;
+    uint32_t val = 0;
+
+    for (int slot = 0; slot < PCI_MAX_DEVICES; slot++) {
+        struct pci_device *d = bus->devices[slot];
+        if (!d) {
+            continue;
+        }
+        for (int i = 0; i < PCI_NUM_BARS; i++) {
+            uint64_t offset = addr - d->bar_addr[i];
+            if (!d->bar_mapped[i] || addr < d->bar_addr[i] ||
+                offset >= d->bar_size[i]) {
+                continue;
+            }
+            // split 64-bit accesses
+            for (int done = 0; done < size; done += 4) {
+                int len = size - done < 4 ? size - done : 4;
+                if (is_write) {
+                    d->bar_write(d, i, offset + done,
+                                 config_get(p + done, len), len);
+                } else {
+                    val = d->bar_read(d, i, offset + done, len);
+                    for (int j = 0; j < len; j++) {
+                        p[done + j] = val >> (j * 8);
+                    }
+                }
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int
+pci_alloc_gsi(struct pci_bus *bus)
+{
+    int gsi = -1;
+
+    pthread_mutex_lock(&bus->lock);
+    if (bus->next_gsi < PCI_MAX_GSI) {
+        gsi = bus->next_gsi++;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return gsi;
+}
+
+static void
+routing_del(struct pci_bus *bus, int gsi)
+{
+    struct kvm_irq_routing *r = bus->routing;
+
+    for (uint32_t i = 0; i < r->nr; i++) {
+        if (r->entries[i].gsi == (uint32_t)gsi) {
+            r->entries[i] = r->entries[--r->nr];
+            return;
+        }
+    }
+}
+
+int
+pci_set_msi_route(struct pci_bus *bus, int gsi, uint64_t addr, uint32_t data)
+{
+    struct kvm_irq_routing_entry e = {0};
+    int ret = -1;
+
+    e.gsi = gsi;
+    e.type = KVM_IRQ_ROUTING_MSI;
+    e.u.msi.address_lo = addr;
+    e.u.msi.address_hi = addr >> 32;
+    e.u.msi.data = data;
+    pthread_mutex_lock(&bus->lock);
+    routing_del(bus, gsi);
+    if (routing_add(bus, &e) == 0) {
+        ret = routing_commit(bus);
+    }
+    pthread_mutex_unlock(&bus->lock);
+    return ret;
+}
+
+void
+pci_remove_msi_route(struct pci_bus *bus, int gsi)
+{
+    pthread_mutex_lock(&bus->lock);
+    routing_del(bus, gsi);
+    routing_commit(bus);
+    pthread_mutex_unlock(&bus->lock);
+}
@@ -0,0 +1,84 @@
+#ifndef MVVMM_PCI_H_
+#define MVVMM_PCI_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/pci_regs.h>
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA    0xcfc
+#define PCI_CONFIG_SIZE    256
+#define PCI_MAX_DEVICES    32
+#define PCI_NUM_BARS       6
+
+struct kvm_irq_routing;
+
+// A single function device on bus 0. The structure is owned by the device
+// and must stay valid until pci_unregister_device() returns.
+struct pci_device {
+    uint8_t config[PCI_CONFIG_SIZE];
+    uint8_t wmask[PCI_CONFIG_SIZE];     // bits the driver may write
+    // Memory BARs, set before registration. The size is a power of 2, 0 if
+    // the BAR is not implemented. For a 64-bit BAR, the next one is unused.
+    uint64_t bar_size[PCI_NUM_BARS];
+    uint32_t (*bar_read)(struct pci_device *d, int bar, uint64_t offset,
+                         int size);
+    void (*bar_write)(struct pci_device *d, int bar, uint64_t offset,
+                      uint32_t val, int size);
+    // Called when a BAR starts or stops being decoded at bar_addr[bar],
+    // may be NULL.
+    void (*bar_map)(struct pci_device *d, int bar, bool mapped);
+    // Called after the driver wrote the config space, may be NULL.
+    void (*config_write)(struct pci_device *d, uint32_t offset, int size);
+    void *opaque;
+
+    // the following is managed by the bus
+    int slot;
+    uint64_t bar_addr[PCI_NUM_BARS];
+    bool bar_mapped[PCI_NUM_BARS];
+};
+
+struct pci_bus {
+    int vmfd;
+    uint32_t config_address;            // last value written to 0xcf8
+    struct pci_device host_bridge;
+    struct pci_device *devices[PCI_MAX_DEVICES];
+    // where the BARs are placed
+    uint64_t mmio_next;
+    uint64_t mmio_end;
+    // The GSI routing table of the VM: the default routes of the irqchip
+    // and the MSI routes of the devices.
+    pthread_mutex_t lock;
+    struct kvm_irq_routing *routing;
+    int routing_max;
+    int next_gsi;
+};
+
+// Create bus 0 with a host bridge. The BARs are given addresses in
+// [mmio_addr, mmio_addr + mmio_size).
+struct pci_bus *new_pci_bus(int vmfd, uint64_t mmio_addr, uint64_t mmio_size);
+void delete_pci_bus(struct pci_bus *bus);
+
+// Put the device in the first free slot and assign addresses to its BARs.
+int pci_register_device(struct pci_bus *bus, struct pci_device *d);
+void pci_unregister_device(struct pci_bus *bus, struct pci_device *d);
+
+// Configuration mechanism #1, for the ports 0xcf8-0xcff
+void pci_ioport_access(struct pci_bus *bus, uint16_t port, void *data,
+                       int size, bool is_write);
+
+// Return 0 if 'addr' is in a BAR, -1 otherwise.
+int pci_mmio_access(struct pci_bus *bus, uint64_t addr, void *data,
+                    int size, bool is_write);
+
+// Reserve a GSI for an MSI, -1 if none is left.
+int pci_alloc_gsi(struct pci_bus *bus);
+
+// Route an MSI GSI to the given message. An irqfd attached to the GSI
+// then injects the message directly.
+int pci_set_msi_route(struct pci_bus *bus, int gsi, uint64_t addr,
+                      uint32_t data);
+void pci_remove_msi_route(struct pci_bus *bus, int gsi);
+
+#endif
@@ -0,0 +1,191 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+static void *
+pool_heap_alloc(size_t size, size_t align)
+{
+    void *obj = NULL;
+
+    if (align == 0) {
+        return malloc(size ? size : 1);
+    }
+    if (posix_memalign(&obj, align, size ? size : 1) != 0) {
+        return NULL;
+    }
+    return obj;
+}
+
+int
+obj_pool_init(struct obj_pool *p, size_t size, size_t align, int max)
+{
+    *p = (struct obj_pool){0};
+    p->free = calloc(max > 0 ? max : 1, sizeof(*p->free));
+    if (!p->free) {
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    p->size = size;
+    p->align = align;
+    p->max = max;
+    return 0;
+}
+
+void
+obj_pool_destroy(struct obj_pool *p)
+{
+    // the lock stays, for the objects still out
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->nfree; i++) {
+        free(p->free[i]);
+    }
+    free(p->free);
+    p->free = NULL;
+    p->nfree = 0;
+    p->max = 0;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int
+obj_pool_prealloc(struct obj_pool *p, int n)
+{
+    void *obj = NULL;
+    int ret = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->nfree < n && p->nfree < p->max) {
+        obj = pool_heap_alloc(p->size, p->align);
+        if (!obj) {
+            ret = -1;
+            break;
+        }
+        p->free[p->nfree++] = obj;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+void *
+obj_pool_alloc(struct obj_pool *p, size_t size)
+{
+    void *obj = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    if (size <= p->size && p->nfree > 0) {
+        obj = p->free[--p->nfree];
+        p->stats.hits++;
+    } else {
+        p->stats.misses++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (obj) {
+        return obj;
+    }
+    // of the size of the pool, to be kept once given back
+    return pool_heap_alloc(size > p->size ? size : p->size, p->align);
+}
+
+void
+obj_pool_free(struct obj_pool *p, void *obj, size_t size)
+{
+    if (!obj) {
+        return;
+    }
+    if (size <= p->size) {
+        pthread_mutex_lock(&p->lock);
+        if (p->nfree < p->max) {
+            p->free[p->nfree++] = obj;
+            obj = NULL;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(obj);
+}
+
+void
+obj_pool_get_stats(struct obj_pool *p, struct pool_stats *st)
+{
+    pthread_mutex_lock(&p->lock);
+    *st = p->stats;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int
+buf_pool_init(struct buf_pool *p, int max)
+{
+    for (int i = 0; i < POOL_BUF_CLASSES; i++) {
+        if (obj_pool_init(&p->classes[i], POOL_BUF_MIN << i, POOL_BUF_MIN,
+                          max) < 0) {
+            while (i-- > 0) {
+                obj_pool_destroy(&p->classes[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+buf_pool_destroy(struct buf_pool *p)
+{
+    for (int i = 0; i < POOL_BUF_CLASSES; i++) {
+        obj_pool_destroy(&p->classes[i]);
+    }
+}
+
+// The smallest class for 'size', the largest one for those above it
+static struct obj_pool *
+buf_pool_class(struct buf_pool *p, size_t size)
+{
+    int i = 0;
+
+    while (i < POOL_BUF_CLASSES - 1 && (POOL_BUF_MIN << i) < size) {
+        i++;
+    }
+    return &p->classes[i];
+}
+
+int
+buf_pool_prealloc(struct buf_pool *p, size_t size, int n)
+{
+    return obj_pool_prealloc(buf_pool_class(p, size), n);
+}
+
+void *
+buf_pool_alloc(struct buf_pool *p, size_t size)
+{
+    return obj_pool_alloc(buf_pool_class(p, size), size);
+}
+
+void
+buf_pool_free(struct buf_pool *p, void *buf, size_t size)
+{
+    obj_pool_free(buf_pool_class(p, size), buf, size);
+}
+
+void
+buf_pool_get_stats(struct buf_pool *p, struct pool_stats *st)
+{
+    struct pool_stats cst = {0};
+
+    *st = (struct pool_stats){0};
+    for (int i = 0; i < POOL_BUF_CLASSES; i++) {
+        obj_pool_get_stats(&p->classes[i], &cst);
+        st->hits += cst.hits;
+        st->misses += cst.misses;
+    }
+}
+
+void
+pool_print_stats(const struct pool_stats *st, const char *name,
+                 const char *what, FILE *f)
+{
+    uint64_t allocs = st->hits + st->misses;
+
+    if (allocs == 0) {
+        return;
+    }
+    fprintf(f, "%s %s: %" PRIu64 "/%" PRIu64 " from the pool (%.2f%%)\n",
+            name, what, st->hits, allocs, 100.0 * st->hits / allocs);
+}
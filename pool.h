@@ -0,0 +1,70 @@
+#ifndef MVVMM_POOL_H_
+#define MVVMM_POOL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Free lists for the memory of each request, so that once they are warm
+// the requests are served without going to the heap. Objects given back
+// are kept for the next request, up to a bound, and only freed with the
+// pool. Thread safe.
+
+struct pool_stats {
+    uint64_t hits;      // allocations served from the pool
+    uint64_t misses;    // those which went to the heap
+};
+
+// Objects of a fixed size, e.g. the state of a request
+struct obj_pool {
+    pthread_mutex_t lock;
+    size_t size;
+    size_t align;       // 0 for that of malloc()
+    void **free;        // the objects kept, 'max' at most
+    int nfree;
+    int max;
+    struct pool_stats stats;
+};
+
+// Page aligned buffers, in power of two sizes from POOL_BUF_MIN to
+// POOL_BUF_MAX. Larger ones come from the heap.
+#define POOL_BUF_MIN_SHIFT 12
+#define POOL_BUF_MAX_SHIFT 20
+#define POOL_BUF_CLASSES (POOL_BUF_MAX_SHIFT - POOL_BUF_MIN_SHIFT + 1)
+#define POOL_BUF_MIN (1UL << POOL_BUF_MIN_SHIFT)
+#define POOL_BUF_MAX (1UL << POOL_BUF_MAX_SHIFT)
+
+struct buf_pool {
+    struct obj_pool classes[POOL_BUF_CLASSES];
+};
+
+// Keep up to 'max' objects of 'size' bytes aligned to 'align', 0 for
+// any. -1 on failure.
+int obj_pool_init(struct obj_pool *p, size_t size, size_t align, int max);
+// Free the objects kept. Those given back afterwards go to the heap.
+void obj_pool_destroy(struct obj_pool *p);
+// Allocate 'n' objects up front, up to the bound, so that the first
+// requests do not go to the heap either. -1 on failure.
+int obj_pool_prealloc(struct obj_pool *p, int n);
+// An object of 'size' bytes, not zeroed. Those larger than the objects
+// of the pool come from the heap. NULL on failure.
+void *obj_pool_alloc(struct obj_pool *p, size_t size);
+// Give back an object of obj_pool_alloc(), 'size' is the one asked for
+void obj_pool_free(struct obj_pool *p, void *obj, size_t size);
+void obj_pool_get_stats(struct obj_pool *p, struct pool_stats *st);
+
+// Keep up to 'max' buffers of each size
+int buf_pool_init(struct buf_pool *p, int max);
+void buf_pool_destroy(struct buf_pool *p);
+// 'n' buffers of the size class of 'size'
+int buf_pool_prealloc(struct buf_pool *p, size_t size, int n);
+void *buf_pool_alloc(struct buf_pool *p, size_t size);
+void buf_pool_free(struct buf_pool *p, void *buf, size_t size);
+void buf_pool_get_stats(struct buf_pool *p, struct pool_stats *st);
+
+// "NAME WHAT: HITS/ALLOCS from the pool (P%)", nothing if no allocation
+void pool_print_stats(const struct pool_stats *st, const char *name,
+                      const char *what, FILE *f);
+
+#endif
@@ -5,10 +5,12 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <linux/kvm.h>
 #include <linux/kvm_para.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 
 #include "mvvm.h"
 
@@ -78,24 +80,22 @@ void serial_init(struct serial *self, int vmfd) {
     self->vm_fd = vmfd;
     clear_intr(self);
     pthread_mutex_init(&self->rx_lock, NULL);
-    pthread_cond_init(&self->rx_cond, NULL);
+    self->rx_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->rx_event_fd < 0) {
+        perror("serial_init: eventfd");
+    }
 }
 
 static inline void write_reg(struct serial *self, int offset, uint8_t data) {
     self->regs[offset] = data;
 }
 
-void write_to_serial(struct mvvm *vm, char c) {
+int write_to_serial(struct mvvm *vm, char c) {
     struct serial *serial = &vm->serial;
+    int ret = -1;
     pthread_mutex_lock(&serial->rx_lock);
-    while (!is_rx_empty(serial)) {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 3;
-        int ret = pthread_cond_timedwait(&serial->rx_cond, &serial->rx_lock, &ts);
-        if (ret == ETIMEDOUT) {
-            goto end;
-        }
+    if (!is_rx_empty(serial)) {
+        goto end;
     }
     serial->regs[0] = c;
     if (is_rx_intr_enabled(serial)) {
@@ -103,8 +103,10 @@ void write_to_serial(struct mvvm *vm, char c) {
         set_irq(vm->vm_fd);
     }
     set_data_ready(serial);
+    ret = 0;
 end:
     pthread_mutex_unlock(&serial->rx_lock);
+    return ret;
 }
 
 static uint8_t read_reg(struct serial *self, int offset) {
@@ -121,8 +123,11 @@ static uint8_t read_reg(struct serial *self, int offset) {
     }
     if (offset == 0) {
         uint8_t ret = self->regs[0];
+        uint64_t val = 1;
         clear_data_ready(self);
-        pthread_cond_signal(&self->rx_cond);
+        if (self->rx_event_fd >= 0) {
+            write(self->rx_event_fd, &val, sizeof(val));
+        }
         return ret;
     }
     return self->regs[offset];
@@ -165,5 +170,7 @@ void handle_serial(struct mvvm *vm, struct kvm_run *run) {
 
 void serial_destroy(struct serial *self) {
     pthread_mutex_destroy(&self->rx_lock);
-    pthread_cond_destroy(&self->rx_cond);
+    if (self->rx_event_fd >= 0) {
+        close(self->rx_event_fd);
+    }
 }
\ No newline at end of file
@@ -8,7 +8,7 @@ struct serial {
     uint8_t regs[8];
     uint8_t dl[2];
     pthread_mutex_t rx_lock;
-    pthread_cond_t rx_cond;
+    int rx_event_fd; // eventfd, written when the guest reads a character
     int vm_fd;
 };
 struct kvm_run;
@@ -16,7 +16,9 @@ struct mvvm;
 
 void serial_init(struct serial *self, int vmfd);
 void handle_serial(struct mvvm *vm, struct kvm_run *run);
-void write_to_serial(struct mvvm *vm, char c);
+// Return -1 if the guest has not read the previous character yet, wait
+// for rx_event_fd then.
+int write_to_serial(struct mvvm *vm, char c);
 void serial_destroy(struct serial *self);
 
 #endif
\ No newline at end of file
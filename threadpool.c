@@ -1,62 +1,86 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
 
-#include <bits/pthreadtypes.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
-void *worker_thread_fn(void* arg)
+static void *
+worker_thread_fn(void *arg)
 {
-    struct worker_thread *worker = arg;
-    pthread_mutex_lock(&worker->lock);
+    struct thread_pool *pool = arg;
+    struct thread_pool_task task = {0};
+    int prio = 0;
+
+    pthread_mutex_lock(&pool->lock);
     while (1) {
-        while (worker->task_fn == NULL) {
-            if (worker->pool->quit && worker->task_fn == NULL) {
-                pthread_mutex_unlock(&worker->pool->lock);
-                return NULL;
-            }
-            struct timespec ts = {0};
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += 300000LL;
-            pthread_cond_timedwait(&worker->cond, &worker->lock, &ts);
+        while (pool->count == 0 && !pool->quit) {
+            pool->idle++;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            pool->idle--;
+        }
+        if (pool->count == 0) {
+            // quit, and nothing left to run
+            break;
+        }
+        for (prio = 0; pool->len[prio] == 0; prio++) {
         }
-        worker->task_fn(worker->arg);
-        worker->task_fn = NULL;
-        worker->arg = NULL;
-        pthread_mutex_lock(&worker->pool->lock);
-        worker->pool->is_working[worker->id] = false;
-        pthread_mutex_unlock(&worker->pool->lock);
+        task = pool->tasks[prio][pool->head[prio]];
+        pool->head[prio] = (pool->head[prio] + 1) % pool->capacity;
+        pool->len[prio]--;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+        task.fn(task.arg);
+        pthread_mutex_lock(&pool->lock);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-static struct worker_thread *
-new_worker_thread(struct thread_pool *pool, int id)
+static void
+pin_worker(pthread_t th, int id, int cpu)
 {
-    struct worker_thread *worker = malloc(sizeof(struct worker_thread));
-    *worker = (struct worker_thread){0};
-    pthread_mutex_init(&worker->lock, NULL);
-    pthread_cond_init(&worker->cond, NULL);
-    worker->pool = pool;
-    worker->id = id;
-    pthread_create(&worker->th, NULL, worker_thread_fn, worker);
-    return worker;
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "thread_pool: invalid cpu %d\n", cpu);
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(th, sizeof(set), &set) != 0) {
+        fprintf(stderr, "thread_pool: failed to pin worker %d to cpu %d\n",
+                id, cpu);
+    }
 }
 
 struct thread_pool*
-new_thread_pool(int thread_num)
+new_thread_pool(int thread_num, int capacity, const int *cpus, int cpu_num)
 {
-    struct thread_pool *pool = malloc(sizeof(struct thread_pool));
-    memset(pool, 0, sizeof(struct thread_pool));
+    struct thread_pool *pool = calloc(1, sizeof(*pool));
+
     pthread_mutex_init(&pool->lock, NULL);
-    pool->quit = 0;
-    pool->worker_num = thread_num;
-    pool->workers = malloc(sizeof(struct worker_thread*) * pool->worker_num);
-    memset(pool->workers, 0, sizeof(struct worker_thread*) * pool->worker_num);
-    pool->is_working = malloc(sizeof(bool) * pool->worker_num);
-    memset(pool->is_working, 0, sizeof(bool) * pool->worker_num);
-    for (int i = 0; i < pool->worker_num; i++) {
-        pool->workers[i] = new_worker_thread(pool, i);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->capacity = capacity;
+    // each priority may have all of the tasks
+    for (int i = 0; i < THREAD_POOL_PRIOS; i++) {
+        pool->tasks[i] = calloc(capacity, sizeof(*pool->tasks[i]));
+    }
+    pool->threads = calloc(thread_num, sizeof(*pool->threads));
+    for (int i = 0; i < thread_num; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_thread_fn,
+                           pool) != 0) {
+            fprintf(stderr, "thread_pool: failed to start worker %d\n", i);
+            delete_thread_pool(pool);
+            return NULL;
+        }
+        pool->worker_num++;
+        if (cpus) {
+            pin_worker(pool->threads[i], i, cpus[i % cpu_num]);
+        }
     }
     return pool;
 }
@@ -64,36 +88,51 @@ new_thread_pool(int thread_num)
 int
 thread_pool_run(struct thread_pool *self, void* (*task_fn)(void*), void *arg)
 {
+    return thread_pool_run_prio(self, task_fn, arg, THREAD_POOL_PRIO_DEFAULT);
+}
+
+int
+thread_pool_run_prio(struct thread_pool *self, void* (*task_fn)(void*),
+                     void *arg, int prio)
+{
+    struct thread_pool_task *task = NULL;
+
     pthread_mutex_lock(&self->lock);
-    for (int i = 0; i < self->worker_num; i++) {
-        if (!self->is_working[i]) {
-            self->is_working[i] = true;
-            pthread_mutex_unlock(&self->lock);
-            struct worker_thread *worker = self->workers[i];
-            pthread_mutex_lock(&worker->lock);
-            if (self->quit) {
-                pthread_mutex_unlock(&worker->lock);
-                return -1;
-            }
-            worker->task_fn = task_fn;
-            worker->arg = arg;
-            pthread_cond_signal(&worker->cond);
-            pthread_mutex_unlock(&worker->lock);
-            return 0;
-        }
+    if (self->quit) {
+        pthread_mutex_unlock(&self->lock);
+        return -1;
+    }
+    if (self->count == self->capacity) {
+        pthread_mutex_unlock(&self->lock);
+        return -EAGAIN;
+    }
+    task = &self->tasks[prio][(self->head[prio] + self->len[prio]) %
+                              self->capacity];
+    task->fn = task_fn;
+    task->arg = arg;
+    self->len[prio]++;
+    self->count++;
+    // busy workers pick the task up when they are done
+    if (self->idle > 0) {
+        pthread_cond_signal(&self->cond);
     }
     pthread_mutex_unlock(&self->lock);
-    return -1;
+    return 0;
 }
 
 void delete_thread_pool(struct thread_pool* pool) {
-    pool->quit = 1;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
     for (int i = 0; i < pool->worker_num; i++) {
-        void *ret;
-        pthread_join(pool->workers[i]->th, &ret);
-        free(pool->workers[i]);
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    for (int i = 0; i < THREAD_POOL_PRIOS; i++) {
+        free(pool->tasks[i]);
     }
-    free(pool->workers);
-    free(pool->is_working);
     free(pool);
-}
\ No newline at end of file
+}
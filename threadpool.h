@@ -4,30 +4,47 @@
 #include <stdbool.h>
 #include <pthread.h>
 
-struct thread_pool {
-    struct worker_thread **workers;
-    bool *is_working;
-    int worker_num;
-    pthread_mutex_t lock;
-    int quit;
+struct thread_pool_task {
+    void* (*fn)(void*);
+    void *arg;
 };
 
-struct worker_thread {
-    void* (*task_fn)(void*);
-    void *arg;
-    pthread_t th;
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
+// priorities of the tasks, those of priority 0 run first
+#define THREAD_POOL_PRIOS 3
+#define THREAD_POOL_PRIO_DEFAULT 1
 
-    struct thread_pool *pool;
-    int id;
+// Workers taking tasks from a bounded queue, shared by all the producers
+// and workers. Idle workers sleep until a task comes in.
+struct thread_pool {
+    pthread_t *threads;
+    int worker_num;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a task was queued, or quit
+    int idle;                   // workers waiting on 'cond'
+    bool quit;
+    // a ring of queued tasks per priority, 'count' in all of them
+    struct thread_pool_task *tasks[THREAD_POOL_PRIOS];
+    int capacity;
+    int head[THREAD_POOL_PRIOS];
+    int len[THREAD_POOL_PRIOS];
+    int count;
 };
 
-struct thread_pool* new_thread_pool(int thread_num);
+// Start 'thread_num' workers, with up to 'capacity' tasks waiting for them.
+// If 'cpus' is not NULL, worker i is pinned to cpus[i % cpu_num].
+struct thread_pool *new_thread_pool(int thread_num, int capacity,
+                                    const int *cpus, int cpu_num);
 
+// Queue a task. Return -EAGAIN if the queue is full, the caller retries
+// once one of its tasks completed, or -1 if the pool is being deleted.
 int
 thread_pool_run(struct thread_pool *self, void* (*task_fn)(void*), void *arg);
+// The same, the task runs before those of a larger 'prio'
+int
+thread_pool_run_prio(struct thread_pool *self, void* (*task_fn)(void*),
+                     void *arg, int prio);
 
+// Run the tasks still queued, then stop the workers
 void delete_thread_pool(struct thread_pool *self);
 
-#endif
\ No newline at end of file
+#endif
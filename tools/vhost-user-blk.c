@@ -0,0 +1,663 @@
+// A small vhost-user-blk backend, to test the vhost-user frontend of mvvmm
+// and to serve a disk from a process of its own.
+//
+//     tools/vhost-user-blk [-p] SOCKET DISK
+//     ./mvvmm ... -d vhost-user:SOCKET
+//
+// One frontend at a time, split rings only, the requests are served
+// synchronously. With -p, the rings are polled and the driver does not
+// kick at all.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ring.h>
+
+#include "../iov.h"
+#include "../vhostuser.h"
+
+#define SECTOR_SIZE 512
+#define MAX_VRINGS  8
+#define MAX_SEGS    1024
+
+#define BACKEND_FEATURES ((1ULL << VIRTIO_F_VERSION_1) | \
+                          (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | \
+                          (1ULL << VIRTIO_RING_F_EVENT_IDX) | \
+                          (1ULL << VIRTIO_BLK_F_FLUSH) | \
+                          (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+
+struct vq {
+    unsigned int num;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t last_avail_idx;
+    int kick_fd;            // the ring runs once it has one
+    int call_fd;
+    bool enabled;
+};
+
+struct region {
+    uint64_t gpa;
+    uint64_t uaddr;         // in the frontend
+    uint64_t size;
+    uint8_t *host;
+    void *mmap_addr;
+    size_t mmap_size;
+};
+
+struct backend {
+    int disk_fd;
+    uint64_t sectors;
+    bool poll;
+    bool event_idx;
+    int nregions;
+    struct region regions[VHOST_USER_MAX_REGIONS];
+    struct vq vq[MAX_VRINGS];
+};
+
+static void *
+gpa_to_host(struct backend *b, uint64_t gpa, uint64_t len)
+{
+    for (int i = 0; i < b->nregions; i++) {
+        struct region *r = &b->regions[i];
+        if (gpa >= r->gpa && len <= r->size && gpa - r->gpa <= r->size - len) {
+            return r->host + (gpa - r->gpa);
+        }
+    }
+    return NULL;
+}
+
+static void *
+uaddr_to_host(struct backend *b, uint64_t uaddr, uint64_t len)
+{
+    for (int i = 0; i < b->nregions; i++) {
+        struct region *r = &b->regions[i];
+        if (uaddr >= r->uaddr && len <= r->size &&
+            uaddr - r->uaddr <= r->size - len) {
+            return r->host + (uaddr - r->uaddr);
+        }
+    }
+    return NULL;
+}
+
+static void
+unmap_regions(struct backend *b)
+{
+    for (int i = 0; i < b->nregions; i++) {
+        munmap(b->regions[i].mmap_addr, b->regions[i].mmap_size);
+    }
+    b->nregions = 0;
+}
+
+static void
+vring_stop(struct vq *vq)
+{
+    if (vq->kick_fd >= 0) {
+        close(vq->kick_fd);
+    }
+    vq->kick_fd = -1;
+}
+
+static void
+vring_reset(struct vq *vq)
+{
+    vring_stop(vq);
+    if (vq->call_fd >= 0) {
+        close(vq->call_fd);
+    }
+    *vq = (struct vq){.kick_fd = -1, .call_fd = -1};
+}
+
+static bool
+vring_running(struct vq *vq)
+{
+    return vq->kick_fd >= 0 && vq->enabled && vq->desc;
+}
+
+struct request {
+    struct iovec out[MAX_SEGS];
+    struct iovec in[MAX_SEGS];
+    int out_num;
+    int in_num;
+    size_t out_len;
+    size_t in_len;
+};
+
+static int
+map_desc(struct backend *b, struct request *req, struct vring_desc *d)
+{
+    void *addr = gpa_to_host(b, d->addr, d->len);
+
+    if (!addr || req->out_num + req->in_num >= MAX_SEGS) {
+        return -1;
+    }
+    if (d->flags & VRING_DESC_F_WRITE) {
+        req->in[req->in_num].iov_base = addr;
+        req->in[req->in_num++].iov_len = d->len;
+        req->in_len += d->len;
+    } else {
+        // the readable buffers come first
+        if (req->in_num > 0) {
+            return -1;
+        }
+        req->out[req->out_num].iov_base = addr;
+        req->out[req->out_num++].iov_len = d->len;
+        req->out_len += d->len;
+    }
+    return 0;
+}
+
+// Map the descriptor chain starting at 'head'
+static int
+map_chain(struct backend *b, struct vq *vq, uint16_t head,
+          struct request *req)
+{
+    struct vring_desc *table = vq->desc;
+    unsigned int num = vq->num;
+    unsigned int i = head, count = 0;
+
+    req->out_num = req->in_num = 0;
+    req->out_len = req->in_len = 0;
+    if (table[i].flags & VRING_DESC_F_INDIRECT) {
+        if (table[i].len % sizeof(struct vring_desc) != 0) {
+            return -1;
+        }
+        num = table[i].len / sizeof(struct vring_desc);
+        table = gpa_to_host(b, table[i].addr, table[i].len);
+        if (!table) {
+            return -1;
+        }
+        i = 0;
+    }
+    for (;;) {
+        if (i >= num || ++count > num || map_desc(b, req, &table[i]) < 0) {
+            return -1;
+        }
+        if (!(table[i].flags & VRING_DESC_F_NEXT)) {
+            return 0;
+        }
+        i = table[i].next;
+    }
+}
+
+// Serve the request, return the bytes written to the driver buffers
+static uint32_t
+handle_request(struct backend *b, struct request *req)
+{
+    static const char id[VIRTIO_BLK_ID_BYTES] = "vhost-user-blk";
+    struct virtio_blk_outhdr h = {0};
+    struct iovec iov[MAX_SEGS];
+    uint8_t status = VIRTIO_BLK_S_OK;
+    size_t len = 0;
+    int iovcnt = 0;
+    ssize_t n = 0;
+
+    if (req->in_len < 1 ||
+        iov_to_buf(req->out, req->out_num, 0, &h, sizeof(h)) < sizeof(h)) {
+        fprintf(stderr, "vhost-user-blk: invalid request\n");
+        return 0;
+    }
+    switch (h.type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        if (h.type == VIRTIO_BLK_T_IN) {
+            len = req->in_len - 1;
+            iovcnt = iov_slice(iov, req->in, req->in_num, 0, len);
+        } else {
+            len = req->out_len - sizeof(h);
+            iovcnt = iov_slice(iov, req->out, req->out_num, sizeof(h), len);
+        }
+        if (len % SECTOR_SIZE != 0 || h.sector > b->sectors ||
+            len / SECTOR_SIZE > b->sectors - h.sector) {
+            status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        if (h.type == VIRTIO_BLK_T_IN) {
+            n = preadv(b->disk_fd, iov, iovcnt, h.sector * SECTOR_SIZE);
+        } else {
+            n = pwritev(b->disk_fd, iov, iovcnt, h.sector * SECTOR_SIZE);
+        }
+        if (n < 0 || (size_t)n != len) {
+            status = VIRTIO_BLK_S_IOERR;
+        }
+        if (h.type == VIRTIO_BLK_T_OUT) {
+            len = 0;
+        }
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        if (fdatasync(b->disk_fd) < 0) {
+            status = VIRTIO_BLK_S_IOERR;
+        }
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        len = req->in_len - 1;
+        if (len > VIRTIO_BLK_ID_BYTES) {
+            len = VIRTIO_BLK_ID_BYTES;
+        }
+        iov_from_buf(req->in, req->in_num, 0, id, len);
+        break;
+    default:
+        status = VIRTIO_BLK_S_UNSUPP;
+        len = 0;
+        break;
+    }
+    if (status != VIRTIO_BLK_S_OK) {
+        len = 0;
+    }
+    // the status is the last byte of the writable buffers
+    iov_from_buf(req->in, req->in_num, req->in_len - 1, &status, 1);
+    return len + 1;
+}
+
+static uint16_t *
+avail_event(struct vq *vq)
+{
+    return (uint16_t *)&vq->used->ring[vq->num];
+}
+
+static uint16_t
+used_event(struct vq *vq)
+{
+    return vq->avail->ring[vq->num];
+}
+
+// Ask for a kick when the driver adds buffers, and check once more for
+// buffers added in the meantime
+static bool
+vring_enable_notification(struct backend *b, struct vq *vq)
+{
+    uint16_t idx = vq->last_avail_idx;
+
+    if (b->event_idx) {
+        *avail_event(vq) = idx;
+    } else {
+        vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    return *(volatile uint16_t *)&vq->avail->idx == idx;
+}
+
+static void
+vring_notify(struct backend *b, struct vq *vq, uint16_t old_used)
+{
+    bool notify = false;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (b->event_idx) {
+        notify = vring_need_event(used_event(vq), vq->used->idx, old_used);
+    } else {
+        notify = !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    if (notify && vq->call_fd >= 0) {
+        eventfd_write(vq->call_fd, 1);
+    }
+}
+
+// Serve the available buffers, return whether there were any
+static bool
+process_vring(struct backend *b, struct vq *vq)
+{
+    static struct request req;
+    uint16_t old_used = vq->used->idx;
+    uint16_t used_idx = old_used;
+    uint16_t avail_idx = 0;
+
+    for (;;) {
+        avail_idx = *(volatile uint16_t *)&vq->avail->idx;
+        if (avail_idx == vq->last_avail_idx) {
+            // when polling, the driver does not have to kick
+            if (b->poll || vring_enable_notification(b, vq)) {
+                break;
+            }
+            continue;
+        }
+        if (!b->event_idx) {
+            vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        while (vq->last_avail_idx != avail_idx) {
+            uint16_t head = vq->avail->ring[vq->last_avail_idx % vq->num];
+            struct vring_used_elem *e = &vq->used->ring[used_idx % vq->num];
+            uint32_t len = 0;
+
+            vq->last_avail_idx++;
+            if (head >= vq->num || map_chain(b, vq, head, &req) < 0) {
+                fprintf(stderr, "vhost-user-blk: invalid descriptor chain\n");
+            } else {
+                len = handle_request(b, &req);
+            }
+            e->id = head;
+            e->len = len;
+            used_idx++;
+        }
+        atomic_thread_fence(memory_order_release);
+        vq->used->idx = used_idx;
+    }
+    if (used_idx == old_used) {
+        return false;
+    }
+    vring_notify(b, vq, old_used);
+    return true;
+}
+
+static int
+set_mem_table(struct backend *b, struct vhost_user_memory m, int *fds,
+              int nfds)
+{
+    unmap_regions(b);
+    if (m.nregions > VHOST_USER_MAX_REGIONS || (int)m.nregions != nfds) {
+        fprintf(stderr, "vhost-user-blk: bad memory table\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < m.nregions; i++) {
+        struct region *r = &b->regions[i];
+        r->gpa = m.regions[i].guest_phys_addr;
+        r->uaddr = m.regions[i].userspace_addr;
+        r->size = m.regions[i].memory_size;
+        r->mmap_size = m.regions[i].mmap_offset + r->size;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fds[i], 0);
+        if (r->mmap_addr == MAP_FAILED) {
+            perror("vhost-user-blk: mmap");
+            return -1;
+        }
+        r->host = (uint8_t *)r->mmap_addr + m.regions[i].mmap_offset;
+        b->nregions++;
+    }
+    return 0;
+}
+
+static int
+set_vring_addr(struct backend *b, struct vhost_user_vring_addr a)
+{
+    struct vq *vq = &b->vq[a.index];
+
+    vq->desc = uaddr_to_host(b, a.desc, vq->num * sizeof(struct vring_desc));
+    vq->avail = uaddr_to_host(b, a.avail, 6 + 2 * vq->num);
+    vq->used = uaddr_to_host(b, a.used, 6 + 8 * vq->num);
+    if (!vq->desc || !vq->avail || !vq->used) {
+        fprintf(stderr, "vhost-user-blk: ring %u outside guest memory\n",
+                a.index);
+        vq->desc = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static struct vhost_user_config
+get_config(struct backend *b, struct vhost_user_config c)
+{
+    struct virtio_blk_config config = {0};
+
+    config.capacity = b->sectors;
+    if (c.size > sizeof(c.region)) {
+        c.size = sizeof(c.region);
+    }
+    memset(c.region, 0, c.size);
+    if (c.offset < sizeof(config)) {
+        size_t n = sizeof(config) - c.offset;
+        memcpy(c.region, (uint8_t *)&config + c.offset,
+               n < c.size ? n : c.size);
+    }
+    return c;
+}
+
+// Handle one message of the frontend, -1 if it went away
+static int
+handle_message(struct backend *b, int sock)
+{
+    struct vhost_user_msg msg = {0};
+    int fds[VHOST_USER_MAX_REGIONS];
+    int nfds = 0, used_fds = 0, ret = 0;
+    bool reply = false;
+    uint32_t idx = 0;
+
+    if (vhost_user_recv(sock, &msg, fds, VHOST_USER_MAX_REGIONS, &nfds) < 0) {
+        return -1;
+    }
+    switch (msg.request) {
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE:
+        idx = msg.payload.state.index;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        idx = msg.payload.addr.index;
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+        idx = msg.payload.u64 & VHOST_USER_VRING_IDX_MASK;
+        break;
+    }
+    if (idx >= MAX_VRINGS) {
+        fprintf(stderr, "vhost-user-blk: ring %u out of range\n", idx);
+        ret = -1;
+        goto out;
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        msg.payload.u64 = BACKEND_FEATURES;
+        msg.size = sizeof(msg.payload.u64);
+        reply = true;
+        break;
+    case VHOST_USER_SET_FEATURES:
+        b->event_idx = msg.payload.u64 & (1ULL << VIRTIO_RING_F_EVENT_IDX);
+        break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg.payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_CONFIG;
+        msg.size = sizeof(msg.payload.u64);
+        reply = true;
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        // the mappings stay when the fds are closed
+        ret = set_mem_table(b, msg.payload.memory, fds, nfds);
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+        if (msg.payload.state.num == 0 || msg.payload.state.num > 32768 ||
+            (msg.payload.state.num & (msg.payload.state.num - 1))) {
+            ret = -1;
+            break;
+        }
+        b->vq[idx].num = msg.payload.state.num;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        ret = set_vring_addr(b, msg.payload.addr);
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        b->vq[idx].last_avail_idx = msg.payload.state.num;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        vring_stop(&b->vq[idx]);
+        msg.payload.state.num = b->vq[idx].last_avail_idx;
+        msg.size = sizeof(msg.payload.state);
+        reply = true;
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+        if (!(msg.payload.u64 & VHOST_USER_VRING_NOFD) && nfds < 1) {
+            ret = -1;
+            break;
+        }
+        if (msg.request == VHOST_USER_SET_VRING_KICK) {
+            vring_stop(&b->vq[idx]);
+        } else if (b->vq[idx].call_fd >= 0) {
+            close(b->vq[idx].call_fd);
+            b->vq[idx].call_fd = -1;
+        }
+        if (msg.payload.u64 & VHOST_USER_VRING_NOFD) {
+            break;
+        }
+        used_fds = 1;
+        if (msg.request == VHOST_USER_SET_VRING_KICK) {
+            b->vq[idx].kick_fd = fds[0];
+        } else {
+            b->vq[idx].call_fd = fds[0];
+        }
+        break;
+    case VHOST_USER_SET_VRING_ENABLE:
+        b->vq[idx].enabled = msg.payload.state.num;
+        break;
+    case VHOST_USER_GET_CONFIG:
+        msg.payload.config = get_config(b, msg.payload.config);
+        msg.size = offsetof(struct vhost_user_config, region) +
+                   msg.payload.config.size;
+        reply = true;
+        break;
+    default:
+        fprintf(stderr, "vhost-user-blk: unsupported request %u\n",
+                msg.request);
+        break;
+    }
+out:
+    for (int i = used_fds; i < nfds; i++) {
+        close(fds[i]);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    if (reply) {
+        msg.flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+        return vhost_user_send(sock, &msg, NULL, 0);
+    }
+    return 0;
+}
+
+// Serve a frontend until it disconnects
+static void
+serve(struct backend *b, int sock)
+{
+    struct pollfd pfd[1 + MAX_VRINGS];
+    int vq_of[1 + MAX_VRINGS];
+    uint64_t val = 0;
+    int n = 0;
+
+    for (int i = 0; i < MAX_VRINGS; i++) {
+        b->vq[i] = (struct vq){.kick_fd = -1, .call_fd = -1};
+    }
+    for (;;) {
+        n = 0;
+        pfd[n++] = (struct pollfd){.fd = sock, .events = POLLIN};
+        for (int i = 0; i < MAX_VRINGS && !b->poll; i++) {
+            if (vring_running(&b->vq[i])) {
+                vq_of[n] = i;
+                pfd[n++] = (struct pollfd){
+                    .fd = b->vq[i].kick_fd,
+                    .events = POLLIN,
+                };
+            }
+        }
+        if (poll(pfd, n, b->poll ? 0 : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("vhost-user-blk: poll");
+            break;
+        }
+        if (pfd[0].revents) {
+            if (handle_message(b, sock) < 0) {
+                break;
+            }
+            // the rings may have changed
+            continue;
+        }
+        for (int i = 1; i < n; i++) {
+            if (pfd[i].revents & POLLIN) {
+                read(pfd[i].fd, &val, sizeof(val));
+                process_vring(b, &b->vq[vq_of[i]]);
+            }
+        }
+        for (int i = 0; i < MAX_VRINGS && b->poll; i++) {
+            if (vring_running(&b->vq[i])) {
+                process_vring(b, &b->vq[i]);
+            }
+        }
+    }
+    for (int i = 0; i < MAX_VRINGS; i++) {
+        vring_reset(&b->vq[i]);
+    }
+    unmap_regions(b);
+}
+
+static void
+print_usage(FILE *f, const char *prog)
+{
+    fprintf(f, "usage: %s [-p] SOCKET DISK\n", prog);
+    fprintf(f, "  -p    poll the rings instead of waiting for kicks\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct backend b = {0};
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st = {0};
+    int opt = 0, listen_fd = -1, sock = -1;
+
+    while ((opt = getopt(argc, argv, "ph")) != -1) {
+        switch (opt) {
+        case 'p':
+            b.poll = true;
+            break;
+        case 'h':
+            print_usage(stdout, argv[0]);
+            return 0;
+        default:
+            print_usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+        print_usage(stderr, argv[0]);
+        return 1;
+    }
+    b.disk_fd = open(argv[optind + 1], O_RDWR);
+    if (b.disk_fd < 0 || fstat(b.disk_fd, &st) < 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    b.sectors = st.st_size / SECTOR_SIZE;
+
+    strcpy(addr.sun_path, argv[optind]);
+    unlink(addr.sun_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0) {
+        perror(addr.sun_path);
+        return 1;
+    }
+    for (;;) {
+        sock = accept(listen_fd, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("vhost-user-blk: accept");
+            return 1;
+        }
+        serve(&b, sock);
+        close(sock);
+    }
+}
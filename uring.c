@@ -0,0 +1,231 @@
+#include "uring.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+               unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int
+uring_init(struct uring *r, unsigned entries, bool sqpoll)
+{
+    struct io_uring_params p = {0};
+    unsigned *sq_array = NULL;
+    uint8_t *sq = NULL, *cq = NULL;
+
+    *r = (struct uring){.fd = -1};
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;    // ms before the kernel thread sleeps
+    }
+    r->fd = io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sqpoll = sqpoll;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    sq = r->sq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    r->sq_tail_local = *r->sq_tail;
+
+    cq = r->cq_ring;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    perror("io_uring mmap");
+    uring_destroy(r);
+    return -1;
+}
+
+void
+uring_destroy(struct uring *r)
+{
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    *r = (struct uring){.fd = -1};
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe = NULL;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sq_tail_local - head >= r->entries) {
+        return NULL;
+    }
+    sqe = &r->sqes[r->sq_tail_local & *r->sq_mask];
+    r->sq_tail_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int
+uring_submit(struct uring *r)
+{
+    unsigned pending = 0;
+    int ret = 0;
+
+    // the sqes must be visible before the tail
+    __atomic_store_n(r->sq_tail, r->sq_tail_local, __ATOMIC_RELEASE);
+    if (r->sqpoll) {
+        // the kernel thread went to sleep, wake it up
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) &
+            IORING_SQ_NEED_WAKEUP) {
+            io_uring_enter(r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return 0;
+    }
+    pending = r->sq_tail_local -
+              __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    while (pending > 0) {
+        ret = io_uring_enter(r->fd, pending, 0, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            // EAGAIN or EBUSY, the sqes stay in the ring
+            return errno == EAGAIN || errno == EBUSY ? 0 : -1;
+        }
+        pending -= ret;
+    }
+    return 0;
+}
+
+int
+uring_wait(struct uring *r)
+{
+    int ret = 0;
+
+    do {
+        ret = io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+uring_register_eventfd(struct uring *r, int efd)
+{
+    if (io_uring_register(r->fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        perror("io_uring: register eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+int
+uring_register_files(struct uring *r, const int *fds, int nfds)
+{
+    if (io_uring_register(r->fd, IORING_REGISTER_FILES, fds, nfds) < 0) {
+        perror("io_uring: register files");
+        return -1;
+    }
+    return 0;
+}
+
+int
+uring_register_buffers(struct uring *r, const struct iovec *iov, int iovcnt)
+{
+    if (io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, iovcnt) < 0) {
+        perror("io_uring: register buffers");
+        return -1;
+    }
+    return 0;
+}
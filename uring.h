@@ -0,0 +1,65 @@
+#ifndef MVVMM_URING_H_
+#define MVVMM_URING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring without liburing: the rings shared with the kernel
+// and the system calls around them. Not thread safe, the caller serializes
+// the submission side and the completion side.
+struct uring {
+    int fd;
+    unsigned entries;
+    bool sqpoll;
+    // submission ring, slot i of the ring always holds sqe i
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    struct io_uring_sqe *sqes;
+    unsigned sq_tail_local;     // includes the sqes not submitted yet
+    // completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // the mappings, cq_ring may be sq_ring
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// Create a ring of 'entries' submissions. With 'sqpoll', a kernel thread
+// picks the submissions up without system calls. Return -1 and print why
+// on failure, e.g. if the kernel has no io_uring.
+int uring_init(struct uring *r, unsigned entries, bool sqpoll);
+void uring_destroy(struct uring *r);
+
+// A zeroed sqe to fill in, NULL if the ring is full
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+// Hand the sqes got so far to the kernel. Return -1 on failure, the sqes
+// are then submitted with the next call.
+int uring_submit(struct uring *r);
+
+// Wait for at least one completion
+int uring_wait(struct uring *r);
+
+// The next completion, NULL if there is none. uring_cqe_seen() frees it.
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+// Signal 'efd' when completions are posted
+int uring_register_eventfd(struct uring *r, int efd);
+// The sqes refer to fds[i] as i with IOSQE_FIXED_FILE
+int uring_register_files(struct uring *r, const int *fds, int nfds);
+// READ_FIXED and WRITE_FIXED refer to iov[i] as buf_index i. The memory
+// is pinned.
+int uring_register_buffers(struct uring *r, const struct iovec *iov,
+                           int iovcnt);
+
+#endif
@@ -0,0 +1,161 @@
+#include "vhost.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/vhost.h>
+
+int
+vhost_open(const char *path, void *host_mem, uint64_t size,
+           uint64_t *features)
+{
+    struct vhost_memory *mem = NULL;
+    int fd = -1;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (ioctl(fd, VHOST_SET_OWNER) < 0) {
+        perror("VHOST_SET_OWNER");
+        goto fail;
+    }
+    if (ioctl(fd, VHOST_GET_FEATURES, features) < 0) {
+        perror("VHOST_GET_FEATURES");
+        goto fail;
+    }
+    mem = calloc(1, sizeof(*mem) + sizeof(mem->regions[0]));
+    if (!mem) {
+        goto fail;
+    }
+    mem->nregions = 1;
+    mem->regions[0].guest_phys_addr = 0;
+    mem->regions[0].memory_size = size;
+    mem->regions[0].userspace_addr = (uintptr_t)host_mem;
+    if (ioctl(fd, VHOST_SET_MEM_TABLE, mem) < 0) {
+        perror("VHOST_SET_MEM_TABLE");
+        goto fail;
+    }
+    free(mem);
+    return fd;
+
+fail:
+    free(mem);
+    close(fd);
+    return -1;
+}
+
+static int
+vhost_set_features(int fd, uint64_t features)
+{
+    if (ioctl(fd, VHOST_SET_FEATURES, &features) < 0) {
+        perror("VHOST_SET_FEATURES");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+vhost_set_vring(int fd, int idx, int num, uint16_t base, void *desc,
+                void *avail, void *used, int kick_fd)
+{
+    struct vhost_vring_state state = {0};
+    struct vhost_vring_addr addr = {0};
+    struct vhost_vring_file kick = {0};
+
+    state.index = idx;
+    state.num = num;
+    if (ioctl(fd, VHOST_SET_VRING_NUM, &state) < 0) {
+        perror("VHOST_SET_VRING_NUM");
+        return -1;
+    }
+    state.num = base;
+    if (ioctl(fd, VHOST_SET_VRING_BASE, &state) < 0) {
+        perror("VHOST_SET_VRING_BASE");
+        return -1;
+    }
+    addr.index = idx;
+    addr.desc_user_addr = (uintptr_t)desc;
+    addr.avail_user_addr = (uintptr_t)avail;
+    addr.used_user_addr = (uintptr_t)used;
+    if (ioctl(fd, VHOST_SET_VRING_ADDR, &addr) < 0) {
+        perror("VHOST_SET_VRING_ADDR");
+        return -1;
+    }
+    kick.index = idx;
+    kick.fd = kick_fd;
+    if (ioctl(fd, VHOST_SET_VRING_KICK, &kick) < 0) {
+        perror("VHOST_SET_VRING_KICK");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+vhost_set_vring_call(int fd, int idx, int call_fd)
+{
+    struct vhost_vring_file call = {.index = idx, .fd = call_fd};
+
+    if (ioctl(fd, VHOST_SET_VRING_CALL, &call) < 0) {
+        perror("VHOST_SET_VRING_CALL");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+vhost_get_vring_base(int fd, int idx, uint16_t *base)
+{
+    struct vhost_vring_state state = {.index = idx};
+
+    if (ioctl(fd, VHOST_GET_VRING_BASE, &state) < 0) {
+        perror("VHOST_GET_VRING_BASE");
+        return -1;
+    }
+    *base = state.num;
+    return 0;
+}
+
+const struct vhost_ops vhost_kernel_ops = {
+    .set_features = vhost_set_features,
+    .set_vring = vhost_set_vring,
+    .set_vring_call = vhost_set_vring_call,
+    .get_vring_base = vhost_get_vring_base,
+};
+
+int
+vhost_net_set_backend(int fd, int idx, int tap_fd)
+{
+    struct vhost_vring_file backend = {.index = idx, .fd = tap_fd};
+
+    if (ioctl(fd, VHOST_NET_SET_BACKEND, &backend) < 0) {
+        perror("VHOST_NET_SET_BACKEND");
+        return -1;
+    }
+    return 0;
+}
+
+int
+vhost_vsock_set_guest_cid(int fd, uint64_t cid)
+{
+    if (ioctl(fd, VHOST_VSOCK_SET_GUEST_CID, &cid) < 0) {
+        perror("VHOST_VSOCK_SET_GUEST_CID");
+        return -1;
+    }
+    return 0;
+}
+
+int
+vhost_vsock_set_running(int fd, bool running)
+{
+    int val = running;
+
+    if (ioctl(fd, VHOST_VSOCK_SET_RUNNING, &val) < 0) {
+        perror("VHOST_VSOCK_SET_RUNNING");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef MVVMM_VHOST_H_
+#define MVVMM_VHOST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A vhost backend: a driver of the host kernel (/dev/vhost-net...) or a
+// vhost-user process, see vhostuser.h. The calls return -1 and print why
+// on failure.
+struct vhost_ops {
+    int (*set_features)(int fd, uint64_t features);
+    // Start queue 'idx', a split ring at the given host addresses, at
+    // avail index 'base'. The driver kicks it through 'kick_fd'.
+    int (*set_vring)(int fd, int idx, int num, uint16_t base, void *desc,
+                     void *avail, void *used, int kick_fd);
+    // The eventfd signalled when the queue has used buffers.
+    int (*set_vring_call)(int fd, int idx, int call_fd);
+    // Stop queue 'idx' and return where it stopped in '*base'.
+    int (*get_vring_base)(int fd, int idx, uint16_t *base);
+};
+
+extern const struct vhost_ops vhost_kernel_ops;
+
+// Open 'path' and become its owner. Guest memory is the single mapping
+// of 'size' bytes at 'host_mem'. Return the fd, which supports 'features'.
+int vhost_open(const char *path, void *host_mem, uint64_t size,
+               uint64_t *features);
+
+// vhost-net: the tap device of queue 'idx', -1 to detach it.
+int vhost_net_set_backend(int fd, int idx, int tap_fd);
+
+// vhost-vsock: the address of the guest, and whether the rings are served.
+int vhost_vsock_set_guest_cid(int fd, uint64_t cid);
+int vhost_vsock_set_running(int fd, bool running);
+
+// VHOST_NET_F_VIRTIO_NET_HDR: vhost-net adds and strips the virtio-net
+// header itself, for a tap device without IFF_VNET_HDR.
+#define VHOST_NET_F_HDR (1ULL << 27)
+
+#endif
@@ -0,0 +1,343 @@
+#include "vhostuser.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int
+vhost_user_send(int sock, struct vhost_user_msg *msg, const int *fds,
+                int nfds)
+{
+    char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE + msg->size,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg = NULL;
+    ssize_t n = 0;
+
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    do {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)iov.iov_len) {
+        perror("vhost-user: sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+read_full(int sock, void *buf, size_t len)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = read(sock, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+int
+vhost_user_recv(int sock, struct vhost_user_msg *msg, int *fds,
+                int max_fds, int *nfds)
+{
+    char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = NULL;
+    ssize_t n = 0;
+    int count = 0;
+
+    *nfds = 0;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != VHOST_USER_HDR_SIZE) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd = ((int *)CMSG_DATA(cmsg))[i];
+            if (*nfds < max_fds) {
+                fds[(*nfds)++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    if (msg->size > sizeof(msg->payload)) {
+        fprintf(stderr, "vhost-user: message %u too large\n", msg->request);
+        return -1;
+    }
+    return read_full(sock, &msg->payload, msg->size);
+}
+
+// Send a request and wait for its reply if 'reply' is not NULL
+static int
+request(int sock, struct vhost_user_msg *msg, const int *fds, int nfds,
+        struct vhost_user_msg *reply)
+{
+    int nrfds = 0;
+
+    msg->flags = VHOST_USER_VERSION;
+    if (vhost_user_send(sock, msg, fds, nfds) < 0) {
+        return -1;
+    }
+    if (!reply) {
+        return 0;
+    }
+    if (vhost_user_recv(sock, reply, NULL, 0, &nrfds) < 0 ||
+        reply->request != msg->request ||
+        !(reply->flags & VHOST_USER_REPLY)) {
+        fprintf(stderr, "vhost-user: bad reply to request %u\n",
+                msg->request);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+get_u64(int sock, uint32_t req, uint64_t *val)
+{
+    struct vhost_user_msg msg = {.request = req};
+    struct vhost_user_msg reply = {0};
+
+    if (request(sock, &msg, NULL, 0, &reply) < 0 ||
+        reply.size != sizeof(reply.payload.u64)) {
+        return -1;
+    }
+    *val = reply.payload.u64;
+    return 0;
+}
+
+static int
+set_u64(int sock, uint32_t req, uint64_t val)
+{
+    struct vhost_user_msg msg = {.request = req};
+
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = val;
+    return request(sock, &msg, NULL, 0, NULL);
+}
+
+static int
+set_state(int sock, uint32_t req, int idx, uint32_t num)
+{
+    struct vhost_user_msg msg = {.request = req};
+
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = idx;
+    msg.payload.state.num = num;
+    return request(sock, &msg, NULL, 0, NULL);
+}
+
+static int
+set_vring_fd(int sock, uint32_t req, int idx, int fd)
+{
+    struct vhost_user_msg msg = {.request = req};
+
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = idx & VHOST_USER_VRING_IDX_MASK;
+    if (fd < 0) {
+        msg.payload.u64 |= VHOST_USER_VRING_NOFD;
+        return request(sock, &msg, NULL, 0, NULL);
+    }
+    return request(sock, &msg, &fd, 1, NULL);
+}
+
+int
+vhost_user_connect(const char *path, void *host_mem, uint64_t size,
+                   int mem_fd, uint64_t protocol, uint64_t *features)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct vhost_user_msg msg = {0};
+    uint64_t supported = 0;
+    int sock = -1;
+
+    if (mem_fd < 0) {
+        fprintf(stderr, "vhost-user: guest memory cannot be shared\n");
+        return -1;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vhost-user: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("vhost-user: socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        goto fail;
+    }
+    msg.request = VHOST_USER_SET_OWNER;
+    if (request(sock, &msg, NULL, 0, NULL) < 0 ||
+        get_u64(sock, VHOST_USER_GET_FEATURES, features) < 0) {
+        goto fail;
+    }
+    // needed to enable the rings explicitly
+    if (!(*features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) ||
+        get_u64(sock, VHOST_USER_GET_PROTOCOL_FEATURES, &supported) < 0 ||
+        (supported & protocol) != protocol) {
+        fprintf(stderr, "vhost-user: %s lacks protocol features\n", path);
+        goto fail;
+    }
+    if (set_u64(sock, VHOST_USER_SET_PROTOCOL_FEATURES, protocol) < 0) {
+        goto fail;
+    }
+
+    msg = (struct vhost_user_msg){.request = VHOST_USER_SET_MEM_TABLE};
+    msg.size = offsetof(struct vhost_user_memory, regions[1]);
+    msg.payload.memory.nregions = 1;
+    msg.payload.memory.regions[0].guest_phys_addr = 0;
+    msg.payload.memory.regions[0].memory_size = size;
+    msg.payload.memory.regions[0].userspace_addr = (uintptr_t)host_mem;
+    msg.payload.memory.regions[0].mmap_offset = 0;
+    if (request(sock, &msg, &mem_fd, 1, NULL) < 0) {
+        goto fail;
+    }
+    return sock;
+
+fail:
+    close(sock);
+    return -1;
+}
+
+static int
+vhost_user_set_features(int sock, uint64_t features)
+{
+    return set_u64(sock, VHOST_USER_SET_FEATURES, features);
+}
+
+static int
+vhost_user_set_vring(int sock, int idx, int num, uint16_t base, void *desc,
+                     void *avail, void *used, int kick_fd)
+{
+    struct vhost_user_msg msg = {.request = VHOST_USER_SET_VRING_ADDR};
+
+    if (set_state(sock, VHOST_USER_SET_VRING_NUM, idx, num) < 0 ||
+        set_state(sock, VHOST_USER_SET_VRING_BASE, idx, base) < 0) {
+        return -1;
+    }
+    msg.size = sizeof(msg.payload.addr);
+    msg.payload.addr.index = idx;
+    msg.payload.addr.desc = (uintptr_t)desc;
+    msg.payload.addr.avail = (uintptr_t)avail;
+    msg.payload.addr.used = (uintptr_t)used;
+    if (request(sock, &msg, NULL, 0, NULL) < 0) {
+        return -1;
+    }
+    return set_vring_fd(sock, VHOST_USER_SET_VRING_KICK, idx, kick_fd);
+}
+
+static int
+vhost_user_set_vring_call(int sock, int idx, int call_fd)
+{
+    return set_vring_fd(sock, VHOST_USER_SET_VRING_CALL, idx, call_fd);
+}
+
+static int
+vhost_user_get_vring_base(int sock, int idx, uint16_t *base)
+{
+    struct vhost_user_msg msg = {.request = VHOST_USER_GET_VRING_BASE};
+    struct vhost_user_msg reply = {0};
+
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = idx;
+    if (request(sock, &msg, NULL, 0, &reply) < 0) {
+        return -1;
+    }
+    *base = reply.payload.state.num;
+    return 0;
+}
+
+const struct vhost_ops vhost_user_ops = {
+    .set_features = vhost_user_set_features,
+    .set_vring = vhost_user_set_vring,
+    .set_vring_call = vhost_user_set_vring_call,
+    .get_vring_base = vhost_user_get_vring_base,
+};
+
+int
+vhost_user_set_vring_enable(int sock, int idx, bool enable)
+{
+    return set_state(sock, VHOST_USER_SET_VRING_ENABLE, idx, enable);
+}
+
+int
+vhost_user_get_config(int sock, void *buf, uint32_t size)
+{
+    struct vhost_user_msg msg = {.request = VHOST_USER_GET_CONFIG};
+    struct vhost_user_msg reply = {0};
+
+    if (size > VHOST_USER_MAX_CONFIG) {
+        return -1;
+    }
+    msg.size = offsetof(struct vhost_user_config, region) + size;
+    msg.payload.config.size = size;
+    if (request(sock, &msg, NULL, 0, &reply) < 0 ||
+        reply.payload.config.size != size) {
+        fprintf(stderr, "vhost-user: failed to read the config space\n");
+        return -1;
+    }
+    memcpy(buf, reply.payload.config.region, size);
+    return 0;
+}
+
+int
+vhost_user_set_backend_req_fd(int sock, int fd)
+{
+    struct vhost_user_msg msg = {.request = VHOST_USER_SET_BACKEND_REQ_FD};
+
+    return request(sock, &msg, &fd, 1, NULL);
+}
+
+int
+vhost_user_reply(int sock, struct vhost_user_msg *msg, uint64_t ret)
+{
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+    msg->size = sizeof(msg->payload.u64);
+    msg->payload.u64 = ret;
+    return vhost_user_send(sock, msg, NULL, 0);
+}
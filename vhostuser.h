@@ -0,0 +1,142 @@
+#ifndef MVVMM_VHOSTUSER_H_
+#define MVVMM_VHOSTUSER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vhost.h"
+
+// The vhost-user protocol: the vhost ioctls as messages on a Unix socket,
+// with the fds (guest memory, eventfds) passed along. Only what mvvmm and
+// tools/vhost-user-blk use is defined.
+
+#define VHOST_USER_GET_FEATURES          1
+#define VHOST_USER_SET_FEATURES          2
+#define VHOST_USER_SET_OWNER             3
+#define VHOST_USER_SET_MEM_TABLE         5
+#define VHOST_USER_SET_VRING_NUM         8
+#define VHOST_USER_SET_VRING_ADDR        9
+#define VHOST_USER_SET_VRING_BASE        10
+#define VHOST_USER_GET_VRING_BASE        11
+#define VHOST_USER_SET_VRING_KICK        12
+#define VHOST_USER_SET_VRING_CALL        13
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_SET_VRING_ENABLE      18
+#define VHOST_USER_SET_BACKEND_REQ_FD    21
+#define VHOST_USER_GET_CONFIG            24
+
+// requests of the backend, on the socket passed with SET_BACKEND_REQ_FD
+#define VHOST_USER_BACKEND_FS_MAP        6
+#define VHOST_USER_BACKEND_FS_UNMAP      7
+
+#define VHOST_USER_VERSION    1
+#define VHOST_USER_REPLY      (1 << 2)
+#define VHOST_USER_NEED_REPLY (1 << 3)
+
+// in the features, announces the protocol features
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK        3
+#define VHOST_USER_PROTOCOL_F_BACKEND_REQ      5
+#define VHOST_USER_PROTOCOL_F_CONFIG           9
+#define VHOST_USER_PROTOCOL_F_BACKEND_SEND_FD  10
+
+// in SET_VRING_KICK/CALL, the low byte is the queue index
+#define VHOST_USER_VRING_IDX_MASK 0xff
+#define VHOST_USER_VRING_NOFD     (1 << 8)
+
+#define VHOST_USER_MAX_REGIONS 8
+#define VHOST_USER_MAX_CONFIG  256
+
+struct vhost_user_vring_state {
+    uint32_t index;
+    uint32_t num;
+};
+
+// the addresses are in the frontend address space, see the memory table
+struct vhost_user_vring_addr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc;
+    uint64_t used;
+    uint64_t avail;
+    uint64_t log;
+};
+
+struct vhost_user_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;   // in the fd passed for the region
+};
+
+struct vhost_user_memory {
+    uint32_t nregions;
+    uint32_t padding;
+    struct vhost_user_region regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG];
+};
+
+// virtio-fs: map ranges of the fd passed along into the DAX window, or
+// unmap them (a 'len' of ~0 is the whole window)
+#define VHOST_USER_FS_ENTRIES 8
+#define VHOST_USER_FS_FLAG_MAP_R (1 << 0)
+#define VHOST_USER_FS_FLAG_MAP_W (1 << 1)
+
+struct vhost_user_fs_map {
+    uint64_t fd_offset[VHOST_USER_FS_ENTRIES];
+    uint64_t cache_offset[VHOST_USER_FS_ENTRIES];
+    uint64_t len[VHOST_USER_FS_ENTRIES];
+    uint64_t flags[VHOST_USER_FS_ENTRIES];
+};
+
+struct vhost_user_msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;          // of the payload
+    union {
+        uint64_t u64;
+        struct vhost_user_vring_state state;
+        struct vhost_user_vring_addr addr;
+        struct vhost_user_memory memory;
+        struct vhost_user_config config;
+        struct vhost_user_fs_map fs_map;
+    } payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE 12
+
+// Send 'msg' with 'nfds' fds, receive a message and up to 'max_fds' fds.
+// Both return -1 on failure or when the peer went away.
+int vhost_user_send(int sock, struct vhost_user_msg *msg, const int *fds,
+                    int nfds);
+int vhost_user_recv(int sock, struct vhost_user_msg *msg, int *fds,
+                    int max_fds, int *nfds);
+
+// The frontend side. Connect to the backend at 'path' and share guest
+// memory, the 'size' bytes of 'mem_fd' mapped at 'host_mem'. The
+// backend must support the 'protocol' features, which are acked. Return
+// the socket, whose backend supports 'features'.
+int vhost_user_connect(const char *path, void *host_mem, uint64_t size,
+                       int mem_fd, uint64_t protocol, uint64_t *features);
+
+extern const struct vhost_ops vhost_user_ops;
+
+int vhost_user_set_vring_enable(int sock, int idx, bool enable);
+
+// Read 'size' bytes of the device config space, needs PROTOCOL_F_CONFIG
+int vhost_user_get_config(int sock, void *buf, uint32_t size);
+
+// Let the backend send requests on 'fd', needs PROTOCOL_F_BACKEND_REQ
+int vhost_user_set_backend_req_fd(int sock, int fd);
+
+// Answer a request of the backend which asked for a reply
+int vhost_user_reply(int sock, struct vhost_user_msg *msg, uint64_t ret);
+
+#endif
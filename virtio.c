@@ -32,13 +32,27 @@
 #include <stdarg.h>
 #include <stdatomic.h>
 #include <linux/kvm.h>
+#include <linux/ioprio.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <poll.h>
 #include <errno.h>
+#include <time.h>
 
 #include "virtio.h"
+#include "iothread.h"
+#include "pci.h"
+#include "vhost.h"
+#include "vhostuser.h"
+#include "threadpool.h"
+#include "pool.h"
+#include "iov.h"
 #include "config.h"
 #include "mvvm.h"
 
@@ -65,26 +79,94 @@
 #define VIRTIO_MMIO_QUEUE_AVAIL_HIGH	0x094
 #define VIRTIO_MMIO_QUEUE_USED_LOW	    0x0a0
 #define VIRTIO_MMIO_QUEUE_USED_HIGH	    0x0a4
+#define VIRTIO_MMIO_SHM_SEL		        0x0ac
+#define VIRTIO_MMIO_SHM_LEN_LOW		    0x0b0
+#define VIRTIO_MMIO_SHM_LEN_HIGH	    0x0b4
+#define VIRTIO_MMIO_SHM_BASE_LOW	    0x0b8
+#define VIRTIO_MMIO_SHM_BASE_HIGH	    0x0bc
 #define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc
 #define VIRTIO_MMIO_CONFIG		        0x100
 
-#define MAX_QUEUE 2
+/* PCI transport, the modern interface of virtio 1.0 */
+#define VIRTIO_PCI_VENDOR_ID            0x1af4
+#define VIRTIO_PCI_DEVICE_ID_BASE       0x1040
+
+#define VIRTIO_PCI_CAP_COMMON_CFG       1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG       2
+#define VIRTIO_PCI_CAP_ISR_CFG          3
+#define VIRTIO_PCI_CAP_DEVICE_CFG       4
+
+#define VIRTIO_PCI_COMMON_DFSELECT      0
+#define VIRTIO_PCI_COMMON_DF            4
+#define VIRTIO_PCI_COMMON_GFSELECT      8
+#define VIRTIO_PCI_COMMON_GF            12
+#define VIRTIO_PCI_COMMON_MSIX          16
+#define VIRTIO_PCI_COMMON_NUMQ          18
+#define VIRTIO_PCI_COMMON_STATUS        20
+#define VIRTIO_PCI_COMMON_CFGGENERATION 21
+#define VIRTIO_PCI_COMMON_Q_SELECT      22
+#define VIRTIO_PCI_COMMON_Q_SIZE        24
+#define VIRTIO_PCI_COMMON_Q_MSIX        26
+#define VIRTIO_PCI_COMMON_Q_ENABLE      28
+#define VIRTIO_PCI_COMMON_Q_NOFF        30
+#define VIRTIO_PCI_COMMON_Q_DESCLO      32
+#define VIRTIO_PCI_COMMON_Q_DESCHI      36
+#define VIRTIO_PCI_COMMON_Q_AVAILLO     40
+#define VIRTIO_PCI_COMMON_Q_AVAILHI     44
+#define VIRTIO_PCI_COMMON_Q_USEDLO      48
+#define VIRTIO_PCI_COMMON_Q_USEDHI      52
+#define VIRTIO_PCI_COMMON_SIZE          56
+
+/* everything is in BAR 0 */
+#define VIRTIO_PCI_COMMON_OFFSET        0x0000
+#define VIRTIO_PCI_ISR_OFFSET           0x1000
+#define VIRTIO_PCI_DEVICE_OFFSET        0x2000
+#define VIRTIO_PCI_NOTIFY_OFFSET        0x3000
+#define VIRTIO_PCI_NOTIFY_MULTIPLIER    4
+#define VIRTIO_PCI_MSIX_TABLE_OFFSET    0x4000
+#define VIRTIO_PCI_MSIX_PBA_OFFSET      0x5000
+#define VIRTIO_PCI_BAR_SIZE             0x8000
+
+/* capabilities in the config space */
+#define VIRTIO_PCI_CAP_OFFSET           0x40
+#define VIRTIO_PCI_CAP_LEN              16
+#define VIRTIO_PCI_NOTIFY_CAP_LEN       20
+#define VIRTIO_PCI_MSIX_CAP_OFFSET      0x84
+
+#define VIRTIO_MSI_NO_VECTOR            0xffff
+
+#define MAX_QUEUE 3
 #define MAX_CONFIG_SPACE_SIZE 256
+/* one per queue and one for configuration changes */
+#define VIRTIO_PCI_MSIX_VECTORS (MAX_QUEUE + 1)
+#define VIRTQUEUE_MAX_SEGS 1024
+/* the elements of up to this many buffers are kept for reuse */
+#define VIRTQUEUE_POOL_SEGS 32
 
-struct queue_state {
-    uint32_t ready; /* 0 or 1 */
-    uint32_t num;
-    uint16_t last_avail_idx;
-    virtio_phys_addr_t desc_addr;
-    virtio_phys_addr_t avail_addr;
-    virtio_phys_addr_t used_addr;
-    bool manual_recv; /* if true, the device_recv() callback is not called */
-};
+#define VIRTIO_CONFIG_S_DRIVER_OK   0x04
+#define VIRTIO_CONFIG_S_NEEDS_RESET 0x40
+
+/* feature bits common to all devices */
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1      32
+#define VIRTIO_F_RING_PACKED    34
 
 #define VRING_DESC_F_NEXT	1
 #define VRING_DESC_F_WRITE	2
 #define VRING_DESC_F_INDIRECT	4
 
+#define VRING_USED_F_NO_NOTIFY	1
+
+/* packed ring descriptor flags */
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+/* packed ring event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+
 struct virtio_desc {
     uint64_t addr;
     uint32_t len;
@@ -92,11 +174,82 @@ struct virtio_desc {
     uint16_t next;
 };
 
+struct virtio_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags; /* VRING_DESC_F_x | VRING_PACKED_DESC_F_x */
+};
+
+struct coalescing {
+    uint32_t max_frames;
+    uint32_t usecs; /* 0 disables coalescing */
+};
+
+struct queue_state {
+    uint32_t ready; /* 0 or 1 */
+    uint32_t num;
+    uint16_t last_avail_idx;
+    virtio_phys_addr_t desc_addr;
+    virtio_phys_addr_t avail_addr; /* driver event suppression if packed */
+    virtio_phys_addr_t used_addr;  /* device event suppression if packed */
+    bool manual_recv; /* if true, the device_recv() callback is not called */
+    uint16_t used_idx;        /* next used index (slot if packed) */
+    uint16_t signalled_used;  /* used_idx when the driver was last notified */
+    bool signalled_used_valid;
+    /* packed: slots used since then, the slot index alone is the same
+       once the ring went round */
+    uint32_t unsignalled_slots;
+    bool avail_wrap_counter;  /* packed only */
+    bool used_wrap_counter;   /* packed only */
+    /* used buffers written to the ring but not yet visible to the driver,
+       see virtqueue_flush() */
+    uint16_t used_pending;
+    uint16_t first_used_flags; /* packed: flags of the first pending slot */
+    uint16_t first_used_slot;
+    struct virtio_queue_stats stats;
+
+    /* interrupt coalescing: the interrupt owed for 'coal_pending' buffers
+       is held back until there are 'max_frames' of them or 'usecs' have
+       passed. 'coal_conf' is set by the host, 'coal' is in effect and may
+       be changed by the driver until the next reset. */
+    struct coalescing coal_conf;
+    struct coalescing coal;
+    uint32_t coal_pending;
+    uint64_t coal_deadline; /* CLOCK_MONOTONIC ns, 0 if not armed */
+    bool polling; /* driver notifications are off, the event thread polls */
+    bool stalled; /* the device refused a buffer, see queue_process() */
+    uint16_t msix_vector; /* PCI only */
+    struct obj_pool elem_pool; /* see virtqueue_elem_free() */
+};
+
+struct msix_entry {
+    uint32_t addr_lo;
+    uint32_t addr_hi;
+    uint32_t data;
+    uint32_t ctrl;
+    bool routed; /* the GSI of the vector routes to this message */
+};
+
+/* a descriptor chain taken from a virtqueue. The iovecs point directly
+   into guest memory, device readable buffers first. */
+struct virtqueue_element {
+    int queue_idx;
+    uint16_t index;  /* head descriptor (split) or buffer id (packed) */
+    uint16_t ndescs; /* ring slots used by the chain (packed) */
+    int out_num;     /* device readable buffers */
+    int in_num;      /* device writable buffers */
+    size_t out_len;
+    size_t in_len;
+    struct iovec *out_sg;
+    struct iovec *in_sg;
+    struct iovec sg[];
+};
+
 /* return < 0 to stop the notification (it must be manually restarted
-   later), 0 if OK */
+   later), 0 if OK. If OK, the element now belongs to the device. */
 typedef int (*virtio_device_recv_fn)(struct virtio_device *s1, int queue_idx,
-                                 int desc_idx, int read_size,
-                                 int write_size);
+                                     struct virtqueue_element *elem);
 
 struct virtio_device {
     struct guest_mem_map *mem_map;
@@ -107,29 +260,95 @@ struct virtio_device {
     uint32_t int_status;
     uint32_t status;
     uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features;
     uint32_t queue_sel; /* currently selected queue */
     struct queue_state queue[MAX_QUEUE];
 
     /* device specific */
     uint32_t device_id;
     uint32_t vendor_id;
-    uint32_t device_features;
+    uint64_t device_features;
     virtio_device_recv_fn device_recv;
     void (*config_write)(struct virtio_device *s); /* called after the config
                                               is written */
+    /* called when the driver resets the device, NULL if nothing to do */
+    void (*reset)(struct virtio_device *s);
+    /* device specific statistics, NULL if none */
+    void (*print_stats)(struct virtio_device *s, const char *name, FILE *f);
     uint32_t config_space_size; /* in bytes, must be multiple of 4 */
     uint8_t config_space[MAX_CONFIG_SPACE_SIZE];
     pthread_mutex_t lock;
     int max_queue_num;
     uint64_t mmio_addr;                     /* MMIO base address */
     int ioeventfd[MAX_QUEUE];               /* eventfd for each queue notify */
-    pthread_t ioeventfd_thread;             /* thread polling ioeventfds */
-    bool ioeventfd_enabled;                 /* whether ioeventfd is active */
+    struct io_thread *iothread;             /* runs the handlers below */
+    struct io_handler ioeventfd_handler[MAX_QUEUE];
+    struct io_handler coal_timer_handler;
+    struct io_handler poll_handler;
+    atomic_int completing;                  /* completions waiting for the lock */
+    int coal_timer_fd;                      /* timerfd for held back interrupts */
+    uint32_t poll_usecs;                    /* busy polling budget, 0 if off */
+    /* busy polling state, only used by the io thread */
+    uint64_t poll_start;
+    uint64_t poll_last_hit;
+    uint64_t poll_polls[MAX_QUEUE];
+    uint64_t poll_hits[MAX_QUEUE];
+
+    /* PCI only. Each MSI-X vector has its own GSI and irqfd, so that an
+       interrupt is a single eventfd write and needs no status register. */
+    struct pci_bus *pci_bus;
+    struct pci_device pci;
+    uint16_t msix_config;                   /* vector for config changes */
+    bool msix_enabled;
+    bool msix_masked;                       /* function mask */
+    struct msix_entry msix_table[VIRTIO_PCI_MSIX_VECTORS];
+    uint32_t msix_pending;                  /* pending bit array */
+    int msix_gsi[VIRTIO_PCI_MSIX_VECTORS];
+    int msix_irqfd[VIRTIO_PCI_MSIX_VECTORS];
+
+    /* vhost: once the driver is ready, the queues in 'vhost_queues' are
+       served by the host kernel or a vhost-user process. It is kicked
+       through the ioeventfds and signals the MSI-X irqfds, or 'vhost_call'
+       which is relayed here. */
+    int vhost_fd;                           /* -1 if not used */
+    const struct vhost_ops *vhost_ops;
+    uint32_t vhost_queues;                  /* bit i for queue i */
+    uint64_t vhost_features;                /* supported by the driver */
+    uint64_t vhost_backend_features;        /* always acked */
+    bool vhost_started;
+    /* attach the device specific backend of a queue, or detach it */
+    int (*vhost_set_backend)(struct virtio_device *s, int queue_idx,
+                             bool start);
+    int vhost_call[MAX_QUEUE];
+    int vhost_call_fd[MAX_QUEUE];           /* what vhost signals now */
+    struct io_handler vhost_call_handler[MAX_QUEUE];
+
+    /* shared memory region 0 in guest physical memory, e.g. the virtio-fs
+       DAX window. Only on virtio-mmio, 'shm_size' is 0 if there is none. */
+    uint64_t shm_addr;
+    uint64_t shm_size;
+    uint32_t shm_sel;
 };
 
 static void queue_notify(struct virtio_device *s, int queue_idx);
+static void virtio_coal_expire(struct virtio_device *s);
+static uint64_t get_time_ns(void);
+static bool virtio_queue_has_avail(struct virtio_device *s, int queue_idx);
+static bool virtio_queue_enable_notification(struct virtio_device *s,
+                                             int queue_idx);
+static void virtio_queue_disable_notification(struct virtio_device *s,
+                                              int queue_idx);
 static int virtio_ioeventfd_start(struct virtio_device *s);
+static int virtio_pci_init(struct virtio_device *s, struct pci_bus *bus,
+                           int irqline);
 static void virtio_ioeventfd_stop(struct virtio_device *s);
+static void virtio_raise_irq(struct virtio_device *s, uint16_t vector,
+                             uint32_t isr);
+static bool virtio_vhost_serves(struct virtio_device *s, int queue_idx);
+static void virtio_vhost_start(struct virtio_device *s);
+static void virtio_vhost_stop(struct virtio_device *s);
+static void virtio_vhost_update_calls(struct virtio_device *s);
 
 static void put_le32(void* ptr, uint32_t val)
 {
@@ -175,6 +394,11 @@ static uint16_t get_le16(void *ptr)
            ((uint16_t)p[1] << 8);
 }
 
+static bool virtio_has_feature(struct virtio_device *s, int bit)
+{
+    return (s->driver_features >> bit) & 1;
+}
+
 static void virtio_reset(struct virtio_device *s)
 {
     int i = 0;
@@ -182,7 +406,10 @@ static void virtio_reset(struct virtio_device *s)
     s->status = 0;
     s->queue_sel = 0;
     s->device_features_sel = 0;
+    s->driver_features_sel = 0;
+    s->driver_features = 0;
     s->int_status = 0;
+    s->msix_config = VIRTIO_MSI_NO_VECTOR;
     for(i = 0; i < MAX_QUEUE; i++) {
         struct queue_state *qs = &s->queue[i];
         qs->avail_addr = 0;
@@ -191,15 +418,32 @@ static void virtio_reset(struct virtio_device *s)
         qs->last_avail_idx = 0;
         qs->ready = 0;
         qs->num = s->max_queue_num;
+        qs->avail_wrap_counter = true;
+        qs->used_wrap_counter = true;
+        qs->used_idx = 0;
+        qs->signalled_used = 0;
+        qs->signalled_used_valid = false;
+        qs->unsignalled_slots = 0;
+        qs->used_pending = 0;
+        qs->coal = qs->coal_conf;
+        qs->coal_pending = 0;
+        qs->coal_deadline = 0;
+        qs->polling = false;
+        qs->stalled = false;
+        qs->msix_vector = VIRTIO_MSI_NO_VECTOR;
     }
 }
 
-static uint8_t* guest_addr_to_host_addr(struct virtio_device *s, uint64_t guest_addr) {
+/* return the host address of [guest_addr, guest_addr + len), or NULL if
+   the range is not entirely inside guest RAM */
+static void *guest_range_to_host(struct virtio_device *s, uint64_t guest_addr,
+                                 uint64_t len)
+{
     struct guest_mem_map *mem_map = s->mem_map;
-    if (guest_addr > mem_map->size) {
+    if (guest_addr > mem_map->size || len > mem_map->size - guest_addr) {
         return NULL;
     }
-    return mem_map->host_mem + guest_addr;
+    return (uint8_t *)mem_map->host_mem + guest_addr;
 }
 
 static int virtio_init(struct virtio_device *s, struct virtio_bus_def bus, uint64_t mmio_addr,
@@ -215,13 +459,36 @@ static int virtio_init(struct virtio_device *s, struct virtio_bus_def bus, uint6
     for (int i = 0; i < MAX_QUEUE; i++) {
         s->ioeventfd[i] = -1;
     }
-    s->ioeventfd_enabled = false;
+    s->iothread = bus.iothread;
+    s->coal_timer_fd = -1;
+    s->pci_bus = bus.pci;
+    for (int i = 0; i < VIRTIO_PCI_MSIX_VECTORS; i++) {
+        s->msix_irqfd[i] = -1;
+    }
+    s->vhost_fd = -1;
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        s->vhost_call[i] = -1;
+        s->vhost_call_fd[i] = -1;
+    }
 
     s->device_id = device_id;
     s->vendor_id = 0xffff;
     s->config_space_size = config_space_size;
     s->device_recv = device_recv;
     s->max_queue_num = max_queue_num;
+    /* a queue of elements, ready for the first requests */
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        if (obj_pool_init(&s->queue[i].elem_pool,
+                          sizeof(struct virtqueue_element) +
+                          VIRTQUEUE_POOL_SEGS * sizeof(struct iovec), 0,
+                          max_queue_num) < 0 ||
+            obj_pool_prealloc(&s->queue[i].elem_pool, max_queue_num) < 0)
+            return -1;
+    }
+    s->device_features = (1ULL << VIRTIO_F_VERSION_1) |
+                         (1ULL << VIRTIO_F_RING_PACKED) |
+                         (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+                         (1ULL << VIRTIO_RING_F_EVENT_IDX);
     pthread_mutex_init(&s->lock, NULL);
     virtio_reset(s);
 
@@ -230,11 +497,20 @@ static int virtio_init(struct virtio_device *s, struct virtio_bus_def bus, uint6
         fprintf(stderr, "virtio_init: failed to initialize irqfd\n");
         return -1;
     }
+    s->coal_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (s->coal_timer_fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
     /* Initialize ioeventfd for queue notifications */
     if (virtio_ioeventfd_start(s) < 0) {
         fprintf(stderr, "virtio_init: ioeventfd initialization failed, falling back to MMIO exits\n");
         return -1;
     }
+    if (s->pci_bus && virtio_pci_init(s, s->pci_bus, s->irq.irqline) < 0) {
+        fprintf(stderr, "virtio_init: failed to add the PCI device\n");
+        return -1;
+    }
     return 0;
 }
 
@@ -244,7 +520,7 @@ static uint16_t virtio_read16(struct virtio_device *s, virtio_phys_addr_t addr)
     uint8_t *ptr = NULL;
     if (addr & 1)
         return 0; /* unaligned access are not supported */
-    ptr = guest_addr_to_host_addr(s, addr);
+    ptr = guest_range_to_host(s, addr, 2);
     if (!ptr)
         return 0;
     return *(uint16_t *)ptr;
@@ -257,7 +533,7 @@ static void virtio_write16(struct virtio_device *s, virtio_phys_addr_t addr,
     if (addr & 1) {
         return; /* unaligned access are not supported */
     }
-    ptr = guest_addr_to_host_addr(s, addr);
+    ptr = guest_range_to_host(s, addr, 2);
     if (!ptr) {
         return;
     }
@@ -272,7 +548,7 @@ static void virtio_write32(struct virtio_device *s, virtio_phys_addr_t addr,
     if (addr & 3) {
         return; /* unaligned access are not supported */
     }
-    ptr = guest_addr_to_host_addr(s, addr);
+    ptr = guest_range_to_host(s, addr, 4);
     if (!ptr) {
         return;
     }
@@ -280,158 +556,10 @@ static void virtio_write32(struct virtio_device *s, virtio_phys_addr_t addr,
     atomic_thread_fence(memory_order_release);
 }
 
-static inline int min_int(int a, int b) {
+static inline size_t min_size(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
-static int virtio_memcpy_from_guest(struct virtio_device *s, uint8_t *buf,
-                                  virtio_phys_addr_t addr, int count)
-{
-    uint8_t *ptr = NULL;
-    int l = {0};
-
-    while (count > 0) {
-        l = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
-        ptr = guest_addr_to_host_addr(s, addr);
-        if (!ptr) return -1;
-        atomic_thread_fence(memory_order_acquire);
-        memcpy(buf, ptr, l);
-        addr += l;
-        buf += l;
-        count -= l;
-    }
-    return 0;
-}
-
-static int virtio_memcpy_to_guest(struct virtio_device *s, virtio_phys_addr_t addr, 
-                                const uint8_t *buf, int count)
-{
-    uint8_t *ptr = {0};
-    int l = {0};
-
-    while (count > 0) {
-        l = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
-        ptr = guest_addr_to_host_addr(s, addr);
-        if (!ptr) return -1;
-        memcpy(ptr, buf, l);
-        atomic_thread_fence(memory_order_release);
-        addr += l;
-        buf += l;
-        count -= l;
-    }
-    return 0;
-}
-
-static int get_desc(struct virtio_device *s, struct virtio_desc *desc,  
-                    int queue_idx, int desc_idx)
-{
-    struct queue_state *qs = &s->queue[queue_idx];
-    return virtio_memcpy_from_guest(s, (void *)desc, qs->desc_addr +
-                                  desc_idx * sizeof(struct virtio_desc),
-                                  sizeof(struct virtio_desc));
-}
-
-static int memcpy_to_from_queue(struct virtio_device *s, uint8_t *buf,
-                                int queue_idx, int desc_idx,
-                                int offset, int count, bool to_queue)
-{
-    struct virtio_desc desc = {0};
-    int l, f_write_flag = {0};
-
-    if (count == 0) return 0;
-
-    if (get_desc(s, &desc, queue_idx, desc_idx) < 0) {
-        fprintf(stderr, "memcpy_to_from_queue get_desc failed.\n");
-        return -1;
-    }
-
-    if (to_queue) {
-        f_write_flag = VRING_DESC_F_WRITE;
-        /* find the first write descriptor */
-        for(int i = 0;;i++) {
-            if (i > 1024) {
-                fprintf(stderr, "memcpy_to_from_queue infinite loop1.\n");
-                return -1;
-            }
-            if ((desc.flags & VRING_DESC_F_WRITE) == f_write_flag) break;
-            if (!(desc.flags & VRING_DESC_F_NEXT)) return -1;
-            desc_idx = desc.next;
-            if (get_desc(s, &desc, queue_idx, desc_idx) < 0) {
-                fprintf(stderr, "memcpy_to_from_queue: failed to get_desc2.\n");
-                return -1;
-            }
-        }
-    } else {
-        f_write_flag = 0;
-    }
-
-    /* find the descriptor at offset */
-    for(int i = 0;;i++) {
-        if (i > 1024) {
-            fprintf(stderr, "memcpy_to_from_queue infinite loop2.\n");
-            return -1;
-        }
-        if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag) return -1;
-        if (offset < desc.len) {
-            break;
-        }
-        if (!(desc.flags & VRING_DESC_F_NEXT)) return -1;
-        desc_idx = desc.next;
-        offset -= desc.len;
-        if (get_desc(s, &desc, queue_idx, desc_idx) < 0) {
-            fprintf(stderr, "memcpy_to_from_queue: failed to get_desc3.\n");
-            return -1;
-        }
-    }
-
-    for(int i = 0;;i++) {
-        if (i > 1024) {
-            fprintf(stderr, "memcpy_to_from_queue infinite loop1.\n");
-            return -1;
-        }
-        l = min_int(count, desc.len - offset);
-        if (to_queue) {
-            virtio_memcpy_to_guest(s, desc.addr + offset, buf, l);
-        } else {
-            virtio_memcpy_from_guest(s, buf, desc.addr + offset, l);
-        }
-        count -= l;
-        if (count == 0) {
-            break;
-        }
-        offset += l;
-        buf += l;
-        if (offset == desc.len) {
-            if (!(desc.flags & VRING_DESC_F_NEXT))
-                return -1;
-            desc_idx = desc.next;
-            if (get_desc(s, &desc, queue_idx, desc_idx) < 0) {
-                fprintf(stderr, "memcpy_to_from_queue: failed to get_desc4.\n");
-                return -1;
-            }
-            if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag) return -1;
-            offset = 0;
-        }
-    }
-    return 0;
-}
-
-static int memcpy_from_queue(struct virtio_device *s, void *buf,
-                             int queue_idx, int desc_idx,
-                             int offset, int count)
-{
-    return memcpy_to_from_queue(s, buf, queue_idx, desc_idx, offset, count,
-                                false);
-}
-
-static int memcpy_to_queue(struct virtio_device *s,
-                           int queue_idx, int desc_idx,
-                           int offset, const void *buf, int count)
-{
-    return memcpy_to_from_queue(s, (void *)buf, queue_idx, desc_idx, offset,
-                                count, true);
-}
-
 static void set_irq(struct irq_signal irqsig, int level) {
     struct kvm_irq_level irq = {0};
     irq.irq = irqsig.irqline;
@@ -459,6 +587,11 @@ int virtio_irqfd_init(struct irq_signal *irq)
         perror("eventfd");
         return -1;
     }
+    /* without a VM (bench/), the eventfd only counts the interrupts */
+    if (irq->vmfd < 0) {
+        irq->irqfd = fd;
+        return 0;
+    }
 
     irqfd.fd = fd;
     irqfd.gsi = irq->irqline;
@@ -483,9 +616,38 @@ void virtio_irqfd_cleanup(struct irq_signal *irq)
 }
 
 /* ioeventfd functions */
-static int virtio_ioeventfd_register(struct virtio_device *s, int queue_idx)
+static int virtio_ioeventfd_assign(struct virtio_device *s, int queue_idx,
+                                   bool assign)
 {
     struct kvm_ioeventfd ioevent = {0};
+
+    /* without a VM, notifications come through the register writes */
+    if (s->irq.vmfd < 0)
+        return 0;
+    ioevent.fd = s->ioeventfd[queue_idx];
+    if (s->pci_bus) {
+        /* each queue has its own notification address */
+        ioevent.addr = s->pci.bar_addr[0] + VIRTIO_PCI_NOTIFY_OFFSET +
+                       queue_idx * VIRTIO_PCI_NOTIFY_MULTIPLIER;
+        ioevent.len = 2;
+    } else {
+        ioevent.datamatch = queue_idx;  /* guest writes queue index to QUEUE_NOTIFY */
+        ioevent.len = 4;                /* 32-bit write */
+        ioevent.addr = s->mmio_addr + VIRTIO_MMIO_QUEUE_NOTIFY;
+        ioevent.flags = KVM_IOEVENTFD_FLAG_DATAMATCH;
+    }
+    if (!assign)
+        ioevent.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
+
+    if (ioctl(s->irq.vmfd, KVM_IOEVENTFD, &ioevent) < 0) {
+        perror("KVM_IOEVENTFD");
+        return -1;
+    }
+    return 0;
+}
+
+static int virtio_ioeventfd_register(struct virtio_device *s, int queue_idx)
+{
     int fd;
 
     fd = eventfd(0, EFD_NONBLOCK);
@@ -493,20 +655,13 @@ static int virtio_ioeventfd_register(struct virtio_device *s, int queue_idx)
         perror("eventfd");
         return -1;
     }
-
-    ioevent.fd = fd;
-    ioevent.datamatch = queue_idx;  /* guest writes queue index to QUEUE_NOTIFY */
-    ioevent.len = 4;                /* 32-bit write */
-    ioevent.addr = s->mmio_addr + VIRTIO_MMIO_QUEUE_NOTIFY;
-    ioevent.flags = KVM_IOEVENTFD_FLAG_DATAMATCH;
-
-    if (ioctl(s->irq.vmfd, KVM_IOEVENTFD, &ioevent) < 0) {
-        perror("KVM_IOEVENTFD");
+    s->ioeventfd[queue_idx] = fd;
+    /* with PCI, this is done when the driver maps the BAR */
+    if (!s->pci_bus && virtio_ioeventfd_assign(s, queue_idx, true) < 0) {
         close(fd);
+        s->ioeventfd[queue_idx] = -1;
         return -1;
     }
-
-    s->ioeventfd[queue_idx] = fd;
     return 0;
 }
 
@@ -519,208 +674,696 @@ static void virtio_ioeventfd_unregister(struct virtio_device *s, int queue_idx)
     }
 }
 
-static void *virtio_ioeventfd_poll_thread(void *arg)
+static inline void cpu_relax(void)
 {
-    struct virtio_device *s = arg;
-    struct pollfd pfds[MAX_QUEUE];
-    int nfds = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile("pause");
+#endif
+}
+
+/* begin busy polling the queues with driver notifications off, called
+   with the lock held after a driver notification */
+static void virtio_busy_poll_start(struct virtio_device *s)
+{
+    bool any = false;
+
+    if (s->poll_usecs == 0 || s->poll_handler.polling)
+        return;
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        struct queue_state *qs = &s->queue[i];
+        if (qs->manual_recv || !qs->ready || virtio_vhost_serves(s, i))
+            continue;
+        qs->polling = true;
+        virtio_queue_disable_notification(s, i);
+        any = true;
+    }
+    if (!any)
+        return;
+    s->poll_start = s->poll_last_hit = get_time_ns();
+    io_handler_start_polling(s->iothread, &s->poll_handler);
+}
+
+/* one round of busy polling, until nothing has been found for
+   'poll_usecs'. The rings are peeked at without the lock, which is only
+   taken when there is something to do, so that completions are not held
+   back by the spinning. */
+static bool virtio_busy_poll(struct io_handler *h)
+{
+    struct virtio_device *s = h->opaque;
+    uint64_t now = get_time_ns();
+    bool work = false, polling = false;
     int i;
 
-    /* setup pollfd for each queue */
     for (i = 0; i < MAX_QUEUE; i++) {
-        if (s->ioeventfd[i] >= 0) {
-            pfds[nfds].fd = s->ioeventfd[i];
-            pfds[nfds].events = POLLIN;
-            pfds[nfds].revents = 0;
-            nfds++;
-        }
+        struct queue_state *qs = &s->queue[i];
+        /* a queue stalled by the backend is restarted on completion */
+        if (!qs->polling || qs->stalled)
+            continue;
+        s->poll_polls[i]++;
+        if (virtio_queue_has_avail(s, i))
+            work = true;
+    }
+    if (!work && now - s->poll_last_hit < s->poll_usecs * 1000ULL) {
+        cpu_relax();
+        return true;
     }
 
-    while (s->ioeventfd_enabled) {
-        int ret = poll(pfds, nfds, 300); /* timeout 1 second */
-        if (ret < 0) {
-            if (errno == EINTR) continue;
-            perror("poll");
-            break;
+    pthread_mutex_lock(&s->lock);
+    if (work) {
+        for (i = 0; i < MAX_QUEUE; i++) {
+            struct queue_state *qs = &s->queue[i];
+            if (!qs->polling || qs->stalled || !virtio_queue_has_avail(s, i))
+                continue;
+            s->poll_hits[i]++;
+            queue_notify(s, i);
         }
-        if (ret == 0) {
-            /* timeout, check flag again */
+        s->poll_last_hit = now;
+        pthread_mutex_unlock(&s->lock);
+        return true;
+    }
+    /* idle, go back to notifications */
+    for (i = 0; i < MAX_QUEUE; i++) {
+        struct queue_state *qs = &s->queue[i];
+        if (!qs->polling)
             continue;
+        qs->polling = false;
+        if (virtio_queue_enable_notification(s, i)) {
+            qs->polling = true;
+            virtio_queue_disable_notification(s, i);
+            s->poll_last_hit = now;
         }
-
-        for (i = 0; i < nfds; i++) {
-            if (pfds[i].revents & POLLIN) {
-                uint64_t val;
-                /* read to clear eventfd */
-                read(pfds[i].fd, &val, sizeof(val));
-                /* find queue index */
-                int qidx;
-                for (qidx = 0; qidx < MAX_QUEUE; qidx++) {
-                    if (s->ioeventfd[qidx] == pfds[i].fd) break;
-                }
-                if (qidx < MAX_QUEUE) {
-                    pthread_mutex_lock(&s->lock);
-                    queue_notify(s, qidx);
-                    pthread_mutex_unlock(&s->lock);
-                }
-            }
+        polling |= qs->polling;
+    }
+    if (!polling) {
+        for (i = 0; i < MAX_QUEUE; i++) {
+            struct queue_state *qs = &s->queue[i];
+            if (s->poll_polls[i] == 0)
+                continue;
+            qs->stats.polls += s->poll_polls[i];
+            qs->stats.poll_hits += s->poll_hits[i];
+            qs->stats.poll_ns += now - s->poll_start;
+            s->poll_polls[i] = 0;
+            s->poll_hits[i] = 0;
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&s->lock);
+    return polling;
+}
+
+static void virtio_ioeventfd_handler(struct io_handler *h, uint32_t revents)
+{
+    struct virtio_device *s = h->opaque;
+    int qidx = h - s->ioeventfd_handler;
+    uint64_t val = 0;
+
+    /* read to clear eventfd */
+    read(h->fd, &val, sizeof(val));
+    pthread_mutex_lock(&s->lock);
+    s->queue[qidx].stats.kicks++;
+    queue_notify(s, qidx);
+    /* the driver is active, expect more requests soon */
+    virtio_busy_poll_start(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void virtio_coal_timer_handler(struct io_handler *h, uint32_t revents)
+{
+    struct virtio_device *s = h->opaque;
+    uint64_t val = 0;
+
+    read(h->fd, &val, sizeof(val));
+    pthread_mutex_lock(&s->lock);
+    virtio_coal_expire(s);
+    pthread_mutex_unlock(&s->lock);
 }
 
 static int virtio_ioeventfd_start(struct virtio_device *s)
 {
     int i;
     for (i = 0; i < MAX_QUEUE; i++) {
-        if (virtio_ioeventfd_register(s, i) < 0) {
-            /* cleanup previously registered */
-            while (--i >= 0) {
-                virtio_ioeventfd_unregister(s, i);
-            }
-            return -1;
-        }
-    }
-    s->ioeventfd_enabled = true;
-    if (pthread_create(&s->ioeventfd_thread, NULL, virtio_ioeventfd_poll_thread, s) != 0) {
-        perror("pthread_create");
-        s->ioeventfd_enabled = false;
-        for (i = 0; i < MAX_QUEUE; i++) {
+        if (virtio_ioeventfd_register(s, i) < 0)
+            goto fail;
+        s->ioeventfd_handler[i] = (struct io_handler){
+            .fd = s->ioeventfd[i],
+            .events = EPOLLIN,
+            .fn = virtio_ioeventfd_handler,
+            .opaque = s,
+        };
+        if (io_handler_add(s->iothread, &s->ioeventfd_handler[i]) < 0) {
             virtio_ioeventfd_unregister(s, i);
+            goto fail;
         }
-        return -1;
     }
+    s->coal_timer_handler = (struct io_handler){
+        .fd = s->coal_timer_fd,
+        .events = EPOLLIN,
+        .fn = virtio_coal_timer_handler,
+        .opaque = s,
+    };
+    if (io_handler_add(s->iothread, &s->coal_timer_handler) < 0)
+        goto fail;
+    s->poll_handler = (struct io_handler){
+        .fd = -1,
+        .poll_fn = virtio_busy_poll,
+        .opaque = s,
+    };
     return 0;
+fail:
+    /* cleanup previously registered */
+    while (--i >= 0) {
+        io_handler_remove(&s->ioeventfd_handler[i]);
+        virtio_ioeventfd_unregister(s, i);
+    }
+    return -1;
 }
 
 static void virtio_ioeventfd_stop(struct virtio_device *s)
 {
-    s->ioeventfd_enabled = false;
-    pthread_join(s->ioeventfd_thread, NULL);
+    io_handler_remove(&s->poll_handler);
+    io_handler_remove(&s->coal_timer_handler);
     for (int i = 0; i < MAX_QUEUE; i++) {
+        io_handler_remove(&s->ioeventfd_handler[i]);
         virtio_ioeventfd_unregister(s, i);
     }
+    if (s->coal_timer_fd >= 0) {
+        close(s->coal_timer_fd);
+        s->coal_timer_fd = -1;
+    }
 }
 
-/* signal that the descriptor has been consumed */
-static void virtio_consume_desc(struct virtio_device *s,
-                                int queue_idx, int desc_idx, int desc_len)
+static bool packed_desc_is_avail(uint16_t flags, bool wrap_counter)
 {
-    struct queue_state *qs = &s->queue[queue_idx];
-    virtio_phys_addr_t index_addr = 0, ring_addr = {0};
-    uint32_t index = {0};
+    bool avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+    bool used = !!(flags & VRING_PACKED_DESC_F_USED);
+    return avail != used && avail == wrap_counter;
+}
+
+static virtio_phys_addr_t packed_desc_addr(struct queue_state *qs, int idx)
+{
+    return qs->desc_addr + idx * sizeof(struct virtio_packed_desc);
+}
 
-    DEBUG("consume vq, dev: %p, qid: %d, did: %d, len: %d\n", s, queue_idx, desc_idx, desc_len);
+static bool virtio_queue_has_avail(struct virtio_device *s, int queue_idx)
+{
+    struct queue_state *qs = &s->queue[queue_idx];
+    uint16_t flags = 0;
 
-    index_addr = qs->used_addr + 2;
-    index = virtio_read16(s, index_addr);
-    DEBUG("index: %d\n", index);
+    if (!qs->ready || qs->num == 0 || (s->status & VIRTIO_CONFIG_S_NEEDS_RESET))
+        return false;
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        flags = virtio_read16(s, packed_desc_addr(qs, qs->last_avail_idx) + 14);
+        return packed_desc_is_avail(flags, qs->avail_wrap_counter);
+    }
+    return qs->last_avail_idx != virtio_read16(s, qs->avail_addr + 2);
+}
 
-    ring_addr = qs->used_addr + 4 + (index & (qs->num - 1)) * 8;
-    virtio_write32(s, ring_addr, desc_idx);
-    virtio_write32(s, ring_addr + 4, desc_len);
-    virtio_write16(s, index_addr, index + 1);
+/* read entry 'idx' of a descriptor table in the negotiated layout */
+static void read_desc(struct virtio_device *s, const uint8_t *table, int idx,
+                      struct virtio_desc *desc, uint16_t *id)
+{
+    struct virtio_packed_desc pdesc = {0};
 
-    uint16_t flags = virtio_read16(s, qs->avail_addr);
-    if (flags & 0x01) { // intr suppression
+    if (!virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        memcpy(desc, table + idx * sizeof(*desc), sizeof(*desc));
         return;
     }
-    s->int_status |= 1;
-    trigger_irqfd(s->irq.irqfd);
+    memcpy(&pdesc, table + idx * sizeof(pdesc), sizeof(pdesc));
+    desc->addr = pdesc.addr;
+    desc->len = pdesc.len;
+    desc->flags = pdesc.flags;
+    desc->next = 0;
+    *id = pdesc.id;
 }
 
-static int get_desc_rw_size(struct virtio_device *s, 
-                             int *pread_size, int *pwrite_size,
-                             int queue_idx, int desc_idx)
+/* walk the chain starting at descriptor 'head' of the ring once, mapping
+   its buffers and following an indirect table if there is one. Return
+   NULL if the chain is malformed. */
+static struct virtqueue_element *
+virtqueue_map_chain(struct virtio_device *s, int queue_idx, uint16_t head)
 {
+    struct queue_state *qs = &s->queue[queue_idx];
+    bool packed = virtio_has_feature(s, VIRTIO_F_RING_PACKED);
+    struct iovec iov[VIRTQUEUE_MAX_SEGS];
+    struct virtqueue_element *elem = NULL;
     struct virtio_desc desc = {0};
-    int read_size, write_size = {0};
-
-    read_size = 0;
-    write_size = 0;
-    get_desc(s, &desc, queue_idx, desc_idx);
-
-    for(;;) {
-        if (desc.flags & VRING_DESC_F_WRITE)
-            break;
-        read_size += desc.len;
+    const uint8_t *table = NULL;
+    uint32_t table_num = qs->num, count = 0, idx = head;
+    bool indirect = false;
+    uint16_t id = 0, desc_id = 0, ndescs = 0;
+    int n = 0, in_num = 0, out_num = 0;
+    size_t in_len = 0, out_len = 0;
+    void *ptr = NULL;
+
+    table = guest_range_to_host(s, qs->desc_addr,
+                                qs->num * sizeof(struct virtio_desc));
+    if (!table)
+        goto fail;
+    for (;;) {
+        if (idx >= table_num || ++count > table_num)
+            goto fail; /* out of range or looping */
+        read_desc(s, table, idx, &desc, &desc_id);
+        if (indirect && packed) {
+            /* only WRITE is meaningful in a packed indirect table */
+            desc.flags &= VRING_DESC_F_WRITE;
+        }
+        if (!indirect) {
+            ndescs++;
+            id = desc_id;
+        }
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (indirect || !virtio_has_feature(s, VIRTIO_RING_F_INDIRECT_DESC) ||
+                (desc.flags & VRING_DESC_F_NEXT) ||
+                desc.len == 0 || desc.len % sizeof(struct virtio_desc) != 0)
+                goto fail;
+            table = guest_range_to_host(s, desc.addr, desc.len);
+            if (!table)
+                goto fail;
+            table_num = desc.len / sizeof(struct virtio_desc);
+            idx = 0;
+            count = 0;
+            indirect = true;
+            continue;
+        }
+        ptr = guest_range_to_host(s, desc.addr, desc.len);
+        if (!ptr || n >= VIRTQUEUE_MAX_SEGS)
+            goto fail;
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            in_num++;
+            in_len += desc.len;
+        } else {
+            if (in_num > 0)
+                goto fail; /* readable after writable buffers */
+            out_num++;
+            out_len += desc.len;
+        }
+        iov[n].iov_base = ptr;
+        iov[n].iov_len = desc.len;
+        n++;
+        if (indirect && packed) {
+            /* packed indirect tables are sequential */
+            if (++idx == table_num)
+                break;
+            continue;
+        }
         if (!(desc.flags & VRING_DESC_F_NEXT))
-            goto done;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
-    }
-    
-    for(;;) {
-        if (!(desc.flags & VRING_DESC_F_WRITE)) return -1;
-        write_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT)) break;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
+            break;
+        if (packed)
+            idx = idx + 1 == qs->num ? 0 : idx + 1;
+        else
+            idx = desc.next;
     }
 
- done:
-    *pread_size = read_size;
-    *pwrite_size = write_size;
-    return 0;
+    elem = obj_pool_alloc(&qs->elem_pool,
+                          sizeof(*elem) + n * sizeof(struct iovec));
+    if (!elem)
+        return NULL;
+    elem->queue_idx = queue_idx;
+    /* in a packed ring the buffer id is carried by the last descriptor */
+    elem->index = packed ? id : head;
+    elem->ndescs = ndescs;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->out_len = out_len;
+    elem->in_len = in_len;
+    elem->out_sg = elem->sg;
+    elem->in_sg = elem->sg + out_num;
+    memcpy(elem->sg, iov, n * sizeof(struct iovec));
+    return elem;
+fail:
+    fprintf(stderr, "virtio: invalid descriptor chain in queue %d.\n", queue_idx);
+    return NULL;
 }
 
-/* XXX: test if the queue is ready ? */
-static void queue_notify(struct virtio_device *s, int queue_idx)
+/* take the next available descriptor chain, or return NULL if the queue
+   is empty. The element must be given back with virtqueue_push() or
+   virtqueue_unpop(), then freed with virtqueue_elem_free(). */
+static struct virtqueue_element *virtqueue_pop(struct virtio_device *s,
+                                               int queue_idx)
 {
     struct queue_state *qs = &s->queue[queue_idx];
-    uint16_t avail_idx = {0};
-    int desc_idx = {0}, read_size = {0}, write_size = {0};
-
-    if (qs->manual_recv)
-        return;
+    struct virtqueue_element *elem = NULL;
+    uint16_t head = 0;
 
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    while (qs->last_avail_idx != avail_idx) {
-        desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
-                                 (qs->last_avail_idx & (qs->num - 1)) * 2);
-        if (!get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx)) {
-            if (s->device_recv(s, queue_idx, desc_idx,
-                               read_size, write_size) < 0)
-                break;
+    if (!virtio_queue_has_avail(s, queue_idx))
+        return NULL;
+    /* read the descriptors only after seeing them available */
+    atomic_thread_fence(memory_order_acquire);
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        head = qs->last_avail_idx;
+    } else {
+        head = virtio_read16(s, qs->avail_addr + 4 +
+                             (qs->last_avail_idx & (qs->num - 1)) * 2);
+    }
+    elem = virtqueue_map_chain(s, queue_idx, head);
+    if (!elem) {
+        /* the driver broke the ring, stop using it until the next reset */
+        s->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+        virtio_raise_irq(s, s->msix_config, 2);
+        return NULL;
+    }
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        qs->last_avail_idx += elem->ndescs;
+        if (qs->last_avail_idx >= qs->num) {
+            qs->last_avail_idx -= qs->num;
+            qs->avail_wrap_counter = !qs->avail_wrap_counter;
         }
+    } else {
         qs->last_avail_idx++;
     }
+    return elem;
 }
 
-static uint32_t virtio_config_read(struct virtio_device *s, uint32_t offset,
-                                   int size)
+/* free an element of virtqueue_pop(), kept by its queue for the next one */
+static void virtqueue_elem_free(struct virtio_device *s,
+                                struct virtqueue_element *elem)
 {
-    uint32_t val = {0};
-    switch(size) {
-    case 1:
-        if (offset < s->config_space_size) {
-            val = s->config_space[offset];
-        } else {
-            val = 0;
-        }
-        break;
-    case 2:
-        if (offset < (s->config_space_size - 1)) {
-            val = get_le16(&s->config_space[offset]);
-        } else {
-            val = 0;
-        }
-        break;
-    case 4:
-        if (offset < (s->config_space_size - 3)) {
-            val = get_le32(s->config_space + offset);
-        } else {
-            val = 0;
-        }
-        break;
-    default:
-        abort();
+    obj_pool_free(&s->queue[elem->queue_idx].elem_pool, elem,
+                  sizeof(*elem) +
+                  (elem->out_num + elem->in_num) * sizeof(struct iovec));
+}
+
+/* put back an element returned by virtqueue_pop() which was not used */
+static void virtqueue_unpop(struct virtio_device *s,
+                            struct virtqueue_element *elem)
+{
+    struct queue_state *qs = &s->queue[elem->queue_idx];
+
+    if (!virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        qs->last_avail_idx--;
+        return;
+    }
+    if (qs->last_avail_idx < elem->ndescs) {
+        qs->last_avail_idx += qs->num - elem->ndescs;
+        qs->avail_wrap_counter = !qs->avail_wrap_counter;
+    } else {
+        qs->last_avail_idx -= elem->ndescs;
     }
-    return val;
 }
 
-static void virtio_config_write(struct virtio_device *s, uint32_t offset,
-                                uint32_t val, int size)
+/* the used element is written now, the used index is only updated by
+   virtqueue_flush() */
+static void split_push_used(struct virtio_device *s, struct queue_state *qs,
+                            struct virtqueue_element *elem, int len)
+{
+    virtio_phys_addr_t ring_addr = {0};
+
+    DEBUG("index: %d\n", qs->used_idx);
+    ring_addr = qs->used_addr + 4 + (qs->used_idx & (qs->num - 1)) * 8;
+    virtio_write32(s, ring_addr, elem->index);
+    virtio_write32(s, ring_addr + 4, len);
+    qs->used_idx++;
+}
+
+/* the driver consumes used descriptors in order, so the whole batch
+   becomes visible when the flags of its first descriptor are written by
+   virtqueue_flush() */
+static void packed_push_used(struct virtio_device *s, struct queue_state *qs,
+                             struct virtqueue_element *elem, int len)
+{
+    virtio_phys_addr_t addr = packed_desc_addr(qs, qs->used_idx);
+    uint16_t flags = 0;
+
+    if (qs->used_wrap_counter)
+        flags = VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED;
+    if (len > 0)
+        flags |= VRING_DESC_F_WRITE;
+    virtio_write16(s, addr + 12, elem->index);
+    virtio_write32(s, addr + 8, len);
+    if (qs->used_pending == 0) {
+        qs->first_used_slot = qs->used_idx;
+        qs->first_used_flags = flags;
+    } else {
+        /* id and len must be visible before the flags */
+        atomic_thread_fence(memory_order_release);
+        virtio_write16(s, addr + 14, flags);
+    }
+
+    qs->used_idx += elem->ndescs;
+    qs->unsignalled_slots += elem->ndescs;
+    if (qs->used_idx >= qs->num) {
+        qs->used_idx -= qs->num;
+        qs->used_wrap_counter = !qs->used_wrap_counter;
+    }
+}
+
+/* true if the other side asked to be notified when the index moves from
+   'old' to 'new', i.e. if 'event' is in [old, new) */
+static bool vring_need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+/* decide whether the driver wants an interrupt for the used entries
+   published since the last one */
+static bool virtio_queue_should_notify(struct virtio_device *s,
+                                       struct queue_state *qs)
+{
+    uint16_t old = qs->signalled_used, new = qs->used_idx;
+    bool valid = qs->signalled_used_valid;
+    uint32_t slots = qs->unsignalled_slots;
+    uint16_t flags = 0, off_wrap = 0, event = 0;
+
+    /* the used index must be visible before the event is read */
+    atomic_thread_fence(memory_order_seq_cst);
+    qs->signalled_used = new;
+    qs->signalled_used_valid = true;
+    qs->unsignalled_slots = 0;
+
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        off_wrap = virtio_read16(s, qs->avail_addr);
+        flags = virtio_read16(s, qs->avail_addr + 2);
+        if (flags != VRING_PACKED_EVENT_FLAG_DESC ||
+            !virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX))
+            return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+        /* the ring went round since the last interrupt, old == new hides it */
+        if (slots >= qs->num)
+            return true;
+        event = off_wrap & 0x7fff;
+        if ((off_wrap >> 15) != qs->used_wrap_counter)
+            event -= qs->num;
+        return !valid || vring_need_event(event, new, old);
+    }
+    if (virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+        /* used_event lives after the avail ring */
+        event = virtio_read16(s, qs->avail_addr + 4 + qs->num * 2);
+        return !valid || vring_need_event(event, new, old);
+    }
+    flags = virtio_read16(s, qs->avail_addr);
+    return !(flags & 0x01); // intr suppression
+}
+
+/* ask the driver to notify the device when it adds buffers, then check
+   the queue again as buffers may have been added just before. Return true
+   if there are available buffers. Nothing is done while the queue is
+   polled, the polling loop will find the buffers. */
+static bool virtio_queue_enable_notification(struct virtio_device *s,
+                                             int queue_idx)
+{
+    struct queue_state *qs = &s->queue[queue_idx];
+
+    if (qs->polling)
+        return false;
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        if (virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+            virtio_write16(s, qs->used_addr,
+                           qs->last_avail_idx | (qs->avail_wrap_counter << 15));
+            virtio_write16(s, qs->used_addr + 2, VRING_PACKED_EVENT_FLAG_DESC);
+        } else {
+            virtio_write16(s, qs->used_addr + 2, VRING_PACKED_EVENT_FLAG_ENABLE);
+        }
+    } else if (virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+        /* avail_event lives after the used ring */
+        virtio_write16(s, qs->used_addr + 4 + qs->num * 8, qs->last_avail_idx);
+    } else {
+        virtio_write16(s, qs->used_addr, 0);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    return virtio_queue_has_avail(s, queue_idx);
+}
+
+/* stop driver notifications while the queue is polled. With
+   VIRTIO_RING_F_EVENT_IDX, the avail event is simply left behind. */
+static void virtio_queue_disable_notification(struct virtio_device *s,
+                                              int queue_idx)
+{
+    struct queue_state *qs = &s->queue[queue_idx];
+
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        virtio_write16(s, qs->used_addr + 2, VRING_PACKED_EVENT_FLAG_DISABLE);
+    } else if (!virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+        virtio_write16(s, qs->used_addr, VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void virtio_queue_raise_irq(struct virtio_device *s,
+                                   struct queue_state *qs)
+{
+    qs->coal_pending = 0;
+    qs->coal_deadline = 0;
+    qs->stats.irqs++;
+    virtio_raise_irq(s, qs->msix_vector, 1);
+}
+
+/* make the coalescing timer fire at the earliest queue deadline */
+static void virtio_coal_arm_timer(struct virtio_device *s)
+{
+    struct itimerspec its = {0};
+    uint64_t deadline = 0;
+
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        uint64_t d = s->queue[i].coal_deadline;
+        if (d != 0 && (deadline == 0 || d < deadline))
+            deadline = d;
+    }
+    /* a zero it_value disarms the timer */
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+    timerfd_settime(s->coal_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* called by the event thread when the coalescing timer fires */
+static void virtio_coal_expire(struct virtio_device *s)
+{
+    uint64_t now = get_time_ns();
+
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        struct queue_state *qs = &s->queue[i];
+        if (qs->coal_deadline != 0 && qs->coal_deadline <= now)
+            virtio_queue_raise_irq(s, qs);
+    }
+    virtio_coal_arm_timer(s);
+}
+
+/* give a buffer back to the driver, 'len' bytes having been written to
+   it. The driver sees it after the next virtqueue_flush(). */
+static void virtqueue_push(struct virtio_device *s,
+                           struct virtqueue_element *elem, int len)
+{
+    struct queue_state *qs = &s->queue[elem->queue_idx];
+
+    DEBUG("push vq, dev: %p, qid: %d, idx: %d, len: %d\n", s, elem->queue_idx, elem->index, len);
+
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        packed_push_used(s, qs, elem, len);
+    } else {
+        split_push_used(s, qs, elem, len);
+    }
+    qs->used_pending++;
+    qs->stats.used_bufs++;
+}
+
+/* publish the pushed buffers at once and interrupt the driver at most
+   once for them */
+static void virtqueue_flush(struct virtio_device *s, int queue_idx)
+{
+    struct queue_state *qs = &s->queue[queue_idx];
+
+    if (qs->used_pending == 0)
+        return;
+    /* the used elements must be visible before the index or flags */
+    atomic_thread_fence(memory_order_release);
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        virtio_write16(s, packed_desc_addr(qs, qs->first_used_slot) + 14,
+                       qs->first_used_flags);
+    } else {
+        virtio_write16(s, qs->used_addr + 2, qs->used_idx);
+    }
+    qs->stats.used_batches++;
+    /* once an interrupt is owed, later buffers ride along with it */
+    if (qs->coal_pending == 0 && !virtio_queue_should_notify(s, qs)) {
+        qs->used_pending = 0;
+        return;
+    }
+    qs->coal_pending += qs->used_pending;
+    qs->used_pending = 0;
+    if (qs->coal.usecs == 0 || qs->coal_pending >= qs->coal.max_frames) {
+        virtio_queue_raise_irq(s, qs);
+        return;
+    }
+    if (qs->coal_deadline == 0) {
+        qs->coal_deadline = get_time_ns() + qs->coal.usecs * 1000ULL;
+        virtio_coal_arm_timer(s);
+    }
+}
+
+/* hand the available buffers to the device, the caller must flush the
+   queue afterwards */
+static void queue_process(struct virtio_device *s, int queue_idx)
+{
+    struct queue_state *qs = &s->queue[queue_idx];
+    struct virtqueue_element *elem = NULL;
+
+    if (qs->manual_recv)
+        return;
+
+    qs->stalled = false;
+    do {
+        while ((elem = virtqueue_pop(s, queue_idx)) != NULL) {
+            if (s->device_recv(s, queue_idx, elem) < 0) {
+                /* the device restarts the queue when it can make progress,
+                   no need for the driver to kick meanwhile */
+                virtqueue_unpop(s, elem);
+                virtqueue_elem_free(s, elem);
+                qs->stalled = true;
+                return;
+            }
+        }
+    } while (virtio_queue_enable_notification(s, queue_idx));
+}
+
+/* XXX: test if the queue is ready ? */
+static void queue_notify(struct virtio_device *s, int queue_idx)
+{
+    if (virtio_vhost_serves(s, queue_idx)) {
+        /* a kick which raced with vhost taking over, pass it on */
+        eventfd_write(s->ioeventfd[queue_idx], 1);
+        return;
+    }
+    queue_process(s, queue_idx);
+    virtqueue_flush(s, queue_idx);
+}
+
+static uint32_t virtio_config_read(struct virtio_device *s, uint32_t offset,
+                                   int size)
+{
+    uint32_t val = {0};
+    switch(size) {
+    case 1:
+        if (offset < s->config_space_size) {
+            val = s->config_space[offset];
+        } else {
+            val = 0;
+        }
+        break;
+    case 2:
+        if (offset < (s->config_space_size - 1)) {
+            val = get_le16(&s->config_space[offset]);
+        } else {
+            val = 0;
+        }
+        break;
+    case 4:
+        if (offset < (s->config_space_size - 3)) {
+            val = get_le32(s->config_space + offset);
+        } else {
+            val = 0;
+        }
+        break;
+    default:
+        abort();
+    }
+    return val;
+}
+
+static void virtio_config_write(struct virtio_device *s, uint32_t offset,
+                                uint32_t val, int size)
 {
     switch(size) {
     case 1:
@@ -778,7 +1421,7 @@ uint32_t virtio_mmio_read(struct virtio_device *s, uint32_t offset, int size)
                 val = s->device_features;
                 break;
             case 1:
-                val = 1; /* version 1 */
+                val = s->device_features >> 32;
                 break;
             default:
                 val = 0;
@@ -824,6 +1467,19 @@ uint32_t virtio_mmio_read(struct virtio_device *s, uint32_t offset, int size)
         case VIRTIO_MMIO_STATUS:
             val = s->status;
             break;
+        case VIRTIO_MMIO_SHM_LEN_LOW:
+        case VIRTIO_MMIO_SHM_LEN_HIGH:
+            /* ~0 if the selected region does not exist */
+            val = (s->shm_sel != 0 || !s->shm_size) ? 0xffffffff :
+                  offset == VIRTIO_MMIO_SHM_LEN_LOW ? s->shm_size :
+                  s->shm_size >> 32;
+            break;
+        case VIRTIO_MMIO_SHM_BASE_LOW:
+        case VIRTIO_MMIO_SHM_BASE_HIGH:
+            val = (s->shm_sel != 0 || !s->shm_size) ? 0xffffffff :
+                  offset == VIRTIO_MMIO_SHM_BASE_LOW ? s->shm_addr :
+                  s->shm_addr >> 32;
+            break;
         case VIRTIO_MMIO_CONFIG_GENERATION:
             val = 0;
             break;
@@ -841,6 +1497,51 @@ end:
     return val;
 }
 
+/* only accept what was offered */
+static void virtio_set_driver_features(struct virtio_device *s, uint32_t val)
+{
+    switch(s->driver_features_sel) {
+    case 0:
+        s->driver_features = (s->driver_features & ~0xffffffffULL) |
+                             (val & (uint32_t)s->device_features);
+        break;
+    case 1:
+        s->driver_features = (s->driver_features & 0xffffffffULL) |
+            ((uint64_t)(val & (uint32_t)(s->device_features >> 32)) << 32);
+        break;
+    }
+}
+
+static void virtio_set_queue_num(struct virtio_device *s, uint32_t val)
+{
+    if (val == 0 || val > s->max_queue_num)
+        return;
+    /* packed rings do not need a power of 2 size */
+    if ((val & (val - 1)) == 0 ||
+        virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        s->queue[s->queue_sel].num = val;
+    }
+}
+
+static void virtio_set_status(struct virtio_device *s, uint32_t val)
+{
+    uint32_t old = s->status;
+
+    s->status = val;
+    if ((old & VIRTIO_CONFIG_S_DRIVER_OK) && !(val & VIRTIO_CONFIG_S_DRIVER_OK))
+        virtio_vhost_stop(s);
+    else if (!(old & VIRTIO_CONFIG_S_DRIVER_OK) && (val & VIRTIO_CONFIG_S_DRIVER_OK))
+        virtio_vhost_start(s);
+    if (val == 0) {
+        /* reset */
+        s->int_status = 0;
+        set_irq(s->irq, 0);
+        if (s->reset)
+            s->reset(s);
+        virtio_reset(s);
+    }
+}
+
 static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
 {
     *paddr = (*paddr & ~(virtio_phys_addr_t)0xffffffff) | val;
@@ -865,14 +1566,18 @@ void virtio_mmio_write(struct virtio_device *s, uint32_t offset,
         case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
             s->device_features_sel = val;
             break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            s->driver_features_sel = val;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            virtio_set_driver_features(s, val);
+            break;
         case VIRTIO_MMIO_QUEUE_SEL:
             if (val < MAX_QUEUE)
                 s->queue_sel = val;
             break;
         case VIRTIO_MMIO_QUEUE_NUM:
-            if ((val & (val - 1)) == 0 && val > 0) {
-                s->queue[s->queue_sel].num = val;
-            }
+            virtio_set_queue_num(s, val);
             break;
         case VIRTIO_MMIO_QUEUE_DESC_LOW:
             set_low32(&s->queue[s->queue_sel].desc_addr, val);
@@ -893,24 +1598,23 @@ void virtio_mmio_write(struct virtio_device *s, uint32_t offset,
             set_high32(&s->queue[s->queue_sel].used_addr, val);
             break;
         case VIRTIO_MMIO_STATUS:
-            s->status = val;
-            if (val == 0) {
-                /* reset */
-                s->int_status = 0;
-                set_irq(s->irq, 0);
-                virtio_reset(s);
-            }
+            virtio_set_status(s, val);
             break;
         case VIRTIO_MMIO_QUEUE_READY:
             s->queue[s->queue_sel].ready = val & 1;
             break;
         case VIRTIO_MMIO_QUEUE_NOTIFY:
-            if (val < MAX_QUEUE)
+            if (val < MAX_QUEUE) {
+                s->queue[val].stats.kicks++;
                 queue_notify(s, val);
+            }
             break;
         case VIRTIO_MMIO_INTERRUPT_ACK:
             s->int_status &= ~val;
             break;
+        case VIRTIO_MMIO_SHM_SEL:
+            s->shm_sel = val;
+            break;
         }
     } else {
         fprintf(stderr, "virtio mmio write error: len != 4\n");
@@ -919,170 +1623,1404 @@ end:
     pthread_mutex_unlock(&s->lock);
 }
 
-void virtio_set_debug(struct virtio_device *s, int debug)
+/*********************************************************************/
+/* PCI transport */
+
+/* signal the driver, 'isr' being 1 for used buffers and 2 for a
+   configuration change. With MSI-X, 'vector' is sent instead and the
+   driver does not have to read the ISR. */
+static void virtio_raise_irq(struct virtio_device *s, uint16_t vector,
+                             uint32_t isr)
 {
-    s->debug = debug;
-}
+    struct msix_entry *e = NULL;
 
-/*********************************************************************/
-/* block device */
+    if (!s->pci_bus || !s->msix_enabled) {
+        s->int_status |= isr;
+        trigger_irqfd(s->irq.irqfd);
+        return;
+    }
+    if (vector >= VIRTIO_PCI_MSIX_VECTORS)
+        return;
+    e = &s->msix_table[vector];
+    if (s->msix_masked || (e->ctrl & PCI_MSIX_ENTRY_CTRL_MASKBIT) ||
+        !e->routed) {
+        s->msix_pending |= 1U << vector;
+        return;
+    }
+    trigger_irqfd(s->msix_irqfd[vector]);
+}
 
-struct virtio_block_device {
-    struct virtio_device common;
-    struct block_device *bs;
-};
+/* route the GSI of a vector to its message, and send what was held back
+   while it was masked */
+static void virtio_pci_msix_update(struct virtio_device *s, int vector)
+{
+    struct msix_entry *e = &s->msix_table[vector];
 
-struct block_request_header{
-    uint32_t type;
-    uint32_t ioprio;
-    uint64_t sector_num;
-};
+    if (!s->msix_enabled || s->msix_masked ||
+        (e->ctrl & PCI_MSIX_ENTRY_CTRL_MASKBIT))
+        return;
+    if (!e->routed) {
+        if (pci_set_msi_route(s->pci_bus, s->msix_gsi[vector],
+                              ((uint64_t)e->addr_hi << 32) | e->addr_lo,
+                              e->data) < 0)
+            return;
+        e->routed = true;
+    }
+    if (s->msix_pending & (1U << vector)) {
+        s->msix_pending &= ~(1U << vector);
+        trigger_irqfd(s->msix_irqfd[vector]);
+    }
+}
 
-#define VIRTIO_BLK_T_IN          0
-#define VIRTIO_BLK_T_OUT         1
-#define VIRTIO_BLK_T_FLUSH       4
-#define VIRTIO_BLK_T_FLUSH_OUT   5
+static uint16_t virtio_pci_check_vector(uint32_t val)
+{
+    return val < VIRTIO_PCI_MSIX_VECTORS ? val : VIRTIO_MSI_NO_VECTOR;
+}
 
-#define VIRTIO_BLK_S_OK     0
-#define VIRTIO_BLK_S_IOERR  1
-#define VIRTIO_BLK_S_UNSUPP 2
+static uint32_t virtio_pci_common_read(struct virtio_device *s,
+                                       uint32_t offset)
+{
+    struct queue_state *qs = &s->queue[s->queue_sel];
+
+    switch(offset) {
+    case VIRTIO_PCI_COMMON_DFSELECT:
+        return s->device_features_sel;
+    case VIRTIO_PCI_COMMON_DF:
+        if (s->device_features_sel == 0)
+            return s->device_features;
+        if (s->device_features_sel == 1)
+            return s->device_features >> 32;
+        return 0;
+    case VIRTIO_PCI_COMMON_GFSELECT:
+        return s->driver_features_sel;
+    case VIRTIO_PCI_COMMON_GF:
+        if (s->driver_features_sel == 0)
+            return s->driver_features;
+        if (s->driver_features_sel == 1)
+            return s->driver_features >> 32;
+        return 0;
+    case VIRTIO_PCI_COMMON_MSIX:
+        return s->msix_config;
+    case VIRTIO_PCI_COMMON_NUMQ:
+        return MAX_QUEUE;
+    case VIRTIO_PCI_COMMON_STATUS:
+        return s->status;
+    case VIRTIO_PCI_COMMON_CFGGENERATION:
+        return 0;
+    case VIRTIO_PCI_COMMON_Q_SELECT:
+        return s->queue_sel;
+    case VIRTIO_PCI_COMMON_Q_SIZE:
+        return qs->num;
+    case VIRTIO_PCI_COMMON_Q_MSIX:
+        return qs->msix_vector;
+    case VIRTIO_PCI_COMMON_Q_ENABLE:
+        return qs->ready;
+    case VIRTIO_PCI_COMMON_Q_NOFF:
+        return s->queue_sel;
+    case VIRTIO_PCI_COMMON_Q_DESCLO:
+        return qs->desc_addr;
+    case VIRTIO_PCI_COMMON_Q_DESCHI:
+        return qs->desc_addr >> 32;
+    case VIRTIO_PCI_COMMON_Q_AVAILLO:
+        return qs->avail_addr;
+    case VIRTIO_PCI_COMMON_Q_AVAILHI:
+        return qs->avail_addr >> 32;
+    case VIRTIO_PCI_COMMON_Q_USEDLO:
+        return qs->used_addr;
+    case VIRTIO_PCI_COMMON_Q_USEDHI:
+        return qs->used_addr >> 32;
+    }
+    return 0;
+}
 
-static void virtio_block_req_end(struct blk_io_callback_arg *arg, int ret)
+static void virtio_pci_common_write(struct virtio_device *s, uint32_t offset,
+                                    uint32_t val)
 {
-    struct virtio_device *s = arg->s;
-    int write_size = {0};
-    int queue_idx = arg->req.queue_idx;
-    int desc_idx = arg->req.desc_idx;
-    uint8_t *buf = {0}, buf1[1] = {0};
+    struct queue_state *qs = &s->queue[s->queue_sel];
 
-    switch(arg->req.type) {
-    case VIRTIO_BLK_T_IN:
-        write_size = arg->req.write_size;
-        buf = arg->req.buf;
-        if (ret < 0) {
-            buf[write_size - 1] = VIRTIO_BLK_S_IOERR;
-        } else {
-            buf[write_size - 1] = VIRTIO_BLK_S_OK;
-        }
-        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, write_size);
-        free(buf);
-        virtio_consume_desc(s, queue_idx, desc_idx, write_size);
+    switch(offset) {
+    case VIRTIO_PCI_COMMON_DFSELECT:
+        s->device_features_sel = val;
         break;
-    case VIRTIO_BLK_T_OUT:
-        if (ret < 0)
-            buf1[0] = VIRTIO_BLK_S_IOERR;
-        else
-            buf1[0] = VIRTIO_BLK_S_OK;
-        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf1, sizeof(buf1));
-        virtio_consume_desc(s, queue_idx, desc_idx, 1);
+    case VIRTIO_PCI_COMMON_GFSELECT:
+        s->driver_features_sel = val;
+        break;
+    case VIRTIO_PCI_COMMON_GF:
+        virtio_set_driver_features(s, val);
+        break;
+    case VIRTIO_PCI_COMMON_MSIX:
+        s->msix_config = virtio_pci_check_vector(val);
+        break;
+    case VIRTIO_PCI_COMMON_STATUS:
+        virtio_set_status(s, val & 0xff);
+        break;
+    case VIRTIO_PCI_COMMON_Q_SELECT:
+        if (val < MAX_QUEUE)
+            s->queue_sel = val;
+        break;
+    case VIRTIO_PCI_COMMON_Q_SIZE:
+        virtio_set_queue_num(s, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_MSIX:
+        /* the driver reads it back to know if the vector was accepted */
+        qs->msix_vector = virtio_pci_check_vector(val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_ENABLE:
+        qs->ready = val & 1;
+        break;
+    case VIRTIO_PCI_COMMON_Q_DESCLO:
+        set_low32(&qs->desc_addr, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_DESCHI:
+        set_high32(&qs->desc_addr, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_AVAILLO:
+        set_low32(&qs->avail_addr, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_AVAILHI:
+        set_high32(&qs->avail_addr, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_USEDLO:
+        set_low32(&qs->used_addr, val);
+        break;
+    case VIRTIO_PCI_COMMON_Q_USEDHI:
+        set_high32(&qs->used_addr, val);
         break;
-    default:
-        abort();
     }
 }
 
-static void virtio_block_req_cb(struct blk_io_callback_arg *arg, int ret)
+static uint32_t virtio_pci_msix_read(struct virtio_device *s, uint32_t offset)
 {
-    struct virtio_device *s = arg->s;
-    pthread_mutex_lock(&s->lock);
+    int vector = offset / PCI_MSIX_ENTRY_SIZE;
+    struct msix_entry *e = NULL;
 
-    virtio_block_req_end(arg, ret);
-
-    /* handle next requests */
-    queue_notify((struct virtio_device *)s, arg->req.queue_idx);
-    free(arg);
-    pthread_mutex_unlock(&s->lock);
+    if (vector >= VIRTIO_PCI_MSIX_VECTORS)
+        return 0;
+    e = &s->msix_table[vector];
+    switch(offset % PCI_MSIX_ENTRY_SIZE) {
+    case PCI_MSIX_ENTRY_LOWER_ADDR:
+        return e->addr_lo;
+    case PCI_MSIX_ENTRY_UPPER_ADDR:
+        return e->addr_hi;
+    case PCI_MSIX_ENTRY_DATA:
+        return e->data;
+    case PCI_MSIX_ENTRY_VECTOR_CTRL:
+        return e->ctrl;
+    }
+    return 0;
 }
 
-static int virtio_block_recv_request(struct virtio_device *s, int queue_idx,
-                                     int desc_idx, int read_size,
-                                     int write_size)
+static void virtio_pci_msix_write(struct virtio_device *s, uint32_t offset,
+                                  uint32_t val)
 {
-    struct virtio_block_device *s1 = (struct virtio_block_device *)s;
-    struct block_device *bs = s1->bs;
-    struct block_request_header h = {0};
-    uint8_t *buf = {0};
-    int len, ret = {0};
-    
-    if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, sizeof(h)) < 0)
-        return 0;
-    struct blk_io_callback_arg *iocb_arg = malloc(sizeof(struct blk_io_callback_arg));
-    *iocb_arg = (struct blk_io_callback_arg){0};
-    iocb_arg->s = s;
-    iocb_arg->req.type = h.type;
-    iocb_arg->req.queue_idx = queue_idx;
-    iocb_arg->req.desc_idx = desc_idx;
-    switch(h.type) {
-    case VIRTIO_BLK_T_IN:
-        iocb_arg->req.buf = malloc(write_size);
-        memset(iocb_arg->req.buf, 0, write_size);
-        iocb_arg->req.write_size = write_size;
-        ret = bs->read_async(bs, h.sector_num, iocb_arg->req.buf, 
-                             (write_size - 1) / SECTOR_SIZE,
-                             virtio_block_req_cb, iocb_arg);
-        if (ret < 0) {
-            virtio_block_req_end(iocb_arg, ret);
-            free(iocb_arg);
-        }
+    int vector = offset / PCI_MSIX_ENTRY_SIZE;
+    struct msix_entry *e = NULL;
+
+    if (vector >= VIRTIO_PCI_MSIX_VECTORS)
+        return;
+    e = &s->msix_table[vector];
+    switch(offset % PCI_MSIX_ENTRY_SIZE) {
+    case PCI_MSIX_ENTRY_LOWER_ADDR:
+        e->addr_lo = val;
+        e->routed = false;
         break;
-    case VIRTIO_BLK_T_OUT:
-        if (write_size < 1) {
-            fprintf(stderr, "virtio_block_recv_request invalid write_size.\n");
-            abort();
-        }
-        len = read_size - sizeof(h);
-        if (len <= 0) {
-            fprintf(stderr, "virtio_block_recv_request invalid read_size.\n");
-            abort();
-        }
-        buf = malloc(len);
-        memset(buf, 0, len);
-        memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
-        ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
-                              virtio_block_req_cb, iocb_arg);
-        if (ret < 0) {
-            free(buf);
-            virtio_block_req_end(iocb_arg, ret);
-            free(iocb_arg);
-        }
+    case PCI_MSIX_ENTRY_UPPER_ADDR:
+        e->addr_hi = val;
+        e->routed = false;
         break;
-    default:
+    case PCI_MSIX_ENTRY_DATA:
+        e->data = val;
+        e->routed = false;
+        break;
+    case PCI_MSIX_ENTRY_VECTOR_CTRL:
+        e->ctrl = val & PCI_MSIX_ENTRY_CTRL_MASKBIT;
         break;
     }
-    return 0;
+    virtio_pci_msix_update(s, vector);
+    virtio_vhost_update_calls(s);
 }
 
-struct virtio_device *virtio_block_init(struct virtio_bus_def bus, uint64_t mmio_addr, struct block_device *bs)
+static uint32_t virtio_pci_bar_read(struct pci_device *d, int bar,
+                                    uint64_t offset, int size)
 {
-    struct virtio_block_device *s = {0};
-    uint64_t nb_sectors = {0};
+    struct virtio_device *s = d->opaque;
+    uint32_t val = 0;
 
-    s = malloc(sizeof(*s));
-    *s = (struct virtio_block_device){0};
-    if (virtio_init(&s->common, bus, mmio_addr,
-                2, 8, virtio_block_recv_request, VIRTIO_BLK_MAX_QUEUE_NUM) < 0) {
-        free(s);
-        return NULL;
+    pthread_mutex_lock(&s->lock);
+    if (offset < VIRTIO_PCI_COMMON_SIZE) {
+        val = virtio_pci_common_read(s, offset);
+        if (size < 4)
+            val &= (1U << (size * 8)) - 1;
+    } else if (offset == VIRTIO_PCI_ISR_OFFSET) {
+        /* reading acknowledges the interrupt */
+        val = s->int_status;
+        s->int_status = 0;
+    } else if (offset >= VIRTIO_PCI_DEVICE_OFFSET &&
+               offset < VIRTIO_PCI_NOTIFY_OFFSET) {
+        val = virtio_config_read(s, offset - VIRTIO_PCI_DEVICE_OFFSET, size);
+    } else if (offset >= VIRTIO_PCI_MSIX_TABLE_OFFSET &&
+               offset < VIRTIO_PCI_MSIX_PBA_OFFSET && size == 4) {
+        val = virtio_pci_msix_read(s, offset - VIRTIO_PCI_MSIX_TABLE_OFFSET);
+    } else if (offset == VIRTIO_PCI_MSIX_PBA_OFFSET) {
+        val = s->msix_pending;
     }
-    s->bs = bs;
+    pthread_mutex_unlock(&s->lock);
+    return val;
+}
+
+static void virtio_pci_bar_write(struct pci_device *d, int bar,
+                                 uint64_t offset, uint32_t val, int size)
+{
+    struct virtio_device *s = d->opaque;
+    uint32_t queue_idx = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (offset < VIRTIO_PCI_COMMON_SIZE) {
+        virtio_pci_common_write(s, offset, val);
+    } else if (offset >= VIRTIO_PCI_DEVICE_OFFSET &&
+               offset < VIRTIO_PCI_NOTIFY_OFFSET) {
+        virtio_config_write(s, offset - VIRTIO_PCI_DEVICE_OFFSET, val, size);
+    } else if (offset >= VIRTIO_PCI_NOTIFY_OFFSET &&
+               offset < VIRTIO_PCI_MSIX_TABLE_OFFSET) {
+        /* only reached while the ioeventfds are not assigned */
+        queue_idx = (offset - VIRTIO_PCI_NOTIFY_OFFSET) /
+                    VIRTIO_PCI_NOTIFY_MULTIPLIER;
+        if (queue_idx < MAX_QUEUE) {
+            s->queue[queue_idx].stats.kicks++;
+            queue_notify(s, queue_idx);
+        }
+    } else if (offset >= VIRTIO_PCI_MSIX_TABLE_OFFSET &&
+               offset < VIRTIO_PCI_MSIX_PBA_OFFSET && size == 4) {
+        virtio_pci_msix_write(s, offset - VIRTIO_PCI_MSIX_TABLE_OFFSET, val);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* the notification addresses move with the BAR */
+static void virtio_pci_bar_map(struct pci_device *d, int bar, bool mapped)
+{
+    struct virtio_device *s = d->opaque;
+
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        if (s->ioeventfd[i] >= 0)
+            virtio_ioeventfd_assign(s, i, mapped);
+    }
+}
+
+static void virtio_pci_config_write(struct pci_device *d, uint32_t offset,
+                                    int size)
+{
+    struct virtio_device *s = d->opaque;
+    uint32_t flags = VIRTIO_PCI_MSIX_CAP_OFFSET + PCI_MSIX_FLAGS;
+    uint16_t ctrl = 0;
+
+    if (offset + size <= flags || offset >= flags + 2)
+        return;
+    ctrl = get_le16(d->config + flags);
+    pthread_mutex_lock(&s->lock);
+    s->msix_enabled = !!(ctrl & PCI_MSIX_FLAGS_ENABLE);
+    s->msix_masked = !!(ctrl & PCI_MSIX_FLAGS_MASKALL);
+    for (int i = 0; i < VIRTIO_PCI_MSIX_VECTORS; i++)
+        virtio_pci_msix_update(s, i);
+    virtio_vhost_update_calls(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void virtio_pci_add_cap(uint8_t *config, int pos, int next, int len,
+                               int type, uint32_t offset, uint32_t length)
+{
+    config[pos] = PCI_CAP_ID_VNDR;
+    config[pos + 1] = next;
+    config[pos + 2] = len;
+    config[pos + 3] = type;
+    config[pos + 4] = 0; /* BAR */
+    put_le32(config + pos + 8, offset);
+    put_le32(config + pos + 12, length);
+}
+
+static int virtio_pci_init(struct virtio_device *s, struct pci_bus *bus,
+                           int irqline)
+{
+    struct pci_device *d = &s->pci;
+    uint8_t *c = d->config;
+    int pos = VIRTIO_PCI_CAP_OFFSET;
+    int msix = VIRTIO_PCI_MSIX_CAP_OFFSET;
+    struct irq_signal irq = {0};
+
+    put_le16(c + PCI_VENDOR_ID, VIRTIO_PCI_VENDOR_ID);
+    put_le16(c + PCI_DEVICE_ID, VIRTIO_PCI_DEVICE_ID_BASE + s->device_id);
+    c[PCI_REVISION_ID] = 1;
+    /* ethernet controller, other mass storage controller, or other system
+       peripheral */
+    put_le16(c + PCI_CLASS_DEVICE, s->device_id == 1 ? 0x0200 :
+                                   s->device_id == 2 ? 0x0180 : 0x0880);
+    put_le16(c + PCI_SUBSYSTEM_VENDOR_ID, VIRTIO_PCI_VENDOR_ID);
+    put_le16(c + PCI_SUBSYSTEM_ID, s->device_id);
+    put_le16(c + PCI_STATUS, PCI_STATUS_CAP_LIST);
+    c[PCI_CAPABILITY_LIST] = pos;
+    /* INTx, for a driver which does not enable MSI-X */
+    c[PCI_INTERRUPT_LINE] = irqline;
+    c[PCI_INTERRUPT_PIN] = 1;
+    d->wmask[PCI_INTERRUPT_LINE] = 0xff;
+    d->wmask[PCI_COMMAND + 1] = PCI_COMMAND_INTX_DISABLE >> 8;
+
+    virtio_pci_add_cap(c, pos, pos + VIRTIO_PCI_CAP_LEN, VIRTIO_PCI_CAP_LEN,
+                       VIRTIO_PCI_CAP_COMMON_CFG, VIRTIO_PCI_COMMON_OFFSET,
+                       VIRTIO_PCI_COMMON_SIZE);
+    pos += VIRTIO_PCI_CAP_LEN;
+    virtio_pci_add_cap(c, pos, pos + VIRTIO_PCI_CAP_LEN, VIRTIO_PCI_CAP_LEN,
+                       VIRTIO_PCI_CAP_ISR_CFG, VIRTIO_PCI_ISR_OFFSET, 1);
+    pos += VIRTIO_PCI_CAP_LEN;
+    virtio_pci_add_cap(c, pos, pos + VIRTIO_PCI_CAP_LEN, VIRTIO_PCI_CAP_LEN,
+                       VIRTIO_PCI_CAP_DEVICE_CFG, VIRTIO_PCI_DEVICE_OFFSET,
+                       s->config_space_size);
+    pos += VIRTIO_PCI_CAP_LEN;
+    /* queue i is notified at notify offset + i * multiplier */
+    virtio_pci_add_cap(c, pos, msix, VIRTIO_PCI_NOTIFY_CAP_LEN,
+                       VIRTIO_PCI_CAP_NOTIFY_CFG, VIRTIO_PCI_NOTIFY_OFFSET,
+                       MAX_QUEUE * VIRTIO_PCI_NOTIFY_MULTIPLIER);
+    put_le32(c + pos + VIRTIO_PCI_CAP_LEN, VIRTIO_PCI_NOTIFY_MULTIPLIER);
+
+    c[msix] = PCI_CAP_ID_MSIX;
+    c[msix + 1] = 0;
+    put_le16(c + msix + PCI_MSIX_FLAGS, VIRTIO_PCI_MSIX_VECTORS - 1);
+    put_le32(c + msix + PCI_MSIX_TABLE, VIRTIO_PCI_MSIX_TABLE_OFFSET);
+    put_le32(c + msix + PCI_MSIX_PBA, VIRTIO_PCI_MSIX_PBA_OFFSET);
+    d->wmask[msix + PCI_MSIX_FLAGS + 1] =
+        (PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL) >> 8;
+
+    c[PCI_BASE_ADDRESS_0] = PCI_BASE_ADDRESS_MEM_TYPE_64;
+    d->bar_size[0] = VIRTIO_PCI_BAR_SIZE;
+    d->bar_read = virtio_pci_bar_read;
+    d->bar_write = virtio_pci_bar_write;
+    d->bar_map = virtio_pci_bar_map;
+    d->config_write = virtio_pci_config_write;
+    d->opaque = s;
+
+    for (int i = 0; i < VIRTIO_PCI_MSIX_VECTORS; i++) {
+        s->msix_table[i].ctrl = PCI_MSIX_ENTRY_CTRL_MASKBIT;
+        s->msix_gsi[i] = pci_alloc_gsi(bus);
+        if (s->msix_gsi[i] < 0) {
+            fprintf(stderr, "virtio_pci_init: out of GSIs\n");
+            return -1;
+        }
+        irq.vmfd = s->irq.vmfd;
+        irq.irqline = s->msix_gsi[i];
+        if (virtio_irqfd_init(&irq) < 0)
+            return -1;
+        s->msix_irqfd[i] = irq.irqfd;
+    }
+    return pci_register_device(bus, d);
+}
+
+static void virtio_pci_cleanup(struct virtio_device *s)
+{
+    if (!s->pci_bus)
+        return;
+    pci_unregister_device(s->pci_bus, &s->pci);
+    for (int i = 0; i < VIRTIO_PCI_MSIX_VECTORS; i++) {
+        if (s->msix_table[i].routed)
+            pci_remove_msi_route(s->pci_bus, s->msix_gsi[i]);
+        if (s->msix_irqfd[i] >= 0)
+            close(s->msix_irqfd[i]);
+        s->msix_irqfd[i] = -1;
+    }
+}
+
+/*********************************************************************/
+/* vhost */
+
+static bool virtio_vhost_serves(struct virtio_device *s, int queue_idx)
+{
+    return s->vhost_started && (s->vhost_queues & (1U << queue_idx));
+}
+
+/* an interrupt from vhost which could not go straight to an irqfd */
+static void virtio_vhost_call_handler(struct io_handler *h, uint32_t revents)
+{
+    struct virtio_device *s = h->opaque;
+    int qidx = h - s->vhost_call_handler;
+    uint64_t val = 0;
+
+    read(h->fd, &val, sizeof(val));
+    pthread_mutex_lock(&s->lock);
+    virtio_queue_raise_irq(s, &s->queue[qidx]);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* let vhost signal the irqfd of the MSI-X vector of a queue while the
+   vector can be sent as is. Otherwise the interrupt has to set the ISR or
+   be held back in the PBA, and goes through virtio_vhost_call_handler(). */
+static void virtio_vhost_update_calls(struct virtio_device *s)
+{
+    int fd = -1;
+
+    if (!s->vhost_started)
+        return;
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        uint16_t vector = s->queue[i].msix_vector;
+        if (!virtio_vhost_serves(s, i))
+            continue;
+        fd = s->vhost_call[i];
+        if (s->pci_bus && s->msix_enabled && !s->msix_masked &&
+            vector < VIRTIO_PCI_MSIX_VECTORS &&
+            !(s->msix_table[vector].ctrl & PCI_MSIX_ENTRY_CTRL_MASKBIT) &&
+            s->msix_table[vector].routed)
+            fd = s->msix_irqfd[vector];
+        if (fd != s->vhost_call_fd[i] &&
+            s->vhost_ops->set_vring_call(s->vhost_fd, i, fd) == 0)
+            s->vhost_call_fd[i] = fd;
+    }
+}
+
+static int virtio_vhost_start_queue(struct virtio_device *s, int queue_idx)
+{
+    struct queue_state *qs = &s->queue[queue_idx];
+    void *desc = NULL, *avail = NULL, *used = NULL;
+
+    desc = guest_range_to_host(s, qs->desc_addr,
+                               qs->num * sizeof(struct virtio_desc));
+    avail = guest_range_to_host(s, qs->avail_addr, 6 + 2 * qs->num);
+    used = guest_range_to_host(s, qs->used_addr, 6 + 8 * qs->num);
+    if (!desc || !avail || !used) {
+        fprintf(stderr, "vhost: queue %d is outside guest memory\n",
+                queue_idx);
+        return -1;
+    }
+    if (s->vhost_ops->set_vring(s->vhost_fd, queue_idx, qs->num,
+                                qs->last_avail_idx, desc, avail, used,
+                                s->ioeventfd[queue_idx]) < 0)
+        return -1;
+    /* the kicks are for vhost now */
+    io_handler_set_events(&s->ioeventfd_handler[queue_idx], 0);
+    return 0;
+}
+
+/* hand the queues over to vhost, called with the lock held when the
+   driver sets DRIVER_OK */
+static void virtio_vhost_start(struct virtio_device *s)
+{
+    uint64_t features = 0;
+    int i = 0;
+
+    if (s->vhost_fd < 0)
+        return;
+    features = (s->driver_features & s->vhost_features) |
+               s->vhost_backend_features;
+    if (s->vhost_ops->set_features(s->vhost_fd, features) < 0)
+        goto fail;
+    for (i = 0; i < MAX_QUEUE; i++) {
+        if (!(s->vhost_queues & (1U << i)))
+            continue;
+        if (!s->queue[i].ready || virtio_vhost_start_queue(s, i) < 0)
+            goto fail;
+        s->vhost_call_fd[i] = -1;
+    }
+    s->vhost_started = true;
+    virtio_vhost_update_calls(s);
+    for (i = 0; i < MAX_QUEUE; i++) {
+        if ((s->vhost_queues & (1U << i)) &&
+            s->vhost_set_backend(s, i, true) < 0)
+            goto fail;
+    }
+    return;
+fail:
+    virtio_vhost_stop(s);
+    /* the driver has to reset the device */
+    fprintf(stderr, "vhost: failed to start the device\n");
+    s->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    virtio_raise_irq(s, s->msix_config, 2);
+}
+
+/* take the queues back, with the lock held */
+static void virtio_vhost_stop(struct virtio_device *s)
+{
+    if (s->vhost_fd < 0)
+        return;
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        if (!(s->vhost_queues & (1U << i)))
+            continue;
+        io_handler_set_events(&s->ioeventfd_handler[i], EPOLLIN);
+        if (!s->vhost_started)
+            continue;
+        s->vhost_set_backend(s, i, false);
+        /* also stops the ring */
+        s->vhost_ops->get_vring_base(s->vhost_fd, i,
+                                     &s->queue[i].last_avail_idx);
+    }
+    s->vhost_started = false;
+}
+
+/* let the vhost backend on 'fd', which supports 'features', serve the
+   queues in 'queues', acking 'backend_features' on top of the negotiated
+   features. Takes 'fd' over, and must be called before the driver starts. */
+static int virtio_vhost_init(struct virtio_device *s, int fd,
+                             const struct vhost_ops *ops, uint64_t features,
+                             uint32_t queues, uint64_t backend_features)
+{
+    /* what vhost must agree on, the rest is up to the device */
+    const uint64_t ring_features = (1ULL << VIRTIO_F_VERSION_1) |
+                                   (1ULL << VIRTIO_F_RING_PACKED) |
+                                   (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+                                   (1ULL << VIRTIO_RING_F_EVENT_IDX);
+    int i = 0;
+
+    s->vhost_fd = fd;
+    s->vhost_ops = ops;
+    s->vhost_queues = queues;
+    if (!(features & (1ULL << VIRTIO_F_VERSION_1)) ||
+        (features & backend_features) != backend_features) {
+        fprintf(stderr, "vhost: the backend misses features\n");
+        goto fail;
+    }
+    /* e.g. vhost-net does not support packed rings */
+    s->device_features &= ~(ring_features & ~features);
+    s->vhost_features = features & ~backend_features;
+    s->vhost_backend_features = backend_features;
+
+    for (i = 0; i < MAX_QUEUE; i++) {
+        if (!(queues & (1U << i)))
+            continue;
+        s->vhost_call[i] = eventfd(0, EFD_NONBLOCK);
+        if (s->vhost_call[i] < 0) {
+            perror("eventfd");
+            goto fail;
+        }
+        s->vhost_call_handler[i] = (struct io_handler){
+            .fd = s->vhost_call[i],
+            .events = EPOLLIN,
+            .fn = virtio_vhost_call_handler,
+            .opaque = s,
+        };
+        if (io_handler_add(s->iothread, &s->vhost_call_handler[i]) < 0) {
+            close(s->vhost_call[i]);
+            s->vhost_call[i] = -1;
+            goto fail;
+        }
+    }
+    return 0;
+fail:
+    while (--i >= 0) {
+        if (s->vhost_call[i] < 0)
+            continue;
+        io_handler_remove(&s->vhost_call_handler[i]);
+        close(s->vhost_call[i]);
+        s->vhost_call[i] = -1;
+    }
+    close(s->vhost_fd);
+    s->vhost_fd = -1;
+    s->vhost_queues = 0;
+    return -1;
+}
+
+static void virtio_vhost_cleanup(struct virtio_device *s)
+{
+    if (s->vhost_fd < 0)
+        return;
+    pthread_mutex_lock(&s->lock);
+    virtio_vhost_stop(s);
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        if (s->vhost_call[i] < 0)
+            continue;
+        io_handler_remove(&s->vhost_call_handler[i]);
+        close(s->vhost_call[i]);
+        s->vhost_call[i] = -1;
+    }
+    close(s->vhost_fd);
+    s->vhost_fd = -1;
+}
+
+/* the rings of a vhost-user backend start disabled */
+static int virtio_vhost_user_set_backend(struct virtio_device *s,
+                                         int queue_idx, bool start)
+{
+    return vhost_user_set_vring_enable(s->vhost_fd, queue_idx, start);
+}
+
+/* let the vhost-user backend listening on 'path' serve 'queues', with
+   the 'protocol' features */
+static int virtio_vhost_user_init(struct virtio_device *s, const char *path,
+                                  uint32_t queues, uint64_t protocol)
+{
+    uint64_t features = 0;
+    int fd = -1;
+
+    fd = vhost_user_connect(path, s->mem_map->host_mem, s->mem_map->size,
+                            s->mem_map->fd, protocol, &features);
+    if (fd < 0)
+        return -1;
+    s->vhost_set_backend = virtio_vhost_user_set_backend;
+    return virtio_vhost_init(s, fd, &vhost_user_ops, features, queues,
+                             1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+}
+
+static void virtio_cleanup(struct virtio_device *s)
+{
+    virtio_vhost_cleanup(s);
+    virtio_pci_cleanup(s);
+    virtio_ioeventfd_stop(s);
+    virtio_irqfd_cleanup(&s->irq);
+    for (int i = 0; i < MAX_QUEUE; i++)
+        obj_pool_destroy(&s->queue[i].elem_pool);
+}
+
+void virtio_set_debug(struct virtio_device *s, int debug)
+{
+    s->debug = debug;
+}
+
+void virtio_get_queue_stats(struct virtio_device *s, int queue_idx,
+                            struct virtio_queue_stats *stats)
+{
+    *stats = (struct virtio_queue_stats){0};
+    if (queue_idx < 0 || queue_idx >= MAX_QUEUE)
+        return;
+    pthread_mutex_lock(&s->lock);
+    *stats = s->queue[queue_idx].stats;
+    pthread_mutex_unlock(&s->lock);
+    obj_pool_get_stats(&s->queue[queue_idx].elem_pool, &stats->elem_pool);
+}
+
+int virtio_set_coalescing(struct virtio_device *s, int queue_idx,
+                          uint32_t max_frames, uint32_t usecs)
+{
+    if (queue_idx < -1 || queue_idx >= MAX_QUEUE)
+        return -1;
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        struct queue_state *qs = &s->queue[i];
+        if (queue_idx >= 0 && i != queue_idx)
+            continue;
+        qs->coal_conf.max_frames = max_frames;
+        qs->coal_conf.usecs = usecs;
+        qs->coal = qs->coal_conf;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void virtio_set_poll(struct virtio_device *s, uint32_t usecs)
+{
+    pthread_mutex_lock(&s->lock);
+    s->poll_usecs = usecs;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void virtio_print_stats(struct virtio_device *s, const char *name, FILE *f)
+{
+    struct virtio_queue_stats st = {0};
+    char queue[64];
+
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        virtio_get_queue_stats(s, i, &st);
+        if (st.used_bufs == 0)
+            continue;
+        /* buffers published without an interrupt of their own */
+        fprintf(f, "%s queue %d: %" PRIu64 " buffers, %" PRIu64 " batches, "
+                "%" PRIu64 " interrupts, %" PRIu64 " merged\n",
+                name, i, st.used_bufs, st.used_batches, st.irqs,
+                st.used_bufs - st.irqs);
+        fprintf(f, "%s queue %d: %" PRIu64 " kicks",
+                name, i, st.kicks);
+        if (st.polls > 0) {
+            /* how often a spin found work, and requests per ms spent */
+            fprintf(f, ", %" PRIu64 "/%" PRIu64 " polls found work (%.2f%%), "
+                    "%.1f ms polling",
+                    st.poll_hits, st.polls, 100.0 * st.poll_hits / st.polls,
+                    st.poll_ns / 1e6);
+        }
+        fprintf(f, "\n");
+        snprintf(queue, sizeof(queue), "%s queue %d", name, i);
+        pool_print_stats(&st.elem_pool, queue, "elements", f);
+    }
+    if (s->print_stats)
+        s->print_stats(s, name, f);
+}
+
+/*********************************************************************/
+/* block device */
+
+struct virtio_block_device {
+    struct virtio_device common;
+    struct block_device *bs;
+    enum virtio_block_cache cache;
+    /* the reads and writes popped since the queue was last drained, sent
+       merged once it is */
+    struct blk_io_callback_arg *batch[MAX_QUEUE][VIRTIO_BLK_MAX_QUEUE_NUM];
+    int batch_len[MAX_QUEUE];
+    /* the requests of each queue, and the iovecs of the merged ones */
+    struct obj_pool req_pool[MAX_QUEUE];
+    struct buf_pool iov_pool;
+};
+
+struct block_request_header{
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector_num;
+};
+
+#define VIRTIO_BLK_F_SIZE_MAX    1
+#define VIRTIO_BLK_F_SEG_MAX     2
+#define VIRTIO_BLK_F_BLK_SIZE    6
+#define VIRTIO_BLK_F_FLUSH       9
+#define VIRTIO_BLK_F_TOPOLOGY    10
+#define VIRTIO_BLK_F_CONFIG_WCE  11
+#define VIRTIO_BLK_F_DISCARD     13
+#define VIRTIO_BLK_F_WRITE_ZEROES 14
+
+/* a descriptor chain has the header and status around the data */
+#define VIRTIO_BLK_SEG_MAX       (VIRTQUEUE_MAX_SEGS - 2)
+#define VIRTIO_BLK_SIZE_MAX      (1U << 30)
+
+#define VIRTIO_BLK_T_IN          0
+#define VIRTIO_BLK_T_OUT         1
+#define VIRTIO_BLK_T_FLUSH       4
+#define VIRTIO_BLK_T_FLUSH_OUT   5
+#define VIRTIO_BLK_T_DISCARD     11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+/* the segments of discard and write zeroes requests */
+struct block_discard_segment {
+    uint64_t sector_num;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_F_UNMAP 1
+#define VIRTIO_BLK_DISCARD_SECTORS_MAX  (VIRTIO_BLK_SIZE_MAX / SECTOR_SIZE)
+
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+/* virtio_blk_config.writeback, 0 if the driver wants a write through
+   cache */
+#define VIRTIO_BLK_CONFIG_WRITEBACK 32
+
+static void virtio_block_req_end(struct blk_io_callback_arg *arg, int ret)
+{
+    struct virtio_device *s = arg->s;
+    struct block_request *req = &arg->req;
+
+    *req->status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+    virtqueue_push(s, req->elem, req->in_len);
+}
+
+static size_t virtio_block_req_size(const struct virtqueue_element *elem)
+{
+    return sizeof(struct blk_io_callback_arg) +
+           (elem->out_num + elem->in_num) * sizeof(struct iovec);
+}
+
+/* give a request and its element back to the pools of their queue */
+static void virtio_block_req_free(struct blk_io_callback_arg *arg)
+{
+    struct virtio_block_device *s = (struct virtio_block_device *)arg->s;
+    struct virtqueue_element *elem = arg->req.elem;
+
+    obj_pool_free(&s->req_pool[arg->req.queue_idx], arg,
+                  virtio_block_req_size(elem));
+    virtqueue_elem_free(&s->common, elem);
+}
+
+/* complete a request and those merged behind it */
+static void virtio_block_req_done(struct blk_io_callback_arg *arg, int ret)
+{
+    struct virtio_block_device *s = (struct virtio_block_device *)arg->s;
+    struct blk_io_callback_arg *next = NULL;
+
+    if (arg->req.iov != arg->iov)
+        buf_pool_free(&s->iov_pool, arg->req.iov,
+                      arg->req.iovcnt * sizeof(struct iovec));
+    for (; arg; arg = next) {
+        next = arg->merged;
+        virtio_block_req_end(arg, ret);
+        virtio_block_req_free(arg);
+    }
+}
+
+static int virtio_block_issue(struct virtio_block_device *s, int queue_idx);
+
+static void virtio_block_req_cb(struct blk_io_callback_arg *arg, int ret)
+{
+    struct virtio_device *s = arg->s;
+    struct virtio_block_device *s1 = (struct virtio_block_device *)s;
+    int queue_idx = arg->req.queue_idx;
+
+    /* completions arriving while the lock is held are published together
+       by the last one */
+    atomic_fetch_add(&s->completing, 1);
+    pthread_mutex_lock(&s->lock);
+
+    virtio_block_req_done(arg, ret);
+
+    /* the requests the backend had no room for, then the next ones */
+    if (s1->batch_len[queue_idx] > 0) {
+        virtio_block_issue(s1, queue_idx);
+        if (s1->bs->submit)
+            s1->bs->submit(s1->bs);
+    }
+    queue_process(s, queue_idx);
+    if (atomic_fetch_sub(&s->completing, 1) == 1) {
+        for (int i = 0; i < MAX_QUEUE; i++)
+            virtqueue_flush(s, i);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* complete a request which is not sent to the backend */
+static void virtio_block_req_status(struct virtio_device *s,
+                                    struct virtqueue_element *elem,
+                                    uint8_t status)
+{
+    iov_from_buf(elem->in_sg, elem->in_num, elem->in_len - 1, &status, 1);
+    virtqueue_push(s, elem, 1);
+    virtqueue_elem_free(s, elem);
+}
+
+/* the status byte, at in_len - 1: the last writable buffers may be empty */
+static uint8_t *virtio_block_status_ptr(struct virtqueue_element *elem)
+{
+    int i = elem->in_num - 1;
+
+    while (elem->in_sg[i].iov_len == 0)
+        i--;
+    return (uint8_t *)elem->in_sg[i].iov_base + elem->in_sg[i].iov_len - 1;
+}
+
+/* the flags of a write: without a cache the driver can flush, each
+   write must be durable */
+static int virtio_block_write_flags(struct virtio_block_device *s)
+{
+    if (s->cache == VIRTIO_BLK_CACHE_UNSAFE)
+        return 0;
+    if (!virtio_has_feature(&s->common, VIRTIO_BLK_F_FLUSH) ||
+        s->common.config_space[VIRTIO_BLK_CONFIG_WRITEBACK] == 0)
+        return BLOCK_REQ_DSYNC;
+    return 0;
+}
+
+/* bytes of a read or write */
+static size_t virtio_block_req_len(const struct block_request *req)
+{
+    if (req->type == VIRTIO_BLK_T_IN)
+        return req->elem->in_len - 1;
+    return req->elem->out_len - sizeof(struct block_request_header);
+}
+
+/* the priority of the header, as the driver uses the ioprio_set()
+   encoding. The real time class of the host is not for guests, their
+   real time requests are the first of best effort. */
+static uint16_t virtio_block_ioprio(uint32_t ioprio)
+{
+    switch (IOPRIO_PRIO_CLASS(ioprio)) {
+    case IOPRIO_CLASS_RT:
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 0);
+    case IOPRIO_CLASS_BE:
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE,
+                                 IOPRIO_PRIO_DATA(ioprio) % IOPRIO_NR_LEVELS);
+    case IOPRIO_CLASS_IDLE:
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    default:
+        return 0;
+    }
+}
+
+/* lower first, no priority is the normal best effort one */
+static int virtio_block_ioprio_rank(uint16_t ioprio)
+{
+    if (ioprio == 0)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_NORM);
+    return ioprio;
+}
+
+static int virtio_block_req_cmp(const void *a, const void *b)
+{
+    const struct block_request *x = &(*(struct blk_io_callback_arg **)a)->req;
+    const struct block_request *y = &(*(struct blk_io_callback_arg **)b)->req;
+    int xp = virtio_block_ioprio_rank(x->ioprio);
+    int yp = virtio_block_ioprio_rank(y->ioprio);
+
+    if (xp != yp)
+        return xp < yp ? -1 : 1;
+    if (x->type != y->type)
+        return x->type < y->type ? -1 : 1;
+    if (x->sector_num != y->sector_num)
+        return x->sector_num < y->sector_num ? -1 : 1;
+    return 0;
+}
+
+/* the requests at the start of a sorted batch which continue each other,
+   chained behind the first. Return how many, and their buffers. */
+static int virtio_block_merge(struct virtio_block_device *s,
+                              struct blk_io_callback_arg **batch, int n,
+                              struct iovec **iov, int *iovcnt)
+{
+    struct block_request *first = &batch[0]->req;
+    size_t len = virtio_block_req_len(first), next_len = 0;
+    int k = 1, cnt = first->iovcnt;
+
+    *iov = first->iov;
+    *iovcnt = first->iovcnt;
+    for (; k < n; k++) {
+        next_len = virtio_block_req_len(&batch[k]->req);
+        if (batch[k]->req.type != first->type ||
+            batch[k]->req.ioprio != first->ioprio ||
+            batch[k]->req.sector_num != first->sector_num + len / SECTOR_SIZE ||
+            len + next_len > VIRTIO_BLK_MERGE_MAX ||
+            cnt + batch[k]->req.iovcnt > VIRTQUEUE_MAX_SEGS)
+            break;
+        len += next_len;
+        cnt += batch[k]->req.iovcnt;
+    }
+    if (k == 1)
+        return 1;
+    *iov = buf_pool_alloc(&s->iov_pool, cnt * sizeof(struct iovec));
+    if (!*iov) {
+        *iov = first->iov;
+        return 1;
+    }
+    cnt = 0;
+    for (int i = 0; i < k; i++) {
+        memcpy(*iov + cnt, batch[i]->req.iov,
+               batch[i]->req.iovcnt * sizeof(struct iovec));
+        cnt += batch[i]->req.iovcnt;
+        batch[i]->merged = i + 1 < k ? batch[i + 1] : NULL;
+    }
+    *iovcnt = cnt;
+    return k;
+}
+
+/* send the batch sorted by priority and sector, the contiguous requests
+   of the same direction in one backend request. -EAGAIN if the backend is full, the
+   rest of the batch is sent when a request completes. */
+static int virtio_block_issue(struct virtio_block_device *s, int queue_idx)
+{
+    struct block_device *bs = s->bs;
+    struct blk_io_callback_arg **batch = s->batch[queue_idx];
+    struct blk_io_callback_arg *arg = NULL;
+    struct iovec *iov = NULL;
+    int n = s->batch_len[queue_idx];
+    int i = 0, k = 0, iovcnt = 0, ret = 0;
+
+    if (n > 1)
+        qsort(batch, n, sizeof(*batch), virtio_block_req_cmp);
+    for (i = 0; i < n; i += k) {
+        arg = batch[i];
+        k = virtio_block_merge(s, batch + i, n - i, &iov, &iovcnt);
+        if (arg->req.type == VIRTIO_BLK_T_IN) {
+            ret = bs->read_async(bs, arg->req.sector_num, iov, iovcnt,
+                                 arg->req.ioprio, virtio_block_req_cb, arg);
+        } else {
+            ret = bs->write_async(bs, arg->req.sector_num, iov, iovcnt,
+                                  arg->req.ioprio, virtio_block_write_flags(s),
+                                  virtio_block_req_cb, arg);
+        }
+        if (ret == -EAGAIN) {
+            if (iov != arg->req.iov)
+                buf_pool_free(&s->iov_pool, iov,
+                              iovcnt * sizeof(struct iovec));
+            for (int j = i; j < i + k; j++)
+                batch[j]->merged = NULL;
+            break;
+        }
+        /* the completion holds the device lock, it has not run yet */
+        arg->req.iov = iov;
+        arg->req.iovcnt = iovcnt;
+        /* failed, or a read served right away */
+        if (ret != 0)
+            virtio_block_req_done(arg, ret < 0 ? ret : 0);
+    }
+    memmove(batch, batch + i, (n - i) * sizeof(*batch));
+    s->batch_len[queue_idx] = n - i;
+    return i < n ? -EAGAIN : 0;
+}
+
+/* read the segments of a discard or write zeroes request, return the
+   status to complete it with if they are not valid */
+static int virtio_block_get_ranges(struct virtio_block_device *s,
+                                   struct virtqueue_element *elem,
+                                   uint32_t type, struct block_range *ranges,
+                                   int *n)
+{
+    struct block_device *bs = s->bs;
+    struct block_discard_segment seg = {0};
+    size_t len = elem->out_len - sizeof(struct block_request_header);
+    uint64_t sectors = bs->get_sector_count(bs);
+    uint32_t flags = type == VIRTIO_BLK_T_WRITE_ZEROES ?
+                     VIRTIO_BLK_WRITE_ZEROES_F_UNMAP : 0;
+
+    if ((type == VIRTIO_BLK_T_DISCARD ? !bs->discard_async :
+                                        !bs->write_zeroes_async) ||
+        len == 0 || len % sizeof(seg) != 0 ||
+        len / sizeof(seg) > VIRTIO_BLK_DISCARD_SEG_MAX)
+        return VIRTIO_BLK_S_UNSUPP;
+    *n = len / sizeof(seg);
+    for (int i = 0; i < *n; i++) {
+        iov_to_buf(elem->out_sg, elem->out_num,
+                   sizeof(struct block_request_header) + i * sizeof(seg),
+                   &seg, sizeof(seg));
+        if (seg.flags & ~flags)
+            return VIRTIO_BLK_S_UNSUPP;
+        if (seg.num_sectors > VIRTIO_BLK_DISCARD_SECTORS_MAX ||
+            seg.sector_num > sectors ||
+            seg.num_sectors > sectors - seg.sector_num)
+            return VIRTIO_BLK_S_IOERR;
+        ranges[i].sector_num = seg.sector_num;
+        ranges[i].num_sectors = seg.num_sectors;
+        ranges[i].unmap = seg.flags & VIRTIO_BLK_WRITE_ZEROES_F_UNMAP;
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+static int virtio_block_recv_request(struct virtio_device *s, int queue_idx,
+                                     struct virtqueue_element *elem)
+{
+    struct virtio_block_device *s1 = (struct virtio_block_device *)s;
+    struct block_device *bs = s1->bs;
+    struct block_request_header h = {0};
+    struct blk_io_callback_arg *iocb_arg = NULL;
+    struct block_range ranges[VIRTIO_BLK_DISCARD_SEG_MAX];
+    size_t len = 0;
+    int nranges = 0;
+    int ret = 0;
+    uint8_t status = 0;
+
+    if (elem->in_len < 1 ||
+        iov_to_buf(elem->out_sg, elem->out_num, 0, &h, sizeof(h)) < sizeof(h)) {
+        fprintf(stderr, "virtio_block_recv_request: invalid request.\n");
+        virtqueue_push(s, elem, 0);
+        virtqueue_elem_free(s, elem);
+        return 0;
+    }
+    switch(h.type) {
+    case VIRTIO_BLK_T_IN:
+        len = elem->in_len - 1;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        len = elem->out_len - sizeof(h);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        break;
+    default:
+        virtio_block_req_status(s, elem, VIRTIO_BLK_S_UNSUPP);
+        return 0;
+    }
+    if (!bs) {
+        /* a kick for the vhost-user backend before DRIVER_OK */
+        virtio_block_req_status(s, elem, VIRTIO_BLK_S_IOERR);
+        return 0;
+    }
+    if (h.type == VIRTIO_BLK_T_FLUSH) {
+        if (!bs->flush_async) {
+            virtio_block_req_status(s, elem, VIRTIO_BLK_S_UNSUPP);
+            goto submit;
+        }
+        /* the data may stay in the host page cache */
+        if (s1->cache == VIRTIO_BLK_CACHE_UNSAFE) {
+            virtio_block_req_status(s, elem, VIRTIO_BLK_S_OK);
+            goto submit;
+        }
+    } else if (h.type == VIRTIO_BLK_T_DISCARD ||
+               h.type == VIRTIO_BLK_T_WRITE_ZEROES) {
+        status = virtio_block_get_ranges(s1, elem, h.type, ranges, &nranges);
+        if (status != VIRTIO_BLK_S_OK) {
+            virtio_block_req_status(s, elem, status);
+            goto submit;
+        }
+    } else if (len % SECTOR_SIZE != 0 ||
+               h.sector_num > bs->get_sector_count(bs) ||
+               len / SECTOR_SIZE > bs->get_sector_count(bs) - h.sector_num) {
+        virtio_block_req_status(s, elem, VIRTIO_BLK_S_IOERR);
+        goto submit;
+    }
+
+    iocb_arg = obj_pool_alloc(&s1->req_pool[queue_idx],
+                              virtio_block_req_size(elem));
+    if (!iocb_arg) {
+        virtio_block_req_status(s, elem, VIRTIO_BLK_S_IOERR);
+        goto submit;
+    }
+    iocb_arg->s = s;
+    iocb_arg->merged = NULL;
+    iocb_arg->req.type = h.type;
+    iocb_arg->req.ioprio = virtio_block_ioprio(h.ioprio);
+    iocb_arg->req.sector_num = h.sector_num;
+    iocb_arg->req.elem = elem;
+    iocb_arg->req.queue_idx = queue_idx;
+    iocb_arg->req.iov = iocb_arg->iov;
+    iocb_arg->req.status = virtio_block_status_ptr(elem);
+    if (h.type == VIRTIO_BLK_T_IN || h.type == VIRTIO_BLK_T_OUT) {
+        if (h.type == VIRTIO_BLK_T_IN) {
+            iocb_arg->req.in_len = elem->in_len;
+            iocb_arg->req.iovcnt = iov_slice(iocb_arg->iov, elem->in_sg,
+                                             elem->in_num, 0, len);
+        } else {
+            iocb_arg->req.in_len = 1;
+            iocb_arg->req.iovcnt = iov_slice(iocb_arg->iov, elem->out_sg,
+                                             elem->out_num, sizeof(h), len);
+        }
+        if (s1->batch_len[queue_idx] == VIRTIO_BLK_MAX_QUEUE_NUM)
+            ret = virtio_block_issue(s1, queue_idx);
+        if (ret == 0)
+            s1->batch[queue_idx][s1->batch_len[queue_idx]++] = iocb_arg;
+    } else {
+        iocb_arg->req.in_len = 1;
+        iocb_arg->req.iovcnt = 0;
+        /* after the reads and writes popped before */
+        ret = virtio_block_issue(s1, queue_idx);
+        if (ret == 0 && h.type == VIRTIO_BLK_T_FLUSH) {
+            ret = bs->flush_async(bs, virtio_block_req_cb, iocb_arg);
+        } else if (ret == 0 && h.type == VIRTIO_BLK_T_DISCARD) {
+            ret = bs->discard_async(bs, ranges, nranges, virtio_block_req_cb,
+                                    iocb_arg);
+        } else if (ret == 0) {
+            ret = bs->write_zeroes_async(bs, ranges, nranges,
+                                         virtio_block_write_flags(s1),
+                                         virtio_block_req_cb, iocb_arg);
+        }
+    }
+submit:
+    /* the reads and writes of a kick go out together, once it is drained */
+    if (s1->batch_len[queue_idx] > 0 && !virtio_queue_has_avail(s, queue_idx))
+        virtio_block_issue(s1, queue_idx);
+    /* one submission for the requests of a kick, also when the last one
+       is completed here */
+    if (bs->submit &&
+        (ret == -EAGAIN || !virtio_queue_has_avail(s, queue_idx)))
+        bs->submit(bs);
+    if (ret == -EAGAIN) {
+        /* backend is full, retried when a request completes */
+        obj_pool_free(&s1->req_pool[queue_idx], iocb_arg,
+                      virtio_block_req_size(elem));
+        return -1;
+    }
+    /* failed, or a read served right away */
+    if (ret != 0) {
+        virtio_block_req_end(iocb_arg, ret < 0 ? ret : 0);
+        virtio_block_req_free(iocb_arg);
+    }
+    return 0;
+}
+
+/* tell the driver the block sizes of the storage, so that it aligns its
+   requests */
+static void virtio_block_set_topology(struct virtio_block_device *s,
+                                      const struct block_topology *t)
+{
+    uint8_t *config = s->common.config_space;
+    uint32_t lbs = t->logical_block_size;
+    int exp = 0;
+
+    if (lbs == 0)
+        return;
+    s->common.device_features |= 1ULL << VIRTIO_BLK_F_BLK_SIZE;
+    put_le32(config + 20, lbs);
+    if (t->physical_block_size <= lbs && t->min_io_size == 0 &&
+        t->opt_io_size == 0)
+        return;
+    s->common.device_features |= 1ULL << VIRTIO_BLK_F_TOPOLOGY;
+    while ((lbs << (exp + 1)) <= t->physical_block_size && exp < 16)
+        exp++;
+    config[24] = exp;                               /* physical_block_exp */
+    config[25] = 0;                                 /* alignment_offset */
+    put_le16(config + 26, t->min_io_size / lbs);    /* in logical blocks */
+    put_le32(config + 28, t->opt_io_size / lbs);
+}
+
+/* the guest then frees the blocks of deleted files, and zeroes blocks
+   without sending the zeroes */
+static void virtio_block_set_discard(struct virtio_block_device *s,
+                                     const struct block_topology *t)
+{
+    struct block_device *bs = s->bs;
+    uint8_t *config = s->common.config_space;
+    /* in sectors, the host frees whole blocks */
+    uint32_t align = t->physical_block_size / SECTOR_SIZE;
+
+    if (bs->discard_async) {
+        s->common.device_features |= 1ULL << VIRTIO_BLK_F_DISCARD;
+        put_le32(config + 36, VIRTIO_BLK_DISCARD_SECTORS_MAX);
+        put_le32(config + 40, VIRTIO_BLK_DISCARD_SEG_MAX);
+        put_le32(config + 44, align ? align : 1);
+    }
+    if (bs->write_zeroes_async) {
+        s->common.device_features |= 1ULL << VIRTIO_BLK_F_WRITE_ZEROES;
+        put_le32(config + 48, VIRTIO_BLK_DISCARD_SECTORS_MAX);
+        put_le32(config + 52, VIRTIO_BLK_DISCARD_SEG_MAX);
+        config[56] = 1;                 /* write_zeroes_may_unmap */
+    }
+}
+
+static void virtio_block_print_stats(struct virtio_device *s,
+                                     const char *name, FILE *f)
+{
+    struct virtio_block_device *s1 = (struct virtio_block_device *)s;
+    struct pool_stats st = {0}, total = {0};
+
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        obj_pool_get_stats(&s1->req_pool[i], &st);
+        total.hits += st.hits;
+        total.misses += st.misses;
+    }
+    pool_print_stats(&total, name, "requests", f);
+    buf_pool_get_stats(&s1->iov_pool, &st);
+    pool_print_stats(&st, name, "merged iovecs", f);
+    if (s1->bs && s1->bs->print_stats)
+        s1->bs->print_stats(s1->bs, name, f);
+}
+
+/* drop the requests the backend never took, their ring is gone */
+static void virtio_block_reset(struct virtio_device *s)
+{
+    struct virtio_block_device *s1 = (struct virtio_block_device *)s;
+
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        for (int j = 0; j < s1->batch_len[i]; j++)
+            virtio_block_req_free(s1->batch[i][j]);
+        s1->batch_len[i] = 0;
+    }
+}
+
+/* the requests in flight are at most a queue of them */
+static int virtio_block_pools_init(struct virtio_block_device *s)
+{
+    for (int i = 0; i < MAX_QUEUE; i++) {
+        if (obj_pool_init(&s->req_pool[i], sizeof(struct blk_io_callback_arg) +
+                          VIRTQUEUE_POOL_SEGS * sizeof(struct iovec), 0,
+                          VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+            obj_pool_prealloc(&s->req_pool[i], VIRTIO_BLK_MAX_QUEUE_NUM) < 0)
+            return -1;
+    }
+    /* the iovecs of the merged requests, of the smallest size */
+    if (buf_pool_init(&s->iov_pool, VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+        buf_pool_prealloc(&s->iov_pool, POOL_BUF_MIN,
+                          VIRTIO_BLK_MAX_QUEUE_NUM) < 0)
+        return -1;
+    s->common.reset = virtio_block_reset;
+    s->common.print_stats = virtio_block_print_stats;
+    return 0;
+}
+
+static void virtio_block_pools_destroy(struct virtio_block_device *s)
+{
+    for (int i = 0; i < MAX_QUEUE; i++)
+        obj_pool_destroy(&s->req_pool[i]);
+    buf_pool_destroy(&s->iov_pool);
+}
+
+struct virtio_device *virtio_block_init(struct virtio_bus_def bus, uint64_t mmio_addr, struct block_device *bs)
+{
+    struct virtio_block_device *s = {0};
+    uint64_t nb_sectors = {0};
+
+    s = malloc(sizeof(*s));
+    *s = (struct virtio_block_device){0};
+    if (virtio_init(&s->common, bus, mmio_addr,
+                2, 60, virtio_block_recv_request, VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+        virtio_block_pools_init(s) < 0) {
+        free(s);
+        return NULL;
+    }
+    s->bs = bs;
 
     nb_sectors = bs->get_sector_count(bs);
     put_le32(s->common.config_space, nb_sectors);
     put_le32(s->common.config_space + 4, nb_sectors >> 32);
+    /* without SEG_MAX, Linux sends a single segment per request */
+    s->common.device_features |= (1ULL << VIRTIO_BLK_F_SIZE_MAX) |
+                                 (1ULL << VIRTIO_BLK_F_SEG_MAX);
+    put_le32(s->common.config_space + 8, VIRTIO_BLK_SIZE_MAX);
+    put_le32(s->common.config_space + 12, VIRTIO_BLK_SEG_MAX);
+    virtio_block_set_topology(s, &bs->topology);
+    /* the driver may switch between write back and write through */
+    if (bs->flush_async) {
+        s->common.device_features |= (1ULL << VIRTIO_BLK_F_FLUSH) |
+                                     (1ULL << VIRTIO_BLK_F_CONFIG_WCE);
+        virtio_block_set_cache(&s->common, VIRTIO_BLK_CACHE_WRITEBACK);
+    }
+    virtio_block_set_discard(s, &bs->topology);
+
+    return (struct virtio_device *)s;
+}
+
+int virtio_block_set_cache(struct virtio_device *s,
+                           enum virtio_block_cache cache)
+{
+    struct virtio_block_device *s1 = (struct virtio_block_device *)s;
+
+    if (!s1->bs || !s1->bs->flush_async)
+        return -1;
+    s1->cache = cache;
+    s->config_space[VIRTIO_BLK_CONFIG_WRITEBACK] =
+        cache != VIRTIO_BLK_CACHE_WRITETHROUGH;
+    return 0;
+}
+
+int virtio_block_parse_cache(const char *name, enum virtio_block_cache *cache)
+{
+    if (strcmp(name, "writeback") == 0)
+        *cache = VIRTIO_BLK_CACHE_WRITEBACK;
+    else if (strcmp(name, "writethrough") == 0)
+        *cache = VIRTIO_BLK_CACHE_WRITETHROUGH;
+    else if (strcmp(name, "unsafe") == 0)
+        *cache = VIRTIO_BLK_CACHE_UNSAFE;
+    else
+        return -1;
+    return 0;
+}
+
+/* the config space of virtio_blk_config up to the write zeroes fields */
+#define VIRTIO_BLK_VHOST_USER_CONFIG_SIZE 60
 
+struct virtio_device *virtio_block_init_vhost_user(struct virtio_bus_def bus,
+                                                   uint64_t mmio_addr,
+                                                   const char *path)
+{
+    struct virtio_block_device *s = NULL;
+
+    s = malloc(sizeof(*s));
+    *s = (struct virtio_block_device){0};
+    if (virtio_init(&s->common, bus, mmio_addr,
+                2, VIRTIO_BLK_VHOST_USER_CONFIG_SIZE, virtio_block_recv_request,
+                VIRTIO_BLK_MAX_QUEUE_NUM) < 0 ||
+        virtio_block_pools_init(s) < 0) {
+        free(s);
+        return NULL;
+    }
+    if (virtio_vhost_user_init(&s->common, path, 1U << 0,
+                               1ULL << VHOST_USER_PROTOCOL_F_CONFIG) < 0 ||
+        vhost_user_get_config(s->common.vhost_fd, s->common.config_space,
+                              VIRTIO_BLK_VHOST_USER_CONFIG_SIZE) < 0) {
+        virtio_cleanup(&s->common);
+        virtio_block_pools_destroy(s);
+        free(s);
+        return NULL;
+    }
+    /* the device specific features are up to the backend */
+    s->common.device_features |= s->common.vhost_features & 0xffffff;
     return (struct virtio_device *)s;
 }
 
 void virtio_block_destroy(struct virtio_device *s) {
     struct virtio_block_device *bs = (void*)s;
-    virtio_ioeventfd_stop(s);
-    virtio_irqfd_cleanup(&s->irq);
+    virtio_cleanup(s);
+    virtio_block_reset(s);
+    virtio_block_pools_destroy(bs);
     free(bs->bs);
 }
 
 void* virtio_block_get_opaque(struct virtio_device *s) {
     struct virtio_block_device *bs = (void*)s;
-    return bs->bs->opaque;
+    return bs->bs ? bs->bs->opaque : NULL;
+}
+
+struct block_device *virtio_block_get_device(struct virtio_device *s) {
+    struct virtio_block_device *bs = (void*)s;
+    return bs->bs;
 }
 
 /*********************************************************************/
@@ -1092,6 +3030,7 @@ struct virtio_net_device {
     struct virtio_device common;
     struct ether_device *es;
     int header_size;
+    int tap_fd; /* with vhost-net */
 };
 
 struct __attribute__((packed)) virtio_io_net_header {
@@ -1104,26 +3043,102 @@ struct __attribute__((packed)) virtio_io_net_header {
     uint16_t num_buffers;
 };
 
+#define VIRTIO_NET_F_MAC        5
+#define VIRTIO_NET_F_CTRL_VQ    17
+#define VIRTIO_NET_F_NOTF_COAL  53
+
+#define VIRTIO_NET_RX_QUEUE     0
+#define VIRTIO_NET_TX_QUEUE     1
+#define VIRTIO_NET_CTRL_QUEUE   2
+
+#define VIRTIO_NET_OK   0
+#define VIRTIO_NET_ERR  1
+
+#define VIRTIO_NET_CTRL_NOTF_COAL           6
+#define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET    0
+#define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET    1
+
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+};
+
+struct virtio_net_ctrl_coal {
+    uint32_t max_packets;
+    uint32_t usecs;
+};
+
+static uint8_t virtio_net_ctrl_coal(struct virtio_device *s, uint8_t cmd,
+                                    struct virtqueue_element *elem)
+{
+    struct virtio_net_ctrl_coal coal = {0};
+    struct queue_state *qs = NULL;
+
+    if (iov_to_buf(elem->out_sg, elem->out_num,
+                   sizeof(struct virtio_net_ctrl_hdr),
+                   &coal, sizeof(coal)) < sizeof(coal))
+        return VIRTIO_NET_ERR;
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_NOTF_COAL_TX_SET:
+        qs = &s->queue[VIRTIO_NET_TX_QUEUE];
+        break;
+    case VIRTIO_NET_CTRL_NOTF_COAL_RX_SET:
+        qs = &s->queue[VIRTIO_NET_RX_QUEUE];
+        break;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+    qs->coal.max_frames = coal.max_packets;
+    qs->coal.usecs = coal.usecs;
+    if (qs->coal.usecs == 0 && qs->coal_pending > 0)
+        virtio_queue_raise_irq(s, qs);
+    return VIRTIO_NET_OK;
+}
+
+/* the control queue, only interrupt coalescing commands are supported */
+static void virtio_net_ctrl(struct virtio_device *s,
+                            struct virtqueue_element *elem)
+{
+    struct virtio_net_ctrl_hdr h = {0};
+    uint8_t ack = VIRTIO_NET_ERR;
+
+    if (elem->in_len < 1) {
+        virtqueue_push(s, elem, 0);
+        virtqueue_elem_free(s, elem);
+        return;
+    }
+    if (iov_to_buf(elem->out_sg, elem->out_num, 0, &h, sizeof(h)) == sizeof(h) &&
+        h.class == VIRTIO_NET_CTRL_NOTF_COAL &&
+        virtio_has_feature(s, VIRTIO_NET_F_NOTF_COAL)) {
+        ack = virtio_net_ctrl_coal(s, h.cmd, elem);
+    }
+    iov_from_buf(elem->in_sg, elem->in_num, 0, &ack, sizeof(ack));
+    virtqueue_push(s, elem, sizeof(ack));
+    virtqueue_elem_free(s, elem);
+}
+
 static int virtio_net_recv_request(struct virtio_device *s, int queue_idx,
-                                   int desc_idx, int read_size,
-                                   int write_size)
+                                   struct virtqueue_element *elem)
 {
     struct virtio_net_device *s1 = (struct virtio_net_device *)s;
     struct ether_device *es = s1->es;
-    struct virtio_io_net_header h = {0};
-    uint8_t *buf = {0};
-    int len = {0};
-    if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, s1->header_size) < 0)
+    struct iovec iov[VIRTQUEUE_MAX_SEGS];
+    int iovcnt = 0;
+
+    if (queue_idx == VIRTIO_NET_CTRL_QUEUE) {
+        virtio_net_ctrl(s, elem);
         return 0;
-    len = read_size - s1->header_size;
-    buf = malloc(len);
-    memset(buf, 0, len);
-    memcpy_from_queue(s, buf, queue_idx, desc_idx, s1->header_size, len);
-    DEBUG("tx packet, queue idx： %d, len: %d\n", queue_idx, len);
-    es->write_packet_to_ether(es, buf, len);
-    free(buf);
-    virtio_consume_desc(s, queue_idx, desc_idx, 0);
-    DEBUG("tx packet proc finish, queue idx： %d, len: %d\n", queue_idx, len);
+    }
+
+    /* skip the header, the packet is sent straight from guest memory */
+    iovcnt = iov_slice(iov, elem->out_sg, elem->out_num, s1->header_size,
+                       elem->out_len - min_size(elem->out_len, s1->header_size));
+    DEBUG("tx packet, queue idx： %d, len: %zu\n", queue_idx, elem->out_len);
+    if (elem->out_len > (size_t)s1->header_size && iovcnt > 0)
+        es->write_packet_to_ether(es, iov, iovcnt);
+    virtqueue_push(s, elem, 0);
+    virtqueue_elem_free(s, elem);
+    DEBUG("tx packet proc finish, queue idx： %d\n", queue_idx);
     return 0;
 }
 
@@ -1132,15 +3147,13 @@ static bool virtio_net_can_write_packet(struct ether_device *es)
     bool ret = 0;
     struct virtio_device *s = es->device_opaque;
     pthread_mutex_lock(&s->lock);
-    struct queue_state *qs = &s->queue[0];
-    uint16_t avail_idx = {0};
+    struct queue_state *qs = &s->queue[VIRTIO_NET_RX_QUEUE];
 
     if (!qs->ready) {
         ret = false;
         goto end;
     }
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    ret = qs->last_avail_idx != avail_idx;
+    ret = virtio_queue_has_avail(s, VIRTIO_NET_RX_QUEUE);
 end:
     pthread_mutex_unlock(&s->lock);
     DEBUG("can write packet: %d\n", ret);
@@ -1153,34 +3166,41 @@ static void virtio_net_write_packet(struct ether_device *es, const uint8_t *buf,
     pthread_mutex_lock(&s->lock);
 
     struct virtio_net_device *s1 = (struct virtio_net_device *)s;
-    int queue_idx = 0;
+    int queue_idx = VIRTIO_NET_RX_QUEUE;
     struct queue_state *qs = &s->queue[queue_idx];
-    int desc_idx = {0};
+    struct virtqueue_element *elem = NULL;
     struct virtio_io_net_header h = {0};
-    int len = {0}, read_size = {0}, write_size = {0};
-    uint16_t avail_idx = {0};
+    size_t len = 0;
 
     if (!qs->ready)
         goto end;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
-        goto end;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
-    if (get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx))
+    elem = virtqueue_pop(s, queue_idx);
+    if (!elem)
         goto end;
-    len = s1->header_size + buf_len; 
-    if (len > write_size)
+    len = s1->header_size + buf_len;
+    if (len > elem->in_len) {
+        virtqueue_unpop(s, elem);
+        virtqueue_elem_free(s, elem);
         goto end;
-    memset(&h, 0, s1->header_size);
-    memcpy_to_queue(s, queue_idx, desc_idx, 0, &h, s1->header_size);
-    memcpy_to_queue(s, queue_idx, desc_idx, s1->header_size, buf, buf_len);
-    virtio_consume_desc(s, queue_idx, desc_idx, len);
-    qs->last_avail_idx++;
+    }
+    iov_from_buf(elem->in_sg, elem->in_num, 0, &h, s1->header_size);
+    iov_from_buf(elem->in_sg, elem->in_num, s1->header_size, buf, buf_len);
+    virtqueue_push(s, elem, len);
+    virtqueue_elem_free(s, elem);
 end:
     pthread_mutex_unlock(&s->lock);
 }
 
+/* the packets of a burst are published at once, with a single interrupt */
+static void virtio_net_flush_packets(struct ether_device *es)
+{
+    struct virtio_device *s = es->device_opaque;
+
+    pthread_mutex_lock(&s->lock);
+    virtqueue_flush(s, VIRTIO_NET_RX_QUEUE);
+    pthread_mutex_unlock(&s->lock);
+}
+
 struct virtio_device *virtio_net_init(struct virtio_bus_def bus, uint64_t mmio_addr, struct ether_device *es)
 {
     struct virtio_net_device *s = NULL;
@@ -1193,8 +3213,11 @@ struct virtio_device *virtio_net_init(struct virtio_bus_def bus, uint64_t mmio_a
         return NULL;
     }
     /* VIRTIO_NET_F_MAC, VIRTIO_NET_F_STATUS */
-    s->common.device_features = (1 << 5) /* | (1 << 16) */;
-    s->common.queue[0].manual_recv = true;
+    s->common.device_features |= (1ULL << VIRTIO_NET_F_MAC) /* | (1 << 16) */;
+    /* let the driver tune interrupt coalescing itself */
+    s->common.device_features |= (1ULL << VIRTIO_NET_F_CTRL_VQ) |
+                                 (1ULL << VIRTIO_NET_F_NOTF_COAL);
+    s->common.queue[VIRTIO_NET_RX_QUEUE].manual_recv = true;
     s->es = es;
     memcpy(s->common.config_space, es->mac_addr, 6);
     /* status */
@@ -1206,17 +3229,458 @@ struct virtio_device *virtio_net_init(struct virtio_bus_def bus, uint64_t mmio_a
     es->device_opaque = s;
     es->can_write_packet_to_virtio = virtio_net_can_write_packet;
     es->write_packet_to_virtio = virtio_net_write_packet;
+    es->flush_packets_to_virtio = virtio_net_flush_packets;
     return (struct virtio_device *)s;
 }
 
+static int virtio_net_vhost_set_backend(struct virtio_device *s,
+                                        int queue_idx, bool start)
+{
+    struct virtio_net_device *s1 = (struct virtio_net_device *)s;
+
+    return vhost_net_set_backend(s->vhost_fd, queue_idx,
+                                 start ? s1->tap_fd : -1);
+}
+
+int virtio_net_set_vhost(struct virtio_device *s, int tap_fd)
+{
+    struct virtio_net_device *s1 = (struct virtio_net_device *)s;
+    uint64_t features = 0;
+    int fd = -1, ret = 0;
+
+    fd = vhost_open("/dev/vhost-net", s->mem_map->host_mem, s->mem_map->size,
+                    &features);
+    if (fd < 0)
+        return -1;
+    s1->tap_fd = tap_fd;
+    s->vhost_set_backend = virtio_net_vhost_set_backend;
+    /* the tap device has no virtio-net header, vhost deals with it */
+    ret = virtio_vhost_init(s, fd, &vhost_kernel_ops, features,
+                            (1U << VIRTIO_NET_RX_QUEUE) |
+                            (1U << VIRTIO_NET_TX_QUEUE), VHOST_NET_F_HDR);
+    if (ret == 0) {
+        /* the interrupts are up to vhost */
+        s->device_features &= ~(1ULL << VIRTIO_NET_F_NOTF_COAL);
+    }
+    return ret;
+}
+
+int virtio_net_set_vhost_user(struct virtio_device *s, const char *path)
+{
+    int ret = 0;
+
+    ret = virtio_vhost_user_init(s, path, (1U << VIRTIO_NET_RX_QUEUE) |
+                                          (1U << VIRTIO_NET_TX_QUEUE), 0);
+    if (ret == 0)
+        s->device_features &= ~(1ULL << VIRTIO_NET_F_NOTF_COAL);
+    return ret;
+}
+
 void virtio_net_destroy(struct virtio_device *s) {
     struct virtio_net_device *es = (void*)s;
-    virtio_ioeventfd_stop(s);
-    virtio_irqfd_cleanup(&s->irq);
+    virtio_cleanup(s);
     free(es->es);
 }
 
 void* virtio_net_get_opaque(struct virtio_device *s) {
     struct virtio_net_device *es = (void*)s;
     return es->es->opaque;
-}
\ No newline at end of file
+}
+/*********************************************************************/
+/* socket device */
+
+#define VIRTIO_VSOCK_RX_QUEUE    0
+#define VIRTIO_VSOCK_TX_QUEUE    1
+#define VIRTIO_VSOCK_EVENT_QUEUE 2
+
+/* the packets are up to vhost, only a kick racing with DRIVER_OK gets
+   here */
+static int virtio_vsock_recv_request(struct virtio_device *s, int queue_idx,
+                                     struct virtqueue_element *elem)
+{
+    virtqueue_push(s, elem, 0);
+    virtqueue_elem_free(s, elem);
+    return 0;
+}
+
+/* vhost-vsock runs all the queues at once */
+static int virtio_vsock_vhost_set_backend(struct virtio_device *s,
+                                          int queue_idx, bool start)
+{
+    if (queue_idx != VIRTIO_VSOCK_RX_QUEUE)
+        return 0;
+    return vhost_vsock_set_running(s->vhost_fd, start);
+}
+
+struct virtio_device *virtio_vsock_init(struct virtio_bus_def bus,
+                                        uint64_t mmio_addr, uint64_t cid)
+{
+    struct virtio_device *s = NULL;
+    uint64_t features = 0;
+    int fd = -1;
+
+    s = malloc(sizeof(*s));
+    if (virtio_init(s, bus, mmio_addr, 19, 8, virtio_vsock_recv_request,
+                    VIRTIO_VSOCK_MAX_QUEUE_NUM) < 0) {
+        free(s);
+        return NULL;
+    }
+    put_le32(s->config_space, cid);
+    put_le32(s->config_space + 4, cid >> 32);
+    /* transport events are never sent, the buffers stay with the device */
+    s->queue[VIRTIO_VSOCK_EVENT_QUEUE].manual_recv = true;
+
+    fd = vhost_open("/dev/vhost-vsock", s->mem_map->host_mem,
+                    s->mem_map->size, &features);
+    if (fd < 0)
+        goto fail;
+    if (vhost_vsock_set_guest_cid(fd, cid) < 0) {
+        close(fd);
+        goto fail;
+    }
+    s->vhost_set_backend = virtio_vsock_vhost_set_backend;
+    if (virtio_vhost_init(s, fd, &vhost_kernel_ops, features,
+                          (1U << VIRTIO_VSOCK_RX_QUEUE) |
+                          (1U << VIRTIO_VSOCK_TX_QUEUE), 0) < 0)
+        goto fail;
+    /* e.g. VIRTIO_VSOCK_F_SEQPACKET */
+    s->device_features |= s->vhost_features & 0xffffff;
+    return s;
+fail:
+    virtio_cleanup(s);
+    free(s);
+    return NULL;
+}
+
+void virtio_vsock_destroy(struct virtio_device *s)
+{
+    virtio_cleanup(s);
+}
+
+/*********************************************************************/
+/* file system device */
+
+#define VIRTIO_FS_TAG_SIZE 36
+
+struct virtio_fs_device {
+    struct virtio_device common;
+    uint8_t *dax;               /* the DAX window, NULL if there is none */
+    uint64_t dax_size;
+    int req_fd;                 /* requests of the backend, -1 if none */
+    struct io_handler req_handler;
+};
+
+/* the requests are up to the backend, only a kick racing with DRIVER_OK
+   gets here */
+static int virtio_fs_recv_request(struct virtio_device *s, int queue_idx,
+                                  struct virtqueue_element *elem)
+{
+    virtqueue_push(s, elem, 0);
+    virtqueue_elem_free(s, elem);
+    return 0;
+}
+
+static bool virtio_fs_dax_range_ok(struct virtio_fs_device *fs,
+                                   uint64_t offset, uint64_t len)
+{
+    return offset < fs->dax_size && len <= fs->dax_size - offset;
+}
+
+/* map ranges of 'fd' into the DAX window, the guest sees the page cache
+   of the host */
+static int virtio_fs_map(struct virtio_fs_device *fs,
+                         struct vhost_user_fs_map map, int fd)
+{
+    int prot = 0;
+
+    for (int i = 0; i < VHOST_USER_FS_ENTRIES; i++) {
+        if (map.len[i] == 0)
+            continue;
+        if (!virtio_fs_dax_range_ok(fs, map.cache_offset[i], map.len[i])) {
+            fprintf(stderr, "virtio-fs: mapping out of the DAX window\n");
+            return -1;
+        }
+        prot = 0;
+        if (map.flags[i] & VHOST_USER_FS_FLAG_MAP_R)
+            prot |= PROT_READ;
+        if (map.flags[i] & VHOST_USER_FS_FLAG_MAP_W)
+            prot |= PROT_WRITE;
+        if (mmap(fs->dax + map.cache_offset[i], map.len[i], prot,
+                 MAP_SHARED | MAP_FIXED, fd,
+                 map.fd_offset[i]) == MAP_FAILED) {
+            perror("virtio-fs: mmap");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* put inaccessible memory back, as when the window was created */
+static int virtio_fs_unmap(struct virtio_fs_device *fs,
+                           struct vhost_user_fs_map map)
+{
+    for (int i = 0; i < VHOST_USER_FS_ENTRIES; i++) {
+        if (map.len[i] == 0)
+            continue;
+        if (map.len[i] == ~0ULL) {
+            map.cache_offset[i] = 0;
+            map.len[i] = fs->dax_size;
+        }
+        if (!virtio_fs_dax_range_ok(fs, map.cache_offset[i], map.len[i])) {
+            fprintf(stderr, "virtio-fs: unmapping out of the DAX window\n");
+            return -1;
+        }
+        if (mmap(fs->dax + map.cache_offset[i], map.len[i], PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                 -1, 0) == MAP_FAILED) {
+            perror("virtio-fs: mmap");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void virtio_fs_req_handler(struct io_handler *h, uint32_t revents)
+{
+    struct virtio_fs_device *fs = h->opaque;
+    struct vhost_user_msg msg = {0};
+    int fd = -1;
+    int nfds = 0;
+    int ret = -1;
+
+    if (vhost_user_recv(fs->req_fd, &msg, &fd, 1, &nfds) < 0) {
+        /* the backend went away, the queues stop with it */
+        fprintf(stderr, "virtio-fs: backend request channel closed\n");
+        io_handler_set_events(h, 0);
+        return;
+    }
+    switch (msg.request) {
+    case VHOST_USER_BACKEND_FS_MAP:
+        if (nfds == 1 && msg.size >= sizeof(msg.payload.fs_map))
+            ret = virtio_fs_map(fs, msg.payload.fs_map, fd);
+        break;
+    case VHOST_USER_BACKEND_FS_UNMAP:
+        if (msg.size >= sizeof(msg.payload.fs_map))
+            ret = virtio_fs_unmap(fs, msg.payload.fs_map);
+        break;
+    default:
+        fprintf(stderr, "virtio-fs: unknown backend request %u\n",
+                msg.request);
+        break;
+    }
+    if (nfds > 0)
+        close(fd);
+    if (msg.flags & VHOST_USER_NEED_REPLY)
+        vhost_user_reply(fs->req_fd, &msg, ret < 0 ? 1 : 0);
+}
+
+/* give the backend a socket to send the DAX mapping requests on */
+static int virtio_fs_dax_init(struct virtio_fs_device *fs)
+{
+    int sv[2] = {-1, -1};
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("virtio-fs: socketpair");
+        return -1;
+    }
+    if (vhost_user_set_backend_req_fd(fs->common.vhost_fd, sv[1]) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    close(sv[1]);
+    fs->req_fd = sv[0];
+    fs->req_handler = (struct io_handler){
+        .fd = fs->req_fd,
+        .events = EPOLLIN,
+        .fn = virtio_fs_req_handler,
+        .opaque = fs,
+    };
+    if (io_handler_add(fs->common.iothread, &fs->req_handler) < 0) {
+        close(fs->req_fd);
+        fs->req_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+struct virtio_device *virtio_fs_init(struct virtio_bus_def bus,
+                                     uint64_t mmio_addr, const char *path,
+                                     const char *tag, void *dax,
+                                     uint64_t dax_addr, uint64_t dax_size)
+{
+    struct virtio_fs_device *s = NULL;
+    uint64_t protocol = 0;
+
+    if (strlen(tag) == 0 || strlen(tag) > VIRTIO_FS_TAG_SIZE) {
+        fprintf(stderr, "virtio-fs: the tag must be 1 to %d bytes\n",
+                VIRTIO_FS_TAG_SIZE);
+        return NULL;
+    }
+    s = malloc(sizeof(*s));
+    *s = (struct virtio_fs_device){0};
+    s->req_fd = -1;
+    if (virtio_init(&s->common, bus, mmio_addr, 26, 40,
+                    virtio_fs_recv_request, VIRTIO_FS_MAX_QUEUE_NUM) < 0) {
+        free(s);
+        return NULL;
+    }
+    /* the tag is not NUL terminated if it fills the field */
+    memcpy(s->common.config_space, tag, strlen(tag));
+    put_le32(s->common.config_space + VIRTIO_FS_TAG_SIZE, 1);
+
+    if (dax) {
+        protocol = (1ULL << VHOST_USER_PROTOCOL_F_BACKEND_REQ) |
+                   (1ULL << VHOST_USER_PROTOCOL_F_BACKEND_SEND_FD) |
+                   (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    }
+    /* the high priority queue and one request queue */
+    if (virtio_vhost_user_init(&s->common, path, (1U << 0) | (1U << 1),
+                               protocol) < 0)
+        goto fail;
+    if (dax) {
+        if (virtio_fs_dax_init(s) < 0)
+            goto fail;
+        s->dax = dax;
+        s->dax_size = dax_size;
+        s->common.shm_addr = dax_addr;
+        s->common.shm_size = dax_size;
+    }
+    return (struct virtio_device *)s;
+fail:
+    virtio_cleanup(&s->common);
+    free(s);
+    return NULL;
+}
+
+void virtio_fs_destroy(struct virtio_device *s)
+{
+    struct virtio_fs_device *fs = (void *)s;
+
+    virtio_cleanup(s);
+    if (fs->req_fd >= 0) {
+        io_handler_remove(&fs->req_handler);
+        close(fs->req_fd);
+        fs->req_fd = -1;
+    }
+}
+
+/*********************************************************************/
+/* persistent memory device */
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+
+struct virtio_pmem_device {
+    struct virtio_device common;
+    int fd;                     /* the image, -1 if the writes are private */
+    struct thread_pool *pool;   /* runs the flushes */
+    struct obj_pool flush_pool; /* their requests, a queue of them */
+};
+
+struct virtio_pmem_flush {
+    struct virtio_device *s;
+    struct virtqueue_element *elem;
+};
+
+static void *virtio_pmem_flush_fn(void *arg)
+{
+    struct virtio_pmem_flush *req = arg;
+    struct virtio_pmem_device *pmem = (struct virtio_pmem_device *)req->s;
+    struct virtio_device *s = req->s;
+    uint8_t resp[4] = {0};
+
+    /* the guest writes went to the page cache through the memory slot */
+    if (pmem->fd >= 0 && fdatasync(pmem->fd) < 0) {
+        perror("virtio-pmem: fdatasync");
+        put_le32(resp, 1);
+    }
+    pthread_mutex_lock(&s->lock);
+    iov_from_buf(req->elem->in_sg, req->elem->in_num, 0, resp, sizeof(resp));
+    virtqueue_push(s, req->elem, sizeof(resp));
+    virtqueue_elem_free(s, req->elem);
+    obj_pool_free(&pmem->flush_pool, req, sizeof(*req));
+    /* a request may have waited for the worker */
+    queue_process(s, 0);
+    virtqueue_flush(s, 0);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static int virtio_pmem_recv_request(struct virtio_device *s, int queue_idx,
+                                    struct virtqueue_element *elem)
+{
+    struct virtio_pmem_device *pmem = (struct virtio_pmem_device *)s;
+    struct virtio_pmem_flush *req = NULL;
+    uint8_t type[4] = {0};
+
+    if (elem->in_len < 4 ||
+        iov_to_buf(elem->out_sg, elem->out_num, 0, type, 4) < 4 ||
+        get_le32(type) != VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+        fprintf(stderr, "virtio_pmem_recv_request: invalid request.\n");
+        virtqueue_push(s, elem, 0);
+        virtqueue_elem_free(s, elem);
+        return 0;
+    }
+    req = obj_pool_alloc(&pmem->flush_pool, sizeof(*req));
+    if (!req) {
+        put_le32(type, 1);
+        iov_from_buf(elem->in_sg, elem->in_num, 0, type, sizeof(type));
+        virtqueue_push(s, elem, sizeof(type));
+        virtqueue_elem_free(s, elem);
+        return 0;
+    }
+    req->s = s;
+    req->elem = elem;
+    if (thread_pool_run(pmem->pool, virtio_pmem_flush_fn, req) < 0) {
+        /* retried when the flush in progress completes */
+        obj_pool_free(&pmem->flush_pool, req, sizeof(*req));
+        return -1;
+    }
+    return 0;
+}
+
+struct virtio_device *virtio_pmem_init(struct virtio_bus_def bus,
+                                       uint64_t mmio_addr, int fd,
+                                       uint64_t addr, uint64_t size)
+{
+    struct virtio_pmem_device *s = NULL;
+
+    s = malloc(sizeof(*s));
+    if (!s)
+        return NULL;
+    *s = (struct virtio_pmem_device){0};
+    if (virtio_init(&s->common, bus, mmio_addr, 27, 16,
+                    virtio_pmem_recv_request, VIRTIO_PMEM_MAX_QUEUE_NUM) < 0) {
+        free(s);
+        return NULL;
+    }
+    s->fd = fd;
+    if (obj_pool_init(&s->flush_pool, sizeof(struct virtio_pmem_flush), 0,
+                      VIRTIO_PMEM_MAX_QUEUE_NUM) < 0) {
+        virtio_cleanup(&s->common);
+        free(s);
+        return NULL;
+    }
+    if (obj_pool_prealloc(&s->flush_pool, VIRTIO_PMEM_MAX_QUEUE_NUM) == 0)
+        s->pool = new_thread_pool(1, VIRTIO_PMEM_MAX_QUEUE_NUM, NULL, 0);
+    if (!s->pool) {
+        virtio_cleanup(&s->common);
+        obj_pool_destroy(&s->flush_pool);
+        free(s);
+        return NULL;
+    }
+    put_le32(s->common.config_space, addr);
+    put_le32(s->common.config_space + 4, addr >> 32);
+    put_le32(s->common.config_space + 8, size);
+    put_le32(s->common.config_space + 12, size >> 32);
+    return (struct virtio_device *)s;
+}
+
+void virtio_pmem_destroy(struct virtio_device *s)
+{
+    struct virtio_pmem_device *pmem = (struct virtio_pmem_device *)s;
+
+    virtio_cleanup(s);
+    delete_thread_pool(pmem->pool);
+    obj_pool_destroy(&pmem->flush_pool);
+}
@@ -27,6 +27,10 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "pool.h"
 
 typedef uint64_t virtio_phys_addr_t;
 
@@ -36,9 +40,15 @@ struct irq_signal {
     int irqfd;  /* eventfd for irqfd mechanism */
 };
 
+struct io_thread;
+struct pci_bus;
+
 struct virtio_bus_def {
     struct guest_mem_map *mem_map;
-    struct irq_signal irq;
+    struct irq_signal irq;      /* INTx line if on PCI */
+    struct io_thread *iothread; /* runs the notification and timer handlers */
+    struct pci_bus *pci;        /* if set, a virtio-pci device with MSI-X is
+                                   added to the bus instead of virtio-mmio */
 };
 
 /* irqfd functions */
@@ -46,6 +56,7 @@ int virtio_irqfd_init(struct irq_signal *irq);
 void virtio_irqfd_cleanup(struct irq_signal *irq);
 
 struct virtio_device;
+struct virtqueue_element;
 
 uint32_t virtio_mmio_read(struct virtio_device *s, uint32_t offset1, int size);
 void virtio_mmio_write(struct virtio_device *s, uint32_t offset,
@@ -53,6 +64,31 @@ void virtio_mmio_write(struct virtio_device *s, uint32_t offset,
 
 void virtio_set_debug(struct virtio_device *s, int debug_flags);
 
+struct virtio_queue_stats {
+    uint64_t used_bufs;    /* buffers given back to the driver */
+    uint64_t used_batches; /* used ring updates, several buffers each */
+    uint64_t irqs;         /* interrupts raised */
+    uint64_t kicks;        /* notifications from the driver */
+    uint64_t polls;        /* queue checks while busy polling */
+    uint64_t poll_hits;    /* checks that found available buffers */
+    uint64_t poll_ns;      /* time spent busy polling the device */
+    struct pool_stats elem_pool; /* descriptor chains popped */
+};
+
+/* hold interrupts back until 'max_frames' buffers are used or 'usecs'
+   have passed, for queue 'queue_idx' or all queues if -1. A zero 'usecs'
+   disables coalescing. */
+int virtio_set_coalescing(struct virtio_device *s, int queue_idx,
+                          uint32_t max_frames, uint32_t usecs);
+
+/* after a driver notification, busy poll the queues for new buffers with
+   notifications off until none is found for 'usecs'. 0 disables polling. */
+void virtio_set_poll(struct virtio_device *s, uint32_t usecs);
+
+void virtio_get_queue_stats(struct virtio_device *s, int queue_idx,
+                            struct virtio_queue_stats *stats);
+void virtio_print_stats(struct virtio_device *s, const char *name, FILE *f);
+
 /* block device */
 struct blk_io_callback_arg;
 
@@ -65,51 +101,166 @@ struct disk_image {
 
 struct block_request {
     uint32_t type;
-    uint8_t *buf;
-    int write_size;
+    uint16_t ioprio;     /* see read_async */
+    uint64_t sector_num;
+    struct virtqueue_element *elem;
+    uint8_t *status;     /* last byte of the writable buffers */
+    size_t in_len;       /* bytes written back to the driver */
     int queue_idx;
-    int desc_idx;
+    int iovcnt;
+    struct iovec *iov;   /* the data buffers, in guest memory */
 };
 
 struct blk_io_callback_arg {
     struct virtio_device *s;
     struct block_request req;
+    /* the requests merged behind this one, completed with it */
+    struct blk_io_callback_arg *merged;
+    struct iovec iov[];
 };
 
+/* the storage underneath, in bytes, 0 if unknown */
+struct block_topology {
+    uint32_t logical_block_size;    /* the smallest request */
+    uint32_t physical_block_size;   /* avoids read-modify-write */
+    uint32_t min_io_size;
+    uint32_t opt_io_size;
+};
+
+/* a segment of a discard or write zeroes request */
+struct block_range {
+    uint64_t sector_num;
+    uint32_t num_sectors;
+    bool unmap;                     /* write zeroes may deallocate */
+};
+
+/* the iovecs are only valid until the completion callback is called. A
+   read done right away, e.g. from a cache, returns 1 without calling it. */
+/* flags of a write: durable once it completes */
+#define BLOCK_REQ_DSYNC (1 << 0)
+
 struct block_device {
     int64_t (*get_sector_count)(struct block_device *bs);
-    int (*read_async)(struct block_device *bs,
-                      uint64_t sector_num, uint8_t *buf, int sector_count,
+    /* 'ioprio' is the priority of the guest request in the ioprio_set()
+       encoding, 0 if none. Never above the best effort class. */
+    int (*read_async)(struct block_device *bs, uint64_t sector_num,
+                      const struct iovec *iov, int iovcnt, uint16_t ioprio,
                       block_device_completion_fn *cb, struct blk_io_callback_arg *cbarg);
-    int (*write_async)(struct block_device *bs,
-                       uint64_t sector_num, const uint8_t *buf, int sector_count,
+    int (*write_async)(struct block_device *bs, uint64_t sector_num,
+                       const struct iovec *iov, int iovcnt, uint16_t ioprio,
+                       int flags,
+                       block_device_completion_fn *cb, struct blk_io_callback_arg *cbarg);
+    /* send the requests queued by read_async and write_async, NULL if
+       they are sent right away. Called once the queue is drained or the
+       backend is full. */
+    void (*submit)(struct block_device *bs);
+    /* complete once the writes completed so far are durable, NULL if the
+       storage has no volatile cache */
+    int (*flush_async)(struct block_device *bs,
                        block_device_completion_fn *cb, struct blk_io_callback_arg *cbarg);
+    /* deallocate the ranges, or make them read as zeroes, NULL if not
+       supported. The ranges are copied. */
+    int (*discard_async)(struct block_device *bs,
+                         const struct block_range *ranges, int n,
+                         block_device_completion_fn *cb, struct blk_io_callback_arg *cbarg);
+    int (*write_zeroes_async)(struct block_device *bs,
+                              const struct block_range *ranges, int n,
+                              int flags, block_device_completion_fn *cb,
+                              struct blk_io_callback_arg *cbarg);
+    /* statistics of the backend, NULL if none */
+    void (*print_stats)(struct block_device *bs, const char *name, FILE *f);
+    struct block_topology topology;
     void *opaque;
 };
 
 struct virtio_device *virtio_block_init(struct virtio_bus_def bus, uint64_t mmio_addr, struct block_device *bs);
 
+/* the requests are served by the vhost-user backend listening on 'path',
+   which also provides the config space */
+struct virtio_device *virtio_block_init_vhost_user(struct virtio_bus_def bus,
+                                                   uint64_t mmio_addr,
+                                                   const char *path);
+
+/* the host page cache is a volatile write cache, which the driver flushes
+   in writeback mode. In writethrough mode, each write is durable when it
+   completes. In unsafe mode, the flushes are ignored. */
+enum virtio_block_cache {
+    VIRTIO_BLK_CACHE_WRITEBACK,
+    VIRTIO_BLK_CACHE_WRITETHROUGH,
+    VIRTIO_BLK_CACHE_UNSAFE,
+};
+
+/* the driver may still switch to writethrough, -1 if the backend has no
+   flush */
+int virtio_block_set_cache(struct virtio_device *s,
+                           enum virtio_block_cache cache);
+/* "writeback", "writethrough" or "unsafe" */
+int virtio_block_parse_cache(const char *name, enum virtio_block_cache *cache);
+
 void virtio_block_destroy(struct virtio_device *s);
 void* virtio_block_get_opaque(struct virtio_device *s);
+/* NULL with a vhost-user backend */
+struct block_device *virtio_block_get_device(struct virtio_device *s);
 
 /* network device */
 
 struct ether_device {
     uint8_t mac_addr[6]; /* mac address of the interface */
     void (*write_packet_to_ether)(struct ether_device *net,
-                                  const uint8_t *buf, int len);
+                                  const struct iovec *iov, int iovcnt);
     void *opaque;
     /* the following is set by the device */
     void *device_opaque;
     bool (*can_write_packet_to_virtio)(struct ether_device *net);
     void (*write_packet_to_virtio)(struct ether_device *net,
                                 const uint8_t *buf, int len);
+    /* the packets written are seen by the driver once flushed */
+    void (*flush_packets_to_virtio)(struct ether_device *net);
 
 };
 
 struct virtio_device *virtio_net_init(struct virtio_bus_def bus, uint64_t mmio_addr, struct ether_device *es);
 
+/* let /dev/vhost-net move the packets between the rx and tx queues and
+   'tap_fd' in the host kernel, before the driver starts. On failure, the
+   device stays in userspace. */
+int virtio_net_set_vhost(struct virtio_device *s, int tap_fd);
+
+/* let the vhost-user backend listening on 'path' serve the rx and tx
+   queues, before the driver starts */
+int virtio_net_set_vhost_user(struct virtio_device *s, const char *path);
+
 void virtio_net_destroy(struct virtio_device *s);
 void* virtio_net_get_opaque(struct virtio_device *s);
 
+/* socket device */
+
+/* the guest with address 'cid' talks to host AF_VSOCK sockets through
+   /dev/vhost-vsock */
+struct virtio_device *virtio_vsock_init(struct virtio_bus_def bus,
+                                        uint64_t mmio_addr, uint64_t cid);
+void virtio_vsock_destroy(struct virtio_device *s);
+
+/* file system device */
+
+/* export the directory shared by the virtiofsd listening on 'path' as
+   'tag'. If 'dax' is not NULL, the 'dax_size' bytes there are the DAX
+   window, at 'dax_addr' in guest physical memory: the backend maps files
+   into it and the guest reads the host page cache directly. */
+struct virtio_device *virtio_fs_init(struct virtio_bus_def bus,
+                                     uint64_t mmio_addr, const char *path,
+                                     const char *tag, void *dax,
+                                     uint64_t dax_addr, uint64_t dax_size);
+void virtio_fs_destroy(struct virtio_device *s);
+
+/* persistent memory device */
+
+/* the image 'fd' is mapped at 'addr' in guest physical memory, 'size'
+   bytes. The guest accesses it directly, flushes are an fdatasync() of
+   'fd', or nothing if 'fd' is -1. */
+struct virtio_device *virtio_pmem_init(struct virtio_bus_def bus,
+                                       uint64_t mmio_addr, int fd,
+                                       uint64_t addr, uint64_t size);
+void virtio_pmem_destroy(struct virtio_device *s);
+
 #endif /* VIRTIO_H */